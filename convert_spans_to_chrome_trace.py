@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# Convert span files dumped by gateway, engine and func workers (see
+# src/common/span_recorder.h) into Chrome trace JSON, which can be opened
+# in chrome://tracing or https://ui.perfetto.dev
+#
+# Usage: python3 convert_spans_to_chrome_trace.py output.json spans.*.bin
+
+import json
+import struct
+import sys
+
+HEADER_FORMAT = "<IIIiq32s"
+EVENT_FORMAT = "<QqiBBH"
+MAGIC = 0x4e435350
+
+SPAN_NAMES = {
+    1: "gateway_request",
+    2: "gateway_dispatch",
+    3: "gateway_response_write",
+    4: "engine_call",
+    5: "engine_queueing",
+    6: "worker_input",
+    7: "worker_execute",
+    8: "worker_output",
+}
+
+# Phases of SpanEvent mapped to Chrome async events
+PHASES = { 0: "b", 1: "e", 2: "n" }
+
+
+# See protocol::FuncCall and protocol::MakeCallId
+CALL_ID_GENERATION_BITS = 8
+CALL_ID_SEQ_BITS = 32 - CALL_ID_GENERATION_BITS
+
+
+def decode_full_call_id(full_call_id):
+    call_id = (full_call_id >> 28) & 0xffffffff
+    return {
+        "func_id": full_call_id & 0xff,
+        "method_id": (full_call_id >> 8) & 0x3f,
+        "client_id": (full_call_id >> 14) & 0x3fff,
+        "client_id_generation": call_id >> CALL_ID_SEQ_BITS,
+        "call_seq": call_id & ((1 << CALL_ID_SEQ_BITS) - 1),
+    }
+
+
+def read_span_file(filename):
+    with open(filename, "rb") as f:
+        data = f.read()
+    header_size = struct.calcsize(HEADER_FORMAT)
+    if len(data) < header_size:
+        print("Truncated span file:", filename)
+        return None, []
+    magic, version, event_size, pid, _, process_name = struct.unpack_from(
+        HEADER_FORMAT, data, 0)
+    if magic != MAGIC or event_size != struct.calcsize(EVENT_FORMAT):
+        print("Invalid span file:", filename)
+        return None, []
+    process_name = process_name.split(b"\0", 1)[0].decode()
+    events = []
+    for offset in range(header_size, len(data) - event_size + 1, event_size):
+        events.append(struct.unpack_from(EVENT_FORMAT, data, offset))
+    return (pid, process_name), events
+
+
+def main():
+    if len(sys.argv) < 3:
+        print("Usage: python3 convert_spans_to_chrome_trace.py <output.json> <span files...>")
+        sys.exit(1)
+    trace_events = []
+    for filename in sys.argv[2:]:
+        process, events = read_span_file(filename)
+        if process is None:
+            continue
+        pid, process_name = process
+        trace_events.append({
+            "name": "process_name", "ph": "M", "pid": pid,
+            "args": { "name": "%s (%d)" % (process_name, pid) }
+        })
+        for full_call_id, timestamp, tid, span, phase, _ in events:
+            trace_events.append({
+                "name": SPAN_NAMES.get(span, "span_%d" % span),
+                "cat": "nightcore",
+                "ph": PHASES[phase],
+                "id": "0x%x" % full_call_id,
+                "pid": pid,
+                "tid": tid,
+                "ts": timestamp / 1000.0,
+                "args": decode_full_call_id(full_call_id),
+            })
+    trace_events.sort(key=lambda event: event.get("ts", 0))
+    with open(sys.argv[1], "w") as f:
+        json.dump({ "traceEvents": trace_events, "displayTimeUnit": "ns" }, f)
+    print("Wrote %d events to %s" % (len(trace_events), sys.argv[1]))
+
+
+if __name__ == "__main__":
+    main()
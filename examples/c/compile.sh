@@ -4,3 +4,5 @@ CC=gcc
 
 $CC -shared -fPIC -O2 -I../../include -o libfoo.so foo.c
 $CC -shared -fPIC -O2 -I../../include -o libbar.so bar.c
+$CC -shared -fPIC -O2 -I../../include -o libecho.so echo.c
+$CC -shared -fPIC -O2 -I../../include -o libnested.so nested.c
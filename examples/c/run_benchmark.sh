@@ -0,0 +1,82 @@
+#!/bin/bash
+# End-to-end benchmark on one box: starts gateway, engine and launchers of
+# Echo, Nested (which calls Echo) and grpc:EchoService, then runs
+# load_generator against each target at every QPS level.
+#
+# Usage: ./run_benchmark.sh [results dir] [QPS levels]
+# Results go to results/<target>_<qps>.txt (summary) and .csv (histograms),
+# which can be diffed against a baseline run.
+
+BASE_DIR=$(realpath $(dirname $0))
+NIGHTCORE_ROOT=$(realpath $(dirname $0)/../..)
+BUILD_TYPE=release
+BIN_DIR=$NIGHTCORE_ROOT/bin/$BUILD_TYPE
+
+RESULTS_DIR=$(realpath -m ${1:-$BASE_DIR/results})
+QPS_LEVELS=${2:-"1000 5000 10000"}
+PAYLOAD_BYTESIZE=${PAYLOAD_BYTESIZE:-64}
+WARMUP=${WARMUP:-5s}
+DURATION=${DURATION:-30s}
+ARRIVAL=${ARRIVAL:-poisson}
+
+ulimit -n 655350
+
+cd $BASE_DIR && ./compile.sh || exit 1
+
+rm -rf $BASE_DIR/outputs $RESULTS_DIR
+mkdir -p $BASE_DIR/outputs $RESULTS_DIR
+
+$BIN_DIR/gateway \
+    --func_config_file=$BASE_DIR/bench_config.json \
+    --metrics_snapshot_path=/dev/shm/nightcore_gateway_metrics \
+    2>$BASE_DIR/outputs/gateway.log &
+
+sleep 1
+
+$BIN_DIR/engine \
+    --func_config_file=$BASE_DIR/bench_config.json \
+    --node_id=0 \
+    --metrics_snapshot_path=/dev/shm/nightcore_engine_metrics \
+    2>$BASE_DIR/outputs/engine.log &
+
+sleep 1
+
+function start_launcher {
+    $BIN_DIR/launcher \
+        --func_id=$1 --fprocess_mode=cpp \
+        --fprocess_output_dir=$BASE_DIR/outputs \
+        --fprocess="$BIN_DIR/func_worker_v1 $BASE_DIR/$2" \
+        2>$BASE_DIR/outputs/launcher_$1.log &
+}
+
+start_launcher 21 libecho.so
+start_launcher 22 libnested.so
+start_launcher 23 libecho.so
+
+sleep 3
+
+function run_load {
+    name=$1; qps=$2; shift 2
+    echo "Running $name at $qps QPS"
+    $BIN_DIR/load_generator \
+        --qps=$qps --arrival=$ARRIVAL \
+        --payload_bytesize=$PAYLOAD_BYTESIZE \
+        --warmup=$WARMUP --duration=$DURATION \
+        --histogram_output=$RESULTS_DIR/${name}_${qps}.csv \
+        "$@" >$RESULTS_DIR/${name}_${qps}.txt 2>$RESULTS_DIR/${name}_${qps}.log
+    cat $RESULTS_DIR/${name}_${qps}.txt
+}
+
+for qps in $QPS_LEVELS; do
+    run_load http_echo $qps --protocol=http --func_name=Echo
+    run_load http_nested $qps --protocol=http --func_name=Nested
+    run_load grpc_echo $qps --protocol=grpc --func_name=EchoService --grpc_method=Echo
+done
+
+$BIN_DIR/dump_metrics --snapshot_path=/dev/shm/nightcore_gateway_metrics \
+    >$RESULTS_DIR/gateway_metrics.txt 2>/dev/null
+$BIN_DIR/dump_metrics --snapshot_path=/dev/shm/nightcore_engine_metrics \
+    >$RESULTS_DIR/engine_metrics.txt 2>/dev/null
+
+pkill -INT -f "$BIN_DIR/(gateway|engine|launcher)"
+wait
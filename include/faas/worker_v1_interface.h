@@ -2,6 +2,7 @@
 #define _FAAS_WORKER_V1_INTERFACE_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __FAAS_SRC
     #define API_EXPORT
@@ -24,6 +25,21 @@ typedef int (*faas_invoke_func_fn_t)(
     const char* input_data, size_t input_length,
     const char** output_data, size_t* output_length);
 
+// Invoke a function without waiting for it to finish. On success, a handle
+// identifying this call is stored in `call_handle`. Return 0 on success.
+typedef int (*faas_invoke_func_async_fn_t)(
+    void* caller_context, const char* func_name,
+    const char* input_data, size_t input_length,
+    uint64_t* call_handle);
+
+// Wait for any outstanding call issued by `invoke_func_async_fn` to finish.
+// Handle of the finished call is stored in `call_handle`. Return 0 if that
+// call succeeded, in which case its output is given. If there is no
+// outstanding call, -1 is returned with `call_handle` set to 0.
+typedef int (*faas_wait_any_func_fn_t)(
+    void* caller_context, uint64_t* call_handle,
+    const char** output_data, size_t* output_length);
+
 // Below are APIs that function library must implement.
 // For all APIs, return 0 on success.
 
@@ -38,6 +54,16 @@ API_EXPORT int faas_create_func_worker(
     faas_invoke_func_fn_t invoke_func_fn,
     faas_append_output_fn_t append_output_fn,
     void** worker_handle);
+// Optional. If implemented, it will be called right after
+// `faas_create_func_worker`, providing functions for issuing multiple
+// nested calls concurrently. `invoke_func_async_fn` and `wait_any_func_fn`
+// should be called from the thread executing `faas_func_call`. Outputs of
+// nested calls remain valid until `faas_func_call` returns, and calls still
+// outstanding by then are waited and discarded.
+API_EXPORT int faas_init_async_invoke(
+    void* worker_handle,
+    faas_invoke_func_async_fn_t invoke_func_async_fn,
+    faas_wait_any_func_fn_t wait_any_func_fn);
 // Destroy a function worker.
 API_EXPORT int faas_destroy_func_worker(void* worker_handle);
 // Execute the function. `append_output_fn` can be called multiple
@@ -61,6 +87,7 @@ API_EXPORT int faas_func_call(
 
 typedef decltype(faas_init)*                 faas_init_fn_t;
 typedef decltype(faas_create_func_worker)*   faas_create_func_worker_fn_t;
+typedef decltype(faas_init_async_invoke)*    faas_init_async_invoke_fn_t;
 typedef decltype(faas_destroy_func_worker)*  faas_destroy_func_worker_fn_t;
 typedef decltype(faas_func_call)*            faas_func_call_fn_t;
 
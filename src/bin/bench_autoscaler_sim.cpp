@@ -0,0 +1,316 @@
+#include "base/init.h"
+#include "base/common.h"
+#include "utils/fs.h"
+#include "utils/bench.h"
+#include "utils/exp_moving_avg.h"
+#include "engine/autoscaler.h"
+
+#include <sstream>
+
+#include <absl/flags/flag.h>
+
+ABSL_FLAG(std::string, trace_file, "",
+          "Arrival trace to replay, each line is \"arrival_us processing_us\"");
+ABSL_FLAG(std::string, policy, "reactive", "Autoscale policy to simulate");
+ABSL_FLAG(int, tick_ms, 1000, "Interval of periodic autoscaling");
+ABSL_FLAG(int, worker_launch_time_ms, 500, "Time for a requested worker to become ready");
+ABSL_FLAG(int, worker_request_interval_ms, 200,
+          "Minimal interval between on-demand worker requests");
+ABSL_FLAG(size_t, initial_workers, 1, "Number of workers at start");
+ABSL_FLAG(size_t, sim_min_workers, 0, "");
+ABSL_FLAG(size_t, sim_max_workers, 1024, "");
+// Same as instant_rps_ema_alpha and instant_rps_p_norm of engine's tracer
+ABSL_FLAG(double, rps_ema_alpha, 0.001, "");
+ABSL_FLAG(double, rps_ema_p_norm, 1.0, "");
+ABSL_FLAG(double, processing_time_ema_alpha, 0.001, "");
+
+using namespace faas;
+
+namespace {
+
+struct Request {
+    int64_t arrival;
+    int64_t processing_time;
+};
+
+enum class EventType {
+    // Smaller values are handled first among events at the same time
+    kWorkerFinish = 0,
+    kWorkerReady  = 1,
+    kTick         = 2,
+    kArrival      = 3
+};
+
+struct Event {
+    int64_t   timestamp;
+    EventType type;
+    size_t    index;  // Of request for kArrival, of worker for kWorkerFinish
+};
+
+struct EventCompare {
+    bool operator()(const Event& lhs, const Event& rhs) const {
+        if (lhs.timestamp != rhs.timestamp) {
+            return lhs.timestamp > rhs.timestamp;
+        }
+        return static_cast<int>(lhs.type) > static_cast<int>(rhs.type);
+    }
+};
+
+// Replays requests of a single function against one autoscale policy, in the
+// same way Dispatcher consults it
+class Simulator {
+public:
+    Simulator(std::vector<Request> requests, std::unique_ptr<engine::AutoscalePolicy> policy)
+        : requests_(std::move(requests)), policy_(std::move(policy)),
+          tick_us_(int64_t{absl::GetFlag(FLAGS_tick_ms)} * 1000),
+          launch_time_us_(int64_t{absl::GetFlag(FLAGS_worker_launch_time_ms)} * 1000),
+          request_interval_us_(int64_t{absl::GetFlag(FLAGS_worker_request_interval_ms)} * 1000),
+          min_workers_(absl::GetFlag(FLAGS_sim_min_workers)),
+          max_workers_(absl::GetFlag(FLAGS_sim_max_workers)),
+          rps_ema_(/* tau_ms= */ 0, absl::GetFlag(FLAGS_rps_ema_alpha),
+                   absl::GetFlag(FLAGS_rps_ema_p_norm)),
+          processing_time_ema_(absl::GetFlag(FLAGS_processing_time_ema_alpha)),
+          queueing_delays_(requests_.size() + 1),
+          launching_workers_(0), total_workers_(0), last_request_worker_timestamp_(-1),
+          last_arrival_(-1), busy_time_in_tick_(0), cpu_usage_(-1),
+          last_accounting_timestamp_(0), worker_seconds_(0), peak_workers_(0),
+          launched_workers_(0), retired_workers_(0) {}
+
+    void Run() {
+        if (requests_.empty()) {
+            return;
+        }
+        int64_t start_timestamp = requests_.front().arrival;
+        last_accounting_timestamp_ = start_timestamp;
+        for (size_t i = 0; i < absl::GetFlag(FLAGS_initial_workers); i++) {
+            AddWorker();
+        }
+        for (size_t i = 0; i < requests_.size(); i++) {
+            events_.push({ .timestamp = requests_[i].arrival,
+                           .type = EventType::kArrival, .index = i });
+        }
+        if (policy_->periodic()) {
+            events_.push({ .timestamp = start_timestamp + tick_us_,
+                           .type = EventType::kTick, .index = 0 });
+        }
+        size_t remaining_requests = requests_.size();
+        while (!events_.empty()) {
+            Event event = events_.top();
+            events_.pop();
+            AccountWorkerTime(event.timestamp);
+            switch (event.type) {
+            case EventType::kArrival:
+                OnArrival(event.timestamp, event.index);
+                break;
+            case EventType::kWorkerFinish:
+                remaining_requests--;
+                OnWorkerFinish(event.timestamp, event.index);
+                break;
+            case EventType::kWorkerReady:
+                launching_workers_--;
+                AddWorker();
+                DispatchPending(event.timestamp);
+                break;
+            case EventType::kTick:
+                OnTick(event.timestamp);
+                if (remaining_requests > 0) {
+                    events_.push({ .timestamp = event.timestamp + tick_us_,
+                                   .type = EventType::kTick, .index = 0 });
+                }
+                break;
+            default:
+                LOG(FATAL) << "Unreachable";
+            }
+        }
+        Report(last_accounting_timestamp_ - start_timestamp);
+    }
+
+private:
+    std::vector<Request> requests_;
+    std::unique_ptr<engine::AutoscalePolicy> policy_;
+    int64_t tick_us_;
+    int64_t launch_time_us_;
+    int64_t request_interval_us_;
+    size_t min_workers_;
+    size_t max_workers_;
+
+    std::priority_queue<Event, std::vector<Event>, EventCompare> events_;
+    std::deque</* request index */ size_t> pending_requests_;
+    std::vector</* worker index */ size_t> idle_workers_;
+    std::vector<bool> worker_alive_;
+
+    utils::ExpMovingAvgExt rps_ema_;
+    utils::ExpMovingAvg processing_time_ema_;
+    bench_utils::Samples<int32_t> queueing_delays_;
+
+    size_t launching_workers_;
+    size_t total_workers_;
+    int64_t last_request_worker_timestamp_;
+    int64_t last_arrival_;
+    int64_t busy_time_in_tick_;
+    float cpu_usage_;
+
+    int64_t last_accounting_timestamp_;
+    double worker_seconds_;
+    size_t peak_workers_;
+    size_t launched_workers_;
+    size_t retired_workers_;
+
+    size_t current_workers() const { return total_workers_ + launching_workers_; }
+
+    void AddWorker() {
+        idle_workers_.push_back(worker_alive_.size());
+        worker_alive_.push_back(true);
+        total_workers_++;
+        peak_workers_ = std::max(peak_workers_, total_workers_);
+    }
+
+    void AccountWorkerTime(int64_t timestamp) {
+        worker_seconds_ += (timestamp - last_accounting_timestamp_) * 1e-6 * total_workers_;
+        last_accounting_timestamp_ = timestamp;
+    }
+
+    engine::AutoscaleInput BuildInput(int64_t timestamp) {
+        return {
+            .timestamp = timestamp,
+            .arrival_rps = rps_ema_.GetValue(),
+            .processing_time = processing_time_ema_.GetValue(),
+            .worker_launch_time = gsl::narrow_cast<double>(launch_time_us_),
+            .cpu_usage = cpu_usage_,
+            .current_workers = current_workers(),
+            .running_workers = total_workers_ - idle_workers_.size(),
+            .pending_func_calls = pending_requests_.size()
+        };
+    }
+
+    void LaunchWorker(int64_t timestamp) {
+        launching_workers_++;
+        launched_workers_++;
+        last_request_worker_timestamp_ = timestamp;
+        events_.push({ .timestamp = timestamp + launch_time_us_,
+                       .type = EventType::kWorkerReady, .index = 0 });
+    }
+
+    void StartRequest(int64_t timestamp, size_t request_index) {
+        size_t worker_index = idle_workers_.back();
+        idle_workers_.pop_back();
+        const Request& request = requests_[request_index];
+        queueing_delays_.Add(gsl::narrow_cast<int32_t>(timestamp - request.arrival));
+        events_.push({ .timestamp = timestamp + request.processing_time,
+                       .type = EventType::kWorkerFinish, .index = worker_index });
+        busy_time_in_tick_ += request.processing_time;
+        processing_time_ema_.AddSample(request.processing_time);
+    }
+
+    void DispatchPending(int64_t timestamp) {
+        while (!pending_requests_.empty() && !idle_workers_.empty()) {
+            size_t request_index = pending_requests_.front();
+            pending_requests_.pop_front();
+            StartRequest(timestamp, request_index);
+        }
+    }
+
+    void OnArrival(int64_t timestamp, size_t request_index) {
+        if (last_arrival_ != -1 && timestamp > last_arrival_) {
+            rps_ema_.AddSample(timestamp, 1e6 / (timestamp - last_arrival_));
+        }
+        last_arrival_ = timestamp;
+        if (!idle_workers_.empty()) {
+            StartRequest(timestamp, request_index);
+            return;
+        }
+        pending_requests_.push_back(request_index);
+        // Same as Dispatcher::MayRequestNewFuncWorker
+        if (current_workers() >= max_workers_) {
+            return;
+        }
+        if (last_request_worker_timestamp_ != -1
+              && timestamp < last_request_worker_timestamp_ + request_interval_us_) {
+            return;
+        }
+        size_t desired_workers = std::min(policy_->DesiredWorkers(BuildInput(timestamp)),
+                                          max_workers_);
+        if (current_workers() < desired_workers) {
+            LaunchWorker(timestamp);
+        }
+    }
+
+    void OnWorkerFinish(int64_t timestamp, size_t worker_index) {
+        DCHECK(worker_alive_[worker_index]);
+        idle_workers_.push_back(worker_index);
+        DispatchPending(timestamp);
+    }
+
+    void OnTick(int64_t timestamp) {
+        cpu_usage_ = gsl::narrow_cast<float>(busy_time_in_tick_)
+                   / gsl::narrow_cast<float>(tick_us_);
+        busy_time_in_tick_ = 0;
+        size_t desired_workers = std::clamp(policy_->DesiredWorkers(BuildInput(timestamp)),
+                                            min_workers_, max_workers_);
+        while (current_workers() < desired_workers) {
+            LaunchWorker(timestamp);
+        }
+        // Same as Dispatcher::RetireIdleWorkers, longest idle ones first
+        size_t n = current_workers() - std::min(current_workers(), desired_workers);
+        n = std::min(n, idle_workers_.size());
+        for (size_t i = 0; i < n; i++) {
+            worker_alive_[idle_workers_[i]] = false;
+        }
+        idle_workers_.erase(idle_workers_.begin(), idle_workers_.begin() + n);
+        total_workers_ -= n;
+        retired_workers_ += n;
+    }
+
+    void Report(int64_t duration) {
+        LOG(INFO) << fmt::format("Replayed {} requests in {:.3f}s",
+                                 requests_.size(), duration * 1e-6);
+        queueing_delays_.ReportStatistics("Queueing delay (us)");
+        LOG(INFO) << fmt::format("Workers: peak={}, launched={}, retired={}, "
+                                 "worker_seconds={:.1f}, average={:.2f}",
+                                 peak_workers_, launched_workers_, retired_workers_,
+                                 worker_seconds_,
+                                 duration > 0 ? worker_seconds_ / (duration * 1e-6) : 0.0);
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(Simulator);
+};
+
+bool LoadTrace(std::string_view path, std::vector<Request>* requests) {
+    std::string contents;
+    if (!fs_utils::ReadContents(path, &contents)) {
+        LOG(ERROR) << "Failed to read trace file " << path;
+        return false;
+    }
+    std::istringstream stream(contents);
+    Request request;
+    while (stream >> request.arrival >> request.processing_time) {
+        if (!requests->empty() && request.arrival < requests->back().arrival) {
+            LOG(ERROR) << "Arrival timestamps in trace should be non-decreasing";
+            return false;
+        }
+        requests->push_back(request);
+    }
+    if (!stream.eof()) {
+        LOG(ERROR) << "Malformed trace file " << path;
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    base::InitMain(argc, argv);
+
+    std::vector<Request> requests;
+    if (!LoadTrace(absl::GetFlag(FLAGS_trace_file), &requests)) {
+        return 1;
+    }
+    auto policy = engine::AutoscalePolicy::Create(absl::GetFlag(FLAGS_policy));
+    if (policy == nullptr) {
+        LOG(FATAL) << "Unknown autoscale policy: " << absl::GetFlag(FLAGS_policy);
+    }
+    Simulator simulator(std::move(requests), std::move(policy));
+    simulator.Run();
+    return 0;
+}
@@ -0,0 +1,349 @@
+#include "base/init.h"
+#include "base/asm.h"
+#include "base/common.h"
+#include "base/thread.h"
+#include "common/time.h"
+#include "common/protocol.h"
+#include "utils/bench.h"
+#include "utils/object_pool.h"
+#include "utils/appendable_buffer.h"
+#include "engine/engine.h"
+#include "engine/tracer.h"
+#include "engine/dispatcher.h"
+#include "engine/worker_manager.h"
+
+#include <sched.h>
+
+#include <absl/flags/flag.h>
+#include <absl/strings/str_split.h>
+
+ABSL_FLAG(absl::Duration, duration, absl::Seconds(10), "Duration to run each scenario");
+ABSL_FLAG(int, num_threads, 4, "Number of threads driving each scenario");
+ABSL_FLAG(std::string, scenarios, "protocol,object_pool,appendable_buffer,tracer,dispatcher",
+          "Comma-separated list of scenarios to run");
+ABSL_FLAG(int, num_func_workers, 4, "Number of fake func workers in the dispatcher scenario");
+ABSL_FLAG(size_t, payload_bytesize, 64, "Byte size of func call inputs");
+ABSL_FLAG(size_t, read_chunk_bytesize, 1500,
+          "Byte size of chunks fed to ReadMessages in the appendable_buffer scenario");
+ABSL_FLAG(size_t, sample_interval, 16, "Measure latency of every this many operations");
+ABSL_FLAG(bool, pin_threads, false, "Pin the i-th thread to CPU i");
+ABSL_FLAG(bool, perf_events, false, "Report cycles and instructions of each thread");
+
+using namespace faas;
+
+using protocol::FuncCall;
+using protocol::Message;
+using protocol::GatewayMessage;
+
+static constexpr size_t kBufferSizeForSamples = 1<<22;
+static constexpr uint16_t kBenchFuncId = 1;
+static constexpr size_t kObjectsPerPoolOperation = 4;
+static constexpr size_t kMessagesInReadStream = 64;
+static constexpr size_t kSpinsBeforeYield = 64;
+
+// Every operation of a scenario is invoked with the index of the calling
+// thread and a sequence number local to the thread
+typedef std::function<void(int /* thread_idx */, uint64_t /* seq */)> OperationFn;
+
+// Func calls dispatched to func workers are recorded in the inbox of the
+// benchmark thread which issued them, to be completed by that thread
+struct FuncCallInbox {
+    absl::Mutex mu;
+    std::vector<FuncCall> func_calls ABSL_GUARDED_BY(mu);
+};
+static std::vector<std::unique_ptr<FuncCallInbox>> func_call_inboxes;
+
+namespace {
+
+// Needs no MessageConnection, while the dispatcher still calls SendMessage
+// the same way as in the engine
+class FakeFuncWorker final : public engine::FuncWorker {
+public:
+    FakeFuncWorker(uint16_t func_id, uint16_t client_id)
+        : engine::FuncWorker(func_id, client_id, /* retirable= */ false) {}
+    ~FakeFuncWorker() {}
+
+    void SendMessage(protocol::Message* message) override {
+        message->send_timestamp = GetMonotonicMicroTimestamp();
+        if (!protocol::IsDispatchFuncCallMessage(*message)) {
+            return;
+        }
+        FuncCall func_call = protocol::GetFuncCallFromMessage(*message);
+        FuncCallInbox* inbox = func_call_inboxes[func_call.client_id - 1].get();
+        absl::MutexLock lk(&inbox->mu);
+        inbox->func_calls.push_back(func_call);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FakeFuncWorker);
+};
+
+// Keeps results of benchmarked code from being optimized away, without
+// sharing a cache line among threads
+thread_local uint64_t checksum_sink = 0;
+
+FuncCall BenchFuncCall(int thread_idx, uint64_t seq) {
+    // Threads act as distinct clients, so that func calls never collide
+    return protocol::NewFuncCall(kBenchFuncId, gsl::narrow_cast<uint16_t>(thread_idx + 1),
+                                 static_cast<uint32_t>(seq));
+}
+
+void RunScenario(std::string_view name, OperationFn op_fn) {
+    int num_threads = absl::GetFlag(FLAGS_num_threads);
+    size_t sample_interval = std::max<size_t>(1, absl::GetFlag(FLAGS_sample_interval));
+    absl::Duration duration = absl::GetFlag(FLAGS_duration);
+    bool pin_threads = absl::GetFlag(FLAGS_pin_threads);
+    bool perf_events = absl::GetFlag(FLAGS_perf_events);
+
+    std::vector<std::unique_ptr<bench_utils::Samples<int32_t>>> latencies(num_threads);
+    std::vector<size_t> loop_counts(num_threads, 0);
+    std::vector<absl::Duration> elapsed_times(num_threads);
+    std::atomic<int> num_ready_threads(0);
+    std::vector<std::unique_ptr<base::Thread>> threads;
+    for (int i = 0; i < num_threads; i++) {
+        latencies[i] = std::make_unique<bench_utils::Samples<int32_t>>(kBufferSizeForSamples);
+        threads.push_back(std::make_unique<base::Thread>(
+            fmt::format("{}-{}", name, i), [&, i] () {
+                if (pin_threads) {
+                    bench_utils::PinCurrentThreadToCpu(i);
+                }
+                std::unique_ptr<utils::PerfEventGroup> perf_event_group;
+                if (perf_events) {
+                    perf_event_group = bench_utils::SetupCpuRelatedPerfEvents();
+                }
+                bench_utils::Samples<int32_t>* latency = latencies[i].get();
+                // Start all threads at the same time for maximum contention
+                num_ready_threads.fetch_add(1);
+                while (num_ready_threads.load() < num_threads) {
+                    asm_volatile_pause();
+                }
+                if (perf_event_group != nullptr) {
+                    perf_event_group->ResetAndEnable();
+                }
+                uint64_t seq = 0;
+                bench_utils::BenchLoop bench_loop(duration, [&] () -> bool {
+                    if (seq % sample_interval == 0) {
+                        int64_t start_timestamp = GetMonotonicNanoTimestamp();
+                        op_fn(i, seq);
+                        latency->Add(gsl::narrow_cast<int32_t>(
+                            GetMonotonicNanoTimestamp() - start_timestamp));
+                    } else {
+                        op_fn(i, seq);
+                    }
+                    seq++;
+                    return true;
+                });
+                loop_counts[i] = bench_loop.loop_count();
+                elapsed_times[i] = bench_loop.elapsed_time();
+                if (perf_event_group != nullptr) {
+                    perf_event_group->Disable();
+                    bench_utils::ReportCpuRelatedPerfEventValues(
+                        fmt::format("{}[{}]", name, i), perf_event_group.get(),
+                        bench_loop.elapsed_time(), bench_loop.loop_count());
+                }
+            }));
+    }
+    for (const auto& thread : threads) {
+        thread->Start();
+    }
+    for (const auto& thread : threads) {
+        thread->Join();
+    }
+
+    size_t total_loop_count = 0;
+    absl::Duration max_elapsed_time = absl::ZeroDuration();
+    for (int i = 0; i < num_threads; i++) {
+        total_loop_count += loop_counts[i];
+        max_elapsed_time = std::max(max_elapsed_time, elapsed_times[i]);
+        LOG(INFO) << fmt::format("{}[{}]: {} operations, {:.1f} ns per operation",
+                                 name, i, loop_counts[i],
+                                 absl::ToDoubleNanoseconds(elapsed_times[i]) / loop_counts[i]);
+        latencies[i]->ReportStatistics(fmt::format("{}[{}]: latency in ns", name, i));
+    }
+    LOG(INFO) << fmt::format("{}: {} threads, {:.3f} million operations per second",
+                             name, num_threads,
+                             total_loop_count / absl::ToDoubleMicroseconds(max_elapsed_time));
+}
+
+// Building, filling and parsing messages along the path of one func call
+void BenchProtocol() {
+    std::string payload(absl::GetFlag(FLAGS_payload_bytesize), 'x');
+    std::span<const char> input(payload.data(),
+                                std::min(payload.size(), size_t{MESSAGE_INLINE_DATA_SIZE}));
+    RunScenario("protocol", [input] (int thread_idx, uint64_t seq) {
+        FuncCall func_call = BenchFuncCall(thread_idx, seq);
+        Message invoke_message = protocol::NewInvokeFuncMessage(func_call, 0);
+        protocol::SetInlineDataInMessage(&invoke_message, input);
+        Message dispatch_message = protocol::NewDispatchFuncCallMessage(
+            protocol::GetFuncCallFromMessage(invoke_message));
+        protocol::SetInlineDataInMessage(
+            &dispatch_message, protocol::GetInlineDataFromMessage(invoke_message));
+        Message complete_message = protocol::NewFuncCallCompleteMessage(
+            protocol::GetFuncCallFromMessage(dispatch_message), /* processing_time= */ 1);
+        GatewayMessage gateway_message = protocol::NewFuncCallCompleteGatewayMessage(
+            protocol::GetFuncCallFromMessage(complete_message), complete_message.processing_time);
+        asm_volatile_memory();
+        checksum_sink += gateway_message.call_id;
+    });
+}
+
+// SimpleObjectPool is not thread-safe, and is guarded by a mutex shared by
+// all threads, the same as in Dispatcher and Tracer
+void BenchObjectPool() {
+    absl::Mutex mu;
+    utils::SimpleObjectPool<Message> message_pool;
+    RunScenario("object_pool", [&mu, &message_pool] (int thread_idx, uint64_t seq) {
+        Message* messages[kObjectsPerPoolOperation];
+        for (size_t i = 0; i < kObjectsPerPoolOperation; i++) {
+            absl::MutexLock lk(&mu);
+            messages[i] = message_pool.Get();
+        }
+        for (size_t i = 0; i < kObjectsPerPoolOperation; i++) {
+            messages[i]->call_id = static_cast<uint32_t>(seq);
+        }
+        for (size_t i = 0; i < kObjectsPerPoolOperation; i++) {
+            absl::MutexLock lk(&mu);
+            message_pool.Return(messages[i]);
+        }
+    });
+}
+
+// Message streams are fed in fixed-size chunks, as connections receive them,
+// which leaves partial messages in the buffer
+void BenchAppendableBuffer() {
+    int num_threads = absl::GetFlag(FLAGS_num_threads);
+    size_t chunk_size = absl::GetFlag(FLAGS_read_chunk_bytesize);
+    std::string stream;
+    for (size_t i = 0; i < kMessagesInReadStream; i++) {
+        Message message = protocol::NewDispatchFuncCallMessage(BenchFuncCall(0, i));
+        stream.append(reinterpret_cast<const char*>(&message), sizeof(Message));
+    }
+    CHECK_GT(chunk_size, 0U);
+    CHECK_LE(chunk_size, stream.size());
+    std::vector<std::unique_ptr<utils::AppendableBuffer>> buffers;
+    std::vector<size_t> stream_positions(num_threads, 0);
+    for (int i = 0; i < num_threads; i++) {
+        buffers.push_back(std::make_unique<utils::AppendableBuffer>());
+    }
+    RunScenario("appendable_buffer", [&] (int thread_idx, uint64_t seq) {
+        size_t* pos = &stream_positions[thread_idx];
+        size_t size = std::min(chunk_size, stream.size() - *pos);
+        uint64_t checksum = 0;
+        utils::ReadMessages<Message>(
+            buffers[thread_idx].get(), stream.data() + *pos, size,
+            [&checksum] (Message* message) {
+                checksum += message->call_id;
+            });
+        *pos = (*pos + size) % stream.size();
+        checksum_sink += checksum;
+    });
+}
+
+std::unique_ptr<engine::Engine> CreateEngine(int num_func_workers) {
+    auto engine = std::make_unique<engine::Engine>();
+    // Fixing the number of func workers keeps the concurrency limiter from
+    // holding back func calls, and the dispatcher from requesting new workers
+    std::string func_config_json = fmt::format(
+        "[{{ \"funcName\": \"Bench\", \"funcId\": {}, "
+        "\"minWorkers\": {}, \"maxWorkers\": {} }}]",
+        kBenchFuncId, num_func_workers, num_func_workers);
+    CHECK(engine->func_config()->Load(func_config_json));
+    engine->tracer()->Init();
+    return engine;
+}
+
+void BenchTracer() {
+    int num_threads = absl::GetFlag(FLAGS_num_threads);
+    size_t input_size = absl::GetFlag(FLAGS_payload_bytesize);
+    auto engine = CreateEngine(num_threads);
+    engine::Tracer* tracer = engine->tracer();
+    std::vector<std::unique_ptr<engine::FuncWorker>> func_workers;
+    for (int i = 0; i < num_threads; i++) {
+        func_workers.push_back(std::make_unique<FakeFuncWorker>(
+            kBenchFuncId, gsl::narrow_cast<uint16_t>(num_threads + i + 1)));
+    }
+    RunScenario("tracer", [&] (int thread_idx, uint64_t seq) {
+        FuncCall func_call = BenchFuncCall(thread_idx, seq);
+        tracer->OnNewFuncCall(func_call, protocol::kInvalidFuncCall, input_size,
+                              /* deadline= */ 0);
+        tracer->OnFuncCallDispatched(func_call, func_workers[thread_idx].get());
+        tracer->OnFuncCallCompleted(func_call, /* processing_time= */ 10,
+                                    /* dispatch_delay= */ 5, /* output_size= */ input_size);
+        tracer->DiscardFuncCallInfo(func_call);
+    });
+}
+
+// Each thread issues one func call at a time, and waits until it is
+// dispatched to a fake func worker before completing it. With more threads
+// than func workers, func calls queue up in the dispatcher.
+void BenchDispatcher() {
+    int num_threads = absl::GetFlag(FLAGS_num_threads);
+    int num_func_workers = absl::GetFlag(FLAGS_num_func_workers);
+    CHECK_GT(num_func_workers, 0);
+    std::string payload(absl::GetFlag(FLAGS_payload_bytesize), 'x');
+    std::span<const char> input(payload.data(),
+                                std::min(payload.size(), size_t{MESSAGE_INLINE_DATA_SIZE}));
+    auto engine = CreateEngine(num_func_workers);
+    engine::Dispatcher dispatcher(engine.get(), kBenchFuncId);
+    func_call_inboxes.clear();
+    for (int i = 0; i < num_threads; i++) {
+        func_call_inboxes.push_back(std::make_unique<FuncCallInbox>());
+    }
+    for (int i = 0; i < num_func_workers; i++) {
+        dispatcher.OnFuncWorkerConnected(std::make_shared<FakeFuncWorker>(
+            kBenchFuncId, gsl::narrow_cast<uint16_t>(num_threads + i + 1)));
+    }
+    RunScenario("dispatcher", [&] (int thread_idx, uint64_t seq) {
+        FuncCall func_call = BenchFuncCall(thread_idx, seq);
+        dispatcher.OnNewFuncCall(func_call, protocol::kInvalidFuncCall,
+                                 input.size(), input, /* shm_input= */ false);
+        FuncCallInbox* inbox = func_call_inboxes[thread_idx].get();
+        for (size_t spin_count = 1; ; spin_count++) {
+            {
+                absl::MutexLock lk(&inbox->mu);
+                if (!inbox->func_calls.empty()) {
+                    DCHECK_EQ(inbox->func_calls.size(), 1U);
+                    DCHECK_EQ(inbox->func_calls[0].full_call_id, func_call.full_call_id);
+                    inbox->func_calls.clear();
+                    break;
+                }
+            }
+            // Yield once in a while, in case threads outnumber CPUs
+            if (spin_count % kSpinsBeforeYield == 0) {
+                sched_yield();
+            } else {
+                asm_volatile_pause();
+            }
+        }
+        dispatcher.OnFuncCallCompleted(func_call, /* processing_time= */ 10,
+                                       /* dispatch_delay= */ 5, /* output_size= */ input.size());
+    });
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    base::InitMain(argc, argv);
+    CHECK_GT(absl::GetFlag(FLAGS_num_threads), 0);
+    CHECK_LT(absl::GetFlag(FLAGS_num_threads) + absl::GetFlag(FLAGS_num_func_workers),
+             protocol::kMaxClientId);
+
+    std::vector<std::string> scenarios = absl::StrSplit(absl::GetFlag(FLAGS_scenarios), ',',
+                                                         absl::SkipEmpty());
+    for (const std::string& scenario : scenarios) {
+        if (scenario == "protocol") {
+            BenchProtocol();
+        } else if (scenario == "object_pool") {
+            BenchObjectPool();
+        } else if (scenario == "appendable_buffer") {
+            BenchAppendableBuffer();
+        } else if (scenario == "tracer") {
+            BenchTracer();
+        } else if (scenario == "dispatcher") {
+            BenchDispatcher();
+        } else {
+            LOG(FATAL) << "Unknown scenario: " << scenario;
+        }
+    }
+    return 0;
+}
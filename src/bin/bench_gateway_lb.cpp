@@ -0,0 +1,243 @@
+#include "base/init.h"
+#include "base/common.h"
+#include "utils/histogram.h"
+#include "gateway/load_balancer.h"
+
+#include <math.h>
+#include <random>
+
+#include <absl/flags/flag.h>
+#include <absl/strings/str_split.h>
+
+ABSL_FLAG(std::string, policies, "random,per_fn_round_robin,least_load,p2c,consistent_hash",
+          "Comma-separated list of load balancing policies to simulate");
+ABSL_FLAG(int, num_nodes, 16, "Number of engine nodes");
+ABSL_FLAG(int, workers_per_node, 8, "Number of func calls a node runs concurrently");
+ABSL_FLAG(int, num_funcs, 64, "Number of functions");
+ABSL_FLAG(double, func_popularity_skew, 1.0,
+          "Zipf exponent of function popularity, 0 for uniform");
+ABSL_FLAG(double, service_time_us, 2000,
+          "Mean service time, each function has its own mean within [0.5x, 2x] of it");
+ABSL_FLAG(int, slow_nodes, 2, "Number of nodes slower than the others");
+ABSL_FLAG(double, slow_node_factor, 3.0, "Service time multiplier of slow nodes");
+ABSL_FLAG(int, warm_funcs_per_node, 48,
+          "Functions a node keeps warm (LRU), others pay cold_start_us. 0 to disable");
+ABSL_FLAG(double, cold_start_us, 2000, "Extra service time of calls to a cold function");
+ABSL_FLAG(double, utilization, 0.7, "Offered load relative to capacity of all nodes");
+ABSL_FLAG(size_t, num_requests, 500000, "Number of simulated func calls");
+ABSL_FLAG(size_t, warmup_requests, 50000, "Func calls excluded from results");
+ABSL_FLAG(double, lb_hash_load_factor, faas::gateway::LoadBalancer::kDefaultLoadFactor,
+          "Load factor for consistent_hash");
+ABSL_FLAG(uint64_t, random_seed, 1, "Seed for the workload and policies");
+
+using namespace faas;
+
+// Discrete-event simulation of the gateway dispatching func calls to engine
+// nodes. Func calls arrive as a Poisson process, and each node runs up to
+// workers_per_node calls at a time, queueing the rest. Latency includes
+// queueing, as gateway observes. Node latencies are fed back to the load
+// balancer as completion messages do in gateway::Server.
+
+namespace {
+
+struct Workload {
+    std::vector<double> func_cdf;
+    std::vector<double> func_service_time_us;
+    std::vector<double> node_factors;
+    double arrival_interval_us;
+};
+
+struct Request {
+    uint64_t seq;
+    uint16_t func_id;
+    double arrival_time;
+};
+
+struct Completion {
+    double time;
+    size_t node_idx;
+    Request request;
+
+    bool operator>(const Completion& other) const { return time > other.time; }
+};
+
+struct Node {
+    double factor;
+    int busy_workers;
+    std::deque<Request> queue;
+    // Most recently used first
+    std::list<uint16_t> warm_funcs;
+    uint64_t num_requests;
+};
+
+Workload BuildWorkload() {
+    std::mt19937_64 rng(absl::GetFlag(FLAGS_random_seed));
+    Workload workload;
+    int num_funcs = absl::GetFlag(FLAGS_num_funcs);
+    double skew = absl::GetFlag(FLAGS_func_popularity_skew);
+    double service_time_us = absl::GetFlag(FLAGS_service_time_us);
+    double total_weight = 0;
+    for (int i = 0; i < num_funcs; i++) {
+        total_weight += 1.0 / pow(i + 1, skew);
+        workload.func_cdf.push_back(total_weight);
+        double scale = exp2(std::uniform_real_distribution<double>(-1.0, 1.0)(rng));
+        workload.func_service_time_us.push_back(service_time_us * scale);
+    }
+    // Mean service time of a func call on a normal node
+    double mean_service_time_us = 0;
+    for (int i = 0; i < num_funcs; i++) {
+        workload.func_cdf[i] /= total_weight;
+        double prob = (i == 0) ? workload.func_cdf[0]
+                               : workload.func_cdf[i] - workload.func_cdf[i - 1];
+        mean_service_time_us += prob * workload.func_service_time_us[i];
+    }
+    double capacity_per_us = 0;
+    for (int i = 0; i < absl::GetFlag(FLAGS_num_nodes); i++) {
+        double factor = (i < absl::GetFlag(FLAGS_slow_nodes))
+                            ? absl::GetFlag(FLAGS_slow_node_factor) : 1.0;
+        workload.node_factors.push_back(factor);
+        capacity_per_us += absl::GetFlag(FLAGS_workers_per_node)
+                           / (mean_service_time_us * factor);
+    }
+    workload.arrival_interval_us = 1.0 / (capacity_per_us * absl::GetFlag(FLAGS_utilization));
+    return workload;
+}
+
+void Simulate(std::string_view policy_name, const Workload& workload) {
+    gateway::LoadBalancer::Policy policy;
+    if (!gateway::LoadBalancer::ParsePolicy(policy_name, &policy)) {
+        LOG(FATAL) << "Unknown load balancing policy: " << policy_name;
+    }
+    uint64_t random_seed = absl::GetFlag(FLAGS_random_seed);
+    size_t num_requests = absl::GetFlag(FLAGS_num_requests);
+    size_t warmup_requests = absl::GetFlag(FLAGS_warmup_requests);
+    size_t warm_funcs_per_node = gsl::narrow_cast<size_t>(
+        std::max(0, absl::GetFlag(FLAGS_warm_funcs_per_node)));
+    double cold_start_us = absl::GetFlag(FLAGS_cold_start_us);
+    int workers_per_node = absl::GetFlag(FLAGS_workers_per_node);
+
+    std::mt19937_64 rng(random_seed);
+    std::exponential_distribution<double> interarrival_dist(1.0 / workload.arrival_interval_us);
+    std::uniform_real_distribution<double> func_dist(0.0, 1.0);
+    gateway::LoadBalancer load_balancer(policy, absl::GetFlag(FLAGS_lb_hash_load_factor),
+                                        random_seed);
+    std::vector<Node> nodes(workload.node_factors.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        nodes[i].factor = workload.node_factors[i];
+        nodes[i].busy_workers = 0;
+        nodes[i].num_requests = 0;
+        load_balancer.AddNode(gsl::narrow_cast<uint16_t>(i));
+    }
+    std::priority_queue<Completion, std::vector<Completion>,
+                        std::greater<Completion>> completions;
+    utils::Histogram latency;
+    uint64_t num_cold_starts = 0;
+
+    auto start_request = [&] (double now, size_t node_idx, const Request& request) {
+        Node* node = &nodes[node_idx];
+        node->busy_workers++;
+        double mean_us = workload.func_service_time_us[request.func_id] * node->factor;
+        double service_time_us = std::exponential_distribution<double>(1.0 / mean_us)(rng);
+        if (warm_funcs_per_node > 0) {
+            auto iter = absl::c_find(node->warm_funcs, request.func_id);
+            if (iter != node->warm_funcs.end()) {
+                node->warm_funcs.erase(iter);
+            } else {
+                service_time_us += cold_start_us;
+                if (request.seq >= warmup_requests) {
+                    num_cold_starts++;
+                }
+                if (node->warm_funcs.size() >= warm_funcs_per_node) {
+                    node->warm_funcs.pop_back();
+                }
+            }
+            node->warm_funcs.push_front(request.func_id);
+        }
+        completions.push({ now + service_time_us, node_idx, request });
+    };
+
+    double next_arrival = interarrival_dist(rng);
+    uint64_t num_arrived = 0;
+    uint64_t num_finished = 0;
+    while (num_finished < num_requests) {
+        if (num_arrived < num_requests
+              && (completions.empty() || next_arrival <= completions.top().time)) {
+            double now = next_arrival;
+            next_arrival += interarrival_dist(rng);
+            size_t func_idx = absl::c_upper_bound(workload.func_cdf, func_dist(rng))
+                                - workload.func_cdf.begin();
+            Request request = {
+                .seq = num_arrived++,
+                .func_id = gsl::narrow_cast<uint16_t>(
+                    std::min(func_idx, workload.func_cdf.size() - 1)),
+                .arrival_time = now
+            };
+            uint16_t node_id;
+            CHECK(load_balancer.PickNode(request.func_id, &node_id));
+            size_t node_idx = node_id;
+            Node* node = &nodes[node_idx];
+            node->num_requests++;
+            if (node->busy_workers < workers_per_node) {
+                start_request(now, node_idx, request);
+            } else {
+                node->queue.push_back(request);
+            }
+        } else {
+            Completion completion = completions.top();
+            completions.pop();
+            double now = completion.time;
+            double latency_us = now - completion.request.arrival_time;
+            if (completion.request.seq >= warmup_requests) {
+                latency.Add(latency_us);
+            }
+            num_finished++;
+            load_balancer.OnRequestFinished(gsl::narrow_cast<uint16_t>(completion.node_idx),
+                                            static_cast<int64_t>(latency_us));
+            Node* node = &nodes[completion.node_idx];
+            node->busy_workers--;
+            if (!node->queue.empty()) {
+                Request request = node->queue.front();
+                node->queue.pop_front();
+                start_request(now, completion.node_idx, request);
+            }
+        }
+    }
+
+    uint64_t max_node_requests = 0;
+    for (const Node& node : nodes) {
+        max_node_requests = std::max(max_node_requests, node.num_requests);
+    }
+    size_t num_measured = num_requests - std::min(num_requests, warmup_requests);
+    printf("%-20s p50=%.0f p90=%.0f p99=%.0f p99.9=%.0f max=%.0f mean=%.1f "
+           "cold_starts=%.2f%% busiest_node=%.1f%%\n",
+           std::string(policy_name).c_str(),
+           latency.Percentile(0.5), latency.Percentile(0.9), latency.Percentile(0.99),
+           latency.Percentile(0.999), latency.max(), latency.mean(),
+           num_measured > 0 ? 100.0 * num_cold_starts / num_measured : 0.0,
+           100.0 * max_node_requests / num_requests);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    base::InitMain(argc, argv);
+    CHECK_GT(absl::GetFlag(FLAGS_num_nodes), 0);
+    CHECK_GT(absl::GetFlag(FLAGS_workers_per_node), 0);
+    CHECK_GT(absl::GetFlag(FLAGS_num_funcs), 0);
+    CHECK_GT(absl::GetFlag(FLAGS_utilization), 0);
+
+    Workload workload = BuildWorkload();
+    printf("%d nodes (%d slow by %.1fx) x %d workers, %d functions, utilization %.2f, "
+           "mean interarrival %.1fus\n",
+           absl::GetFlag(FLAGS_num_nodes), absl::GetFlag(FLAGS_slow_nodes),
+           absl::GetFlag(FLAGS_slow_node_factor), absl::GetFlag(FLAGS_workers_per_node),
+           absl::GetFlag(FLAGS_num_funcs), absl::GetFlag(FLAGS_utilization),
+           workload.arrival_interval_us);
+    printf("Latency in microseconds\n");
+    std::vector<std::string> policies = absl::StrSplit(absl::GetFlag(FLAGS_policies), ',',
+                                                       absl::SkipEmpty());
+    for (const std::string& policy : policies) {
+        Simulate(policy, workload);
+    }
+    return 0;
+}
@@ -73,8 +73,7 @@ void Server(int infd, int outfd) {
         msg_delay.Add(gsl::narrow_cast<int32_t>(GetMonotonicNanoTimestamp() - send_timestamp));
         recv_message_count++;
         if (sleep_every > 0 && recv_message_count % sleep_every == 0) {
-            server_queue->ConsumerEnterSleep();
-            slept = true;
+            slept = server_queue->ConsumerEnterSleep();
         }
         return true;
     });
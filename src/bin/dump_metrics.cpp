@@ -0,0 +1,28 @@
+#include "base/init.h"
+#include "base/common.h"
+#include "common/metrics.h"
+#include "common/time.h"
+
+#include <absl/flags/flag.h>
+
+ABSL_FLAG(std::string, snapshot_path, "",
+          "Metrics snapshot written by engine or gateway (--metrics_snapshot_path)");
+
+// Print metrics snapshot in Prometheus text format, e.g. for node_exporter's
+// textfile collector
+int main(int argc, char* argv[]) {
+    faas::base::InitMain(argc, argv);
+    std::string path = absl::GetFlag(FLAGS_snapshot_path);
+    if (path.empty()) {
+        LOG(FATAL) << "--snapshot_path is not set";
+    }
+    std::string text;
+    int64_t timestamp;
+    if (!faas::stat::ReadMetricsSnapshot(path, &text, &timestamp)) {
+        LOG(FATAL) << "Failed to read metrics snapshot from " << path;
+    }
+    int64_t age_ms = (faas::GetRealtimeMicroTimestamp() - timestamp) / 1000;
+    printf("# Snapshot age: %" PRId64 "ms\n", age_ms);
+    fwrite(text.data(), 1, text.size(), stdout);
+    return 0;
+}
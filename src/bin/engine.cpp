@@ -4,6 +4,7 @@
 #include "utils/docker.h"
 #include "utils/fs.h"
 #include "utils/env_variables.h"
+#include "common/span_recorder.h"
 #include "engine/engine.h"
 
 #include <signal.h>
@@ -71,9 +72,11 @@ int main(int argc, char* argv[]) {
     }
     engine->set_func_config_file(absl::GetFlag(FLAGS_func_config_file));
 
+    faas::tracing::Init("engine");
     engine->Start();
     engine_ptr.store(engine.get());
     engine->WaitForFinish();
+    faas::tracing::Shutdown();
 
     return 0;
 }
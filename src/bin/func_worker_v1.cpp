@@ -25,10 +25,17 @@ int main(int argc, char* argv[]) {
     if (faas::utils::GetEnvVariableAsInt("FAAS_USE_ENGINE_SOCKET", 0) == 1) {
         func_worker->enable_use_engine_socket();
     }
+    if (faas::utils::GetEnvVariableAsInt("FAAS_USE_SHM_QUEUE", 0) == 1) {
+        func_worker->enable_use_shm_queue();
+    }
     func_worker->set_engine_tcp_port(
         faas::utils::GetEnvVariableAsInt("FAAS_ENGINE_TCP_PORT", -1));
     func_worker->set_func_library_path(positional_args[0]);
-    func_worker->Serve();
+    if (faas::utils::GetEnvVariableAsInt("FAAS_ZYGOTE", 0) == 1) {
+        func_worker->ServeAsZygote();
+    } else {
+        func_worker->Serve();
+    }
 
     return 0;
 }
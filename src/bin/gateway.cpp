@@ -3,6 +3,7 @@
 #include "ipc/base.h"
 #include "utils/docker.h"
 #include "utils/env_variables.h"
+#include "common/span_recorder.h"
 #include "gateway/server.h"
 
 #include <signal.h>
@@ -35,9 +36,11 @@ int main(int argc, char* argv[]) {
     server->set_num_io_workers(absl::GetFlag(FLAGS_num_io_workers));
     server->set_func_config_file(absl::GetFlag(FLAGS_func_config_file));
 
+    faas::tracing::Init("gateway");
     server->Start();
     server_ptr.store(server.get());
     server->WaitForFinish();
+    faas::tracing::Shutdown();
 
     return 0;
 }
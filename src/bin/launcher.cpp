@@ -17,6 +17,8 @@ ABSL_FLAG(std::string, fprocess_output_dir, "",
 ABSL_FLAG(std::string, fprocess_mode, "cpp",
           "Operating mode of fprocess. Valid options are cpp, go, nodejs, and python.");
 ABSL_FLAG(int, engine_tcp_port, -1, "If set, will connect to engine via localhost TCP socket");
+ABSL_FLAG(bool, fprocess_use_zygote, false,
+          "In cpp mode, fork new function workers from a pre-initialized zygote process");
 
 static std::atomic<faas::launcher::Launcher*> launcher_ptr(nullptr);
 void SignalHandlerToStopLauncher(int signal) {
@@ -37,6 +39,7 @@ int main(int argc, char* argv[]) {
     launcher->set_fprocess_working_dir(absl::GetFlag(FLAGS_fprocess_working_dir));
     launcher->set_fprocess_output_dir(absl::GetFlag(FLAGS_fprocess_output_dir));
     launcher->set_engine_tcp_port(absl::GetFlag(FLAGS_engine_tcp_port));
+    launcher->set_fprocess_use_zygote(absl::GetFlag(FLAGS_fprocess_use_zygote));
 
     std::string fprocess_mode = absl::GetFlag(FLAGS_fprocess_mode);
     if (fprocess_mode == "cpp") {
@@ -50,6 +53,9 @@ int main(int argc, char* argv[]) {
     } else {
         LOG(FATAL) << "Invalid fprocess_mode: " << fprocess_mode;
     }
+    if (absl::GetFlag(FLAGS_fprocess_use_zygote) && fprocess_mode != "cpp") {
+        LOG(FATAL) << "Zygote is only supported in cpp mode";
+    }
 
     launcher->Start();
     launcher_ptr.store(launcher.get());
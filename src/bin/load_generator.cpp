@@ -0,0 +1,159 @@
+#include "base/init.h"
+#include "base/common.h"
+#include "loadgen/load_generator.h"
+
+#include <random>
+#include <absl/flags/flag.h>
+
+ABSL_FLAG(std::string, gateway_addr, "127.0.0.1", "Address of the gateway");
+ABSL_FLAG(int, http_port, 8080, "HTTP port of the gateway");
+ABSL_FLAG(int, grpc_port, 50051, "gRPC port of the gateway");
+ABSL_FLAG(std::string, protocol, "http", "http or grpc");
+ABSL_FLAG(std::string, func_name, "",
+          "Function to invoke, or gRPC service name (without the grpc: prefix)");
+ABSL_FLAG(std::string, grpc_method, "", "gRPC method to invoke");
+ABSL_FLAG(size_t, payload_bytesize, 64, "Byte size of request payloads");
+ABSL_FLAG(double, qps, 1000, "Target requests per second, summed over all threads");
+ABSL_FLAG(std::string, arrival, "poisson", "Arrival process, fixed or poisson");
+ABSL_FLAG(absl::Duration, warmup, absl::Seconds(5), "Warmup duration, not measured");
+ABSL_FLAG(absl::Duration, duration, absl::Seconds(30), "Measured duration");
+ABSL_FLAG(absl::Duration, drain_timeout, absl::Seconds(5),
+          "Time to wait for outstanding requests after the last arrival");
+ABSL_FLAG(int, num_threads, 1, "Number of client threads");
+ABSL_FLAG(int, num_connections, 16, "Number of connections per thread");
+ABSL_FLAG(size_t, max_streams_per_connection, 64, "Max concurrent gRPC streams per connection");
+ABSL_FLAG(size_t, max_queued_requests, 100000,
+          "Requests arriving when this many are waiting for connections are dropped");
+ABSL_FLAG(uint64_t, random_seed, 0, "Seed for arrivals and payloads, 0 for a random one");
+ABSL_FLAG(std::string, histogram_output, "",
+          "If set, write latency histograms to this file as CSV, for comparing runs");
+
+using namespace faas;
+
+namespace {
+void PrintLatencyLine(std::string_view name, const utils::Histogram& histogram) {
+    if (histogram.count() == 0) {
+        printf("%-22s no samples\n", std::string(name).c_str());
+        return;
+    }
+    printf("%-22s p50=%.0f p90=%.0f p99=%.0f p99.9=%.0f p99.99=%.0f max=%.0f mean=%.1f\n",
+           std::string(name).c_str(),
+           histogram.Percentile(0.5), histogram.Percentile(0.9),
+           histogram.Percentile(0.99), histogram.Percentile(0.999),
+           histogram.Percentile(0.9999), histogram.max(), histogram.mean());
+}
+
+bool WriteHistograms(std::string_view path, const utils::Histogram& corrected,
+                     const utils::Histogram& uncorrected) {
+    std::string contents("bucket_lower_bound_us,corrected_count,uncorrected_count\n");
+    for (size_t i = 0; i < utils::Histogram::kNumBuckets; i++) {
+        uint32_t corrected_count = corrected.bucket_count(i);
+        uint32_t uncorrected_count = uncorrected.bucket_count(i);
+        if (corrected_count == 0 && uncorrected_count == 0) {
+            continue;
+        }
+        contents.append(fmt::format("{},{},{}\n", utils::Histogram::BucketLowerBound(i),
+                                    corrected_count, uncorrected_count));
+    }
+    FILE* fout = fopen(std::string(path).c_str(), "w");
+    if (fout == nullptr) {
+        return false;
+    }
+    bool success = fwrite(contents.data(), 1, contents.size(), fout) == contents.size();
+    fclose(fout);
+    return success;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    base::InitMain(argc, argv);
+
+    loadgen::LoadGenerator::Config config;
+    std::string protocol = absl::GetFlag(FLAGS_protocol);
+    if (protocol == "http") {
+        config.protocol = loadgen::LoadGenerator::kHttp;
+        config.port = absl::GetFlag(FLAGS_http_port);
+    } else if (protocol == "grpc") {
+        config.protocol = loadgen::LoadGenerator::kGrpc;
+        config.port = absl::GetFlag(FLAGS_grpc_port);
+    } else {
+        LOG(FATAL) << "Unknown protocol: " << protocol;
+    }
+    std::string arrival = absl::GetFlag(FLAGS_arrival);
+    if (arrival == "fixed") {
+        config.arrival = loadgen::LoadGenerator::kFixed;
+    } else if (arrival == "poisson") {
+        config.arrival = loadgen::LoadGenerator::kPoisson;
+    } else {
+        LOG(FATAL) << "Unknown arrival process: " << arrival;
+    }
+    config.address = absl::GetFlag(FLAGS_gateway_addr);
+    config.func_name = absl::GetFlag(FLAGS_func_name);
+    config.grpc_method = absl::GetFlag(FLAGS_grpc_method);
+    if (config.func_name.empty()) {
+        LOG(FATAL) << "--func_name is not set";
+    }
+    if (config.protocol == loadgen::LoadGenerator::kGrpc && config.grpc_method.empty()) {
+        LOG(FATAL) << "--grpc_method is not set";
+    }
+    int num_threads = absl::GetFlag(FLAGS_num_threads);
+    CHECK_GT(num_threads, 0);
+    config.payload_size = absl::GetFlag(FLAGS_payload_bytesize);
+    config.qps = absl::GetFlag(FLAGS_qps) / num_threads;
+    config.warmup = absl::GetFlag(FLAGS_warmup);
+    config.duration = absl::GetFlag(FLAGS_duration);
+    config.drain_timeout = absl::GetFlag(FLAGS_drain_timeout);
+    config.num_connections = absl::GetFlag(FLAGS_num_connections);
+    config.max_streams_per_connection = absl::GetFlag(FLAGS_max_streams_per_connection);
+    config.max_queued_requests = absl::GetFlag(FLAGS_max_queued_requests);
+    uint64_t random_seed = absl::GetFlag(FLAGS_random_seed);
+    if (random_seed == 0) {
+        random_seed = std::random_device()();
+    }
+
+    std::vector<std::unique_ptr<loadgen::LoadGenerator>> generators;
+    for (int i = 0; i < num_threads; i++) {
+        config.random_seed = random_seed + static_cast<uint64_t>(i);
+        generators.push_back(std::make_unique<loadgen::LoadGenerator>(
+            fmt::format("LoadGen-{}", i), config));
+    }
+    for (const auto& generator : generators) {
+        generator->Start();
+    }
+
+    utils::Histogram corrected_latency;
+    utils::Histogram uncorrected_latency;
+    uint64_t num_scheduled = 0, num_succeeded = 0, num_failed = 0;
+    uint64_t num_dropped = 0, num_unfinished = 0;
+    for (const auto& generator : generators) {
+        generator->WaitForFinish();
+        const loadgen::LoadGenerator::Result& result = generator->result();
+        num_scheduled += result.num_scheduled;
+        num_succeeded += result.num_succeeded;
+        num_failed += result.num_failed;
+        num_dropped += result.num_dropped;
+        num_unfinished += result.num_unfinished;
+        corrected_latency.MergeFrom(result.corrected_latency);
+        uncorrected_latency.MergeFrom(result.uncorrected_latency);
+    }
+
+    double duration_s = absl::ToDoubleSeconds(config.duration);
+    printf("Target: %s %s, %.1f QPS (%s arrivals), payload %zu bytes\n",
+           protocol.c_str(), config.func_name.c_str(), absl::GetFlag(FLAGS_qps),
+           arrival.c_str(), config.payload_size);
+    printf("Requests: scheduled=%" PRIu64 ", succeeded=%" PRIu64 ", failed=%" PRIu64 ", "
+           "dropped=%" PRIu64 ", unfinished=%" PRIu64 "\n",
+           num_scheduled, num_succeeded, num_failed, num_dropped, num_unfinished);
+    printf("Throughput: %.1f QPS\n", num_succeeded / duration_s);
+    printf("Latency in microseconds\n");
+    PrintLatencyLine("  from scheduled time:", corrected_latency);
+    PrintLatencyLine("  from send time:", uncorrected_latency);
+
+    std::string histogram_output = absl::GetFlag(FLAGS_histogram_output);
+    if (!histogram_output.empty()) {
+        if (!WriteHistograms(histogram_output, corrected_latency, uncorrected_latency)) {
+            LOG(FATAL) << "Failed to write " << histogram_output;
+        }
+    }
+    return (num_failed + num_dropped + num_unfinished) == 0 ? 0 : 1;
+}
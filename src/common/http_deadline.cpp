@@ -0,0 +1,29 @@
+#include "common/http_deadline.h"
+
+#include "common/time.h"
+
+namespace faas {
+
+bool ReadDeadlineHttpHeader(
+        const absl::flat_hash_map<std::string_view, std::string_view>& headers,
+        int64_t* deadline) {
+    for (const auto& [field, value] : headers) {
+        if (!absl::EqualsIgnoreCase(field, kDeadlineHttpHeader)) {
+            continue;
+        }
+        int64_t deadline_ms;
+        if (!absl::SimpleAtoi(value, &deadline_ms) || deadline_ms <= 0) {
+            return false;
+        }
+        int64_t current_timestamp = GetMonotonicMicroTimestamp();
+        if (deadline_ms > (std::numeric_limits<int64_t>::max() - current_timestamp) / 1000) {
+            LOG(WARNING) << "Deadline too large: " << value << "ms";
+            return false;
+        }
+        *deadline = current_timestamp + deadline_ms * 1000;
+        return true;
+    }
+    return false;
+}
+
+}  // namespace faas
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "base/common.h"
+
+namespace faas {
+
+// Value is the relative deadline of the call in milliseconds
+constexpr const char* kDeadlineHttpHeader = "X-Faas-Deadline-Ms";
+
+// Reads the deadline header from parsed HTTP headers, and converts it into an
+// absolute deadline in monotonic microseconds. Returns false if the header is
+// missing, non-positive, or too large to be represented as a timestamp.
+bool ReadDeadlineHttpHeader(
+        const absl::flat_hash_map<std::string_view, std::string_view>& headers,
+        int64_t* deadline);
+
+}  // namespace faas
@@ -0,0 +1,308 @@
+#include "common/metrics.h"
+
+#include "common/time.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HLOG(l) LOG(l) << "Metrics: "
+#define HVLOG(l) VLOG(l) << "Metrics: "
+
+namespace faas {
+namespace stat {
+
+namespace {
+static constexpr const char* kMetricPrefix = "nightcore_";
+
+// Stat names are in the form of "name" or "name[id]"
+void ParseStatName(std::string_view stat_name, std::string_view* name, std::string_view* id) {
+    size_t pos = stat_name.find('[');
+    if (pos != std::string_view::npos && stat_name.back() == ']') {
+        *name = stat_name.substr(0, pos);
+        *id = stat_name.substr(pos + 1, stat_name.size() - pos - 2);
+    } else {
+        *name = stat_name;
+        *id = std::string_view();
+    }
+}
+
+std::string SanitizeMetricName(std::string_view name) {
+    std::string result(name);
+    for (size_t i = 0; i < result.size(); i++) {
+        char c = result[i];
+        if (!(isalnum(c) || c == '_')) {
+            result[i] = '_';
+        }
+    }
+    return result;
+}
+
+std::string EscapeLabelValue(std::string_view value) {
+    std::string result;
+    for (char c : value) {
+        switch (c) {
+        case '\\':
+            result.append("\\\\");
+            break;
+        case '"':
+            result.append("\\\"");
+            break;
+        case '\n':
+            result.append("\\n");
+            break;
+        default:
+            result.push_back(c);
+        }
+    }
+    return result;
+}
+
+std::string FormatValue(double value) {
+    if (std::isnan(value)) {
+        return "NaN";
+    } else if (std::isinf(value)) {
+        return value > 0 ? "+Inf" : "-Inf";
+    } else {
+        return fmt::format("{}", value);
+    }
+}
+
+std::string FormatLabels(std::string_view id, std::string_view extra_label) {
+    std::string labels;
+    if (!id.empty()) {
+        labels = fmt::format("id=\"{}\"", EscapeLabelValue(id));
+    }
+    if (!extra_label.empty()) {
+        if (!labels.empty()) {
+            labels.push_back(',');
+        }
+        labels.append(extra_label);
+    }
+    return labels.empty() ? labels : fmt::format("{{{}}}", labels);
+}
+}  // namespace
+
+MetricsRegistry* MetricsRegistry::instance() {
+    static MetricsRegistry registry;
+    return &registry;
+}
+
+MetricsRegistry::Metric* MetricsRegistry::GetOrCreateMetric(std::string_view name,
+                                                            std::string_view suffix,
+                                                            Type type) {
+    std::string_view base_name, id;
+    ParseStatName(name, &base_name, &id);
+    std::string metric_name = fmt::format("{}{}{}", kMetricPrefix,
+                                          SanitizeMetricName(base_name), suffix);
+    Family& family = families_[metric_name];
+    family.type = type;
+    auto iter = family.metrics.find(std::string(id));
+    if (iter == family.metrics.end()) {
+        Metric metric = { .values = {}, .count = 0 };
+        iter = family.metrics.insert(std::make_pair(std::string(id), std::move(metric))).first;
+    }
+    return &iter->second;
+}
+
+void MetricsRegistry::UpdateSummary(std::string_view name, size_t n_samples,
+                                    const std::vector<std::pair<double, double>>& values) {
+    absl::MutexLock lk(&mu_);
+    Metric* metric = GetOrCreateMetric(name, "", kSummary);
+    metric->values.clear();
+    for (const auto& entry : values) {
+        metric->values.push_back(std::make_pair(
+            fmt::format("quantile=\"{}\"", entry.first), entry.second));
+    }
+    metric->count += n_samples;
+}
+
+void MetricsRegistry::UpdatePNorms(std::string_view name,
+                                   const std::vector<std::pair<double, double>>& values) {
+    absl::MutexLock lk(&mu_);
+    Metric* metric = GetOrCreateMetric(name, "_pnorm", kGauge);
+    metric->values.clear();
+    for (const auto& entry : values) {
+        metric->values.push_back(std::make_pair(
+            fmt::format("p=\"{}\"", entry.first), entry.second));
+    }
+}
+
+void MetricsRegistry::UpdateCounter(std::string_view name, int64_t value) {
+    absl::MutexLock lk(&mu_);
+    Metric* metric = GetOrCreateMetric(name, "_total", kCounter);
+    metric->values.clear();
+    metric->values.push_back(std::make_pair(std::string(), static_cast<double>(value)));
+}
+
+void MetricsRegistry::AddCategoryCounts(std::string_view name,
+                                        const std::map<int, int64_t>& values) {
+    absl::MutexLock lk(&mu_);
+    Metric* metric = GetOrCreateMetric(name, "_total", kCounter);
+    for (const auto& entry : values) {
+        std::string label = fmt::format("category=\"{}\"", entry.first);
+        bool found = false;
+        for (auto& value : metric->values) {
+            if (value.first == label) {
+                value.second += static_cast<double>(entry.second);
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            metric->values.push_back(std::make_pair(label, static_cast<double>(entry.second)));
+        }
+    }
+}
+
+void MetricsRegistry::UpdateGauge(std::string_view name, double value) {
+    absl::MutexLock lk(&mu_);
+    Metric* metric = GetOrCreateMetric(name, "", kGauge);
+    metric->values.clear();
+    metric->values.push_back(std::make_pair(std::string(), value));
+}
+
+std::string MetricsRegistry::ExportPrometheusText() {
+    std::string text;
+    absl::MutexLock lk(&mu_);
+    for (const auto& family_entry : families_) {
+        const std::string& metric_name = family_entry.first;
+        const Family& family = family_entry.second;
+        const char* type_str = "gauge";
+        if (family.type == kSummary) {
+            type_str = "summary";
+        } else if (family.type == kCounter) {
+            type_str = "counter";
+        }
+        text.append(fmt::format("# TYPE {} {}\n", metric_name, type_str));
+        for (const auto& metric_entry : family.metrics) {
+            const std::string& id = metric_entry.first;
+            const Metric& metric = metric_entry.second;
+            for (const auto& value : metric.values) {
+                text.append(fmt::format("{}{} {}\n", metric_name,
+                                        FormatLabels(id, value.first),
+                                        FormatValue(value.second)));
+            }
+            if (family.type == kSummary) {
+                text.append(fmt::format("{}_count{} {}\n", metric_name,
+                                        FormatLabels(id, ""), metric.count));
+            }
+        }
+    }
+    return text;
+}
+
+MetricsSnapshotWriter::MetricsSnapshotWriter(std::string_view path, size_t capacity)
+    : path_(path), capacity_(capacity), base_(nullptr), mapped_size_(0),
+      truncation_warned_(false) {}
+
+MetricsSnapshotWriter::~MetricsSnapshotWriter() {
+    if (base_ != nullptr) {
+        PCHECK(munmap(base_, mapped_size_) == 0);
+        if (unlink(path_.c_str()) != 0) {
+            PLOG(ERROR) << "Failed to remove " << path_;
+        }
+    }
+}
+
+bool MetricsSnapshotWriter::Init() {
+    int fd = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        PLOG(ERROR) << "Failed to open " << path_;
+        return false;
+    }
+    size_t size = sizeof(MetricsSnapshotHeader) + capacity_;
+    if (ftruncate(fd, gsl::narrow_cast<off_t>(size)) != 0) {
+        PLOG(ERROR) << "ftruncate failed on " << path_;
+        close(fd);
+        return false;
+    }
+    void* ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        PLOG(ERROR) << "mmap failed on " << path_;
+        return false;
+    }
+    base_ = reinterpret_cast<char*>(ptr);
+    mapped_size_ = size;
+    MetricsSnapshotHeader* header = reinterpret_cast<MetricsSnapshotHeader*>(base_);
+    header->capacity = gsl::narrow_cast<uint32_t>(capacity_);
+    header->seq.store(0, std::memory_order_relaxed);
+    header->timestamp = 0;
+    header->size = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = MetricsSnapshotHeader::kMagic;
+    HLOG(INFO) << "Write metrics snapshot to " << path_;
+    return true;
+}
+
+void MetricsSnapshotWriter::Update(std::string_view text) {
+    DCHECK(base_ != nullptr);
+    if (text.size() > capacity_) {
+        if (!truncation_warned_) {
+            HLOG(WARNING) << fmt::format("Metrics text ({} bytes) exceeds snapshot capacity, "
+                                         "will be truncated", text.size());
+            truncation_warned_ = true;
+        }
+        text = text.substr(0, text.rfind('\n', capacity_ - 1) + 1);
+    }
+    MetricsSnapshotHeader* header = reinterpret_cast<MetricsSnapshotHeader*>(base_);
+    uint64_t seq = header->seq.load(std::memory_order_relaxed);
+    header->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(base_ + sizeof(MetricsSnapshotHeader), text.data(), text.size());
+    header->size = gsl::narrow_cast<uint32_t>(text.size());
+    header->timestamp = GetRealtimeMicroTimestamp();
+    header->seq.store(seq + 2, std::memory_order_release);
+}
+
+bool ReadMetricsSnapshot(std::string_view path, std::string* text, int64_t* timestamp) {
+    static constexpr int kMaxRetries = 100;
+    int fd = open(std::string(path).c_str(), O_RDONLY);
+    if (fd == -1) {
+        PLOG(ERROR) << "Failed to open " << path;
+        return false;
+    }
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) != 0) {
+        PLOG(ERROR) << "fstat failed on " << path;
+        close(fd);
+        return false;
+    }
+    size_t size = gsl::narrow_cast<size_t>(statbuf.st_size);
+    if (size < sizeof(MetricsSnapshotHeader)) {
+        LOG(ERROR) << "Invalid metrics snapshot " << path;
+        close(fd);
+        return false;
+    }
+    void* ptr = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        PLOG(ERROR) << "mmap failed on " << path;
+        return false;
+    }
+    const char* base = reinterpret_cast<const char*>(ptr);
+    const MetricsSnapshotHeader* header = reinterpret_cast<const MetricsSnapshotHeader*>(base);
+    bool success = false;
+    if (header->magic == MetricsSnapshotHeader::kMagic
+          && sizeof(MetricsSnapshotHeader) + header->capacity <= size) {
+        for (int i = 0; i < kMaxRetries && !success; i++) {
+            uint64_t seq = header->seq.load(std::memory_order_acquire);
+            if (seq % 2 == 1) {
+                continue;
+            }
+            size_t text_size = std::min<size_t>(header->size, header->capacity);
+            text->assign(base + sizeof(MetricsSnapshotHeader), text_size);
+            *timestamp = header->timestamp;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            success = (header->seq.load(std::memory_order_relaxed) == seq);
+        }
+    } else {
+        LOG(ERROR) << "Invalid metrics snapshot " << path;
+    }
+    PCHECK(munmap(ptr, size) == 0);
+    return success;
+}
+
+}  // namespace stat
+}  // namespace faas
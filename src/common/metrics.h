@@ -0,0 +1,104 @@
+#pragma once
+
+#include "base/common.h"
+
+namespace faas {
+namespace stat {
+
+// Process-wide registry of the latest reported values of all statistics.
+// Collectors publish into it from their report callbacks, i.e. once per
+// report interval rather than per sample, so the hot path never touches
+// the registry. Metric names follow the convention of stat names, where
+// "queueing_delay[3]" becomes metric nightcore_queueing_delay with label
+// id="3".
+class MetricsRegistry {
+public:
+    static MetricsRegistry* instance();
+
+    // Summary over one report interval of a StatisticsCollector
+    void UpdateSummary(std::string_view name, size_t n_samples,
+                       const std::vector<std::pair</* quantile */ double, double>>& values);
+    // Values of a p-norm StatisticsCollector, exported as gauges
+    void UpdatePNorms(std::string_view name,
+                      const std::vector<std::pair</* p */ double, double>>& values);
+    // Cumulative value of a Counter
+    void UpdateCounter(std::string_view name, int64_t value);
+    // Increments of a CategoryCounter over one report interval
+    void AddCategoryCounts(std::string_view name, const std::map<int, int64_t>& values);
+    void UpdateGauge(std::string_view name, double value);
+
+    // Prometheus text exposition format (version 0.0.4)
+    std::string ExportPrometheusText();
+
+    static constexpr const char* kHttpPath = "/admin/metrics";
+    static constexpr const char* kHttpContentType = "text/plain; version=0.0.4";
+
+private:
+    enum Type { kSummary, kCounter, kGauge };
+
+    struct Metric {
+        // One for counters and gauges, multiple for summaries, p-norms and
+        // category counters
+        std::vector<std::pair</* extra label */ std::string, double>> values;
+        uint64_t count;
+    };
+    struct Family {
+        Type type;
+        std::map</* id */ std::string, Metric> metrics;
+    };
+
+    absl::Mutex mu_;
+    std::map</* metric name */ std::string, Family> families_ ABSL_GUARDED_BY(mu_);
+
+    MetricsRegistry() {}
+    ~MetricsRegistry() {}
+
+    Metric* GetOrCreateMetric(std::string_view name, std::string_view suffix, Type type)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+    DISALLOW_COPY_AND_ASSIGN(MetricsRegistry);
+};
+
+// Snapshot of exported metrics in a shared memory file, for local scrapers
+// that read it without interacting with the process. The file starts with
+// MetricsSnapshotHeader, followed by Prometheus text. The writer updates it
+// under a seqlock: seq is odd while an update is in progress, readers retry
+// if seq is odd or changed across their read.
+struct MetricsSnapshotHeader {
+    static constexpr uint32_t kMagic = 0x4e434d53;  // "NCMS"
+
+    uint32_t magic;
+    uint32_t capacity;   // Bytes available for text
+    std::atomic<uint64_t> seq;
+    int64_t timestamp;   // Wall-clock time of the update, in microseconds
+    uint32_t size;       // Bytes of text
+    uint32_t padding;
+};
+
+class MetricsSnapshotWriter {
+public:
+    static constexpr size_t kDefaultCapacity = 1 << 20;
+
+    explicit MetricsSnapshotWriter(std::string_view path,
+                                   size_t capacity = kDefaultCapacity);
+    ~MetricsSnapshotWriter();
+
+    bool Init();
+    void Update(std::string_view text);
+
+private:
+    std::string path_;
+    size_t capacity_;
+    char* base_;
+    size_t mapped_size_;
+    bool truncation_warned_;
+
+    DISALLOW_COPY_AND_ASSIGN(MetricsSnapshotWriter);
+};
+
+// Returns false if the snapshot file is invalid, or a consistent read
+// cannot be made after several retries
+bool ReadMetricsSnapshot(std::string_view path, std::string* text, int64_t* timestamp);
+
+}  // namespace stat
+}  // namespace faas
@@ -14,13 +14,27 @@ constexpr int kMaxFuncId   = (1 << kFuncIdBits) - 1;
 constexpr int kMaxMethodId = (1 << kMethodIdBits) - 1;
 constexpr int kMaxClientId = (1 << kClientIdBits) - 1;
 
+// client_ids of exited func workers are reused. FuncCall carries the
+// generation of client_id, bumped on every reuse, so that calls issued by
+// different func workers with the same client_id never share full_call_id.
+// It lives in the otherwise unused top bits of full_call_id, leaving all 32
+// bits of call_id to the per-worker call sequence.
+//
+// The identifier space is otherwise unchanged: func_id has 8 bits (at most
+// 255 functions), and full_call_id stays 64 bits. full_call_id is used as
+// hash map key and shm name throughout engine, gateway and worker libraries,
+// and the 16-byte GatewayMessage has no room for wider ids, so a 128-bit
+// call id mode is left for a follow-up change of the wire format.
+constexpr int kCallIdGenerationBits = 4;
+constexpr uint32_t kMaxCallIdGeneration = (1U << kCallIdGenerationBits) - 1;
+
 union FuncCall {
     struct {
         uint16_t func_id   : 8;
         uint16_t method_id : 6;
         uint16_t client_id : 14;
         uint32_t call_id   : 32;
-        uint16_t padding   : 4;
+        uint16_t client_id_generation : 4;
     } __attribute__ ((packed));
     uint64_t full_call_id;
 };
@@ -73,11 +87,26 @@ enum class MessageType : uint16_t {
     INVOKE_FUNC           = 6,
     DISPATCH_FUNC_CALL    = 7,
     FUNC_CALL_COMPLETE    = 8,
-    FUNC_CALL_FAILED      = 9
+    FUNC_CALL_FAILED      = 9,
+    RETIRE_FUNC_WORKER    = 10
 };
 
 constexpr uint32_t kFuncWorkerUseEngineSocketFlag = 1;
 constexpr uint32_t kUseFifoForNestedCallFlag = 2;
+constexpr uint32_t kFuncWorkerUseShmQueueFlag = 4;
+// Used in FUNC_WORKER_HANDSHAKE and HANDSHAKE_RESPONSE
+constexpr uint32_t kShmArenaEnabledFlag = 8;
+// Used in INVOKE_FUNC, DISPATCH_FUNC_CALL, FUNC_CALL_COMPLETE
+constexpr uint32_t kPayloadInShmArenaFlag = 16;
+// Used in FUNC_WORKER_HANDSHAKE, set by func workers that exit gracefully
+// on RETIRE_FUNC_WORKER
+constexpr uint32_t kFuncWorkerRetirableFlag = 32;
+// Used in HANDSHAKE_RESPONSE to func workers, inline data carries the list
+// of CPUs the func worker should run on, in the format of cpuset
+constexpr uint32_t kFuncWorkerCpusetFlag = 64;
+
+// Number of messages in each shared memory queue between engine and func worker
+constexpr size_t kFuncWorkerMessageQueueSize = 128;
 
 struct Message {
     struct {
@@ -97,8 +126,13 @@ struct Message {
     int64_t send_timestamp;
     int32_t payload_size;  // Used in HANDSHAKE_RESPONSE, INVOKE_FUNC, FUNC_CALL_COMPLETE
     uint32_t flags;
+    // Location of the payload when kPayloadInShmArenaFlag is set
+    uint32_t shm_arena_offset;
+    uint16_t shm_arena_segment;
+    // Generation of client_id in FuncCall, see kCallIdGenerationBits
+    uint8_t client_id_generation;
 
-    char padding[__FAAS_CACHE_LINE_SIZE - 32];
+    char padding[__FAAS_CACHE_LINE_SIZE - 39];
     char inline_data[__FAAS_MESSAGE_SIZE - __FAAS_CACHE_LINE_SIZE]
         __attribute__ ((aligned (__FAAS_CACHE_LINE_SIZE)));
 };
@@ -122,6 +156,9 @@ struct GatewayMessage {
         } __attribute__ ((packed));
         int32_t processing_time; // Used in FUNC_CALL_COMPLETE
         int32_t status_code;     // Used in FUNC_CALL_FAILED
+        // Used in DISPATCH_FUNC_CALL, remaining time before deadline in
+        // microseconds, 0 if there is no deadline
+        int32_t deadline_budget;
     };
     int32_t payload_size;        // Used in INVOKE_FUNC, FUNC_CALL_COMPLETE
 } __attribute__ ((packed));
@@ -176,13 +213,20 @@ inline bool IsFuncCallFailedMessage(const GatewayMessage& message) {
     return static_cast<MessageType>(message.message_type) == MessageType::FUNC_CALL_FAILED;
 }
 
+inline bool IsRetireFuncWorkerMessage(const Message& message) {
+    return static_cast<MessageType>(message.message_type) == MessageType::RETIRE_FUNC_WORKER;
+}
+
 inline void SetFuncCallInMessage(Message* message, const FuncCall& func_call) {
     message->func_id = func_call.func_id;
     message->method_id = func_call.method_id;
     message->client_id = func_call.client_id;
     message->call_id = func_call.call_id;
+    message->client_id_generation = func_call.client_id_generation;
 }
 
+// Only external func calls (with client_id 0) are sent to and from gateway,
+// thus GatewayMessage does not carry client_id_generation
 inline void SetFuncCallInMessage(GatewayMessage* message, const FuncCall& func_call) {
     message->func_id = func_call.func_id;
     message->method_id = func_call.method_id;
@@ -200,7 +244,7 @@ inline FuncCall GetFuncCallFromMessage(const Message& message) {
     func_call.method_id = message.method_id;
     func_call.client_id = message.client_id;
     func_call.call_id = message.call_id;
-    func_call.padding = 0;
+    func_call.client_id_generation = message.client_id_generation;
     return func_call;
 }
 
@@ -213,7 +257,7 @@ inline FuncCall GetFuncCallFromMessage(const GatewayMessage& message) {
     func_call.method_id = message.method_id;
     func_call.client_id = message.client_id;
     func_call.call_id = message.call_id;
-    func_call.padding = 0;
+    func_call.client_id_generation = 0;
     return func_call;
 }
 
@@ -238,6 +282,24 @@ inline std::span<const char> GetInlineDataFromMessage(const Message& message) {
     return std::span<const char>();
 }
 
+inline bool IsPayloadInShmArena(const Message& message) {
+    return message.payload_size < 0 && (message.flags & kPayloadInShmArenaFlag) != 0;
+}
+
+inline void SetShmArenaPayloadInMessage(Message* message, uint16_t segment, uint32_t offset,
+                                        size_t size) {
+    message->flags |= kPayloadInShmArenaFlag;
+    message->shm_arena_segment = segment;
+    message->shm_arena_offset = offset;
+    message->payload_size = -gsl::narrow_cast<int32_t>(size);
+}
+
+inline void ClearShmArenaPayloadInMessage(Message* message) {
+    message->flags &= ~kPayloadInShmArenaFlag;
+    message->shm_arena_segment = 0;
+    message->shm_arena_offset = 0;
+}
+
 inline int32_t ComputeMessageDelay(const Message& message) {
     if (message.send_timestamp > 0) {
         return gsl::narrow_cast<int32_t>(GetMonotonicMicroTimestamp() - message.send_timestamp);
@@ -272,6 +334,14 @@ inline Message NewHandshakeResponseMessage(uint32_t payload_size) {
     return message;
 }
 
+// In HANDSHAKE_RESPONSE to func workers, call_id carries the generation of
+// the worker's client_id, to be set in FuncCall of its nested calls
+inline Message NewFuncWorkerHandshakeResponseMessage(uint32_t client_id_generation) {
+    Message message = NewHandshakeResponseMessage(0);
+    message.call_id = client_id_generation;
+    return message;
+}
+
 inline Message NewCreateFuncWorkerMessage(uint16_t client_id) {
     NEW_EMPTY_MESSAGE(message);
     message.message_type = static_cast<uint16_t>(MessageType::CREATE_FUNC_WORKER);
@@ -279,6 +349,12 @@ inline Message NewCreateFuncWorkerMessage(uint16_t client_id) {
     return message;
 }
 
+inline Message NewRetireFuncWorkerMessage() {
+    NEW_EMPTY_MESSAGE(message);
+    message.message_type = static_cast<uint16_t>(MessageType::RETIRE_FUNC_WORKER);
+    return message;
+}
+
 inline Message NewInvokeFuncMessage(const FuncCall& func_call, uint64_t parent_call_id) {
     NEW_EMPTY_MESSAGE(message);
     message.message_type = static_cast<uint16_t>(MessageType::INVOKE_FUNC);
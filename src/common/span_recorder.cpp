@@ -0,0 +1,248 @@
+#include "common/span_recorder.h"
+
+#include "base/thread.h"
+#include "common/time.h"
+#include "utils/fs.h"
+#include "utils/env_variables.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/syscall.h>
+
+#define HLOG(l) LOG(l) << "SpanRecorder: "
+#define HVLOG(l) VLOG(l) << "SpanRecorder: "
+
+namespace faas {
+namespace tracing {
+
+namespace internal {
+uint64_t sample_threshold = 0;
+}  // namespace internal
+
+namespace {
+// Single-producer ring, written by its owner thread and read by the dumper.
+// Old events are overwritten if the dumper falls behind.
+struct SpanRing {
+    static constexpr size_t kSize = 16384;
+
+    SpanEvent events[kSize];
+    // For the event at position pos, seqs[pos % kSize] is pos+1 once it is
+    // written, and 0 while being written
+    std::atomic<uint64_t> seqs[kSize];
+    std::atomic<uint64_t> write_pos;
+    uint64_t read_pos;  // Only accessed by the dumper, under dump_mu
+    int32_t tid;
+};
+
+absl::Mutex rings_mu;
+std::vector<SpanRing*> rings ABSL_GUARDED_BY(rings_mu);
+thread_local SpanRing* current_ring = nullptr;
+
+absl::Mutex dump_mu;
+std::string dump_path ABSL_GUARDED_BY(dump_mu);
+std::string process_name ABSL_GUARDED_BY(dump_mu);
+int dump_fd ABSL_GUARDED_BY(dump_mu) = -1;
+
+std::atomic<bool> dump_requested(false);
+int64_t dump_interval_ms = 0;
+
+absl::Mutex dump_thread_mu;
+bool dump_thread_stopping ABSL_GUARDED_BY(dump_thread_mu) = false;
+// Only accessed by Init and Shutdown
+std::unique_ptr<base::Thread> dump_thread;
+
+SpanRing* CreateRingForCurrentThread() {
+    SpanRing* ring = new SpanRing;
+    for (size_t i = 0; i < SpanRing::kSize; i++) {
+        ring->seqs[i].store(0, std::memory_order_relaxed);
+    }
+    ring->write_pos.store(0, std::memory_order_relaxed);
+    ring->read_pos = 0;
+    ring->tid = gsl::narrow_cast<int32_t>(syscall(SYS_gettid));
+    absl::MutexLock lk(&rings_mu);
+    rings.push_back(ring);
+    return ring;
+}
+
+bool OpenDumpFile() ABSL_EXCLUSIVE_LOCKS_REQUIRED(dump_mu) {
+    dump_fd = open(dump_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dump_fd == -1) {
+        PLOG(ERROR) << "Failed to open " << dump_path;
+        return false;
+    }
+    SpanFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SpanFileHeader::kMagic;
+    header.version = SpanFileHeader::kVersion;
+    header.event_size = sizeof(SpanEvent);
+    header.pid = gsl::narrow_cast<int32_t>(getpid());
+    header.realtime_offset = GetRealtimeNanoTimestamp() - GetMonotonicNanoTimestamp();
+    strncpy(header.process_name, process_name.c_str(), sizeof(header.process_name) - 1);
+    if (write(dump_fd, &header, sizeof(header)) != sizeof(header)) {
+        PLOG(ERROR) << "Failed to write span file header";
+        close(dump_fd);
+        dump_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void DumpRing(SpanRing* ring, std::vector<SpanEvent>* buffer)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(dump_mu) {
+    uint64_t end = ring->write_pos.load(std::memory_order_acquire);
+    uint64_t start = std::max(ring->read_pos, end >= SpanRing::kSize ? end - SpanRing::kSize : 0);
+    for (uint64_t pos = start; pos < end; pos++) {
+        std::atomic<uint64_t>* seq = &ring->seqs[pos % SpanRing::kSize];
+        if (seq->load(std::memory_order_acquire) != pos + 1) {
+            // Being overwritten by the writer
+            continue;
+        }
+        SpanEvent event = ring->events[pos % SpanRing::kSize];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq->load(std::memory_order_relaxed) != pos + 1) {
+            // Overwritten during the copy
+            continue;
+        }
+        buffer->push_back(event);
+    }
+    ring->read_pos = end;
+}
+
+void DumpThreadMain() {
+    int64_t last_dump_timestamp = GetMonotonicMicroTimestamp();
+    while (true) {
+        {
+            absl::MutexLock lk(&dump_thread_mu);
+            if (dump_thread_mu.AwaitWithTimeout(absl::Condition(&dump_thread_stopping),
+                                                absl::Milliseconds(100))) {
+                break;
+            }
+        }
+        int64_t current_timestamp = GetMonotonicMicroTimestamp();
+        bool interval_passed = dump_interval_ms > 0
+            && current_timestamp - last_dump_timestamp >= dump_interval_ms * 1000;
+        if (dump_requested.exchange(false) || interval_passed) {
+            Flush();
+            last_dump_timestamp = current_timestamp;
+        }
+    }
+}
+
+void SignalHandlerToDump(int signal) {
+    dump_requested.store(true);
+}
+}  // namespace
+
+void Init(std::string_view name) {
+    std::string sample_rate_str(utils::GetEnvVariable("FAAS_TRACE_SPAN_SAMPLE_RATE", "0"));
+    double sample_rate = atof(sample_rate_str.c_str());
+    if (sample_rate <= 0) {
+        internal::sample_threshold = 0;
+        return;
+    }
+    internal::sample_threshold = (sample_rate >= 1.0)
+        ? std::numeric_limits<uint64_t>::max()
+        : static_cast<uint64_t>(sample_rate * 18446744073709551616.0 /* 2^64 */);
+    std::string dump_dir(utils::GetEnvVariable("FAAS_TRACE_SPAN_DUMP_DIR", "/tmp"));
+    dump_interval_ms = utils::GetEnvVariableAsInt("FAAS_TRACE_SPAN_DUMP_INTERVAL_MS", 0);
+    {
+        absl::MutexLock lk(&dump_mu);
+        process_name = std::string(name);
+        dump_path = fs_utils::JoinPath(dump_dir, fmt::format("spans.{}.{}.bin", name, getpid()));
+        if (dump_fd != -1) {
+            // Inherited from the parent process
+            close(dump_fd);
+            dump_fd = -1;
+        }
+    }
+    // Rings inherited from the parent process belong to threads that do not exist
+    {
+        absl::MutexLock lk(&rings_mu);
+        rings.clear();
+    }
+    current_ring = nullptr;
+    PCHECK(signal(SIGUSR2, SignalHandlerToDump) != SIG_ERR);
+    if (dump_thread != nullptr) {
+        // Inherited from the parent process, where the thread actually runs
+        dump_thread.release();
+    }
+    {
+        absl::MutexLock lk(&dump_thread_mu);
+        dump_thread_stopping = false;
+    }
+    dump_thread = std::make_unique<base::Thread>("SpanDump", &DumpThreadMain);
+    dump_thread->Start();
+    HLOG(INFO) << fmt::format("Trace spans of {}% func calls, dump to {}",
+                              std::min(sample_rate, 1.0) * 100, dump_path);
+}
+
+void Flush() {
+    if (internal::sample_threshold == 0) {
+        return;
+    }
+    std::vector<SpanRing*> rings_copy;
+    {
+        absl::MutexLock lk(&rings_mu);
+        rings_copy = rings;
+    }
+    absl::MutexLock lk(&dump_mu);
+    std::vector<SpanEvent> buffer;
+    for (SpanRing* ring : rings_copy) {
+        DumpRing(ring, &buffer);
+    }
+    if (buffer.empty()) {
+        return;
+    }
+    if (dump_fd == -1 && !OpenDumpFile()) {
+        return;
+    }
+    size_t size = buffer.size() * sizeof(SpanEvent);
+    if (write(dump_fd, buffer.data(), size) != static_cast<ssize_t>(size)) {
+        PLOG(ERROR) << "Failed to write spans";
+        return;
+    }
+    HVLOG(1) << fmt::format("Dumped {} span events", buffer.size());
+}
+
+void Shutdown() {
+    if (dump_thread != nullptr) {
+        {
+            absl::MutexLock lk(&dump_thread_mu);
+            dump_thread_stopping = true;
+        }
+        dump_thread->Join();
+        dump_thread.reset();
+    }
+    Flush();
+    absl::MutexLock lk(&dump_mu);
+    if (dump_fd != -1) {
+        close(dump_fd);
+        dump_fd = -1;
+    }
+}
+
+namespace internal {
+void Record(uint64_t full_call_id, Span span, Phase phase) {
+    SpanRing* ring = current_ring;
+    if (__FAAS_PREDICT_FALSE(ring == nullptr)) {
+        ring = CreateRingForCurrentThread();
+        current_ring = ring;
+    }
+    uint64_t pos = ring->write_pos.load(std::memory_order_relaxed);
+    std::atomic<uint64_t>* seq = &ring->seqs[pos % SpanRing::kSize];
+    seq->store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    SpanEvent* event = &ring->events[pos % SpanRing::kSize];
+    event->full_call_id = full_call_id;
+    event->timestamp = GetMonotonicNanoTimestamp();
+    event->tid = ring->tid;
+    event->span = static_cast<uint8_t>(span);
+    event->phase = static_cast<uint8_t>(phase);
+    event->padding = 0;
+    seq->store(pos + 1, std::memory_order_release);
+    ring->write_pos.store(pos + 1, std::memory_order_release);
+}
+}  // namespace internal
+
+}  // namespace tracing
+}  // namespace faas
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "base/common.h"
+
+namespace faas {
+namespace tracing {
+
+// Per-call span events, recorded into per-thread lock-free ring buffers and
+// dumped to binary files, which convert_spans_to_chrome_trace.py turns into
+// Chrome trace JSON.
+//
+// Configured by environment variables, so that gateway, engine and func
+// workers share the same settings:
+//   FAAS_TRACE_SPAN_SAMPLE_RATE       Fraction of func calls traced, 0 (default)
+//                                     disables recording
+//   FAAS_TRACE_SPAN_DUMP_DIR          Where span files go, default /tmp
+//   FAAS_TRACE_SPAN_DUMP_INTERVAL_MS  If positive, dump periodically. Spans are
+//                                     also dumped on SIGUSR2, by Flush() and
+//                                     by Shutdown().
+// Sampling is decided by a hash of full_call_id, so all processes trace the
+// same func calls without coordination.
+
+enum class Span : uint8_t {
+    kGatewayRequest       = 1,  // Gateway receives request -> response handed to connection
+    kGatewayDispatch      = 2,  // Instant, gateway sends the func call to an engine
+    kGatewayResponseWrite = 3,  // HTTP response write
+    kEngineCall           = 4,  // Engine receives func call -> completed or failed
+    kEngineQueueing       = 5,  // Engine receives func call -> dispatched to a func worker
+    kWorkerInput          = 6,  // Func worker reads input, from shm if large
+    kWorkerExecute        = 7,  // Func worker runs the function
+    kWorkerOutput         = 8   // Func worker writes output, to shm if large
+};
+
+enum class Phase : uint8_t { kBegin = 0, kEnd = 1, kInstant = 2 };
+
+struct SpanEvent {
+    uint64_t full_call_id;
+    int64_t  timestamp;  // CLOCK_MONOTONIC in nanoseconds
+    int32_t  tid;
+    uint8_t  span;
+    uint8_t  phase;
+    uint16_t padding;
+} __attribute__ ((packed));
+static_assert(sizeof(SpanEvent) == 24, "Unexpected SpanEvent size");
+
+// Header of span files, followed by SpanEvent records. Files are appended
+// on every dump.
+struct SpanFileHeader {
+    static constexpr uint32_t kMagic = 0x4e435350;  // "NCSP"
+    static constexpr uint32_t kVersion = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t event_size;
+    int32_t  pid;
+    int64_t  realtime_offset;  // CLOCK_REALTIME - CLOCK_MONOTONIC, in nanoseconds
+    char     process_name[32];
+} __attribute__ ((packed));
+
+// Should be called after fork, as the dump thread does not survive it
+void Init(std::string_view process_name);
+// Dump all recorded spans
+void Flush();
+// Stop and join the dump thread, then dump remaining spans
+void Shutdown();
+
+namespace internal {
+extern uint64_t sample_threshold;  // 0 if disabled
+void Record(uint64_t full_call_id, Span span, Phase phase);
+}  // namespace internal
+
+inline bool IsSampled(uint64_t full_call_id) {
+    if (__FAAS_PREDICT_TRUE(internal::sample_threshold == 0)) {
+        return false;
+    }
+    return (full_call_id * 0x9e3779b97f4a7c15ULL) < internal::sample_threshold;
+}
+
+inline void BeginSpan(uint64_t full_call_id, Span span) {
+    if (IsSampled(full_call_id)) {
+        internal::Record(full_call_id, span, Phase::kBegin);
+    }
+}
+
+inline void EndSpan(uint64_t full_call_id, Span span) {
+    if (IsSampled(full_call_id)) {
+        internal::Record(full_call_id, span, Phase::kEnd);
+    }
+}
+
+inline void InstantSpan(uint64_t full_call_id, Span span) {
+    if (IsSampled(full_call_id)) {
+        internal::Record(full_call_id, span, Phase::kInstant);
+    }
+}
+
+}  // namespace tracing
+}  // namespace faas
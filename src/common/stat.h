@@ -2,8 +2,10 @@
 
 #include "base/common.h"
 #include "common/time.h"
+#include "common/metrics.h"
 #include "utils/bst.h"
 #include "utils/env_variables.h"
+#include "utils/histogram.h"
 #include "utils/random.h"
 
 #include <math.h>
@@ -11,13 +13,15 @@
 namespace faas {
 namespace stat {
 
+// Check can be called from multiple threads, while MarkReport should be
+// called by one thread at a time
 class ReportTimer {
 public:
     static constexpr uint32_t kDefaultReportIntervalInMs = 10000;  /* 10 seconds */
 
     explicit ReportTimer(uint32_t report_interval_in_ms = kDefaultReportIntervalInMs) {
         set_report_interval_in_ms(report_interval_in_ms);
-        last_report_time_ = -1;
+        last_report_time_.store(-1, std::memory_order_relaxed);
     }
     ~ReportTimer() {}
 
@@ -27,28 +31,57 @@ public:
 
     bool Check() {
         int64_t current_time = GetMonotonicMicroTimestamp();
-        if (last_report_time_ == -1) {
-            last_report_time_ = current_time;
+        int64_t last_report_time = last_report_time_.load(std::memory_order_relaxed);
+        if (last_report_time == -1) {
+            last_report_time_.store(current_time, std::memory_order_relaxed);
             return false;
         } else {
-            return current_time - last_report_time_
+            return current_time - last_report_time
                      > int64_t{report_interval_in_ms_} * 1000; 
         }
     }
 
     void MarkReport(int* duration_ms) {
         int64_t current_time = GetMonotonicMicroTimestamp();
-        *duration_ms = gsl::narrow_cast<int>((current_time - last_report_time_) / 1000);
-        last_report_time_ = current_time;
+        int64_t last_report_time = last_report_time_.load(std::memory_order_relaxed);
+        *duration_ms = gsl::narrow_cast<int>((current_time - last_report_time) / 1000);
+        last_report_time_.store(current_time, std::memory_order_relaxed);
     }
 
 private:
     uint32_t report_interval_in_ms_;
-    int64_t last_report_time_;
+    std::atomic<int64_t> last_report_time_;
 
     DISALLOW_COPY_AND_ASSIGN(ReportTimer);
 };
 
+// For computing intervals between events recorded by multiple threads.
+// Advances last_timestamp to current_timestamp, or past its previous value
+// if current_timestamp is not larger. Returns the previous value, and updates
+// current_timestamp to the new one.
+inline int64_t AdvanceTimestamp(std::atomic<int64_t>* last_timestamp,
+                                int64_t* current_timestamp) {
+    int64_t previous = last_timestamp->load(std::memory_order_relaxed);
+    int64_t updated;
+    do {
+        updated = std::max(*current_timestamp, previous + 1);
+    } while (!last_timestamp->compare_exchange_weak(previous, updated,
+                                                    std::memory_order_relaxed));
+    *current_timestamp = updated;
+    return previous;
+}
+
+// Thread-safe collectors below record into per-thread shards, which are
+// merged when reporting. Threads are spread over shards by the order they
+// first record anything, and threads sharing a shard are serialized by it.
+constexpr size_t kNumStatShards = 32;
+
+inline size_t CurrentStatShard() {
+    static std::atomic<size_t> next_thread_idx{0};
+    static thread_local size_t thread_idx = next_thread_idx.fetch_add(1);
+    return thread_idx % kNumStatShards;
+}
+
 #ifdef __FAAS_USE_NEW_STAT_COLLECTOR
 
 template<class T>
@@ -79,12 +112,15 @@ public:
                 stream << p << "-norm=" << pnorm;
             }
             LOG(INFO) << stream.str();
+            MetricsRegistry::instance()->UpdatePNorms(stat_name_copy, report.data);
         };
     }
 
     explicit StatisticsCollector(ReportCallback report_callback)
         : min_report_samples_(kDefaultMinReportSamples),
-          report_callback_(report_callback) {
+          report_callback_(report_callback),
+          force_enabled_(false),
+          n_samples_(0) {
         std::string pnorms(utils::GetEnvVariable("FAAS_STAT_PNORMS", "1,2,5,10"));
         size_t start = 0;
         while (true) {
@@ -108,9 +144,17 @@ public:
     void set_min_report_samples(size_t value) {
         min_report_samples_ = value;
     }
+    void set_force_enabled(bool value) {
+        force_enabled_ = value;
+    }
 
     void AddSample(T sample) {
-#ifndef __FAAS_DISABLE_STAT
+#ifdef __FAAS_DISABLE_STAT
+        if (!force_enabled_) {
+            return;
+        }
+#endif
+        absl::MutexLock lk(&mu_);
         for (size_t i = 0; i < p_.size(); i++) {
             psum_[i] += std::pow(static_cast<double>(sample), p_[i]);
         }
@@ -126,19 +170,20 @@ public:
             report_timer_.MarkReport(&duration_ms);
             report_callback_(duration_ms, n_samples, report);
         }
-#endif
     }
 
 private:
     size_t min_report_samples_;
     ReportCallback report_callback_;
+    bool force_enabled_;
 
     ReportTimer report_timer_;
-    size_t n_samples_;
+    absl::Mutex mu_;
+    size_t n_samples_ ABSL_GUARDED_BY(mu_);
     std::vector<double> p_;
-    std::vector<double> psum_;
+    std::vector<double> psum_ ABSL_GUARDED_BY(mu_);
 
-    inline Report BuildReport() {
+    inline Report BuildReport() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
         std::vector<std::pair<double, double>> data;
         data.resize(p_.size());
         for (size_t i = 0; i < p_.size(); i++) {
@@ -153,13 +198,21 @@ private:
 
 #else  // __FAAS_USE_NEW_STAT_COLLECTOR
 
+// Samples are recorded into fixed-size log-linear histograms, so AddSample
+// is O(1) and memory does not grow with load. Reported percentiles are within
+// 0.8% of exact values (see utils::Histogram), and integer samples below 64
+// are exact.
+//
+// AddSample is thread-safe. Each thread records into its own shard under a
+// lock that is only contended by reporting, and shards are merged into one
+// histogram when reporting.
 template<class T>
 class StatisticsCollector {
 public:
     static constexpr size_t kDefaultMinReportSamples = 200;
 
     struct Report {
-        T p30; T p50; T p70; T p90; T p99; T p99_9;
+        T p30; T p50; T p70; T p90; T p99; T p99_9; T p99_99;
     };
 
     typedef std::function<void(int /* duration_ms */, size_t /* n_samples */,
@@ -173,17 +226,37 @@ public:
                       << "p70=" << report.p70 << ", "
                       << "p90=" << report.p90 << ", "
                       << "p99=" << report.p99 << ", "
-                      << "p99.9=" << report.p99_9;
+                      << "p99.9=" << report.p99_9 << ", "
+                      << "p99.99=" << report.p99_99;
+            MetricsRegistry::instance()->UpdateSummary(stat_name_copy, n_samples, {
+                std::make_pair(0.3, static_cast<double>(report.p30)),
+                std::make_pair(0.5, static_cast<double>(report.p50)),
+                std::make_pair(0.7, static_cast<double>(report.p70)),
+                std::make_pair(0.9, static_cast<double>(report.p90)),
+                std::make_pair(0.99, static_cast<double>(report.p99)),
+                std::make_pair(0.999, static_cast<double>(report.p99_9)),
+                std::make_pair(0.9999, static_cast<double>(report.p99_99))
+            });
         };
     }
 
     explicit StatisticsCollector(ReportCallback report_callback)
         : min_report_samples_(kDefaultMinReportSamples),
           report_callback_(report_callback),
-          force_enabled_(false) {}
+          force_enabled_(false),
+          next_report_check_(0) {
+        for (size_t i = 0; i < kNumStatShards; i++) {
+            shards_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
 
-    ~StatisticsCollector() {}
+    ~StatisticsCollector() {
+        for (size_t i = 0; i < kNumStatShards; i++) {
+            delete shards_[i].load(std::memory_order_relaxed);
+        }
+    }
 
+    // Setters below should be called before any sample is added
     void set_report_interval_in_ms(uint32_t value) {
         report_timer_.set_report_interval_in_ms(value);
     }
@@ -200,44 +273,99 @@ public:
             return;
         }
 #endif
-        samples_.push_back(sample);
-        if (samples_.size() >= min_report_samples_ && report_timer_.Check()) {
-            int duration_ms;
-            Report report = BuildReport();
-            size_t n_samples = samples_.size();
-            samples_.clear();
-            report_timer_.MarkReport(&duration_ms);
-            report_callback_(duration_ms, n_samples, report);
+        Shard* shard = GetShard();
+        shard->mu.Lock();
+        shard->histogram.Add(sample);
+        shard->mu.Unlock();
+        int64_t current_time = GetMonotonicMicroTimestamp();
+        if (current_time >= next_report_check_.load(std::memory_order_relaxed)) {
+            MayReport(current_time);
         }
     }
 
 private:
+    // Minimal interval between checking whether to report
+    static constexpr int64_t kReportCheckIntervalUs = 100000;
+
     size_t min_report_samples_;
     ReportCallback report_callback_;
-
     bool force_enabled_;
+
+    struct Shard {
+        absl::Mutex mu;
+        utils::Histogram histogram ABSL_GUARDED_BY(mu);
+    };
+    std::atomic<Shard*> shards_[kNumStatShards];
+
+    std::atomic<int64_t> next_report_check_;
+    absl::Mutex report_mu_;
     ReportTimer report_timer_;
-    std::vector<T> samples_;
+    // Merged samples of all shards since the last report
+    utils::Histogram merged_ ABSL_GUARDED_BY(report_mu_);
+
+    Shard* GetShard() {
+        std::atomic<Shard*>* slot = &shards_[CurrentStatShard()];
+        Shard* shard = slot->load(std::memory_order_acquire);
+        if (__FAAS_PREDICT_FALSE(shard == nullptr)) {
+            Shard* new_shard = new Shard;
+            if (slot->compare_exchange_strong(shard, new_shard, std::memory_order_acq_rel)) {
+                shard = new_shard;
+            } else {
+                delete new_shard;
+            }
+        }
+        return shard;
+    }
+
+    void MayReport(int64_t current_time) {
+        if (!report_mu_.TryLock()) {
+            // Another thread is checking
+            return;
+        }
+        next_report_check_.store(current_time + kReportCheckIntervalUs,
+                                 std::memory_order_relaxed);
+        if (report_timer_.Check()) {
+            for (size_t i = 0; i < kNumStatShards; i++) {
+                Shard* shard = shards_[i].load(std::memory_order_acquire);
+                if (shard != nullptr) {
+                    absl::MutexLock lk(&shard->mu);
+                    merged_.MergeFrom(shard->histogram);
+                    shard->histogram.Reset();
+                }
+            }
+            size_t n_samples = merged_.count();
+            if (n_samples >= min_report_samples_) {
+                int duration_ms;
+                Report report = BuildReport();
+                merged_.Reset();
+                report_timer_.MarkReport(&duration_ms);
+                report_callback_(duration_ms, n_samples, report);
+            }
+        }
+        report_mu_.Unlock();
+    }
 
-    inline Report BuildReport() {
-        std::sort(samples_.begin(), samples_.end());
+    inline Report BuildReport() ABSL_EXCLUSIVE_LOCKS_REQUIRED(report_mu_) {
         return {
             .p30 = percentile(0.3),
             .p50 = percentile(0.5),
             .p70 = percentile(0.7),
             .p90 = percentile(0.9),
             .p99 = percentile(0.99),
-            .p99_9 = percentile(0.999)
+            .p99_9 = percentile(0.999),
+            .p99_99 = percentile(0.9999)
         };
     }
 
-    inline T percentile(double p) {
-        size_t idx = gsl::narrow_cast<size_t>(samples_.size() * p + 0.5);
-        if (idx < 0) idx = 0;
-        if (idx >= samples_.size()) {
-            idx = samples_.size() - 1;
+    inline T percentile(double p) ABSL_EXCLUSIVE_LOCKS_REQUIRED(report_mu_) {
+        double value = merged_.Percentile(p);
+        if constexpr (std::is_integral_v<T>) {
+            // Buckets narrower than 1 start at integers, flooring the midpoint
+            // keeps small integer samples exact
+            return static_cast<T>(floor(value));
+        } else {
+            return static_cast<T>(value);
         }
-        return samples_[idx];
     }
 
     DISALLOW_COPY_AND_ASSIGN(StatisticsCollector);
@@ -245,6 +373,8 @@ private:
 
 #endif  // __FAAS_USE_NEW_STAT_COLLECTOR
 
+// Tick is thread-safe. Each thread increments its own shard, and shards are
+// summed when reporting.
 class Counter {
 public:
     typedef std::function<void(int /* duration_ms */, int64_t /* new_value */,
@@ -255,12 +385,17 @@ public:
             double rate = gsl::narrow_cast<double>(new_value - old_value) / duration_ms * 1000;
             LOG(INFO) << counter_name_copy << " counter: value=" << new_value << ", "
                       << "rate=" << rate << " per sec";
+            MetricsRegistry::instance()->UpdateCounter(counter_name_copy, new_value);
         };
     }
 
     explicit Counter(ReportCallback report_callback)
         : report_callback_(report_callback),
-          value_(0), last_report_value_(0) {}
+          last_report_value_(0) {
+        for (size_t i = 0; i < kNumStatShards; i++) {
+            shards_[i].value.store(0, std::memory_order_relaxed);
+        }
+    }
     
     ~Counter() {}
 
@@ -271,12 +406,9 @@ public:
     void Tick(int delta = 1) {
 #ifndef __FAAS_DISABLE_STAT
         DCHECK_GT(delta, 0);
-        value_ += delta;
-        if (value_ > last_report_value_ && report_timer_.Check()) {
-            int duration_ms;
-            report_timer_.MarkReport(&duration_ms);
-            report_callback_(duration_ms, value_, last_report_value_);
-            last_report_value_ = value_;
+        shards_[CurrentStatShard()].value.fetch_add(delta, std::memory_order_relaxed);
+        if (report_timer_.Check()) {
+            MayReport();
         }
 #endif
     }
@@ -284,13 +416,38 @@ public:
 private:
     ReportCallback report_callback_;
 
+    struct Shard {
+        std::atomic<int64_t> value;
+    } __attribute__ ((aligned (__FAAS_CACHE_LINE_SIZE)));
+    Shard shards_[kNumStatShards];
+
+    absl::Mutex report_mu_;
     ReportTimer report_timer_;
-    int64_t value_;
-    int64_t last_report_value_;
+    int64_t last_report_value_ ABSL_GUARDED_BY(report_mu_);
+
+    void MayReport() {
+        if (!report_mu_.TryLock()) {
+            return;
+        }
+        if (report_timer_.Check()) {
+            int64_t value = 0;
+            for (size_t i = 0; i < kNumStatShards; i++) {
+                value += shards_[i].value.load(std::memory_order_relaxed);
+            }
+            if (value > last_report_value_) {
+                int duration_ms;
+                report_timer_.MarkReport(&duration_ms);
+                report_callback_(duration_ms, value, last_report_value_);
+                last_report_value_ = value;
+            }
+        }
+        report_mu_.Unlock();
+    }
 
     DISALLOW_COPY_AND_ASSIGN(Counter);
 };
 
+// Not thread-safe, a shared CategoryCounter is guarded by its owner's lock
 class CategoryCounter {
 public:
     typedef std::function<void(int /* duration_ms */,
@@ -315,6 +472,7 @@ public:
                 stream << entry.first << "=" << entry.second << "(" << percentage << "%)";
             }
             LOG(INFO) << counter_name_copy << " counter: " << stream.str();
+            MetricsRegistry::instance()->AddCategoryCounts(counter_name_copy, values);
         };
     }
 
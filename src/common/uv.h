@@ -149,6 +149,45 @@ void HandleFreeCallback(uv_handle_t* handle);
     }                                                                  \
     void ClassName::On##FnName()
 
+#define DECLARE_UV_PREPARE_CB_FOR_CLASS(FnName)        \
+    void On##FnName();                                 \
+    static void FnName##Callback(uv_prepare_t* handle);
+
+#define UV_PREPARE_CB_FOR_CLASS(ClassName, FnName)                     \
+    void ClassName::FnName##Callback(uv_prepare_t* handle) {           \
+        DCHECK_IN_EVENT_LOOP_THREAD(handle->loop);                     \
+        UV_DCHECK_INSTANCE_OF(handle->data, ClassName);                \
+        ClassName* self = reinterpret_cast<ClassName*>(handle->data);  \
+        self->On##FnName();                                            \
+    }                                                                  \
+    void ClassName::On##FnName()
+
+#define DECLARE_UV_CHECK_CB_FOR_CLASS(FnName)          \
+    void On##FnName();                                 \
+    static void FnName##Callback(uv_check_t* handle);
+
+#define UV_CHECK_CB_FOR_CLASS(ClassName, FnName)                       \
+    void ClassName::FnName##Callback(uv_check_t* handle) {             \
+        DCHECK_IN_EVENT_LOOP_THREAD(handle->loop);                     \
+        UV_DCHECK_INSTANCE_OF(handle->data, ClassName);                \
+        ClassName* self = reinterpret_cast<ClassName*>(handle->data);  \
+        self->On##FnName();                                            \
+    }                                                                  \
+    void ClassName::On##FnName()
+
+#define DECLARE_UV_TIMER_CB_FOR_CLASS(FnName)          \
+    void On##FnName();                                 \
+    static void FnName##Callback(uv_timer_t* handle);
+
+#define UV_TIMER_CB_FOR_CLASS(ClassName, FnName)                       \
+    void ClassName::FnName##Callback(uv_timer_t* handle) {             \
+        DCHECK_IN_EVENT_LOOP_THREAD(handle->loop);                     \
+        UV_DCHECK_INSTANCE_OF(handle->data, ClassName);                \
+        ClassName* self = reinterpret_cast<ClassName*>(handle->data);  \
+        self->On##FnName();                                            \
+    }                                                                  \
+    void ClassName::On##FnName()
+
 #define DECLARE_UV_CLOSE_CB_FOR_CLASS(FnName)          \
     void On##FnName(uv_handle_t* handle);              \
     static void FnName##Callback(uv_handle_t* handle);
@@ -236,12 +275,16 @@ public:
     void AddHandle(uv_pipe_t* handle) { AddHandle(UV_AS_HANDLE(handle)); }
     void AddHandle(uv_tcp_t* handle) { AddHandle(UV_AS_HANDLE(handle)); }
     void AddHandle(uv_async_t* handle) { AddHandle(UV_AS_HANDLE(handle)); }
+    void AddHandle(uv_check_t* handle) { AddHandle(UV_AS_HANDLE(handle)); }
+    void AddHandle(uv_timer_t* handle) { AddHandle(UV_AS_HANDLE(handle)); }
     void AddHandle(uv_process_t* handle) { AddHandle(UV_AS_HANDLE(handle)); }
 
     void CloseHandle(uv_stream_t* handle) { CloseHandle(UV_AS_HANDLE(handle)); }
     void CloseHandle(uv_pipe_t* handle) { CloseHandle(UV_AS_HANDLE(handle)); }
     void CloseHandle(uv_tcp_t* handle) { CloseHandle(UV_AS_HANDLE(handle)); }
     void CloseHandle(uv_async_t* handle) { CloseHandle(UV_AS_HANDLE(handle)); }
+    void CloseHandle(uv_check_t* handle) { CloseHandle(UV_AS_HANDLE(handle)); }
+    void CloseHandle(uv_timer_t* handle) { CloseHandle(UV_AS_HANDLE(handle)); }
     void CloseHandle(uv_process_t* handle) { CloseHandle(UV_AS_HANDLE(handle)); }
 
 private:
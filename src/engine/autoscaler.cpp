@@ -0,0 +1,110 @@
+#include "engine/autoscaler.h"
+
+#include <absl/flags/flag.h>
+
+#include <math.h>
+
+ABSL_FLAG(double, expected_concurrency_coef, 1.0, "");
+ABSL_FLAG(bool, always_request_worker_if_possible, false, "");
+ABSL_FLAG(double, autoscale_target_utilization, 0.7,
+          "Fraction of time func workers are expected to be busy under predictive autoscaling");
+ABSL_FLAG(int, autoscale_scale_down_delay_ms, 30000,
+          "Under predictive autoscaling, surplus workers are retired only after "
+          "the surplus lasts for this long");
+
+namespace faas {
+namespace engine {
+
+std::unique_ptr<AutoscalePolicy> AutoscalePolicy::Create(std::string_view name) {
+    if (name == "reactive") {
+        return std::make_unique<ReactiveAutoscalePolicy>();
+    } else if (name == "predictive") {
+        return std::make_unique<PredictiveAutoscalePolicy>();
+    } else {
+        return nullptr;
+    }
+}
+
+ReactiveAutoscalePolicy::ReactiveAutoscalePolicy()
+    : expected_concurrency_coef_(absl::GetFlag(FLAGS_expected_concurrency_coef)),
+      always_request_worker_if_possible_(absl::GetFlag(FLAGS_always_request_worker_if_possible)) {}
+
+size_t ReactiveAutoscalePolicy::DesiredWorkers(const AutoscaleInput& input) {
+    if (always_request_worker_if_possible_) {
+        return input.current_workers + 1;
+    }
+    if (input.processing_time > 0 && input.arrival_rps > 0) {
+        double estimated_concurrency = expected_concurrency_coef_
+                                     * input.processing_time * input.arrival_rps / 1e6;
+        return gsl::narrow_cast<size_t>(0.5 + estimated_concurrency);
+    } else {
+        return 0;
+    }
+}
+
+PredictiveAutoscalePolicy::PredictiveAutoscalePolicy()
+    : target_utilization_(absl::GetFlag(FLAGS_autoscale_target_utilization)),
+      scale_down_delay_us_(int64_t{absl::GetFlag(FLAGS_autoscale_scale_down_delay_ms)} * 1000),
+      rps_level_(0), rps_trend_(0), last_timestamp_(-1), surplus_since_(-1) {
+    if (target_utilization_ <= 0 || target_utilization_ > 1) {
+        LOG(WARNING) << "Invalid autoscale_target_utilization, use 1.0 instead";
+        target_utilization_ = 1.0;
+    }
+}
+
+double PredictiveAutoscalePolicy::ForecastRps(const AutoscaleInput& input) {
+    if (input.arrival_rps <= 0) {
+        return 0;
+    }
+    if (last_timestamp_ == -1 || rps_level_ == 0) {
+        rps_level_ = input.arrival_rps;
+        rps_trend_ = 0;
+        last_timestamp_ = input.timestamp;
+    } else if (input.timestamp >= last_timestamp_ + kMinUpdateIntervalUs) {
+        double elapsed = gsl::narrow_cast<double>(input.timestamp - last_timestamp_);
+        double last_level = rps_level_;
+        rps_level_ = kLevelAlpha * input.arrival_rps
+                   + (1 - kLevelAlpha) * (rps_level_ + rps_trend_ * elapsed);
+        rps_trend_ = kTrendBeta * (rps_level_ - last_level) / elapsed
+                   + (1 - kTrendBeta) * rps_trend_;
+        last_timestamp_ = input.timestamp;
+    }
+    return std::max(0.0, rps_level_ + rps_trend_ * input.worker_launch_time);
+}
+
+size_t PredictiveAutoscalePolicy::DesiredWorkers(const AutoscaleInput& input) {
+    double forecast_rps = ForecastRps(input);
+    if (input.processing_time <= 0 || forecast_rps <= 0) {
+        // Nothing to predict from, only make sure pending func calls get served
+        surplus_since_ = -1;
+        return input.current_workers + (input.pending_func_calls > 0 ? 1 : 0);
+    }
+    double concurrency = forecast_rps * input.processing_time / 1e6;
+    size_t desired = gsl::narrow_cast<size_t>(ceil(concurrency / target_utilization_));
+    if (input.pending_func_calls > 0) {
+        // Extra workers to drain the backlog within one launch time
+        double drain_time = std::max(input.worker_launch_time, input.processing_time);
+        size_t backlog_workers = gsl::narrow_cast<size_t>(
+            ceil(input.pending_func_calls * input.processing_time / drain_time));
+        desired = std::max(desired, input.running_workers
+                                    + std::min(backlog_workers, input.pending_func_calls));
+    }
+    if (input.cpu_usage > 0) {
+        desired = std::max(desired, gsl::narrow_cast<size_t>(
+            ceil(input.cpu_usage / target_utilization_)));
+    }
+    if (desired >= input.current_workers) {
+        surplus_since_ = -1;
+        return desired;
+    }
+    if (surplus_since_ == -1) {
+        surplus_since_ = input.timestamp;
+    }
+    if (input.timestamp - surplus_since_ < scale_down_delay_us_) {
+        return input.current_workers;
+    }
+    return desired;
+}
+
+}  // namespace engine
+}  // namespace faas
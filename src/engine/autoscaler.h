@@ -0,0 +1,97 @@
+#pragma once
+
+#include "base/common.h"
+
+namespace faas {
+namespace engine {
+
+// Load of a function observed by its dispatcher. Rates and times are
+// smoothed estimates, which are 0 if not yet known.
+struct AutoscaleInput {
+    int64_t timestamp;           // Monotonic timestamp in microseconds
+    double  arrival_rps;
+    double  processing_time;     // In microseconds
+    double  worker_launch_time;  // In microseconds
+    float   cpu_usage;           // CPU cores used by func container, negative if unknown
+    size_t  current_workers;     // Connected and requested, not including retiring ones
+    size_t  running_workers;
+    size_t  pending_func_calls;
+};
+
+// Decides the number of func workers for one function. Not thread-safe, each
+// dispatcher owns its own instance.
+class AutoscalePolicy {
+public:
+    virtual ~AutoscalePolicy() {}
+
+    // Returns nullptr if name is unknown
+    static std::unique_ptr<AutoscalePolicy> Create(std::string_view name);
+
+    // If true, the policy is also consulted periodically, and surplus idle
+    // workers are retired. Otherwise, it is only consulted when a func call
+    // finds no idle worker, and workers are never retired.
+    virtual bool periodic() const = 0;
+
+    // Result is clamped to [min_workers, max_workers] by caller
+    virtual size_t DesiredWorkers(const AutoscaleInput& input) = 0;
+};
+
+// Scale up to the concurrency implied by current RPS and processing time,
+// never scale down
+class ReactiveAutoscalePolicy final : public AutoscalePolicy {
+public:
+    ReactiveAutoscalePolicy();
+    ~ReactiveAutoscalePolicy() {}
+
+    bool periodic() const override { return false; }
+    size_t DesiredWorkers(const AutoscaleInput& input) override;
+
+private:
+    double expected_concurrency_coef_;
+    bool always_request_worker_if_possible_;
+
+    DISALLOW_COPY_AND_ASSIGN(ReactiveAutoscalePolicy);
+};
+
+// Forecast RPS one worker launch time ahead by Holt's linear trend method,
+// and provision workers for the forecast at target utilization. Pending func
+// calls and measured CPU usage raise the result, while scaling down only
+// happens after the surplus persists for scale_down_delay. The forecast is
+// only as good as the RPS estimate, arithmetic mean of instant RPS (the
+// default of tracer) overestimates under bursty arrivals, for which
+// --instant_rps_p_norm=-1 is preferred.
+class PredictiveAutoscalePolicy final : public AutoscalePolicy {
+public:
+    static constexpr double kLevelAlpha = 0.5;
+    static constexpr double kTrendBeta = 0.2;
+    // Policy is also consulted on demand, at arbitrary time points. Level and
+    // trend are updated at most once per interval, otherwise the trend is
+    // dominated by noise within short intervals.
+    static constexpr int64_t kMinUpdateIntervalUs = 100000;
+
+    PredictiveAutoscalePolicy();
+    ~PredictiveAutoscalePolicy() {}
+
+    bool periodic() const override { return true; }
+    size_t DesiredWorkers(const AutoscaleInput& input) override;
+
+    // Exposed for debugging and simulation
+    double rps_level() const { return rps_level_; }
+    double rps_trend() const { return rps_trend_; }
+
+private:
+    double target_utilization_;
+    int64_t scale_down_delay_us_;
+
+    double rps_level_;
+    double rps_trend_;  // RPS change per microsecond
+    int64_t last_timestamp_;
+    int64_t surplus_since_;
+
+    double ForecastRps(const AutoscaleInput& input);
+
+    DISALLOW_COPY_AND_ASSIGN(PredictiveAutoscalePolicy);
+};
+
+}  // namespace engine
+}  // namespace faas
@@ -10,10 +10,18 @@
 
 ABSL_FLAG(double, max_relative_queueing_delay, 0.0, "");
 ABSL_FLAG(double, concurrency_limit_coef, 1.0, "");
-ABSL_FLAG(double, expected_concurrency_coef, 1.0, "");
 ABSL_FLAG(int, min_worker_request_interval_ms, 200, "");
-ABSL_FLAG(bool, always_request_worker_if_possible, false, "");
 ABSL_FLAG(bool, disable_concurrency_limiter, false, "");
+ABSL_FLAG(bool, deadline_scheduling, false,
+          "Serve pending func calls earliest-deadline-first, and reject func calls "
+          "that cannot finish before their deadlines");
+ABSL_FLAG(int, max_deferral_ms, 1000,
+          "With deadline_scheduling, no pending func call is deferred longer than this "
+          "by func calls with earlier deadlines");
+ABSL_FLAG(std::string, autoscale_policy, "reactive",
+          "Policy for the number of func workers, either reactive or predictive");
+ABSL_FLAG(int, default_worker_launch_time_ms, 500,
+          "Assumed launch time of func workers, before any is measured");
 
 namespace faas {
 namespace engine {
@@ -22,15 +30,25 @@ using protocol::FuncCall;
 using protocol::FuncCallDebugString;
 using protocol::Message;
 using protocol::SetInlineDataInMessage;
+using protocol::SetShmArenaPayloadInMessage;
+using protocol::IsPayloadInShmArena;
 using protocol::GetFuncCallFromMessage;
 using protocol::NewCreateFuncWorkerMessage;
 using protocol::NewDispatchFuncCallMessage;
+using protocol::NewRetireFuncWorkerMessage;
 
 Dispatcher::Dispatcher(Engine* engine, uint16_t func_id)
     : engine_(engine), func_id_(func_id),
       min_workers_(0), max_workers_(std::numeric_limits<size_t>::max()),
+      shm_arena_supported_(false),
       log_header_(fmt::format("Dispatcher[{}]: ", func_id)),
+      num_shm_arena_workers_(0),
       last_request_worker_timestamp_(-1),
+      worker_launch_time_(/* alpha= */ 0.2, /* min_samples= */ 1),
+      autoscale_policy_(AutoscalePolicy::Create(absl::GetFlag(FLAGS_autoscale_policy))),
+      deadline_scheduling_(absl::GetFlag(FLAGS_deadline_scheduling)),
+      max_deferral_us_(int64_t{absl::GetFlag(FLAGS_max_deferral_ms)} * 1000),
+      next_pending_seq_(0),
       idle_workers_stat_(stat::StatisticsCollector<uint16_t>::StandardReportCallback(
           fmt::format("idle_workers[{}]", func_id))),
       running_workers_stat_(stat::StatisticsCollector<uint16_t>::StandardReportCallback(
@@ -40,7 +58,12 @@ Dispatcher::Dispatcher(Engine* engine, uint16_t func_id)
       estimated_rps_stat_(stat::StatisticsCollector<float>::StandardReportCallback(
           fmt::format("estimated_rps[{}]", func_id))),
       estimated_concurrency_stat_(stat::StatisticsCollector<float>::StandardReportCallback(
-          fmt::format("estimated_concurrency[{}]", func_id))) {
+          fmt::format("estimated_concurrency[{}]", func_id))),
+      desired_workers_stat_(stat::StatisticsCollector<uint16_t>::StandardReportCallback(
+          fmt::format("desired_workers[{}]", func_id))) {
+    if (autoscale_policy_ == nullptr) {
+        HLOG(FATAL) << "Unknown autoscale policy: " << absl::GetFlag(FLAGS_autoscale_policy);
+    }
     const FuncConfig::Entry* func_entry = engine_->func_config()->find_by_func_id(func_id);
     DCHECK(func_entry != nullptr);
     func_config_entry_ = func_entry;
@@ -61,13 +84,13 @@ bool Dispatcher::OnFuncWorkerConnected(std::shared_ptr<FuncWorker> func_worker)
     uint16_t client_id = func_worker->client_id();
     absl::MutexLock lk(&mu_);
     DCHECK(!workers_.contains(client_id));
-    workers_[client_id] = func_worker;
+    AddWorker(func_worker);
     if (requested_workers_.contains(client_id)) {
-        int64_t request_timestamp = requested_workers_[client_id];
+        int64_t launch_time = GetMonotonicMicroTimestamp() - requested_workers_[client_id];
         requested_workers_.erase(client_id);
+        worker_launch_time_.AddSample(launch_time);
         HLOG(INFO) << fmt::format("FuncWorker (client_id {}) takes {}ms to launch",
-                                  client_id,
-                                  (GetMonotonicMicroTimestamp() - request_timestamp) / 1000);
+                                  client_id, launch_time / 1000);
     }
     if (!DispatchPendingFuncCall(func_worker.get())) {
         idle_workers_.push_back(client_id);
@@ -80,34 +103,103 @@ void Dispatcher::OnFuncWorkerDisconnected(FuncWorker* func_worker) {
     DCHECK_EQ(func_id_, func_worker->func_id());
     uint16_t client_id = func_worker->client_id();
     absl::MutexLock lk(&mu_);
+    if (retiring_workers_.contains(client_id)) {
+        retiring_workers_.erase(client_id);
+        return;
+    }
     DCHECK(workers_.contains(client_id));
-    workers_.erase(client_id);
+    RemoveWorker(client_id);
+    if (running_workers_.contains(client_id)) {
+        // Its running func call will not finish, thus fail it, which also
+        // releases its input owned by engine, e.g. buffers in shm arena
+        FuncCall func_call = running_workers_[client_id];
+        HLOG(WARNING) << "FuncWorker exited while running " << FuncCallDebugString(func_call);
+        running_workers_.erase(client_id);
+        assigned_workers_.erase(func_call.full_call_id);
+        engine_->DiscardFuncCall(func_call);
+        engine_->tracer()->DiscardFuncCallInfo(func_call);
+        UpdateWorkerLoadStat();
+    }
+}
+
+void Dispatcher::OnFuncWorkerLaunchFailed(uint16_t client_id) {
+    absl::MutexLock lk(&mu_);
+    if (requested_workers_.contains(client_id)) {
+        requested_workers_.erase(client_id);
+        // Replace it if still needed
+        MayRequestNewFuncWorker();
+    }
+}
+
+void Dispatcher::Autoscale() {
+    absl::MutexLock lk(&mu_);
+    if (!autoscale_policy_->periodic()) {
+        return;
+    }
+    AutoscaleInput input = BuildAutoscaleInput();
+    size_t desired_workers = std::clamp(autoscale_policy_->DesiredWorkers(input),
+                                        min_workers_, max_workers_);
+    desired_workers_stat_.AddSample(gsl::narrow_cast<uint16_t>(desired_workers));
+    if (desired_workers > input.current_workers) {
+        HLOG(INFO) << fmt::format("Scale up from {} to {} FuncWorkers",
+                                  input.current_workers, desired_workers);
+        for (size_t i = input.current_workers; i < desired_workers; i++) {
+            if (!RequestNewFuncWorker(input.timestamp)) {
+                break;
+            }
+        }
+    } else if (desired_workers < input.current_workers) {
+        RetireIdleWorkers(input.current_workers - desired_workers);
+    }
 }
 
 bool Dispatcher::OnNewFuncCall(const FuncCall& func_call, const FuncCall& parent_func_call,
                                size_t input_size, std::span<const char> inline_input,
-                               bool shm_input) {
+                               bool shm_input, const ipc::ShmArenaBuffer* arena_input,
+                               int64_t deadline) {
     VLOG(1) << "OnNewFuncCall " << FuncCallDebugString(func_call);
     DCHECK_EQ(func_id_, func_call.func_id);
     absl::MutexLock lk(&mu_);
     Message* dispatch_func_call_message = message_pool_.Get();
     *dispatch_func_call_message = NewDispatchFuncCallMessage(func_call);
-    if (shm_input) {
+    if (arena_input != nullptr) {
+        DCHECK(shm_input);
+        SetShmArenaPayloadInMessage(dispatch_func_call_message, arena_input->segment,
+                                    arena_input->offset, input_size);
+    } else if (shm_input) {
         dispatch_func_call_message->payload_size = -gsl::narrow_cast<int32_t>(input_size);
     } else {
         SetInlineDataInMessage(dispatch_func_call_message, inline_input);
     }
 
     Tracer::FuncCallInfo* func_call_info = engine_->tracer()->OnNewFuncCall(
-        func_call, parent_func_call, input_size);
+        func_call, parent_func_call, input_size, deadline);
+    int64_t sort_key = 0;
+    if (deadline_scheduling_) {
+        int64_t current_timestamp = GetMonotonicMicroTimestamp();
+        if (CannotMeetDeadline(func_call_info, current_timestamp)) {
+            RejectFuncCall(dispatch_func_call_message);
+            return true;
+        }
+        sort_key = current_timestamp + max_deferral_us_;
+        int64_t deadline = func_call_info != nullptr
+                           ? func_call_info->deadline.load(std::memory_order_relaxed) : 0;
+        if (deadline > 0) {
+            sort_key = std::min(sort_key, deadline);
+        }
+    }
     FuncWorker* idle_worker = PickIdleWorker();
     if (idle_worker) {
-        DispatchFuncCall(idle_worker, dispatch_func_call_message);
+        if (!DispatchFuncCall(idle_worker, dispatch_func_call_message)) {
+            idle_workers_.push_back(idle_worker->client_id());
+        }
     } else {
         VLOG(1) << "No idle worker at the moment";
         pending_func_calls_.push({
             .dispatch_func_call_message = dispatch_func_call_message,
-            .func_call_info = func_call_info
+            .func_call_info = func_call_info,
+            .sort_key = sort_key,
+            .seq = next_pending_seq_++
         });
     }
     return true;
@@ -118,7 +210,7 @@ bool Dispatcher::OnFuncCallCompleted(const FuncCall& func_call, int32_t processi
     VLOG(1) << "OnFuncCallCompleted " << FuncCallDebugString(func_call);
     DCHECK_EQ(func_id_, func_call.func_id);
     Tracer::FuncCallInfo* func_call_info = engine_->tracer()->OnFuncCallCompleted(
-        func_call, dispatch_delay, processing_time, output_size);
+        func_call, processing_time, dispatch_delay, output_size);
     if (func_call_info == nullptr) {
         return false;
     }
@@ -181,21 +273,25 @@ bool Dispatcher::DispatchPendingFuncCall(FuncWorker* func_worker) {
     double max_relative_queueing_delay = absl::GetFlag(FLAGS_max_relative_queueing_delay);
     int64_t current_timestamp = GetMonotonicMicroTimestamp();
     while (!pending_func_calls_.empty()) {
-        PendingFuncCall pending_func_call = pending_func_calls_.front();
+        PendingFuncCall pending_func_call = pending_func_calls_.top();
         pending_func_calls_.pop();
         Tracer::FuncCallInfo* func_call_info = pending_func_call.func_call_info;
-        int64_t queueing_delay;
-        {
-            absl::ReaderMutexLock lk(&func_call_info->mu);
+        int64_t queueing_delay = 0;
+        if (func_call_info != nullptr) {
             queueing_delay = current_timestamp - func_call_info->recv_timestamp;
         }
         Message* dispatch_func_call_message = pending_func_call.dispatch_func_call_message;
+        if (deadline_scheduling_ && CannotMeetDeadline(func_call_info, current_timestamp)) {
+            RejectFuncCall(dispatch_func_call_message);
+            continue;
+        }
         FuncCall func_call = GetFuncCallFromMessage(*dispatch_func_call_message);
         if (func_call.client_id == 0
                 || max_relative_queueing_delay == 0.0
                 || queueing_delay <= max_relative_queueing_delay * average_processing_time) {
-            DispatchFuncCall(func_worker, dispatch_func_call_message);
-            return true;
+            if (DispatchFuncCall(func_worker, dispatch_func_call_message)) {
+                return true;
+            }
         } else {
             message_pool_.Return(dispatch_func_call_message);
             engine_->DiscardFuncCall(func_call);
@@ -205,16 +301,48 @@ bool Dispatcher::DispatchPendingFuncCall(FuncWorker* func_worker) {
     return false;
 }
 
-void Dispatcher::DispatchFuncCall(FuncWorker* func_worker, Message* dispatch_func_call_message) {
+bool Dispatcher::CannotMeetDeadline(const Tracer::FuncCallInfo* func_call_info,
+                                    int64_t current_timestamp) {
+    if (func_call_info == nullptr) {
+        return false;
+    }
+    int64_t deadline = func_call_info->deadline.load(std::memory_order_relaxed);
+    if (deadline == 0) {
+        return false;
+    }
+    double average_processing_time = engine_->tracer()->GetAverageProcessingTime(func_id_);
+    return current_timestamp + average_processing_time > deadline;
+}
+
+void Dispatcher::RejectFuncCall(Message* dispatch_func_call_message) {
+    FuncCall func_call = GetFuncCallFromMessage(*dispatch_func_call_message);
+    HVLOG(1) << "Reject func call that cannot meet deadline: " << FuncCallDebugString(func_call);
+    message_pool_.Return(dispatch_func_call_message);
+    engine_->DiscardFuncCall(func_call);
+    engine_->tracer()->DiscardFuncCallInfo(func_call);
+}
+
+bool Dispatcher::DispatchFuncCall(FuncWorker* func_worker, Message* dispatch_func_call_message) {
     uint16_t client_id = func_worker->client_id();
     DCHECK(workers_.contains(client_id));
     DCHECK(!running_workers_.contains(client_id));
     FuncCall func_call = GetFuncCallFromMessage(*dispatch_func_call_message);
+    if (IsPayloadInShmArena(*dispatch_func_call_message) && !func_worker->use_shm_arena()) {
+        if (!engine_->MoveShmArenaInputToShm(func_call, dispatch_func_call_message)) {
+            HLOG(ERROR) << "Failed to move input out of shm arena: "
+                        << FuncCallDebugString(func_call);
+            message_pool_.Return(dispatch_func_call_message);
+            engine_->DiscardFuncCall(func_call);
+            engine_->tracer()->DiscardFuncCallInfo(func_call);
+            return false;
+        }
+    }
     engine_->tracer()->OnFuncCallDispatched(func_call, func_worker);
     assigned_workers_[func_call.full_call_id] = client_id;
     running_workers_[client_id] = func_call;
     func_worker->SendMessage(dispatch_func_call_message);
     message_pool_.Return(dispatch_func_call_message);
+    return true;
 }
 
 FuncWorker* Dispatcher::PickIdleWorker() {
@@ -244,17 +372,45 @@ void Dispatcher::UpdateWorkerLoadStat() {
     running_workers_stat_.AddSample(gsl::narrow_cast<uint16_t>(running_workers));
 }
 
-size_t Dispatcher::DetermineExpectedConcurrency() {
-    double average_processing_time = engine_->tracer()->GetAverageProcessingTime2(func_id_);
-    double average_instant_rps = engine_->tracer()->GetAverageInstantRps(func_id_);
-    if (average_processing_time > 0 && average_instant_rps > 0) {
-        double estimated_concurrency = absl::GetFlag(FLAGS_expected_concurrency_coef)
-                                     * average_processing_time * average_instant_rps / 1e6;
-        estimated_rps_stat_.AddSample(gsl::narrow_cast<float>(average_instant_rps));
-        return gsl::narrow_cast<size_t>(0.5 + estimated_concurrency);
-    } else {
-        return 0;
+void Dispatcher::AddWorker(std::shared_ptr<FuncWorker> func_worker) {
+    if (func_worker->use_shm_arena()) {
+        num_shm_arena_workers_++;
+    }
+    workers_[func_worker->client_id()] = std::move(func_worker);
+    shm_arena_supported_.store(num_shm_arena_workers_ == workers_.size());
+}
+
+void Dispatcher::RemoveWorker(uint16_t client_id) {
+    auto iter = workers_.find(client_id);
+    DCHECK(iter != workers_.end());
+    if (iter->second->use_shm_arena()) {
+        num_shm_arena_workers_--;
+    }
+    workers_.erase(iter);
+    shm_arena_supported_.store(!workers_.empty() && num_shm_arena_workers_ == workers_.size());
+}
+
+AutoscaleInput Dispatcher::BuildAutoscaleInput() {
+    AutoscaleInput input = {
+        .timestamp = GetMonotonicMicroTimestamp(),
+        .arrival_rps = engine_->tracer()->GetAverageInstantRps(func_id_),
+        .processing_time = engine_->tracer()->GetAverageProcessingTime2(func_id_),
+        .worker_launch_time = worker_launch_time_.GetValue(),
+        .cpu_usage = -1,
+        .current_workers = workers_.size() + requested_workers_.size(),
+        .running_workers = running_workers_.size(),
+        .pending_func_calls = pending_func_calls_.size()
+    };
+    if (input.worker_launch_time == 0) {
+        input.worker_launch_time = absl::GetFlag(FLAGS_default_worker_launch_time_ms) * 1000.0;
+    }
+    if (engine_->monitor() != nullptr) {
+        input.cpu_usage = engine_->monitor()->GetFuncCpuUsage(func_id_);
+    }
+    if (input.arrival_rps > 0) {
+        estimated_rps_stat_.AddSample(gsl::narrow_cast<float>(input.arrival_rps));
     }
+    return input;
 }
 
 size_t Dispatcher::DetermineConcurrencyLimit() {
@@ -281,26 +437,53 @@ void Dispatcher::MayRequestNewFuncWorker() {
     int64_t current_timestamp = GetMonotonicMicroTimestamp();
     int min_worker_request_interval_ms = absl::GetFlag(FLAGS_min_worker_request_interval_ms);
     if (last_request_worker_timestamp_ != -1 && min_worker_request_interval_ms > 0
-          && current_timestamp > last_request_worker_timestamp_
+          && current_timestamp < last_request_worker_timestamp_
                                  + min_worker_request_interval_ms * 1000) {
         return;
     }
-    if (absl::GetFlag(FLAGS_always_request_worker_if_possible)) {
-        HLOG(INFO) << "Request new FuncWorker under always_request_worker_if_possible flag";
-    } else {
-        size_t expected_concurrency = DetermineExpectedConcurrency();
-        if (workers_.size() + requested_workers_.size() >= expected_concurrency) {
-            return;
-        }
-        HLOG(INFO) << "Request new FuncWorker: expected_concurrency=" << expected_concurrency;
+    AutoscaleInput input = BuildAutoscaleInput();
+    size_t desired_workers = std::min(autoscale_policy_->DesiredWorkers(input), max_workers_);
+    desired_workers_stat_.AddSample(gsl::narrow_cast<uint16_t>(desired_workers));
+    if (input.current_workers >= desired_workers) {
+        return;
     }
+    HLOG(INFO) << "Request new FuncWorker: desired_workers=" << desired_workers;
+    RequestNewFuncWorker(current_timestamp);
+}
+
+bool Dispatcher::RequestNewFuncWorker(int64_t current_timestamp) {
     uint16_t client_id;
     if (engine_->worker_manager()->RequestNewFuncWorker(func_id_, &client_id)) {
         requested_workers_[client_id] = current_timestamp;
         last_request_worker_timestamp_ = current_timestamp;
+        return true;
     } else {
         HLOG(ERROR) << "Failed to request new FuncWorker";
+        return false;
+    }
+}
+
+void Dispatcher::RetireIdleWorkers(size_t n) {
+    // Workers idle for the longest time are at the front
+    std::vector<uint16_t> remaining_idle_workers;
+    for (uint16_t client_id : idle_workers_) {
+        if (!workers_.contains(client_id) || running_workers_.contains(client_id)) {
+            continue;
+        }
+        FuncWorker* func_worker = workers_[client_id].get();
+        if (n == 0 || !func_worker->retirable()) {
+            remaining_idle_workers.push_back(client_id);
+            continue;
+        }
+        HLOG(INFO) << fmt::format("Retire FuncWorker (client_id {})", client_id);
+        Message message = NewRetireFuncWorkerMessage();
+        func_worker->SendMessage(&message);
+        RemoveWorker(client_id);
+        retiring_workers_.insert(client_id);
+        n--;
     }
+    idle_workers_ = std::move(remaining_idle_workers);
+    UpdateWorkerLoadStat();
 }
 
 }  // namespace engine
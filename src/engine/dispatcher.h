@@ -4,8 +4,11 @@
 #include "common/stat.h"
 #include "common/protocol.h"
 #include "common/func_config.h"
+#include "ipc/shm_arena.h"
 #include "utils/object_pool.h"
+#include "utils/exp_moving_avg.h"
 #include "engine/tracer.h"
+#include "engine/autoscaler.h"
 
 namespace faas {
 namespace engine {
@@ -19,16 +22,27 @@ public:
     ~Dispatcher();
 
     int16_t func_id() const { return func_id_; }
+    // Whether all func workers of this function can read payloads in shm
+    // arena, false if there is no func worker. It only hints where to place
+    // inputs, as func calls may be dispatched to func workers connected later,
+    // for which arena inputs are moved to standalone shm if necessary.
+    bool shm_arena_supported() const { return shm_arena_supported_.load(); }
 
     // All must be thread-safe
     bool OnFuncWorkerConnected(std::shared_ptr<FuncWorker> func_worker);
     void OnFuncWorkerDisconnected(FuncWorker* func_worker);
+    // Requested func worker with client_id never connects
+    void OnFuncWorkerLaunchFailed(uint16_t client_id);
     bool OnNewFuncCall(const protocol::FuncCall& func_call,
                        const protocol::FuncCall& parent_func_call,
-                       size_t input_size, std::span<const char> inline_input, bool shm_input);
+                       size_t input_size, std::span<const char> inline_input, bool shm_input,
+                       const ipc::ShmArenaBuffer* arena_input = nullptr,
+                       int64_t deadline = 0);
     bool OnFuncCallCompleted(const protocol::FuncCall& func_call,
                              int32_t processing_time, int32_t dispatch_delay, size_t output_size);
     bool OnFuncCallFailed(const protocol::FuncCall& func_call, int32_t dispatch_delay);
+    // Invoked periodically, a no-op unless the autoscale policy is periodic
+    void Autoscale();
 
 private:
     Engine* engine_;
@@ -36,12 +50,15 @@ private:
     const FuncConfig::Entry* func_config_entry_;
     size_t min_workers_;
     size_t max_workers_;
+    std::atomic<bool> shm_arena_supported_;
     absl::Mutex mu_;
 
     std::string log_header_;
 
     absl::flat_hash_map</* client_id */ uint16_t, std::shared_ptr<FuncWorker>>
         workers_ ABSL_GUARDED_BY(mu_);
+    // Number of func workers in workers_ that can read from shm arena
+    size_t num_shm_arena_workers_ ABSL_GUARDED_BY(mu_);
     absl::flat_hash_map</* client_id */ uint16_t, protocol::FuncCall>
         running_workers_ ABSL_GUARDED_BY(mu_);
     std::vector</* client_id */ uint16_t> idle_workers_ ABSL_GUARDED_BY(mu_);
@@ -50,13 +67,32 @@ private:
     absl::flat_hash_map</* client_id */ uint16_t, /* request_timestamp */ int64_t>
         requested_workers_ ABSL_GUARDED_BY(mu_);
     int64_t last_request_worker_timestamp_ ABSL_GUARDED_BY(mu_);
+    utils::ExpMovingAvg worker_launch_time_ ABSL_GUARDED_BY(mu_);
+    // Retired workers, which are removed from workers_, until they disconnect
+    absl::flat_hash_set</* client_id */ uint16_t> retiring_workers_ ABSL_GUARDED_BY(mu_);
+    std::unique_ptr<AutoscalePolicy> autoscale_policy_ ABSL_GUARDED_BY(mu_);
 
     struct PendingFuncCall {
         protocol::Message*    dispatch_func_call_message;
         Tracer::FuncCallInfo* func_call_info;
+        // Pending func calls are served in the order of (sort_key, seq). In
+        // FIFO mode sort_key is always 0, with deadline scheduling it is the
+        // deadline, capped by arrival time plus max_deferral_ms.
+        int64_t               sort_key;
+        uint64_t              seq;
+    };
+    struct PendingFuncCallCompare {
+        bool operator()(const PendingFuncCall& lhs, const PendingFuncCall& rhs) const {
+            return lhs.sort_key != rhs.sort_key ? lhs.sort_key > rhs.sort_key
+                                                : lhs.seq > rhs.seq;
+        }
     };
 
-    std::queue<PendingFuncCall> pending_func_calls_ ABSL_GUARDED_BY(mu_);
+    bool deadline_scheduling_;
+    int64_t max_deferral_us_;
+    uint64_t next_pending_seq_ ABSL_GUARDED_BY(mu_);
+    std::priority_queue<PendingFuncCall, std::vector<PendingFuncCall>, PendingFuncCallCompare>
+        pending_func_calls_ ABSL_GUARDED_BY(mu_);
     absl::flat_hash_map</* full_call_id */ uint64_t, /* client_id */ uint16_t>
         assigned_workers_ ABSL_GUARDED_BY(mu_);
 
@@ -65,16 +101,27 @@ private:
     stat::StatisticsCollector<uint32_t> max_concurrency_stat_ ABSL_GUARDED_BY(mu_);
     stat::StatisticsCollector<float> estimated_rps_stat_ ABSL_GUARDED_BY(mu_);
     stat::StatisticsCollector<float> estimated_concurrency_stat_ ABSL_GUARDED_BY(mu_);
+    stat::StatisticsCollector<uint16_t> desired_workers_stat_ ABSL_GUARDED_BY(mu_);
 
     void FuncWorkerFinished(FuncWorker* func_worker) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
-    void DispatchFuncCall(FuncWorker* func_worker, protocol::Message* dispatch_func_call_message)
+    // Returns false if the func call is discarded instead, in which case
+    // func_worker stays idle
+    bool DispatchFuncCall(FuncWorker* func_worker, protocol::Message* dispatch_func_call_message)
         ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
     bool DispatchPendingFuncCall(FuncWorker* idle_func_worker) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    // Whether the func call is expected to finish after its deadline
+    bool CannotMeetDeadline(const Tracer::FuncCallInfo* func_call_info, int64_t current_timestamp);
+    void RejectFuncCall(protocol::Message* dispatch_func_call_message)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
     FuncWorker* PickIdleWorker() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
     void UpdateWorkerLoadStat() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
-    size_t DetermineExpectedConcurrency() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    void AddWorker(std::shared_ptr<FuncWorker> func_worker) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    void RemoveWorker(uint16_t client_id) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    AutoscaleInput BuildAutoscaleInput() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
     size_t DetermineConcurrencyLimit() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
     void MayRequestNewFuncWorker() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    bool RequestNewFuncWorker(int64_t current_timestamp) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    void RetireIdleWorkers(size_t n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
     DISALLOW_COPY_AND_ASSIGN(Dispatcher);
 };
@@ -4,6 +4,7 @@
 #include "ipc/shm_region.h"
 #include "common/time.h"
 #include "utils/fs.h"
+#include "utils/cpu_topology.h"
 #include "utils/io.h"
 #include "utils/docker.h"
 #include "utils/socket.h"
@@ -14,6 +15,18 @@
 ABSL_FLAG(bool, disable_monitor, false, "");
 ABSL_FLAG(bool, func_worker_use_engine_socket, false, "");
 ABSL_FLAG(bool, use_fifo_for_nested_call, false, "");
+ABSL_FLAG(bool, func_worker_use_shm_queue, false,
+          "Use shared memory queues for messages between engine and func workers, "
+          "with FIFOs only used for wakeup");
+ABSL_FLAG(bool, use_shm_arena, false,
+          "Place large payloads in a pre-mapped shared memory arena, "
+          "instead of creating a shm file for each of them");
+ABSL_FLAG(size_t, shm_arena_segment_size_mb, 64,
+          "Size of the shm arena segment for each size class");
+ABSL_FLAG(bool, shm_arena_prefault, false, "Populate all pages of shm arena at startup");
+ABSL_FLAG(int, autoscale_interval_ms, 0,
+          "Interval of periodic autoscaling of func workers, which is required "
+          "by the predictive autoscale policy. Set to 0 to disable.");
 
 #define HLOG(l) LOG(l) << "Engine: "
 #define HVLOG(l) VLOG(l) << "Engine: "
@@ -32,11 +45,30 @@ using protocol::IsFuncWorkerHandshakeMessage;
 using protocol::IsInvokeFuncMessage;
 using protocol::IsFuncCallCompleteMessage;
 using protocol::IsFuncCallFailedMessage;
+using protocol::IsPayloadInShmArena;
+using protocol::ClearShmArenaPayloadInMessage;
+using protocol::NewFuncCallFailedMessage;
 using protocol::NewHandshakeResponseMessage;
+using protocol::NewFuncWorkerHandshakeResponseMessage;
 using protocol::NewFuncCallCompleteGatewayMessage;
 using protocol::NewFuncCallFailedGatewayMessage;
 using protocol::ComputeMessageDelay;
 
+namespace {
+
+std::unique_ptr<ipc::ShmRegion> CopyToNewShm(std::string_view name, std::span<const char> data) {
+    auto region = ipc::ShmCreate(name, data.size());
+    if (region == nullptr) {
+        return nullptr;
+    }
+    if (data.size() > 0) {
+        memcpy(region->base(), data.data(), data.size());
+    }
+    return region;
+}
+
+}  // anonymous namespace
+
 Engine::Engine()
     : gateway_port_(-1),
       listen_backlog_(kDefaultListenBackLog),
@@ -45,18 +77,23 @@ Engine::Engine()
       engine_tcp_port_(-1),
       func_worker_use_engine_socket_(absl::GetFlag(FLAGS_func_worker_use_engine_socket)),
       use_fifo_for_nested_call_(absl::GetFlag(FLAGS_use_fifo_for_nested_call)),
+      func_worker_use_shm_queue_(absl::GetFlag(FLAGS_func_worker_use_shm_queue)),
       next_call_id_(1),
       uv_handle_(nullptr),
+      autoscale_interval_ms_(absl::GetFlag(FLAGS_autoscale_interval_ms)),
       next_gateway_conn_worker_id_(0),
       next_ipc_conn_worker_id_(0),
       next_gateway_conn_id_(0),
       next_http_connection_id_(0),
       next_http_conn_worker_id_(0),
       max_running_requests_(0),
+      num_running_func_calls_(0),
       worker_manager_(new WorkerManager(this)),
       monitor_(absl::GetFlag(FLAGS_disable_monitor) ? nullptr : new Monitor(this)),
       tracer_(new Tracer(this)),
       inflight_external_requests_(0),
+      has_discarded_func_calls_(false),
+      discarded_func_call_stat_(stat::Counter::StandardReportCallback("discarded_func_call")),
       last_external_request_timestamp_(-1),
       incoming_external_requests_stat_(
           stat::Counter::StandardReportCallback("incoming_external_requests")),
@@ -73,14 +110,18 @@ Engine::Engine()
       dispatch_overhead_stat_(
           stat::StatisticsCollector<int32_t>::StandardReportCallback("dispatch_overhead")),
       input_use_shm_stat_(stat::Counter::StandardReportCallback("input_use_shm")),
-      output_use_shm_stat_(stat::Counter::StandardReportCallback("output_use_shm")),
-      discarded_func_call_stat_(stat::Counter::StandardReportCallback("discarded_func_call")) {
-    
+      output_use_shm_stat_(stat::Counter::StandardReportCallback("output_use_shm")) {
+    for (size_t i = 0; i <= FuncConfig::kMaxFuncId; i++) {
+        dispatchers_[i].store(nullptr, std::memory_order_relaxed);
+    }
     UV_CHECK_OK(uv_tcp_init(uv_loop(), &uv_http_handle_));
     uv_http_handle_.data = this;
 }
 
 Engine::~Engine() {
+    if (monitor_ != nullptr) {
+        monitor_->WaitForFinish();
+    }
     if (uv_handle_ != nullptr) {
         free(uv_handle_);
     }
@@ -92,6 +133,15 @@ void Engine::StartInternal() {
     CHECK(fs_utils::ReadContents(func_config_file_, &func_config_json_))
         << "Failed to read from file " << func_config_file_;
     CHECK(func_config_.Load(func_config_json_));
+    if (func_worker_use_engine_socket_ && func_worker_use_shm_queue_) {
+        HLOG(WARNING) << "func_worker_use_shm_queue is ignored when "
+                         "func workers use engine socket";
+        func_worker_use_shm_queue_ = false;
+    }
+    if (absl::GetFlag(FLAGS_use_shm_arena)) {
+        shm_arena_ = ipc::ShmArena::Create(absl::GetFlag(FLAGS_shm_arena_segment_size_mb) << 20,
+                                           absl::GetFlag(FLAGS_shm_arena_prefault));
+    }
     // Start IO workers
     CHECK_GT(num_io_workers_, 0);
     HLOG(INFO) << fmt::format("Start {} IO workers", num_io_workers_);
@@ -121,12 +171,21 @@ void Engine::StartInternal() {
     CHECK_NE(http_port_, -1);
 
     // Listen on address:http_port for HTTP requests
-    UV_CHECK_OK(uv_ip4_addr(address_.c_str(), http_port_, &bind_addr));
-    UV_CHECK_OK(uv_tcp_bind(&uv_http_handle_, (const struct sockaddr *)&bind_addr, 0));
-    HLOG(INFO) << fmt::format("Listen on {}:{} for HTTP requests", address_, http_port_);
-    UV_CHECK_OK(uv_listen(
-        UV_AS_STREAM(&uv_http_handle_), listen_backlog_,
-        &Engine::HttpConnectionCallback));
+    if (reuseport_accept()) {
+        HLOG(INFO) << fmt::format("IO workers listen on {}:{} for HTTP requests",
+                                  address_, http_port_);
+        ListenOnIOWorkers(io_workers_, address_, http_port_, listen_backlog_, [this] {
+            return OnIOWorkerAccept(std::shared_ptr<server::ConnectionBase>(
+                new HttpConnection(this, next_http_connection_id_.fetch_add(1))));
+        });
+    } else {
+        UV_CHECK_OK(uv_ip4_addr(address_.c_str(), http_port_, &bind_addr));
+        UV_CHECK_OK(uv_tcp_bind(&uv_http_handle_, (const struct sockaddr *)&bind_addr, 0));
+        HLOG(INFO) << fmt::format("Listen on {}:{} for HTTP requests", address_, http_port_);
+        UV_CHECK_OK(uv_listen(
+            UV_AS_STREAM(&uv_http_handle_), listen_backlog_,
+            &Engine::HttpConnectionCallback));
+    }
 
     // Listen on ipc_path
     if (engine_tcp_port_ == -1) {
@@ -152,11 +211,39 @@ void Engine::StartInternal() {
     UV_CHECK_OK(uv_listen(uv_handle_, listen_backlog_, &Engine::MessageConnectionCallback));
     // Initialize tracer
     tracer_->Init();
+    UV_CHECK_OK(uv_timer_init(uv_loop(), &tracer_flush_timer_));
+    tracer_flush_timer_.data = this;
+    UV_CHECK_OK(uv_timer_start(&tracer_flush_timer_, &Engine::TracerFlushCallback,
+                               Tracer::kStatFlushIntervalMs, Tracer::kStatFlushIntervalMs));
+    UV_CHECK_OK(uv_timer_init(uv_loop(), &handshake_timeout_timer_));
+    handshake_timeout_timer_.data = this;
+    UV_CHECK_OK(uv_timer_start(&handshake_timeout_timer_, &Engine::HandshakeTimeoutCallback,
+                               WorkerManager::kHandshakeTimeoutCheckIntervalMs,
+                               WorkerManager::kHandshakeTimeoutCheckIntervalMs));
+    // Start periodic autoscaling, which also makes use of CPU usage from monitor
+    if (autoscale_interval_ms_ > 0) {
+        UV_CHECK_OK(uv_timer_init(uv_loop(), &autoscale_timer_));
+        autoscale_timer_.data = this;
+        UV_CHECK_OK(uv_timer_start(&autoscale_timer_, &Engine::AutoscaleCallback,
+                                   autoscale_interval_ms_, autoscale_interval_ms_));
+        HLOG(INFO) << fmt::format("Autoscale func workers every {}ms", autoscale_interval_ms_);
+        if (monitor_ != nullptr) {
+            monitor_->Start();
+        }
+    }
 }
 
 void Engine::StopInternal() {
     uv_close(UV_AS_HANDLE(uv_handle_), nullptr);
     uv_close(UV_AS_HANDLE(&uv_http_handle_), nullptr);
+    uv_close(UV_AS_HANDLE(&tracer_flush_timer_), nullptr);
+    uv_close(UV_AS_HANDLE(&handshake_timeout_timer_), nullptr);
+    if (autoscale_interval_ms_ > 0) {
+        uv_close(UV_AS_HANDLE(&autoscale_timer_), nullptr);
+    }
+    if (monitor_ != nullptr) {
+        monitor_->ScheduleStop();
+    }
 }
 
 void Engine::OnConnectionClose(server::ConnectionBase* connection) {
@@ -180,9 +267,10 @@ void Engine::OnConnectionClose(server::ConnectionBase* connection) {
                                      gateway_connection->conn_id());
         gateway_connections_.erase(connection->id());
     } else if (connection->type() == HttpConnection::kTypeId) {
-        absl::MutexLock lk(&mu_);
-        DCHECK(connections_.contains(connection->id()));
-        connections_.erase(connection->id());
+        Shard* shard = connection_shard(connection->id());
+        absl::MutexLock lk(&shard->mu);
+        DCHECK(shard->connections.contains(connection->id()));
+        shard->connections.erase(connection->id());
     } else {
         HLOG(ERROR) << "Unknown connection type!";
     }
@@ -226,13 +314,34 @@ bool Engine::OnNewHandshake(MessageConnection* connection,
         if (func_worker_use_engine_socket_) {
             response->flags |= protocol::kFuncWorkerUseEngineSocketFlag;
         }
+        if (func_worker_use_shm_queue_) {
+            response->flags |= protocol::kFuncWorkerUseShmQueueFlag;
+        }
         *response_payload = std::span<const char>(func_config_json_.data(),
                                                   func_config_json_.size());
     } else {
-        *response = NewHandshakeResponseMessage(0);
+        *response = NewFuncWorkerHandshakeResponseMessage(
+            worker_manager_->GetClientIdGeneration(handshake_message.client_id));
         if (use_fifo_for_nested_call_) {
             response->flags |= protocol::kUseFifoForNestedCallFlag;
         }
+        if (connection->use_shm_queue()) {
+            response->flags |= protocol::kFuncWorkerUseShmQueueFlag;
+        }
+        if (connection->use_shm_arena()) {
+            response->flags |= protocol::kShmArenaEnabledFlag;
+        }
+        if (cpu_placement()->enabled()) {
+            std::string cpuset = cpu_utils::FormatCpuList(
+                cpu_placement()->GetFuncWorkerCpus(connection->io_worker()->cpu()));
+            if (!cpuset.empty() && cpuset.size() <= MESSAGE_INLINE_DATA_SIZE) {
+                HLOG(INFO) << fmt::format("Func worker (client_id {}) is placed on CPUs {}",
+                                          connection->client_id(), cpuset);
+                response->flags |= protocol::kFuncWorkerCpusetFlag;
+                SetInlineDataInMessage(response, std::span<const char>(cpuset.data(),
+                                                                       cpuset.size()));
+            }
+        }
         *response_payload = std::span<const char>();
     }
     return true;
@@ -243,7 +352,11 @@ void Engine::OnRecvGatewayMessage(GatewayConnection* connection, const GatewayMe
                                   std::span<const char> payload) {
     if (IsDispatchFuncCallMessage(message)) {
         FuncCall func_call = GetFuncCallFromMessage(message);
-        OnExternalFuncCall(func_call, payload);
+        int64_t deadline = 0;
+        if (message.deadline_budget > 0) {
+            deadline = GetMonotonicMicroTimestamp() + message.deadline_budget;
+        }
+        OnExternalFuncCall(func_call, payload, deadline);
     } else {
         HLOG(ERROR) << "Unknown engine message type";
     }
@@ -251,26 +364,57 @@ void Engine::OnRecvGatewayMessage(GatewayConnection* connection, const GatewayMe
 
 // This is the message comming from Fun worker, either function result or internal invoking
 void Engine::OnRecvMessage(MessageConnection* connection, const Message& message) {
+#ifndef __FAAS_DISABLE_STAT
     int32_t message_delay = ComputeMessageDelay(message);
+#endif
     if (IsInvokeFuncMessage(message)) {
         FuncCall func_call = GetFuncCallFromMessage(message);
         FuncCall parent_func_call;
         parent_func_call.full_call_id = message.parent_call_id;
         Dispatcher* dispatcher = nullptr;
-        {
-            absl::MutexLock lk(&mu_);
-            incoming_internal_requests_stat_.Tick();
-            if (message.payload_size < 0) {
-                input_use_shm_stat_.Tick();
-            }
-            if (message_delay >= 0) {
-                message_delay_stat_.AddSample(message_delay);
-            }
-            dispatcher = GetOrCreateDispatcherLocked(func_call.func_id);
+#ifndef __FAAS_DISABLE_STAT
+        incoming_internal_requests_stat_.Tick();
+        if (message.payload_size < 0) {
+            input_use_shm_stat_.Tick();
+        }
+        if (message_delay >= 0) {
+            message_delay_stat_.AddSample(message_delay);
         }
+#endif
+        if (IsPayloadInShmArena(message)) {
+            AddCallerArenaInput(func_call, message);
+        }
+        dispatcher = GetOrCreateDispatcher(func_call.func_id);
         bool success = false;
         if (dispatcher != nullptr) {
-            if (message.payload_size < 0) {
+            if (IsPayloadInShmArena(message) && dispatcher->shm_arena_supported()) {
+                ipc::ShmArenaBuffer arena_input = {
+                    .segment = message.shm_arena_segment,
+                    .offset = message.shm_arena_offset
+                };
+                success = dispatcher->OnNewFuncCall(
+                    func_call, parent_func_call,
+                    /* input_size= */ gsl::narrow_cast<size_t>(-message.payload_size),
+                    std::span<const char>(), /* shm_input= */ true, &arena_input);
+            } else if (IsPayloadInShmArena(message)) {
+                // Func workers of the callee cannot read from shm arena, thus copy
+                // input to a standalone shm, which is owned by engine. The arena
+                // buffer is still released by the caller.
+                std::unique_ptr<ipc::ShmRegion> input_region;
+                if (auto arena_region = GetShmArenaPayload(message)) {
+                    input_region = CopyToNewShm(
+                        ipc::GetFuncCallInputShmName(func_call.full_call_id),
+                        arena_region->to_span());
+                }
+                if (input_region != nullptr) {
+                    input_region->EnableRemoveOnDestruction();
+                    size_t input_size = input_region->size();
+                    AddFuncCallShmInput(func_call, std::move(input_region));
+                    success = dispatcher->OnNewFuncCall(
+                        func_call, parent_func_call, input_size,
+                        std::span<const char>(), /* shm_input= */ true);
+                }
+            } else if (message.payload_size < 0) {
                 success = dispatcher->OnNewFuncCall(
                     func_call, parent_func_call,
                     /* input_size= */ gsl::narrow_cast<size_t>(-message.payload_size),
@@ -285,28 +429,31 @@ void Engine::OnRecvMessage(MessageConnection* connection, const Message& message
         }
         if (!success) {
             HLOG(ERROR) << "Dispatcher failed for func_id " << func_call.func_id;
+            if (IsPayloadInShmArena(message)) {
+                RemoveCallerArenaInput(func_call);
+            }
         }
     } else if (IsFuncCallCompleteMessage(message) || IsFuncCallFailedMessage(message)) {
         FuncCall func_call = GetFuncCallFromMessage(message);
         Dispatcher* dispatcher = nullptr;
         std::unique_ptr<ipc::ShmRegion> input_region = nullptr;
-        {
-            absl::MutexLock lk(&mu_);
-            if (message_delay >= 0) {
-                message_delay_stat_.AddSample(message_delay);
-            }
-            if (IsFuncCallCompleteMessage(message)) {
-                if ((func_call.client_id == 0 && message.payload_size < 0)
-                      || (func_call.client_id > 0
-                          && message.payload_size + sizeof(int32_t) > PIPE_BUF)) {
-                    output_use_shm_stat_.Tick();
-                }
-            }
-            if (func_call.client_id == 0) {
-                input_region = GrabExternalFuncCallShmInput(func_call);
+#ifndef __FAAS_DISABLE_STAT
+        if (message_delay >= 0) {
+            message_delay_stat_.AddSample(message_delay);
+        }
+        if (IsFuncCallCompleteMessage(message)) {
+            if ((func_call.client_id == 0 && message.payload_size < 0)
+                  || (func_call.client_id > 0
+                      && message.payload_size + sizeof(int32_t) > PIPE_BUF)) {
+                output_use_shm_stat_.Tick();
             }
-            dispatcher = GetOrCreateDispatcherLocked(func_call.func_id);
         }
+#endif
+        input_region = GrabFuncCallShmInput(func_call);
+        if (func_call.client_id > 0 && shm_arena_ != nullptr) {
+            RemoveCallerArenaInput(func_call);
+        }
+        dispatcher = GetOrCreateDispatcher(func_call.func_id);
         bool success = false;
         if (dispatcher != nullptr) {
             if (IsFuncCallCompleteMessage(message)) {
@@ -315,18 +462,27 @@ void Engine::OnRecvMessage(MessageConnection* connection, const Message& message
                     /* output_size= */ gsl::narrow_cast<size_t>(std::abs(message.payload_size)));
                 if (success && func_call.client_id == 0) {
                     if (message.payload_size < 0) {
-                        auto output_region = ipc::ShmOpen(
-                            ipc::GetFuncCallOutputShmName(func_call.full_call_id));
+                        std::unique_ptr<ipc::ShmRegion> output_region;
+                        if (IsPayloadInShmArena(message)) {
+                            output_region = GetShmArenaPayload(message);
+                        } else {
+                            output_region = ipc::ShmOpen(
+                                ipc::GetFuncCallOutputShmName(func_call.full_call_id));
+                        }
                         if (output_region == nullptr) {
                             ExternalFuncCallFailed(func_call);
                         } else {
                             output_region->EnableRemoveOnDestruction();
-                            ExternalFuncCallCompleted(func_call, output_region->to_span(),
-                                                      message.processing_time);
+                            // Output shm is released after the output is sent out
+                            std::span<const char> output = output_region->to_span();
+                            ExternalFuncCallCompleted(
+                                func_call, utils::PayloadRef::Wrap(std::move(output_region), output),
+                                message.processing_time);
                         }
                     } else {
-                        ExternalFuncCallCompleted(func_call, GetInlineDataFromMessage(message),
-                                                  message.processing_time);
+                        ExternalFuncCallCompleted(
+                            func_call, utils::PayloadRef(GetInlineDataFromMessage(message)),
+                            message.processing_time);
                     }
                 }
             } else {
@@ -338,7 +494,36 @@ void Engine::OnRecvMessage(MessageConnection* connection, const Message& message
         }
         if (success && func_call.client_id > 0 && !use_fifo_for_nested_call_) {
             Message message_copy = message;
-            worker_manager_->GetFuncWorker(func_call.client_id)->SendMessage(&message_copy);
+            std::shared_ptr<FuncWorker> func_worker =
+                worker_manager_->GetFuncWorker(func_call.client_id);
+            if (func_worker != nullptr && func_worker->client_id_generation()
+                                            != func_call.client_id_generation) {
+                // The caller has exited, and its client_id is reused
+                HLOG(WARNING) << "Drop result of stale nested call: "
+                              << FuncCallDebugString(func_call);
+                func_worker = nullptr;
+            }
+            if (IsPayloadInShmArena(message)
+                  && (func_worker == nullptr || !func_worker->use_shm_arena())) {
+                // The caller cannot read from shm arena, thus copy output to
+                // a standalone shm, and release the arena buffer
+                auto arena_region = GetShmArenaPayload(message);
+                if (arena_region != nullptr) {
+                    arena_region->EnableRemoveOnDestruction();
+                }
+                if (func_worker != nullptr) {
+                    ClearShmArenaPayloadInMessage(&message_copy);
+                    if (arena_region == nullptr
+                          || CopyToNewShm(ipc::GetFuncCallOutputShmName(func_call.full_call_id),
+                                          arena_region->to_span()) == nullptr) {
+                        message_copy = NewFuncCallFailedMessage(func_call);
+                        message_copy.dispatch_delay = message.dispatch_delay;
+                    }
+                }
+            }
+            if (func_worker != nullptr) {
+                func_worker->SendMessage(&message_copy);
+            }
         }
     } else {
         LOG(ERROR) << "Unknown message type!";
@@ -350,39 +535,68 @@ void Engine::OnRecvMessage(MessageConnection* connection, const Message& message
 void Engine::OnNewFuncCallCommon(std::shared_ptr<server::ConnectionBase> parent_connection,
                                  gateway::FuncCallContext* func_call_context) {
     FuncCall func_call = func_call_context->func_call();
-    bool server_overloaded = false;
-    {
-        absl::MutexLock lk(&mu_);
-        int64_t current_timestamp = GetMonotonicMicroTimestamp();
-            FuncCallState state = {
-                .func_call = func_call,
-                .connection_id = parent_connection->id(),
-                .context = func_call_context,
-                .recv_timestamp = current_timestamp,
-                .dispatch_timestamp = 0
-            };
-            if (max_running_requests_ > 0 && running_func_calls_.size() >= max_running_requests_) {
-                pending_func_calls_.push(std::move(state));
-                server_overloaded = true;
-            } else {
-                state.dispatch_timestamp = current_timestamp;
-                running_func_calls_[func_call.full_call_id] = std::move(state);
-                running_requests_stat_.AddSample(
-                    gsl::narrow_cast<uint16_t>(running_func_calls_.size()));
-            }
+    int64_t current_timestamp = GetMonotonicMicroTimestamp();
+    FuncCallState state = {
+        .func_call = func_call,
+        .connection_id = parent_connection->id(),
+        .context = func_call_context,
+        .recv_timestamp = current_timestamp,
+        .dispatch_timestamp = 0
+    };
+    if (max_running_requests_ > 0) {
+        absl::MutexLock lk(&pending_mu_);
+        if (num_running_func_calls_.load() >= max_running_requests_) {
+            pending_func_calls_.push(std::move(state));
+            return;
         }
-    if (server_overloaded) {
-        return;
+        num_running_func_calls_.fetch_add(1);
+    } else {
+        num_running_func_calls_.fetch_add(1);
     }
+    state.dispatch_timestamp = current_timestamp;
+    {
+        Shard* shard = func_call_shard(func_call);
+        absl::MutexLock lk(&shard->mu);
+        shard->running_func_calls[func_call.full_call_id] = std::move(state);
+    }
+    running_requests_stat_.AddSample(
+        gsl::narrow_cast<uint16_t>(num_running_func_calls_.load()));
 }
 
 // This is the function request comming from gateway
-void Engine::OnExternalFuncCall(const FuncCall& func_call, std::span<const char> input) {
+void Engine::OnExternalFuncCall(const FuncCall& func_call, std::span<const char> input,
+                                int64_t deadline) {
     inflight_external_requests_.fetch_add(1);
+    Dispatcher* dispatcher = nullptr;
+#ifndef __FAAS_DISABLE_STAT
+    incoming_external_requests_stat_.Tick();
+    int64_t current_timestamp = GetMonotonicMicroTimestamp();
+    int64_t last_timestamp = stat::AdvanceTimestamp(&last_external_request_timestamp_,
+                                                    &current_timestamp);
+    if (last_timestamp != -1) {
+        external_requests_instant_rps_stat_.AddSample(gsl::narrow_cast<float>(
+            1e6 / (current_timestamp - last_timestamp)));
+    }
+    inflight_external_requests_stat_.AddSample(
+        gsl::narrow_cast<uint16_t>(inflight_external_requests_.load()));
+#endif
+    dispatcher = GetOrCreateDispatcher(func_call.func_id);
+    if (dispatcher == nullptr) {
+        ExternalFuncCallFailed(func_call);
+        return;
+    }
     std::unique_ptr<ipc::ShmRegion> input_region = nullptr;
+    ipc::ShmArenaBuffer arena_input;
+    bool input_in_arena = false;
     if (input.size() > MESSAGE_INLINE_DATA_SIZE) {
-        input_region = ipc::ShmCreate(
-            ipc::GetFuncCallInputShmName(func_call.full_call_id), input.size());
+        if (shm_arena_ != nullptr && dispatcher->shm_arena_supported()) {
+            input_region = shm_arena_->Allocate(input.size(), &arena_input);
+            input_in_arena = (input_region != nullptr);
+        }
+        if (input_region == nullptr) {
+            input_region = ipc::ShmCreate(
+                ipc::GetFuncCallInputShmName(func_call.full_call_id), input.size());
+        }
         if (input_region == nullptr) {
             ExternalFuncCallFailed(func_call);
             return;
@@ -391,56 +605,32 @@ void Engine::OnExternalFuncCall(const FuncCall& func_call, std::span<const char>
         if (input.size() > 0) {
             memcpy(input_region->base(), input.data(), input.size());
         }
-    }
-    Dispatcher* dispatcher = nullptr;
-    {
-        absl::MutexLock lk(&mu_);
-        incoming_external_requests_stat_.Tick();
-        int64_t current_timestamp = GetMonotonicMicroTimestamp();
-        if (current_timestamp <= last_external_request_timestamp_) {
-            current_timestamp = last_external_request_timestamp_ + 1;
-        }
-        if (last_external_request_timestamp_ != -1) {
-            external_requests_instant_rps_stat_.AddSample(gsl::narrow_cast<float>(
-                1e6 / (current_timestamp - last_external_request_timestamp_)));
-        }
-        last_external_request_timestamp_ = current_timestamp;
-        inflight_external_requests_stat_.AddSample(
-            gsl::narrow_cast<uint16_t>(inflight_external_requests_.load()));
-        dispatcher = GetOrCreateDispatcherLocked(func_call.func_id);
-        if (input_region != nullptr) {
-            if (dispatcher != nullptr) {
-                external_func_call_shm_inputs_[func_call.full_call_id] = std::move(input_region);
-            }
-            input_use_shm_stat_.Tick();
-        }
-    }
-    if (dispatcher == nullptr) {
-        ExternalFuncCallFailed(func_call);
-        return;
+        AddFuncCallShmInput(func_call, std::move(input_region));
+        input_use_shm_stat_.Tick();
     }
     bool success = false;
     if (input.size() <= MESSAGE_INLINE_DATA_SIZE) {
         success = dispatcher->OnNewFuncCall(
             func_call, protocol::kInvalidFuncCall,
-            input.size(), /* inline_input= */ input, /* shm_input= */ false);
+            input.size(), /* inline_input= */ input, /* shm_input= */ false,
+            /* arena_input= */ nullptr, deadline);
     } else {
         success = dispatcher->OnNewFuncCall(
             func_call, protocol::kInvalidFuncCall,
-            input.size(), /* inline_input= */ std::span<const char>(), /* shm_input= */ true);
+            input.size(), /* inline_input= */ std::span<const char>(), /* shm_input= */ true,
+            input_in_arena ? &arena_input : nullptr, deadline);
     }
     if (!success) {
-        {
-            absl::MutexLock lk(&mu_);
-            input_region = GrabExternalFuncCallShmInput(func_call);
-        }
+        input_region = GrabFuncCallShmInput(func_call);
         ExternalFuncCallFailed(func_call);
     }
+    // Dispatcher may reject func calls that cannot meet their deadlines
+    ProcessDiscardedFuncCallIfNecessary();
 }
 
 // The function is finished, get the result back
 void Engine::ExternalFuncCallCompleted(const protocol::FuncCall& func_call,
-                                       std::span<const char> output, int32_t processing_time) {
+                                       const utils::PayloadRef& output, int32_t processing_time) {
     inflight_external_requests_.fetch_add(-1);
     server::IOWorker* io_worker = server::IOWorker::current();
     DCHECK(io_worker != nullptr);
@@ -463,41 +653,51 @@ void Engine::ExternalFuncCallCompleted(const protocol::FuncCall& func_call,
 }
 
 void Engine::OnRecvWorkerMessage(const protocol::FuncCall& func_call,
-                                 std::span<const char> payload, int32_t processing_time) {
+                                 const utils::PayloadRef& payload, int32_t processing_time) {
     int64_t current_timestamp = GetMonotonicMicroTimestamp();
     gateway::FuncCallContext* func_call_context = nullptr;
     std::shared_ptr<server::ConnectionBase> connection;
-        {
-            absl::MutexLock lk(&mu_);
-            if (running_func_calls_.contains(func_call.full_call_id)) {
-                const FuncCallState& full_call_state = running_func_calls_[func_call.full_call_id];
-                // Check if corresponding connection is still active
-                if (connections_.contains(full_call_state.connection_id)) {
-                    connection = connections_[full_call_state.connection_id];
-                    func_call_context = full_call_state.context;
-                }
-                dispatch_overhead_stat_.AddSample(gsl::narrow_cast<int32_t>(
-                    current_timestamp - full_call_state.dispatch_timestamp - processing_time));
-                running_func_calls_.erase(func_call.full_call_id);
-                FuncCallState state;
-                if (max_running_requests_ == 0 || running_func_calls_.size() < max_running_requests_) {
-                    while (!pending_func_calls_.empty()) {
-                        state = std::move(pending_func_calls_.front());
-                        pending_func_calls_.pop();
-                        if (connections_.contains(state.connection_id)) {
-                            break;
-                        }
-                    }
-                }
-            } else {
-		printf("running_func_calls_ doesn't contain state\n");
-	    }
+    FuncCallState full_call_state;
+    bool found = false;
+    {
+        Shard* shard = func_call_shard(func_call);
+        absl::MutexLock lk(&shard->mu);
+        auto iter = shard->running_func_calls.find(func_call.full_call_id);
+        if (iter != shard->running_func_calls.end()) {
+            full_call_state = iter->second;
+            shard->running_func_calls.erase(iter);
+            found = true;
         }
-        if (func_call_context != nullptr) {
-            func_call_context->set_status(gateway::FuncCallContext::kSuccess);
-            func_call_context->append_output(payload);
-            FinishFuncCall(std::move(connection), func_call_context);
+    }
+    if (!found) {
+        HLOG(WARNING) << "Cannot find running func call " << FuncCallDebugString(func_call);
+        return;
+    }
+    // Check if corresponding connection is still active
+    connection = GetHttpConnection(full_call_state.connection_id);
+    if (connection != nullptr) {
+        func_call_context = full_call_state.context;
+    }
+    dispatch_overhead_stat_.AddSample(gsl::narrow_cast<int32_t>(
+        current_timestamp - full_call_state.dispatch_timestamp - processing_time));
+    if (max_running_requests_ > 0) {
+        absl::MutexLock lk(&pending_mu_);
+        num_running_func_calls_.fetch_sub(1);
+        while (!pending_func_calls_.empty()) {
+            FuncCallState state = std::move(pending_func_calls_.front());
+            pending_func_calls_.pop();
+            if (GetHttpConnection(state.connection_id) != nullptr) {
+                break;
+            }
         }
+    } else {
+        num_running_func_calls_.fetch_sub(1);
+    }
+    if (func_call_context != nullptr) {
+        func_call_context->set_status(gateway::FuncCallContext::kSuccess);
+        func_call_context->set_output(payload);
+        FinishFuncCall(std::move(connection), func_call_context);
+    }
 }
 
 void Engine::FinishFuncCall(std::shared_ptr<server::ConnectionBase> parent_connection,
@@ -536,54 +736,169 @@ void Engine::OnNewHttpFuncCall(HttpConnection* connection, gateway::FuncCallCont
     VLOG(1) << "OnNewHttpFuncCall: " << FuncCallDebugString(func_call);
     func_call_context->set_func_call(func_call);
     OnNewFuncCallCommon(connection->ref_self(), func_call_context);
-    OnExternalFuncCall(func_call, func_call_context->input());
+    OnExternalFuncCall(func_call, func_call_context->input(), func_call_context->deadline());
 }
 
 Dispatcher* Engine::GetOrCreateDispatcher(uint16_t func_id) {
-    absl::MutexLock lk(&mu_);
-    Dispatcher* dispatcher = GetOrCreateDispatcherLocked(func_id);
+    if (func_id > FuncConfig::kMaxFuncId) {
+        return nullptr;
+    }
+    Dispatcher* dispatcher = dispatchers_[func_id].load(std::memory_order_acquire);
+    if (dispatcher != nullptr) {
+        return dispatcher;
+    }
+    if (func_config_.find_by_func_id(func_id) == nullptr) {
+        return nullptr;
+    }
+    absl::MutexLock lk(&dispatcher_mu_);
+    dispatcher = dispatchers_[func_id].load(std::memory_order_relaxed);
+    if (dispatcher == nullptr) {
+        dispatcher_storage_.push_back(std::make_unique<Dispatcher>(this, func_id));
+        dispatcher = dispatcher_storage_.back().get();
+        dispatchers_[func_id].store(dispatcher, std::memory_order_release);
+    }
     return dispatcher;
 }
 
-Dispatcher* Engine::GetOrCreateDispatcherLocked(uint16_t func_id) {
-    if (dispatchers_.contains(func_id)) {
-        return dispatchers_[func_id].get();
+std::shared_ptr<server::ConnectionBase> Engine::GetHttpConnection(int connection_id) {
+    Shard* shard = connection_shard(connection_id);
+    absl::MutexLock lk(&shard->mu);
+    auto iter = shard->connections.find(connection_id);
+    return iter == shard->connections.end() ? nullptr : iter->second;
+}
+
+void Engine::AddFuncCallShmInput(const FuncCall& func_call,
+                                 std::unique_ptr<ipc::ShmRegion> input_region) {
+    Shard* shard = func_call_shard(func_call);
+    absl::MutexLock lk(&shard->mu);
+    shard->func_call_shm_inputs[func_call.full_call_id] = std::move(input_region);
+}
+
+std::unique_ptr<ipc::ShmRegion> Engine::GrabFuncCallShmInput(const FuncCall& func_call) {
+    Shard* shard = func_call_shard(func_call);
+    absl::MutexLock lk(&shard->mu);
+    std::unique_ptr<ipc::ShmRegion> ret = nullptr;
+    auto iter = shard->func_call_shm_inputs.find(func_call.full_call_id);
+    if (iter != shard->func_call_shm_inputs.end()) {
+        ret = std::move(iter->second);
+        shard->func_call_shm_inputs.erase(iter);
     }
-    if (func_config_.find_by_func_id(func_id) != nullptr) {
-        dispatchers_[func_id] = std::make_unique<Dispatcher>(this, func_id);
-        return dispatchers_[func_id].get();
-    } else {
+    return ret;
+}
+
+std::unique_ptr<ipc::ShmRegion> Engine::GetShmArenaPayload(const Message& message) {
+    DCHECK(IsPayloadInShmArena(message));
+    if (shm_arena_ == nullptr) {
+        HLOG(ERROR) << "Payload is in shm arena, while shm arena is not enabled";
         return nullptr;
     }
+    ipc::ShmArenaBuffer buffer = {
+        .segment = message.shm_arena_segment,
+        .offset = message.shm_arena_offset
+    };
+    return shm_arena_->Get(buffer, gsl::narrow_cast<size_t>(-message.payload_size));
 }
 
-std::unique_ptr<ipc::ShmRegion> Engine::GrabExternalFuncCallShmInput(const FuncCall& func_call) {
-    std::unique_ptr<ipc::ShmRegion> ret = nullptr;
-    if (external_func_call_shm_inputs_.contains(func_call.full_call_id)) {
-        ret = std::move(external_func_call_shm_inputs_[func_call.full_call_id]);
-        external_func_call_shm_inputs_.erase(func_call.full_call_id);
+bool Engine::MoveShmArenaInputToShm(const FuncCall& func_call, Message* message) {
+    auto arena_region = GetShmArenaPayload(*message);
+    if (arena_region == nullptr) {
+        return false;
+    }
+    auto input_region = CopyToNewShm(ipc::GetFuncCallInputShmName(func_call.full_call_id),
+                                     arena_region->to_span());
+    if (input_region == nullptr) {
+        return false;
+    }
+    input_region->EnableRemoveOnDestruction();
+    // If the arena buffer is owned by engine, it is released here. Otherwise
+    // it is still released by the caller.
+    GrabFuncCallShmInput(func_call);
+    AddFuncCallShmInput(func_call, std::move(input_region));
+    ClearShmArenaPayloadInMessage(message);
+    return true;
+}
+
+void Engine::AddCallerArenaInput(const FuncCall& func_call, const Message& message) {
+    DCHECK(IsPayloadInShmArena(message));
+    Shard* shard = func_call_shard(func_call);
+    absl::MutexLock lk(&shard->mu);
+    shard->caller_arena_inputs[func_call.full_call_id] = {
+        .buffer = {
+            .segment = message.shm_arena_segment,
+            .offset = message.shm_arena_offset
+        },
+        .size = gsl::narrow_cast<size_t>(-message.payload_size),
+        .caller_exited = false
+    };
+}
+
+void Engine::RemoveCallerArenaInput(const FuncCall& func_call) {
+    CallerArenaInput arena_input;
+    {
+        Shard* shard = func_call_shard(func_call);
+        absl::MutexLock lk(&shard->mu);
+        auto iter = shard->caller_arena_inputs.find(func_call.full_call_id);
+        if (iter == shard->caller_arena_inputs.end()) {
+            return;
+        }
+        arena_input = iter->second;
+        shard->caller_arena_inputs.erase(iter);
+    }
+    if (arena_input.caller_exited && shm_arena_ != nullptr) {
+        auto region = shm_arena_->Get(arena_input.buffer, arena_input.size);
+        if (region != nullptr) {
+            region->EnableRemoveOnDestruction();
+        }
+    }
+}
+
+void Engine::ReleaseShmArenaInputsOfCaller(uint16_t client_id, uint32_t client_id_generation) {
+    if (shm_arena_ == nullptr) {
+        return;
+    }
+    size_t num_inputs = 0;
+    for (size_t i = 0; i < kNumShards; i++) {
+        Shard* shard = &shards_[i];
+        absl::MutexLock lk(&shard->mu);
+        for (auto& [full_call_id, arena_input] : shard->caller_arena_inputs) {
+            FuncCall func_call;
+            func_call.full_call_id = full_call_id;
+            if (func_call.client_id == client_id
+                  && func_call.client_id_generation == client_id_generation) {
+                arena_input.caller_exited = true;
+                num_inputs++;
+            }
+        }
+    }
+    if (num_inputs > 0) {
+        HLOG(INFO) << fmt::format("{} arena buffers of exited caller (client_id {}) "
+                                  "will be released by engine", num_inputs, client_id);
     }
-    return ret;
 }
 
 void Engine::DiscardFuncCall(const FuncCall& func_call) {
-    absl::MutexLock lk(&mu_);
+    absl::MutexLock lk(&discarded_mu_);
     discarded_func_calls_.push_back(func_call);
     discarded_func_call_stat_.Tick();
+    has_discarded_func_calls_.store(true, std::memory_order_release);
 }
 
 void Engine::ProcessDiscardedFuncCallIfNecessary() {
     std::vector<std::unique_ptr<ipc::ShmRegion>> discarded_input_regions;
     std::vector<FuncCall> discarded_external_func_calls;
     std::vector<FuncCall> discarded_internal_func_calls;
+    if (!has_discarded_func_calls_.load(std::memory_order_acquire)) {
+        return;
+    }
     {
-        absl::MutexLock lk(&mu_);
+        absl::MutexLock lk(&discarded_mu_);
+        has_discarded_func_calls_.store(false, std::memory_order_relaxed);
         for (const FuncCall& func_call : discarded_func_calls_) {
+            auto shm_input = GrabFuncCallShmInput(func_call);
+            if (shm_input != nullptr) {
+                discarded_input_regions.push_back(std::move(shm_input));
+            }
             if (func_call.client_id == 0) {
-                auto shm_input = GrabExternalFuncCallShmInput(func_call);
-                if (shm_input != nullptr) {
-                    discarded_input_regions.push_back(std::move(shm_input));
-                }
                 discarded_external_func_calls.push_back(func_call);
             } else {
                 discarded_internal_func_calls.push_back(func_call);
@@ -598,6 +913,7 @@ void Engine::ProcessDiscardedFuncCallIfNecessary() {
         char pipe_buf[PIPE_BUF];
         Message dummy_message;
         for (const FuncCall& func_call : discarded_internal_func_calls) {
+            RemoveCallerArenaInput(func_call);
             if (use_fifo_for_nested_call_) {
                 worker_lib::FifoFuncCallFinished(
                     func_call, /* success= */ false, /* output= */ std::span<const char>(),
@@ -609,6 +925,17 @@ void Engine::ProcessDiscardedFuncCallIfNecessary() {
     }
 }
 
+server::ConnectionBase* Engine::OnIOWorkerAccept(
+        std::shared_ptr<server::ConnectionBase> connection) {
+    AssignConnectionId(connection.get());
+    server::ConnectionBase* ret = connection.get();
+    Shard* shard = connection_shard(connection->id());
+    absl::MutexLock lk(&shard->mu);
+    DCHECK(!shard->connections.contains(connection->id()));
+    shard->connections[connection->id()] = std::move(connection);
+    return ret;
+}
+
 UV_CONNECTION_CB_FOR_CLASS(Engine, HttpConnection) {
     if (status != 0) {
         HLOG(WARNING) << "Failed to open HTTP connection: " << uv_strerror(status);
@@ -625,9 +952,10 @@ UV_CONNECTION_CB_FOR_CLASS(Engine, HttpConnection) {
         RegisterConnection(io_worker, connection.get(), UV_AS_STREAM(client));
         DCHECK_GE(connection->id(), 0);
         {
-            absl::MutexLock lk(&mu_);
-            DCHECK(!connections_.contains(connection->id()));
-            connections_[connection->id()] = std::move(connection);
+            Shard* shard = connection_shard(connection->id());
+            absl::MutexLock lk(&shard->mu);
+            DCHECK(!shard->connections.contains(connection->id()));
+            shard->connections[connection->id()] = std::move(connection);
         }
     } else {
         LOG(ERROR) << "Failed to accept new HTTP connection";
@@ -685,5 +1013,22 @@ UV_CONNECTION_CB_FOR_CLASS(Engine, MessageConnection) {
     }
 }
 
+UV_TIMER_CB_FOR_CLASS(Engine, Autoscale) {
+    for (size_t i = 0; i <= FuncConfig::kMaxFuncId; i++) {
+        Dispatcher* dispatcher = dispatchers_[i].load(std::memory_order_acquire);
+        if (dispatcher != nullptr) {
+            dispatcher->Autoscale();
+        }
+    }
+}
+
+UV_TIMER_CB_FOR_CLASS(Engine, TracerFlush) {
+    tracer_->FlushAllLocalStatistics();
+}
+
+UV_TIMER_CB_FOR_CLASS(Engine, HandshakeTimeout) {
+    worker_manager_->ReclaimTimedOutClientIds();
+}
+
 }  // namespace engine
 }  // namespace faas
@@ -5,6 +5,8 @@
 #include "common/protocol.h"
 #include "common/func_config.h"
 #include "ipc/shm_region.h"
+#include "ipc/shm_arena.h"
+#include "utils/payload_ref.h"
 #include "server/server_base.h"
 #include "engine/gateway_connection.h"
 #include "engine/message_connection.h"
@@ -23,6 +25,7 @@ public:
     static constexpr int kDefaultNumIOWorkers = 1;
     static constexpr int kDefaultGatewayConnPerWorker = 2;
     static constexpr size_t kMessageConnectionBufferSize = __FAAS_MESSAGE_SIZE * 2;
+    static constexpr size_t kNumShards = 16;
 
     Engine();
     ~Engine();
@@ -47,6 +50,8 @@ public:
     FuncConfig* func_config() { return &func_config_; }
     int engine_tcp_port() const { return engine_tcp_port_; }
     bool func_worker_use_engine_socket() { return func_worker_use_engine_socket_; }
+    bool func_worker_use_shm_queue() { return func_worker_use_shm_queue_; }
+    ipc::ShmArena* shm_arena() { return shm_arena_.get(); }
     WorkerManager* worker_manager() { return worker_manager_.get(); }
     Monitor* monitor() { return monitor_.get(); }
     Tracer* tracer() { return tracer_.get(); }
@@ -63,6 +68,14 @@ public:
     void OnNewHttpFuncCall(HttpConnection* connection, gateway::FuncCallContext* func_call_context);
     Dispatcher* GetOrCreateDispatcher(uint16_t func_id);
     void DiscardFuncCall(const protocol::FuncCall& func_call);
+    // For func workers that cannot read from shm arena, copies the input in
+    // shm arena to a standalone shm owned by engine, and updates message to
+    // refer to it. Returns false on failure.
+    bool MoveShmArenaInputToShm(const protocol::FuncCall& func_call, protocol::Message* message);
+    // Called when the func worker of client_id disconnects. Arena buffers
+    // holding inputs of its unfinished nested calls are then released by
+    // engine once the calls finish, as the caller can no longer release them.
+    void ReleaseShmArenaInputsOfCaller(uint16_t client_id, uint32_t client_id_generation);
 
 private:
     class ExternalFuncCallContext;
@@ -81,19 +94,30 @@ private:
     FuncConfig func_config_;
     bool func_worker_use_engine_socket_;
     bool use_fifo_for_nested_call_;
+    bool func_worker_use_shm_queue_;
+    std::unique_ptr<ipc::ShmArena> shm_arena_;
 
     std::atomic<uint32_t> next_call_id_;
 
     uv_tcp_t uv_http_handle_;
     uv_stream_t* uv_handle_;
+    // Drives periodic autoscaling of func workers, disabled if interval is 0
+    int autoscale_interval_ms_;
+    uv_timer_t autoscale_timer_;
+    // Merges tracer statistics buffered by idle threads
+    uv_timer_t tracer_flush_timer_;
+    // Reclaims client_ids of func workers that never connect
+    uv_timer_t handshake_timeout_timer_;
 
     std::vector<server::IOWorker*> io_workers_;
     size_t next_gateway_conn_worker_id_;
     size_t next_ipc_conn_worker_id_;
     uint16_t next_gateway_conn_id_;
-    int next_http_connection_id_;
+    // Incremented within IO workers if reuseport_accept is on
+    std::atomic<int> next_http_connection_id_;
     size_t next_http_conn_worker_id_;
     size_t max_running_requests_;
+    std::atomic<size_t> num_running_func_calls_;
 
     absl::flat_hash_map</* id */ int, std::shared_ptr<server::ConnectionBase>> message_connections_;
     absl::flat_hash_map</* id */ int, std::shared_ptr<server::ConnectionBase>> gateway_connections_;
@@ -111,61 +135,109 @@ private:
         int64_t            dispatch_timestamp;
     };
 
-    absl::Mutex mu_;
-    absl::flat_hash_map</* full_call_id */ uint64_t, std::unique_ptr<ipc::ShmRegion>>
-        external_func_call_shm_inputs_ ABSL_GUARDED_BY(mu_);
-    absl::flat_hash_map</* func_id */ uint16_t, std::unique_ptr<Dispatcher>>
-        dispatchers_ ABSL_GUARDED_BY(mu_);
-
-    absl::flat_hash_map</* full_call_id */ uint64_t, FuncCallState>
-        running_func_calls_ ABSL_GUARDED_BY(mu_);
-
-    std::queue<FuncCallState> pending_func_calls_ ABSL_GUARDED_BY(mu_);
-
-    std::vector<protocol::FuncCall> discarded_func_calls_ ABSL_GUARDED_BY(mu_);
-
-    int64_t last_external_request_timestamp_ ABSL_GUARDED_BY(mu_);
-    stat::Counter incoming_external_requests_stat_ ABSL_GUARDED_BY(mu_);
-    stat::Counter incoming_internal_requests_stat_ ABSL_GUARDED_BY(mu_);
-    stat::StatisticsCollector<float> external_requests_instant_rps_stat_ ABSL_GUARDED_BY(mu_);
-    stat::StatisticsCollector<uint16_t> inflight_external_requests_stat_ ABSL_GUARDED_BY(mu_);
-    stat::StatisticsCollector<uint16_t> running_requests_stat_ ABSL_GUARDED_BY(mu_);
-
-    absl::flat_hash_map</* connection_id */ int,
-                        std::shared_ptr<server::ConnectionBase>>
-        connections_ ABSL_GUARDED_BY(mu_); /* http connections */
-
-    stat::StatisticsCollector<int32_t> message_delay_stat_ ABSL_GUARDED_BY(mu_);
-    stat::StatisticsCollector<int32_t> dispatch_overhead_stat_ ABSL_GUARDED_BY(mu_);
+    // Per-call tables are split into shards, each with its own lock, keyed by
+    // full_call_id (or connection id for HTTP connections). Thus func calls
+    // handled by different IO workers rarely contend.
+    struct CallerArenaInput {
+        ipc::ShmArenaBuffer buffer;
+        size_t              size;
+        bool                caller_exited;
+    };
 
-    stat::Counter input_use_shm_stat_ ABSL_GUARDED_BY(mu_);
-    stat::Counter output_use_shm_stat_ ABSL_GUARDED_BY(mu_);
-    stat::Counter discarded_func_call_stat_ ABSL_GUARDED_BY(mu_);
+    struct Shard {
+        absl::Mutex mu;
+        // Shm inputs owned by engine, which are inputs of external func calls, and
+        // inputs of internal func calls copied out of shm arena
+        absl::flat_hash_map</* full_call_id */ uint64_t, std::unique_ptr<ipc::ShmRegion>>
+            func_call_shm_inputs ABSL_GUARDED_BY(mu);
+        // Arena buffers holding inputs of running nested calls, which are
+        // allocated and released by callers
+        absl::flat_hash_map</* full_call_id */ uint64_t, CallerArenaInput>
+            caller_arena_inputs ABSL_GUARDED_BY(mu);
+        absl::flat_hash_map</* full_call_id */ uint64_t, FuncCallState>
+            running_func_calls ABSL_GUARDED_BY(mu);
+        absl::flat_hash_map</* connection_id */ int,
+                            std::shared_ptr<server::ConnectionBase>>
+            connections ABSL_GUARDED_BY(mu); /* http connections */
+    } __attribute__ ((aligned (__FAAS_CACHE_LINE_SIZE)));
+    Shard shards_[kNumShards];
+
+    // Dispatchers are never removed once created, thus looked up without lock
+    absl::Mutex dispatcher_mu_;
+    std::atomic<Dispatcher*> dispatchers_[FuncConfig::kMaxFuncId + 1];
+    std::vector<std::unique_ptr<Dispatcher>> dispatcher_storage_ ABSL_GUARDED_BY(dispatcher_mu_);
+
+    absl::Mutex pending_mu_;
+    std::queue<FuncCallState> pending_func_calls_ ABSL_GUARDED_BY(pending_mu_);
+
+    absl::Mutex discarded_mu_;
+    std::atomic<bool> has_discarded_func_calls_;
+    std::vector<protocol::FuncCall> discarded_func_calls_ ABSL_GUARDED_BY(discarded_mu_);
+    stat::Counter discarded_func_call_stat_ ABSL_GUARDED_BY(discarded_mu_);
+
+    // Statistics below are thread-safe themselves
+    std::atomic<int64_t> last_external_request_timestamp_;
+    stat::Counter incoming_external_requests_stat_;
+    stat::Counter incoming_internal_requests_stat_;
+    stat::StatisticsCollector<float> external_requests_instant_rps_stat_;
+    stat::StatisticsCollector<uint16_t> inflight_external_requests_stat_;
+    stat::StatisticsCollector<uint16_t> running_requests_stat_;
+
+    stat::StatisticsCollector<int32_t> message_delay_stat_;
+    stat::StatisticsCollector<int32_t> dispatch_overhead_stat_;
+
+    stat::Counter input_use_shm_stat_;
+    stat::Counter output_use_shm_stat_;
 
     void StartInternal() override;
     void StopInternal() override;
     void OnConnectionClose(server::ConnectionBase* connection) override;
 
-    void OnExternalFuncCall(const protocol::FuncCall& func_call, std::span<const char> input);
+    // deadline is absolute monotonic timestamp in microseconds, 0 if none
+    void OnExternalFuncCall(const protocol::FuncCall& func_call, std::span<const char> input,
+                            int64_t deadline);
     void OnRecvWorkerMessage(const protocol::FuncCall& func_call,
-                                 std::span<const char> payload, int32_t processing_time);
+                                 const utils::PayloadRef& payload, int32_t processing_time);
     void OnNewFuncCallCommon(std::shared_ptr<server::ConnectionBase> parent_connection,
                                  gateway::FuncCallContext* func_call_context);
     void FinishFuncCall(std::shared_ptr<server::ConnectionBase> parent_connection,
                             gateway::FuncCallContext* func_call_context);
 
+    // Output is passed along without copying if it is owned
     void ExternalFuncCallCompleted(const protocol::FuncCall& func_call,
-                                   std::span<const char> output, int32_t processing_time);
+                                   const utils::PayloadRef& output, int32_t processing_time);
     void ExternalFuncCallFailed(const protocol::FuncCall& func_call, int status_code = 0);
 
-    Dispatcher* GetOrCreateDispatcherLocked(uint16_t func_id) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
-    std::unique_ptr<ipc::ShmRegion> GrabExternalFuncCallShmInput(
-            const protocol::FuncCall& func_call) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    Shard* func_call_shard(const protocol::FuncCall& func_call) {
+        return &shards_[absl::Hash<uint64_t>()(func_call.full_call_id) % kNumShards];
+    }
+    Shard* connection_shard(int connection_id) {
+        return &shards_[gsl::narrow_cast<size_t>(connection_id) % kNumShards];
+    }
+    std::shared_ptr<server::ConnectionBase> GetHttpConnection(int connection_id);
+    // Called within IO workers for HTTP connections accepted by them
+    server::ConnectionBase* OnIOWorkerAccept(std::shared_ptr<server::ConnectionBase> connection);
+
+    void AddFuncCallShmInput(const protocol::FuncCall& func_call,
+                             std::unique_ptr<ipc::ShmRegion> input_region);
+    std::unique_ptr<ipc::ShmRegion> GrabFuncCallShmInput(const protocol::FuncCall& func_call);
+    // Returns nullptr on failure. The arena buffer is not released on
+    // destruction of the returned region, unless EnableRemoveOnDestruction()
+    // is called.
+    std::unique_ptr<ipc::ShmRegion> GetShmArenaPayload(const protocol::Message& message);
+    void AddCallerArenaInput(const protocol::FuncCall& func_call,
+                             const protocol::Message& message);
+    // Called when the nested call finishes, releases the arena buffer if
+    // its caller has exited
+    void RemoveCallerArenaInput(const protocol::FuncCall& func_call);
     void ProcessDiscardedFuncCallIfNecessary();
 
     DECLARE_UV_CONNECT_CB_FOR_CLASS(GatewayConnect);
     DECLARE_UV_CONNECTION_CB_FOR_CLASS(MessageConnection);
     DECLARE_UV_CONNECTION_CB_FOR_CLASS(HttpConnection);
+    DECLARE_UV_TIMER_CB_FOR_CLASS(Autoscale);
+    DECLARE_UV_TIMER_CB_FOR_CLASS(TracerFlush);
+    DECLARE_UV_TIMER_CB_FOR_CLASS(HandshakeTimeout);
 
     DISALLOW_COPY_AND_ASSIGN(Engine);
 };
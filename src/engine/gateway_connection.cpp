@@ -11,6 +11,10 @@ ABSL_FLAG(bool, gateway_conn_enable_nodelay, true,
           "Enable TCP_NODELAY for connections to gateway");
 ABSL_FLAG(bool, gateway_conn_enable_keepalive, true,
           "Enable TCP keep-alive for connections to gateway");
+ABSL_FLAG(int, gateway_conn_batch_flush_us, -1,
+          "If non-negative, messages to gateway sent within one event loop iteration are "
+          "coalesced into one write, which may wait up to this many microseconds for "
+          "more messages. Negative to write each message separately");
 
 namespace faas {
 namespace engine {
@@ -21,7 +25,10 @@ using protocol::NewEngineHandshakeGatewayMessage;
 GatewayConnection::GatewayConnection(Engine* engine, uint16_t conn_id)
     : server::ConnectionBase(kTypeId),
       engine_(engine), conn_id_(conn_id), state_(kCreated),
-      log_header_(fmt::format("GatewayConnection[{}]: ", conn_id)) {}
+      log_header_(fmt::format("GatewayConnection[{}]: ", conn_id)),
+      message_reader_(absl::bind_front(&GatewayConnection::OnRecvMessage, this)),
+      message_writer_(absl::GetFlag(FLAGS_gateway_conn_batch_flush_us),
+                      absl::bind_front(&GatewayConnection::OnWriteError, this)) {}
 
 GatewayConnection::~GatewayConnection() {
     DCHECK(state_ == kCreated || state_ == kClosed);
@@ -37,6 +44,8 @@ void GatewayConnection::Start(server::IOWorker* io_worker) {
     DCHECK_IN_EVENT_LOOP_THREAD(uv_tcp_handle_.loop);
     io_worker_ = io_worker;
     uv_tcp_handle_.data = this;
+    message_reader_.Start(io_worker_);
+    message_writer_.Start(io_worker_, UV_AS_STREAM(&uv_tcp_handle_));
     if (absl::GetFlag(FLAGS_gateway_conn_enable_nodelay)) {
         UV_DCHECK_OK(uv_tcp_nodelay(&uv_tcp_handle_, 1));
     }
@@ -60,6 +69,7 @@ void GatewayConnection::ScheduleClose() {
         return;
     }
     DCHECK(state_ == kHandshake || state_ == kRunning);
+    message_writer_.Stop();
     uv_close(UV_AS_HANDLE(&uv_tcp_handle_), &GatewayConnection::CloseCallback);
     state_ = kClosing;
 }
@@ -70,60 +80,41 @@ void GatewayConnection::SendMessage(const GatewayMessage& message, std::span<con
         HLOG(WARNING) << "GatewayConnection is closing or has closed, will not send this message";
         return;
     }
-    DCHECK_EQ(message.payload_size, gsl::narrow_cast<int32_t>(payload.size()));
-    size_t pos = 0;
-    while (pos < sizeof(GatewayMessage) + payload.size()) {
-        uv_buf_t buf;
-        io_worker_->NewWriteBuffer(&buf);
-        size_t write_size;
-        if (pos == 0) {
-            DCHECK(sizeof(GatewayMessage) <= buf.len);
-            memcpy(buf.base, &message, sizeof(GatewayMessage));
-            size_t copy_size = std::min(buf.len - sizeof(GatewayMessage), payload.size());
-            memcpy(buf.base + sizeof(GatewayMessage), payload.data(), copy_size);
-            write_size = sizeof(GatewayMessage) + copy_size;
-        } else {
-            size_t copy_size = std::min(buf.len, payload.size() + sizeof(GatewayMessage) - pos);
-            memcpy(buf.base, payload.data() + pos - sizeof(GatewayMessage), copy_size);
-            write_size = copy_size;
-        }
-        DCHECK_LE(write_size, buf.len);
-        buf.len = write_size;
-        uv_write_t* write_req = io_worker_->NewWriteRequest();
-        write_req->data = buf.base;
-        UV_DCHECK_OK(uv_write(write_req, UV_AS_STREAM(&uv_tcp_handle_),
-                              &buf, 1, &GatewayConnection::DataSentCallback));
-        pos += write_size;
-    }
+    message_writer_.Write(message, payload);
 }
 
-void GatewayConnection::ProcessGatewayMessages() {
+void GatewayConnection::SendMessage(const GatewayMessage& message,
+                                    const utils::PayloadRef& payload) {
     DCHECK_IN_EVENT_LOOP_THREAD(uv_tcp_handle_.loop);
-    while (read_buffer_.length() >= sizeof(GatewayMessage)) {
-        GatewayMessage* message = reinterpret_cast<GatewayMessage*>(read_buffer_.data());
-        size_t full_size = sizeof(GatewayMessage) + std::max<size_t>(0, message->payload_size);
-        if (read_buffer_.length() >= full_size) {
-            std::span<const char> payload(read_buffer_.data() + sizeof(GatewayMessage),
-                                          full_size - sizeof(GatewayMessage));
-            engine_->OnRecvGatewayMessage(this, *message, payload);
-            read_buffer_.ConsumeFront(full_size);
-        } else {
-            break;
-        }
+    if (state_ != kRunning) {
+        HLOG(WARNING) << "GatewayConnection is closing or has closed, will not send this message";
+        return;
+    }
+    message_writer_.Write(message, payload);
+}
+
+void GatewayConnection::OnRecvMessage(const GatewayMessage& message,
+                                      const utils::PayloadRef& payload) {
+    engine_->OnRecvGatewayMessage(this, message, payload.span());
+}
+
+void GatewayConnection::OnWriteError(int status) {
+    if (status == UV_ECANCELED || state_ != kRunning) {
+        // Pending writes are cancelled when the connection is closing
+        return;
     }
+    HLOG(ERROR) << "Failed to send data, will close this connection: "
+                << uv_strerror(status);
+    ScheduleClose();
 }
 
 UV_ALLOC_CB_FOR_CLASS(GatewayConnection, BufferAlloc) {
-    io_worker_->NewReadBuffer(suggested_size, buf);
+    message_reader_.NewReadBuffer(suggested_size, buf);
 }
 
 //Process the request that received from the gateway
 UV_READ_CB_FOR_CLASS(GatewayConnection, RecvData) {
-    auto reclaim_worker_resource = gsl::finally([this, buf] {
-        if (buf->base != 0) {
-            io_worker_->ReturnReadBuffer(buf);
-        }
-    });
+    message_reader_.OnRead(nread, buf);
     if (nread < 0) {
         if (nread == UV_EOF) {
             HLOG(INFO) << "Connection closed remotely";
@@ -132,13 +123,7 @@ UV_READ_CB_FOR_CLASS(GatewayConnection, RecvData) {
                         << uv_strerror(nread);
         }
         ScheduleClose();
-        return;
-    }
-    if (nread == 0) {
-        return;
     }
-    read_buffer_.AppendData(buf->base, nread);
-    ProcessGatewayMessages();
 }
 
 UV_WRITE_CB_FOR_CLASS(GatewayConnection, HandshakeSent) {
@@ -155,18 +140,6 @@ UV_WRITE_CB_FOR_CLASS(GatewayConnection, HandshakeSent) {
                                &GatewayConnection::RecvDataCallback));
 }
 
-UV_WRITE_CB_FOR_CLASS(GatewayConnection, DataSent) {
-    auto reclaim_worker_resource = gsl::finally([this, req] {
-        io_worker_->ReturnWriteBuffer(reinterpret_cast<char*>(req->data));
-        io_worker_->ReturnWriteRequest(req);
-    });
-    if (status != 0) {
-        HLOG(ERROR) << "Failed to send data, will close this connection: "
-                    << uv_strerror(status);
-        ScheduleClose();
-    }
-}
-
 UV_CLOSE_CB_FOR_CLASS(GatewayConnection, Close) {
     DCHECK(state_ == kClosing);
     state_ = kClosed;
@@ -4,9 +4,10 @@
 #include "common/uv.h"
 #include "common/protocol.h"
 #include "common/stat.h"
-#include "utils/appendable_buffer.h"
+#include "utils/payload_ref.h"
 #include "server/io_worker.h"
 #include "server/connection_base.h"
+#include "server/gateway_message_stream.h"
 
 namespace faas {
 namespace engine {
@@ -28,6 +29,10 @@ public:
 
     void SendMessage(const protocol::GatewayMessage& message,
                      std::span<const char> payload = std::span<const char>());
+    // Payload is written without copying if it is owned and no smaller than
+    // server::kGatewayZeroCopyPayloadThreshold, in which case its reference
+    // is held until the write finishes
+    void SendMessage(const protocol::GatewayMessage& message, const utils::PayloadRef& payload);
 
 private:
     enum State { kCreated, kHandshake, kRunning, kClosing, kClosed };
@@ -41,13 +46,16 @@ private:
     std::string log_header_;
 
     protocol::GatewayMessage handshake_message_;
-    utils::AppendableBuffer read_buffer_;
 
-    void ProcessGatewayMessages();
+    server::GatewayMessageReader message_reader_;
+    server::GatewayMessageWriter message_writer_;
+
+    void OnRecvMessage(const protocol::GatewayMessage& message,
+                       const utils::PayloadRef& payload);
+    void OnWriteError(int status);
 
     DECLARE_UV_ALLOC_CB_FOR_CLASS(BufferAlloc);
     DECLARE_UV_READ_CB_FOR_CLASS(RecvData);
-    DECLARE_UV_WRITE_CB_FOR_CLASS(DataSent);
     DECLARE_UV_WRITE_CB_FOR_CLASS(HandshakeSent);
     DECLARE_UV_CLOSE_CB_FOR_CLASS(Close);
 
@@ -1,6 +1,8 @@
 #include "engine/http_connection.h"
 
 #include "common/time.h"
+#include "common/http_deadline.h"
+#include "common/metrics.h"
 #include "engine/engine.h"
 
 #include <nlohmann/json.hpp>
@@ -294,6 +296,14 @@ void HttpConnection::OnNewHttpRequest(std::string_view method, std::string_view
     DCHECK_IN_EVENT_LOOP_THREAD(uv_tcp_handle_.loop);
     HVLOG(1) << "New HTTP request: " << method << " " << path;
 
+    if (method == "GET" && path == stat::MetricsRegistry::kHttpPath) {
+        admin_response_body_ = stat::MetricsRegistry::instance()->ExportPrometheusText();
+        SendHttpResponse(HttpStatus::OK,
+                         std::span<const char>(admin_response_body_.data(),
+                                               admin_response_body_.size()),
+                         stat::MetricsRegistry::kHttpContentType);
+        return;
+    }
     if (!(method == "GET" || method == "POST") || !absl::StartsWith(path, "/function/")) {
         SendHttpResponse(HttpStatus::NOT_FOUND);
         return;
@@ -307,6 +317,10 @@ void HttpConnection::OnNewHttpRequest(std::string_view method, std::string_view
 
     func_call_context_.Reset();
     func_call_context_.set_func_name(func_name);
+    int64_t deadline;
+    if (ReadDeadlineHttpHeader(headers_, &deadline)) {
+        func_call_context_.set_deadline(deadline);
+    }
     if (func_entry->qs_as_input) {
         if (body_buffer_.length() > 0) {
             HLOG(WARNING) << "Body not empty, but qsAsInput is set for func " << func_name;
@@ -326,22 +340,11 @@ void HttpConnection::OnFuncCallFinished(gateway::FuncCallContext* func_call_cont
         this, absl::bind_front(&HttpConnection::OnFuncCallFinishedInternal, this));
 }
 
-void HttpConnection::SendHttpResponse(HttpStatus status, std::span<const char> body) {
+void HttpConnection::SendHttpResponse(HttpStatus status, std::span<const char> body,
+                                      std::string_view content_type) {
     DCHECK_IN_EVENT_LOOP_THREAD(uv_tcp_handle_.loop);
-    response_header_ = fmt::format(
-        "HTTP/1.1 {}\r\n"
-        "Date: {}\r\n"
-        "Server: {}\r\n"
-        "Connection: Keep-Alive\r\n"
-        "Content-Type: {}\r\n"
-        "Content-Length: {}\r\n"
-        "\r\n",
-        GetHttpStatusString(status),
-        absl::FormatTime(absl::RFC1123_full, absl::Now(), absl::UTCTimeZone()),
-        kServerString,
-        kResponseContentType,
-        body.size()
-    );
+    io_worker_->http_header_cache()->BuildHeader(
+        status, content_type, /* keep_alive= */ true, body.size(), &response_header_);
     if (body.size() > 0) {
         uv_buf_t bufs[] = {
             { .base = const_cast<char*>(response_header_.data()), .len = response_header_.length() },
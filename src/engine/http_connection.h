@@ -19,7 +19,6 @@ class HttpConnection final : public server::ConnectionBase {
 public:
     static constexpr int kTypeId = 3;
 
-    static constexpr const char* kServerString = "FaaS/0.1";
     static constexpr const char* kResponseContentType = "text/plain";
 
     HttpConnection(Engine* engine, int connection_id);
@@ -57,6 +56,7 @@ private:
 
     // For response
     std::string response_header_;
+    std::string admin_response_body_;
     uv_write_t response_write_req_;
 
     void StartRecvData();
@@ -79,7 +79,8 @@ private:
     void ResetHttpParser();
     void OnNewHttpRequest(std::string_view method, std::string_view path,
                           std::string_view qs = std::string_view{});
-    void SendHttpResponse(HttpStatus status, std::span<const char> body = std::span<const char>());
+    void SendHttpResponse(HttpStatus status, std::span<const char> body = std::span<const char>(),
+                          std::string_view content_type = kResponseContentType);
     void OnFuncCallFinishedInternal();
 
     static int HttpParserOnMessageBeginCallback(http_parser* http_parser);
@@ -9,6 +9,10 @@
 #include <absl/flags/flag.h>
 
 ABSL_FLAG(bool, func_worker_pipe_direct_write, false, "");
+ABSL_FLAG(bool, message_conn_coalesce_writes, false,
+          "Coalesce messages written within one event loop iteration into a single write");
+ABSL_FLAG(int, message_conn_max_write_batch, 256,
+          "Maximum number of messages in one coalesced write");
 
 #define HLOG(l) LOG(l) << log_header_
 #define HVLOG(l) VLOG(l) << log_header_
@@ -23,8 +27,18 @@ using protocol::IsFuncWorkerHandshakeMessage;
 MessageConnection::MessageConnection(Engine* engine)
     : server::ConnectionBase(kTypeId), engine_(engine), io_worker_(nullptr),
       state_(kCreated), func_id_(0), client_id_(0), handshake_done_(false),
-      uv_handle_(nullptr), pipe_for_write_fd_(-1),
-      log_header_("MessageConnection[Handshaking]: ") {
+      uv_handle_(nullptr), pipe_for_write_fd_(-1), use_shm_queue_(false),
+      queue_retry_handles_inited_(false), queue_retry_scheduled_(false),
+      use_shm_arena_(false), retirable_(false),
+      log_header_("MessageConnection[Handshaking]: "),
+      coalesce_writes_(absl::GetFlag(FLAGS_message_conn_coalesce_writes)),
+      max_write_batch_size_(gsl::narrow_cast<size_t>(
+          std::max(1, absl::GetFlag(FLAGS_message_conn_max_write_batch)))),
+      write_batch_limit_(max_write_batch_size_),
+      write_batch_size_stat_(
+          stat::StatisticsCollector<uint16_t>::StandardReportCallback("message_write_batch_size")),
+      blocked_write_stat_(stat::Counter::StandardReportCallback("message_blocked_write")),
+      flush_scheduled_(false) {
 }
 
 MessageConnection::~MessageConnection() {
@@ -53,6 +67,11 @@ void MessageConnection::Start(server::IOWorker* io_worker) {
     DCHECK_IN_EVENT_LOOP_THREAD(uv_handle_->loop);
     io_worker_ = io_worker;
     uv_handle_->data = this;
+    if (coalesce_writes_) {
+        UV_DCHECK_OK(uv_check_init(uv_handle_->loop, &flush_check_handle_));
+        flush_check_handle_.data = this;
+        handle_scope_.AddHandle(&flush_check_handle_);
+    }
     UV_DCHECK_OK(uv_read_start(uv_handle_,
                                &MessageConnection::BufferAllocCallback,
                                &MessageConnection::ReadHandshakeCallback));
@@ -67,6 +86,13 @@ void MessageConnection::ScheduleClose() {
     }
     DCHECK(state_ == kHandshake || state_ == kRunning);
     handle_scope_.CloseHandle(uv_handle_);
+    if (coalesce_writes_) {
+        handle_scope_.CloseHandle(&flush_check_handle_);
+    }
+    if (queue_retry_handles_inited_) {
+        handle_scope_.CloseHandle(&queue_retry_check_handle_);
+        handle_scope_.CloseHandle(&queue_retry_timer_);
+    }
     if (client_id_ > 0 && !engine_->func_worker_use_engine_socket()) {
         handle_scope_.CloseHandle(&in_fifo_handle_);
         handle_scope_.CloseHandle(&out_fifo_handle_);
@@ -76,6 +102,10 @@ void MessageConnection::ScheduleClose() {
 
 void MessageConnection::SendPendingMessages() {
     DCHECK_IN_EVENT_LOOP_THREAD(uv_handle_->loop);
+    if (coalesce_writes_) {
+        absl::MutexLock lk(&write_message_mu_);
+        flush_scheduled_ = false;
+    }
     if (state_ == kHandshake) {
         return;
     }
@@ -83,6 +113,14 @@ void MessageConnection::SendPendingMessages() {
         HLOG(WARNING) << "MessageConnection is closing or has closed, will not send pending messages";
         return;
     }
+    if (use_shm_queue_) {
+        PushPendingMessagesToQueue();
+        return;
+    }
+    if (coalesce_writes_) {
+        FlushPendingMessages();
+        return;
+    }
     size_t write_size = 0;
     {
         absl::MutexLock lk(&write_message_mu_);
@@ -98,22 +136,147 @@ void MessageConnection::SendPendingMessages() {
     if (write_size == 0) {
         return;
     }
-    char* ptr = write_message_buffer_.data();
-    while (write_size > 0) {
+    WriteWithCopy(write_message_buffer_.data(), write_size);
+}
+
+void MessageConnection::FlushPendingMessages() {
+    DCHECK(write_batch_.empty());
+    {
+        absl::MutexLock lk(&write_message_mu_);
+        write_batch_.swap(pending_messages_);
+    }
+    if (write_batch_.empty()) {
+        return;
+    }
+    write_batch_size_stat_.AddSample(gsl::narrow_cast<uint16_t>(
+        std::min<size_t>(write_batch_.size(), std::numeric_limits<uint16_t>::max())));
+    const char* ptr = reinterpret_cast<const char*>(write_batch_.data());
+    size_t remaining_size = write_batch_.size() * sizeof(Message);
+    while (remaining_size > 0) {
+        size_t batch_size = std::min(remaining_size, write_batch_limit_ * sizeof(Message));
+        uv_buf_t buf = {
+            .base = const_cast<char*>(ptr),
+            .len = batch_size
+        };
+        // uv_try_write returns UV_EAGAIN if earlier writes are still queued,
+        // so message order is kept
+        int ret = uv_try_write(handle_for_write_message_, &buf, 1);
+        if (ret < 0 && ret != UV_EAGAIN) {
+            HLOG(ERROR) << "Failed to write messages, will close this connection: "
+                        << uv_strerror(ret);
+            write_batch_.clear();
+            ScheduleClose();
+            return;
+        }
+        size_t written_size = ret > 0 ? gsl::narrow_cast<size_t>(ret) : 0;
+        ptr += written_size;
+        remaining_size -= written_size;
+        if (written_size < batch_size) {
+            // The peer cannot keep up, use smaller writes from now on
+            write_batch_limit_ = std::max<size_t>(1, write_batch_limit_ / 2);
+            blocked_write_stat_.Tick();
+            break;
+        }
+        write_batch_limit_ = std::min(max_write_batch_size_, write_batch_limit_ * 2);
+    }
+    if (remaining_size > 0) {
+        WriteWithCopy(ptr, remaining_size);
+    }
+    write_batch_.clear();
+}
+
+void MessageConnection::WriteWithCopy(const char* data, size_t size) {
+    while (size > 0) {
         uv_buf_t buf;
         io_worker_->NewWriteBuffer(&buf);
-        size_t copy_size = std::min(buf.len, write_size);
-        memcpy(buf.base, ptr, copy_size);
+        size_t copy_size = std::min(buf.len, size);
+        memcpy(buf.base, data, copy_size);
         buf.len = copy_size;
         uv_write_t* write_req = io_worker_->NewWriteRequest();
         write_req->data = buf.base;
         UV_DCHECK_OK(uv_write(write_req, handle_for_write_message_,
                               &buf, 1, &MessageConnection::WriteMessageCallback));
-        write_size -= copy_size;
-        ptr += copy_size;
+        size -= copy_size;
+        data += copy_size;
+    }
+}
+
+void MessageConnection::PushPendingMessagesToQueue() {
+    DCHECK_IN_EVENT_LOOP_THREAD(uv_handle_->loop);
+    size_t num_remaining = 0;
+    {
+        absl::MutexLock lk(&write_message_mu_);
+        size_t num_pushed = 0;
+        while (num_pushed < pending_messages_.size()
+                 && input_queue_->Push(pending_messages_[num_pushed])) {
+            num_pushed++;
+        }
+        pending_messages_.erase(pending_messages_.begin(),
+                                pending_messages_.begin() + num_pushed);
+        num_remaining = pending_messages_.size();
+    }
+    if (num_remaining > 0 && !queue_retry_scheduled_) {
+        HLOG(WARNING) << fmt::format("Input queue is full, {} messages remain pending",
+                                     num_remaining);
+        if (!queue_retry_handles_inited_) {
+            UV_DCHECK_OK(uv_check_init(uv_handle_->loop, &queue_retry_check_handle_));
+            queue_retry_check_handle_.data = this;
+            handle_scope_.AddHandle(&queue_retry_check_handle_);
+            UV_DCHECK_OK(uv_timer_init(uv_handle_->loop, &queue_retry_timer_));
+            queue_retry_timer_.data = this;
+            handle_scope_.AddHandle(&queue_retry_timer_);
+            queue_retry_handles_inited_ = true;
+        }
+        UV_DCHECK_OK(uv_check_start(&queue_retry_check_handle_,
+                                    &MessageConnection::QueueRetryCheckCallback));
+        UV_DCHECK_OK(uv_timer_start(&queue_retry_timer_,
+                                    &MessageConnection::QueueRetryTimerCallback,
+                                    kQueueRetryIntervalMs, kQueueRetryIntervalMs));
+        queue_retry_scheduled_ = true;
+    } else if (num_remaining == 0 && queue_retry_scheduled_) {
+        UV_DCHECK_OK(uv_check_stop(&queue_retry_check_handle_));
+        UV_DCHECK_OK(uv_timer_stop(&queue_retry_timer_));
+        queue_retry_scheduled_ = false;
+    }
+}
+
+void MessageConnection::DrainOutputQueue() {
+    DCHECK_IN_EVENT_LOOP_THREAD(uv_handle_->loop);
+    Message message;
+    do {
+        while (output_queue_->Pop(&message)) {
+            server::ScopedMessagePerf perf(io_worker_->perf_counters(), message.func_id);
+            engine_->OnRecvMessage(this, message);
+        }
+    } while (!output_queue_->ConsumerEnterSleep());
+    bool has_pending_messages = false;
+    {
+        absl::MutexLock lk(&write_message_mu_);
+        has_pending_messages = !pending_messages_.empty();
+    }
+    if (has_pending_messages && state_ == kRunning) {
+        PushPendingMessagesToQueue();
     }
 }
 
+bool MessageConnection::SetupShmQueues(int in_fifo_fd) {
+    output_queue_ = engine_->worker_manager()->GrabFuncWorkerOutputQueue(client_id_);
+    if (output_queue_ == nullptr) {
+        return false;
+    }
+    auto input_queue = ipc::SPSCQueue<Message>::Open(
+        ipc::GetFuncWorkerInputQueueName(client_id_));
+    input_queue->SetWakeupConsumerFn([in_fifo_fd] () {
+        char doorbell = 0;
+        if (write(in_fifo_fd, &doorbell, 1) != 1) {
+            PLOG(ERROR) << "Failed to wake up func worker";
+        }
+    });
+    absl::MutexLock lk(&write_message_mu_);
+    input_queue_ = std::move(input_queue);
+    return true;
+}
+
 void MessageConnection::OnAllHandlesClosed() {
     DCHECK(state_ == kClosing);
     state_ = kClosed;
@@ -135,6 +298,14 @@ void MessageConnection::RecvHandshakeMessage() {
     } else {
         HLOG(FATAL) << "Unknown handshake message type";
     }
+    use_shm_queue_ = IsFuncWorkerHandshakeMessage(*message)
+                       && engine_->func_worker_use_shm_queue()
+                       && (message->flags & protocol::kFuncWorkerUseShmQueueFlag) != 0;
+    use_shm_arena_ = IsFuncWorkerHandshakeMessage(*message)
+                       && engine_->shm_arena() != nullptr
+                       && (message->flags & protocol::kShmArenaEnabledFlag) != 0;
+    retirable_ = IsFuncWorkerHandshakeMessage(*message)
+                   && (message->flags & protocol::kFuncWorkerRetirableFlag) != 0;
     std::span<const char> payload;
     if (!engine_->OnNewHandshake(this, *message, &handshake_response_, &payload)) {
         ScheduleClose();
@@ -171,6 +342,11 @@ void MessageConnection::RecvHandshakeMessage() {
             }
             UV_DCHECK_OK(uv_pipe_open(&out_fifo_handle_, out_fifo_fd));
             handle_scope_.AddHandle(&out_fifo_handle_);
+            if (use_shm_queue_ && !SetupShmQueues(in_fifo_fd)) {
+                HLOG(ERROR) << "Failed to setup shared memory queues";
+                ScheduleClose();
+                return;
+            }
             // Use FIFOs for sending and receiving messages
             handle_for_read_message_ = UV_AS_STREAM(&out_fifo_handle_);
             handle_for_write_message_ = UV_AS_STREAM(&in_fifo_handle_);
@@ -205,7 +381,14 @@ void MessageConnection::RecvHandshakeMessage() {
 }
 
 void MessageConnection::WriteMessage(const Message& message) {
-    if (is_func_worker_connection()
+    if (use_shm_queue_) {
+        absl::MutexLock lk(&write_message_mu_);
+        if (input_queue_ != nullptr && pending_messages_.empty()
+              && input_queue_->Push(message)) {
+            return;
+        }
+    }
+    if (is_func_worker_connection() && !use_shm_queue_
           && absl::GetFlag(FLAGS_func_worker_pipe_direct_write)
           && !engine_->func_worker_use_engine_socket()) {
         int fd = pipe_for_write_fd_.load();
@@ -224,9 +407,25 @@ void MessageConnection::WriteMessage(const Message& message) {
         }
         HLOG(INFO) << "Fallback to original WriteMessage";
     }
+    bool need_flush = true;
     {
         absl::MutexLock lk(&write_message_mu_);
         pending_messages_.push_back(message);
+        if (coalesce_writes_) {
+            // Only the first message since last flush needs to schedule one
+            need_flush = !flush_scheduled_;
+            flush_scheduled_ = true;
+        }
+    }
+    if (!need_flush) {
+        return;
+    }
+    if (coalesce_writes_ && uv::WithinEventLoop(uv_handle_->loop)
+          && (state_ == kHandshake || state_ == kRunning)) {
+        // Flush at the end of current event loop iteration
+        UV_DCHECK_OK(uv_check_start(&flush_check_handle_,
+                                    &MessageConnection::FlushCheckCallback));
+        return;
     }
     io_worker_->ScheduleFunction(
         this, absl::bind_front(&MessageConnection::SendPendingMessages, this));
@@ -294,9 +493,15 @@ UV_READ_CB_FOR_CLASS(MessageConnection, ReadMessage) {
     if (nread == 0) {
         return;
     }
+    if (use_shm_queue_) {
+        // Bytes read from the FIFO are only doorbells
+        DrainOutputQueue();
+        return;
+    }
     utils::ReadMessages<Message>(
         &message_buffer_, buf->base, nread,
         [this] (Message* message) {
+            server::ScopedMessagePerf perf(io_worker_->perf_counters(), message->func_id);
             engine_->OnRecvMessage(this, *message);
         });
 }
@@ -313,5 +518,22 @@ UV_WRITE_CB_FOR_CLASS(MessageConnection, WriteMessage) {
     }
 }
 
+UV_CHECK_CB_FOR_CLASS(MessageConnection, FlushCheck) {
+    UV_DCHECK_OK(uv_check_stop(&flush_check_handle_));
+    SendPendingMessages();
+}
+
+UV_CHECK_CB_FOR_CLASS(MessageConnection, QueueRetryCheck) {
+    if (state_ == kRunning) {
+        PushPendingMessagesToQueue();
+    }
+}
+
+UV_TIMER_CB_FOR_CLASS(MessageConnection, QueueRetryTimer) {
+    if (state_ == kRunning) {
+        PushPendingMessagesToQueue();
+    }
+}
+
 }  // namespace engine
 }  // namespace faas
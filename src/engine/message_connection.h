@@ -4,6 +4,7 @@
 #include "common/uv.h"
 #include "common/protocol.h"
 #include "common/stat.h"
+#include "ipc/spsc_queue.h"
 #include "utils/appendable_buffer.h"
 #include "utils/object_pool.h"
 #include "server/io_worker.h"
@@ -17,6 +18,7 @@ class Engine;
 class MessageConnection final : public server::ConnectionBase {
 public:
     static constexpr int kTypeId = 1;
+    static constexpr int kQueueRetryIntervalMs = 1;
 
     explicit MessageConnection(Engine* engine);
     ~MessageConnection();
@@ -26,6 +28,10 @@ public:
     bool handshake_done() const { return handshake_done_; }
     bool is_launcher_connection() const { return client_id_ == 0; }
     bool is_func_worker_connection() const { return client_id_ > 0; }
+    bool use_shm_queue() const { return use_shm_queue_; }
+    bool use_shm_arena() const { return use_shm_arena_; }
+    bool retirable() const { return retirable_; }
+    server::IOWorker* io_worker() const { return io_worker_; }
 
     uv_stream_t* InitUVHandle(uv_loop_t* uv_loop) override;
     void Start(server::IOWorker* io_worker) override;
@@ -52,18 +58,54 @@ private:
     uv::HandleScope handle_scope_;
     std::atomic<int> pipe_for_write_fd_;
 
+    // When use_shm_queue_ is set, messages go through shared memory queues,
+    // and FIFOs only carry wakeup signals for sleeping consumers
+    bool use_shm_queue_;
+    std::unique_ptr<ipc::SPSCQueue<protocol::Message>> output_queue_;
+    // Messages left pending by a full input_queue_ are pushed again at the
+    // end of every event loop iteration, and every kQueueRetryIntervalMs in
+    // case the event loop is otherwise idle. Handles are initialized once
+    // the queue is first found full.
+    bool queue_retry_handles_inited_;
+    bool queue_retry_scheduled_;
+    uv_check_t queue_retry_check_handle_;
+    uv_timer_t queue_retry_timer_;
+    // Set if the func worker can handle payloads in engine's shm arena
+    bool use_shm_arena_;
+    // Set if the func worker exits gracefully on RETIRE_FUNC_WORKER
+    bool retirable_;
+
     std::string log_header_;
 
     utils::AppendableBuffer message_buffer_;
     protocol::Message handshake_response_;
     utils::AppendableBuffer write_message_buffer_;
 
+    // When coalesce_writes_ is set, messages queued within one event loop
+    // iteration are written out together with uv_try_write, where the number
+    // of messages per write adapts to how much the peer can take
+    bool coalesce_writes_;
+    uv_check_t flush_check_handle_;
+    size_t max_write_batch_size_;
+    size_t write_batch_limit_;
+    absl::InlinedVector<protocol::Message, 16> write_batch_;
+    stat::StatisticsCollector<uint16_t> write_batch_size_stat_;
+    stat::Counter blocked_write_stat_;
+
     absl::Mutex write_message_mu_;
     absl::InlinedVector<protocol::Message, 16>
         pending_messages_ ABSL_GUARDED_BY(write_message_mu_);
+    std::unique_ptr<ipc::SPSCQueue<protocol::Message>>
+        input_queue_ ABSL_GUARDED_BY(write_message_mu_);
+    bool flush_scheduled_ ABSL_GUARDED_BY(write_message_mu_);
 
     void RecvHandshakeMessage();
+    bool SetupShmQueues(int in_fifo_fd);
     void SendPendingMessages();
+    void FlushPendingMessages();
+    void WriteWithCopy(const char* data, size_t size);
+    void PushPendingMessagesToQueue();
+    void DrainOutputQueue();
     void OnAllHandlesClosed();
 
     DECLARE_UV_ALLOC_CB_FOR_CLASS(BufferAlloc);
@@ -71,6 +113,9 @@ private:
     DECLARE_UV_WRITE_CB_FOR_CLASS(WriteHandshakeResponse);
     DECLARE_UV_READ_CB_FOR_CLASS(ReadMessage);
     DECLARE_UV_WRITE_CB_FOR_CLASS(WriteMessage);
+    DECLARE_UV_CHECK_CB_FOR_CLASS(FlushCheck);
+    DECLARE_UV_CHECK_CB_FOR_CLASS(QueueRetryCheck);
+    DECLARE_UV_TIMER_CB_FOR_CLASS(QueueRetryTimer);
 
     DISALLOW_COPY_AND_ASSIGN(MessageConnection);
 };
@@ -1,6 +1,7 @@
 #include "engine/monitor.h"
 
 #include "common/time.h"
+#include "common/metrics.h"
 #include "utils/docker.h"
 #include "utils/procfs.h"
 #include "engine/engine.h"
@@ -60,6 +61,14 @@ void Monitor::OnNewFuncContainer(uint16_t func_id, std::string_view container_id
     func_container_ids_[func_id] = std::string(container_id);
 }
 
+float Monitor::GetFuncCpuUsage(uint16_t func_id) {
+    absl::MutexLock lk(&mu_);
+    if (!func_cpu_usages_.contains(func_id)) {
+        return -1;
+    }
+    return func_cpu_usages_[func_id];
+}
+
 namespace {
 static float compute_rate(int64_t timestamp1, int64_t value1, int64_t timestamp2, int64_t value2) {
     return gsl::narrow_cast<float>(value2 - value1) / gsl::narrow_cast<float>(timestamp2 - timestamp1);
@@ -92,6 +101,7 @@ void Monitor::BackgroundThreadMain() {
 
     absl::flat_hash_map</* container_id */ std::string, docker_utils::ContainerStat> container_stats;
     absl::flat_hash_map</* io_worker_tid */ int, procfs_utils::ThreadStat> io_thread_stats;
+    stat::MetricsRegistry* metrics = stat::MetricsRegistry::instance();
 
     while (true) {
         uint64_t exp;
@@ -105,6 +115,9 @@ void Monitor::BackgroundThreadMain() {
         } else if (exp > 1) {
             HLOG(WARNING) << "timerfd expires more than once";
         }
+        if (state_.load() == kStopping) {
+            break;
+        }
 
         std::vector<std::pair</* func_id */ int, /* container_id */ std::string>> container_ids;
         if (self_container_id_ != docker_utils::kInvalidContainerId) {
@@ -123,6 +136,7 @@ void Monitor::BackgroundThreadMain() {
             }
         }
 
+        std::vector<std::pair</* func_id */ uint16_t, /* load_usage */ float>> func_load_usages;
         float total_load_usage = 0;
         float total_user_load_stat = 0;
         float total_sys_load_stat = 0;
@@ -147,6 +161,14 @@ void Monitor::BackgroundThreadMain() {
             float sys_load_stat = compute_rate(
                 last_stat.timestamp, tick_to_ns(last_stat.cpu_stat_sys),
                 stat.timestamp, tick_to_ns(stat.cpu_stat_sys));
+            std::string container_name = (entry.first == -1) ? "gateway"
+                                                              : fmt::format("{}", entry.first);
+            metrics->UpdateGauge(fmt::format("container_load_usage[{}]", container_name),
+                                 load_usage);
+            metrics->UpdateGauge(fmt::format("container_user_load[{}]", container_name),
+                                 user_load_stat);
+            metrics->UpdateGauge(fmt::format("container_sys_load[{}]", container_name),
+                                 sys_load_stat);
             if (entry.first == -1) {
                 HLOG(INFO) << fmt::format(
                     "Gateway load: usage={}, user_stat={}, sys_stat={}",
@@ -155,6 +177,8 @@ void Monitor::BackgroundThreadMain() {
                 HLOG(INFO) << fmt::format(
                     "FuncContainer[{}] load: usage={}, user_stat={}, sys_stat={}",
                     entry.first, load_usage, user_load_stat, sys_load_stat);
+                func_load_usages.push_back(
+                    std::make_pair(gsl::narrow_cast<uint16_t>(entry.first), load_usage));
             }
             total_load_usage += load_usage;
             total_user_load_stat += user_load_stat;
@@ -164,6 +188,15 @@ void Monitor::BackgroundThreadMain() {
         HLOG(INFO) << fmt::format(
             "Total load: usage={}, user_stat={}, sys_stat={}",
             total_load_usage, total_user_load_stat, total_sys_load_stat);
+        metrics->UpdateGauge("total_load_usage", total_load_usage);
+        metrics->UpdateGauge("total_user_load", total_user_load_stat);
+        metrics->UpdateGauge("total_sys_load", total_sys_load_stat);
+        {
+            absl::MutexLock lk(&mu_);
+            for (const auto& entry : func_load_usages) {
+                func_cpu_usages_[entry.first] = entry.second;
+            }
+        }
 
         for (const auto& entry : io_workers) {
             std::string worker_name = entry.first;
@@ -186,6 +219,10 @@ void Monitor::BackgroundThreadMain() {
                 stat.timestamp, tick_to_ns(stat.cpu_stat_sys));
             HLOG(INFO) << fmt::format("IOWorker[{}] load: user_stat={}, sys_stat={}",
                                       worker_name, user_load_stat, sys_load_stat);
+            metrics->UpdateGauge(fmt::format("io_worker_user_load[{}]", worker_name),
+                                 user_load_stat);
+            metrics->UpdateGauge(fmt::format("io_worker_sys_load[{}]", worker_name),
+                                 sys_load_stat);
             float voluntary_ctxt_switches_rate = compute_rate(
                 last_stat.timestamp, last_stat.voluntary_ctxt_switches,
                 stat.timestamp, stat.voluntary_ctxt_switches) * 1e6;
@@ -195,10 +232,17 @@ void Monitor::BackgroundThreadMain() {
             HLOG(INFO) << fmt::format("IOWorker[{}] ctxt_switches_rate: voluntary={}, nonvoluntary={}",
                                       worker_name, voluntary_ctxt_switches_rate,
                                       nonvoluntary_ctxt_switches_rate);
+            metrics->UpdateGauge(
+                fmt::format("io_worker_voluntary_ctxt_switches_rate[{}]", worker_name),
+                voluntary_ctxt_switches_rate);
+            metrics->UpdateGauge(
+                fmt::format("io_worker_nonvoluntary_ctxt_switches_rate[{}]", worker_name),
+                nonvoluntary_ctxt_switches_rate);
             io_thread_stats[tid] = std::move(stat);
         }
     }
 
+    close(timer_fd);
     state_.store(kStopped);
 }
 
@@ -25,6 +25,10 @@ public:
     void OnIOWorkerCreated(std::string_view worker_name, int event_loop_thread_tid);
     void OnNewFuncContainer(uint16_t func_id, std::string_view container_id);
 
+    // Number of CPU cores used by the function container in the last
+    // monitoring interval, negative if unknown
+    float GetFuncCpuUsage(uint16_t func_id);
+
 private:
     enum State { kCreated, kRunning, kStopping, kStopped };
     std::atomic<State> state_;
@@ -38,6 +42,8 @@ private:
         io_workers_ ABSL_GUARDED_BY(mu_);
     absl::flat_hash_map</* func_id */ uint16_t, std::string>
         func_container_ids_ ABSL_GUARDED_BY(mu_);
+    absl::flat_hash_map</* func_id */ uint16_t, float>
+        func_cpu_usages_ ABSL_GUARDED_BY(mu_);
 
     void BackgroundThreadMain();
 
@@ -2,6 +2,7 @@
 
 #include "engine/engine.h"
 #include "engine/worker_manager.h"
+#include "common/span_recorder.h"
 
 #include <absl/flags/flag.h>
 
@@ -18,12 +19,27 @@ namespace engine {
 using protocol::FuncCall;
 using protocol::FuncCallDebugString;
 
+namespace {
+inline size_t FuncCallSlotIndex(uint64_t full_call_id) {
+    // Fibonacci hashing spreads sequential call_ids over slots
+    return static_cast<size_t>((full_call_id * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+}  // namespace
+
 Tracer::Tracer(Engine* engine)
     : engine_(engine),
+      func_call_slots_(new FuncCallInfo[kNumFuncCallSlots]),
+      num_overflow_func_call_infos_(0),
       dispatch_delay_stat_(
           stat::StatisticsCollector<int32_t>::StandardReportCallback("dispatch_delay")),
       dispatch_overhead_stat_(
           stat::StatisticsCollector<int32_t>::StandardReportCallback("dispatch_overhead")) {
+    static_assert((kNumFuncCallSlots & (kNumFuncCallSlots - 1)) == 0,
+                  "kNumFuncCallSlots must be power of 2");
+    for (size_t i = 0; i < kNumFuncCallSlots; i++) {
+        func_call_slots_[i].slot_tag.store(0, std::memory_order_relaxed);
+        func_call_slots_[i].generation.store(0, std::memory_order_relaxed);
+    }
     for (int i = 0; i < protocol::kMaxFuncId; i++) {
         per_func_stats_[i] = nullptr;
     }
@@ -45,59 +61,166 @@ void Tracer::Init() {
     }
 }
 
-Tracer::FuncCallInfo* Tracer::OnNewFuncCall(const FuncCall& func_call,
-                                            const FuncCall& parent_func_call, size_t input_size) {
-    int64_t current_timestamp = GetMonotonicMicroTimestamp();
-    FuncCallInfo* info;
+Tracer::FuncCallInfo* Tracer::NewFuncCallInfo(const FuncCall& func_call) {
+    uint64_t full_call_id = func_call.full_call_id;
+    if (full_call_id == 0) {
+        HLOG(WARNING) << "Invalid FuncCall: " << FuncCallDebugString(func_call);
+        return nullptr;
+    }
+    if (FindFuncCallInfo(func_call) != nullptr) {
+        HLOG(WARNING) << "FuncCall already exists: " << FuncCallDebugString(func_call);
+        return nullptr;
+    }
+    FuncCallInfo* info = nullptr;
+    size_t base = FuncCallSlotIndex(full_call_id);
+    for (size_t i = 0; i < kMaxSlotProbes; i++) {
+        FuncCallInfo* slot = &func_call_slots_[(base + i) & (kNumFuncCallSlots - 1)];
+        uint64_t expected = 0;
+        // Slot is reserved, and published after initialized
+        if (slot->slot_tag.compare_exchange_strong(expected, kReservedSlotTag,
+                                                   std::memory_order_acq_rel)) {
+            info = slot;
+            break;
+        }
+    }
+    if (info == nullptr) {
+        HVLOG(1) << "No free slot for FuncCall " << FuncCallDebugString(func_call);
+        absl::MutexLock lk(&mu_);
+        info = func_call_info_pool_.Get();
+        info->slot_tag.store(kReservedSlotTag, std::memory_order_relaxed);
+    }
+    // Child func calls holding this FuncCallInfo for the previous func call
+    // check generation before and after touching it, in the way of seqlock
+    uint32_t generation = info->generation.load(std::memory_order_relaxed) + 1;
+    info->generation.store(generation, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    info->queuing_delay_state.store(uint64_t{generation} << 32, std::memory_order_relaxed);
+    return info;
+}
+
+void Tracer::PublishFuncCallInfo(FuncCallInfo* info, uint64_t full_call_id) {
+    if (IsSlotFuncCallInfo(info)) {
+        info->slot_tag.store(full_call_id, std::memory_order_release);
+        return;
+    }
+    absl::MutexLock lk(&mu_);
+    info->slot_tag.store(full_call_id, std::memory_order_relaxed);
+    overflow_func_call_infos_[full_call_id] = info;
+    num_overflow_func_call_infos_.fetch_add(1, std::memory_order_release);
+}
 
-    {
+bool Tracer::IsSlotFuncCallInfo(const FuncCallInfo* info) const {
+    return info >= func_call_slots_.get() && info < func_call_slots_.get() + kNumFuncCallSlots;
+}
+
+bool Tracer::AddQueuingDelay(FuncCallInfo* info, uint32_t generation, int32_t delay) {
+    uint64_t state = info->queuing_delay_state.load(std::memory_order_relaxed);
+    while (true) {
+        if (static_cast<uint32_t>(state >> 32) != generation) {
+            return false;
+        }
+        uint32_t total = static_cast<uint32_t>(state) + static_cast<uint32_t>(delay);
+        uint64_t new_state = (uint64_t{generation} << 32) | total;
+        if (info->queuing_delay_state.compare_exchange_weak(state, new_state,
+                                                            std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+Tracer::FuncCallInfo* Tracer::FindFuncCallInfo(const FuncCall& func_call,
+                                               uint32_t* generation) {
+    uint64_t full_call_id = func_call.full_call_id;
+    if (full_call_id == 0) {
+        return nullptr;
+    }
+    size_t base = FuncCallSlotIndex(full_call_id);
+    for (size_t i = 0; i < kMaxSlotProbes; i++) {
+        FuncCallInfo* info = &func_call_slots_[(base + i) & (kNumFuncCallSlots - 1)];
+        uint32_t info_generation = info->generation.load(std::memory_order_acquire);
+        if (info->slot_tag.load(std::memory_order_acquire) == full_call_id) {
+            if (generation != nullptr) {
+                *generation = info_generation;
+            }
+            return info;
+        }
+    }
+    if (num_overflow_func_call_infos_.load(std::memory_order_acquire) > 0) {
         absl::MutexLock lk(&mu_);
-        if (func_call_infos_.contains(func_call.full_call_id)) {
-            HLOG(WARNING) << "FuncCall already exists: " << FuncCallDebugString(func_call);
-            return nullptr;
+        if (overflow_func_call_infos_.contains(full_call_id)) {
+            FuncCallInfo* info = overflow_func_call_infos_[full_call_id];
+            if (generation != nullptr) {
+                *generation = info->generation.load(std::memory_order_relaxed);
+            }
+            return info;
         }
-        info = func_call_info_pool_.Get();
-        func_call_infos_[func_call.full_call_id] = info;
     }
+    return nullptr;
+}
 
-    {
-        absl::MutexLock lk(&info->mu);
-        info->state = FuncCallState::kReceived;
-        info->func_call = func_call;
-        info->parent_func_call = parent_func_call;
-        info->input_size = input_size;
-        info->output_size = 0;
-        info->recv_timestamp = current_timestamp;
-        info->dispatch_timestamp = 0;
-        info->finish_timestamp = 0;
-        info->assigned_worker = 0;
-        info->processing_time = 0;
-        info->total_queuing_delay = 0;
+Tracer::FuncCallInfo* Tracer::OnNewFuncCall(const FuncCall& func_call,
+                                            const FuncCall& parent_func_call, size_t input_size,
+                                            int64_t deadline) {
+    int64_t current_timestamp = GetMonotonicMicroTimestamp();
+    FuncCallInfo* info = NewFuncCallInfo(func_call);
+    if (info == nullptr) {
+        return nullptr;
+    }
+    tracing::BeginSpan(func_call.full_call_id, tracing::Span::kEngineCall);
+    tracing::BeginSpan(func_call.full_call_id, tracing::Span::kEngineQueueing);
+    info->state = FuncCallState::kReceived;
+    info->func_call = func_call;
+    info->parent_func_call = parent_func_call;
+    info->input_size = input_size;
+    info->output_size = 0;
+    info->recv_timestamp = current_timestamp;
+    info->dispatch_timestamp = 0;
+    info->finish_timestamp = 0;
+    info->assigned_worker = 0;
+    info->processing_time = 0;
+    info->dispatch_delay = 0;
+    if (deadline == 0 && parent_func_call.full_call_id != protocol::kInvalidFuncCall.full_call_id) {
+        uint32_t parent_generation;
+        FuncCallInfo* parent_info = FindFuncCallInfo(parent_func_call, &parent_generation);
+        if (parent_info != nullptr) {
+            int64_t parent_deadline = parent_info->deadline.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // Otherwise parent has finished, and its slot is taken by another func call
+            if (parent_info->generation.load(std::memory_order_relaxed) == parent_generation) {
+                deadline = parent_deadline;
+            }
+        }
     }
+    info->deadline.store(deadline, std::memory_order_relaxed);
+    PublishFuncCallInfo(info, func_call.full_call_id);
 
     uint16_t func_id = func_call.func_id;
     DCHECK_LT(func_id, protocol::kMaxFuncId);
     DCHECK(per_func_stats_[func_id] != nullptr);
     PerFuncStatistics* per_func_stat = per_func_stats_[func_id];
-    {
-        absl::MutexLock lk(&per_func_stat->mu);
-        int64_t current_timestamp = GetMonotonicMicroTimestamp();
-        if (current_timestamp <= per_func_stat->last_request_timestamp) {
-            current_timestamp = per_func_stat->last_request_timestamp + 1;
-        }
-        if (per_func_stat->last_request_timestamp != -1) {
-            double instant_rps = gsl::narrow_cast<double>(
-                1e6 / (current_timestamp - per_func_stat->last_request_timestamp));
-            per_func_stat->instant_rps_stat.AddSample(instant_rps);
-            per_func_stat->instant_rps_ema.AddSample(current_timestamp, instant_rps);
-        }
-        per_func_stat->last_request_timestamp = current_timestamp;
-        per_func_stat->inflight_requests++;
-        per_func_stat->inflight_requests_stat.AddSample(
-            gsl::narrow_cast<uint16_t>(per_func_stat->inflight_requests));
-        per_func_stat->incoming_requests_stat.Tick();
-        per_func_stat->input_size_stat.AddSample(gsl::narrow_cast<uint32_t>(input_size));
+    // Request timestamps of the same function are kept strictly increasing
+    int64_t last_request_timestamp = per_func_stat->last_request_timestamp.load(
+        std::memory_order_relaxed);
+    int64_t request_timestamp;
+    do {
+        request_timestamp = std::max(current_timestamp, last_request_timestamp + 1);
+    } while (!per_func_stat->last_request_timestamp.compare_exchange_weak(
+                 last_request_timestamp, request_timestamp, std::memory_order_relaxed));
+    int inflight_requests = per_func_stat->inflight_requests.fetch_add(
+        1, std::memory_order_relaxed) + 1;
+
+    LocalStatistics* local_stat = GetLocalStatistics();
+    absl::MutexLock lk(&local_stat->mu);
+    LocalFuncStatistics* local_func_stat = GetLocalFuncStatistics(local_stat, func_id);
+    if (last_request_timestamp != -1) {
+        local_func_stat->instant_rps.push_back(gsl::narrow_cast<float>(
+            1e6 / (request_timestamp - last_request_timestamp)));
+        local_func_stat->instant_rps_timestamps.push_back(request_timestamp);
     }
+    local_func_stat->inflight_requests.push_back(gsl::narrow_cast<uint16_t>(inflight_requests));
+    local_func_stat->incoming_requests++;
+    local_func_stat->input_size.push_back(gsl::narrow_cast<uint32_t>(input_size));
+    SampleAdded(local_stat, current_timestamp);
 
     return info;
 }
@@ -105,33 +228,24 @@ Tracer::FuncCallInfo* Tracer::OnNewFuncCall(const FuncCall& func_call,
 Tracer::FuncCallInfo* Tracer::OnFuncCallDispatched(const protocol::FuncCall& func_call,
                                                    FuncWorker* func_worker) {
     int64_t current_timestamp = GetMonotonicMicroTimestamp();
-    FuncCallInfo* info;
-
-    {
-        absl::MutexLock lk(&mu_);
-        if (!func_call_infos_.contains(func_call.full_call_id)) {
-            HLOG(WARNING) << "Cannot find FuncCall: " << FuncCallDebugString(func_call);
-            return nullptr;
-        }
-        info = func_call_infos_[func_call.full_call_id];
+    FuncCallInfo* info = FindFuncCallInfo(func_call);
+    if (info == nullptr) {
+        HLOG(WARNING) << "Cannot find FuncCall: " << FuncCallDebugString(func_call);
+        return nullptr;
     }
+    tracing::EndSpan(func_call.full_call_id, tracing::Span::kEngineQueueing);
 
-    int32_t queueing_delay = 0;
-    {
-        absl::MutexLock lk(&info->mu);
-        info->state = FuncCallState::kDispatched;
-        info->dispatch_timestamp = current_timestamp;
-        info->assigned_worker = func_worker->client_id();
-        queueing_delay = gsl::narrow_cast<int32_t>(current_timestamp - info->recv_timestamp);
-        info->total_queuing_delay += queueing_delay;
-    }
+    info->state = FuncCallState::kDispatched;
+    info->dispatch_timestamp = current_timestamp;
+    info->assigned_worker = func_worker->client_id();
+    int32_t queueing_delay = gsl::narrow_cast<int32_t>(current_timestamp - info->recv_timestamp);
+    AddQueuingDelay(info, info->generation.load(std::memory_order_relaxed), queueing_delay);
 
-    PerFuncStatistics* per_func_stat = per_func_stats_[func_call.func_id];
-    {
-        absl::MutexLock lk(&per_func_stat->mu);
-        absl::ReaderMutexLock info_lk(&info->mu);
-        per_func_stat->queueing_delay_stat.AddSample(queueing_delay);
-    }
+    LocalStatistics* local_stat = GetLocalStatistics();
+    absl::MutexLock lk(&local_stat->mu);
+    LocalFuncStatistics* local_func_stat = GetLocalFuncStatistics(local_stat, func_call.func_id);
+    local_func_stat->queueing_delay.push_back(queueing_delay);
+    SampleAdded(local_stat, current_timestamp);
 
     return info;
 }
@@ -140,164 +254,280 @@ Tracer::FuncCallInfo* Tracer::OnFuncCallCompleted(const FuncCall& func_call,
                                                   int32_t processing_time, int32_t dispatch_delay,
                                                   size_t output_size) {
     int64_t current_timestamp = GetMonotonicMicroTimestamp();
-    FuncCallInfo* info;
-    FuncCallInfo* parent_info = nullptr;
-
-    {
-        absl::MutexLock lk(&mu_);
-        if (!func_call_infos_.contains(func_call.full_call_id)) {
-            HLOG(WARNING) << "Cannot find FuncCall: " << FuncCallDebugString(func_call);
-            return nullptr;
-        }
-        info = func_call_infos_[func_call.full_call_id];
-        absl::ReaderMutexLock info_lk(&info->mu);
-        dispatch_overhead_stat_.AddSample(gsl::narrow_cast<int32_t>(
-            current_timestamp - info->dispatch_timestamp - processing_time));
-        dispatch_delay_stat_.AddSample(dispatch_delay);
-        if (func_call_infos_.contains(info->parent_func_call.full_call_id)) {
-            parent_info = func_call_infos_[info->parent_func_call.full_call_id];
-        }
-    }
-
-    int32_t total_queuing_delay;
-    {
-        absl::MutexLock lk(&info->mu);
-        info->state = FuncCallState::kCompleted;
-        info->output_size = output_size;
-        info->finish_timestamp = current_timestamp;
-        info->processing_time = processing_time;
-        info->dispatch_delay = dispatch_delay;
-        total_queuing_delay = info->total_queuing_delay;
+    FuncCallInfo* info = FindFuncCallInfo(func_call);
+    if (info == nullptr) {
+        HLOG(WARNING) << "Cannot find FuncCall: " << FuncCallDebugString(func_call);
+        return nullptr;
     }
+    tracing::EndSpan(func_call.full_call_id, tracing::Span::kEngineCall);
+    uint32_t parent_generation;
+    FuncCallInfo* parent_info = FindFuncCallInfo(info->parent_func_call, &parent_generation);
+
+    info->state = FuncCallState::kCompleted;
+    info->output_size = output_size;
+    info->finish_timestamp = current_timestamp;
+    info->processing_time = processing_time;
+    info->dispatch_delay = dispatch_delay;
+    int32_t total_queuing_delay = info->total_queuing_delay();
     if (parent_info != nullptr) {
-        absl::MutexLock lk(&parent_info->mu);
-        parent_info->total_queuing_delay += total_queuing_delay;
+        // Dropped if parent has finished meanwhile
+        AddQueuingDelay(parent_info, parent_generation, total_queuing_delay);
     }
 
     PerFuncStatistics* per_func_stat = per_func_stats_[func_call.func_id];
-    {
-        absl::MutexLock lk(&per_func_stat->mu);
-        absl::ReaderMutexLock info_lk(&info->mu);
-        int32_t running_delay = gsl::narrow_cast<int32_t>(
-            current_timestamp - info->dispatch_timestamp);
-        per_func_stat->running_delay_stat.AddSample(running_delay);
-        per_func_stat->inflight_requests--;
-        if (per_func_stat->inflight_requests < 0) {
-            HLOG(ERROR) << "Negative inflight_requests for func_id " << per_func_stat->func_id;
-            per_func_stat->inflight_requests = 0;
-        }
-        per_func_stat->output_size_stat.AddSample(gsl::narrow_cast<uint32_t>(output_size));
-        per_func_stat->running_delay_ema.AddSample(running_delay);
-        per_func_stat->processing_time_ema.AddSample(processing_time);
-        int64_t processing_time2 = current_timestamp - info->recv_timestamp - total_queuing_delay;
-        if (processing_time2 > 0) {
-            per_func_stat->processing_time2_ema.AddSample(
-                gsl::narrow_cast<int32_t>(processing_time2));
-        }
+    if (per_func_stat->inflight_requests.fetch_sub(1, std::memory_order_relaxed) <= 0) {
+        HLOG(ERROR) << "Negative inflight_requests for func_id " << per_func_stat->func_id;
+        per_func_stat->inflight_requests.fetch_add(1, std::memory_order_relaxed);
     }
 
+    LocalStatistics* local_stat = GetLocalStatistics();
+    absl::MutexLock lk(&local_stat->mu);
+    local_stat->dispatch_overhead.push_back(gsl::narrow_cast<int32_t>(
+        current_timestamp - info->dispatch_timestamp - processing_time));
+    local_stat->dispatch_delay.push_back(dispatch_delay);
+    LocalFuncStatistics* local_func_stat = GetLocalFuncStatistics(local_stat, func_call.func_id);
+    local_func_stat->running_delay.push_back(gsl::narrow_cast<int32_t>(
+        current_timestamp - info->dispatch_timestamp));
+    local_func_stat->output_size.push_back(gsl::narrow_cast<uint32_t>(output_size));
+    local_func_stat->processing_time.push_back(processing_time);
+    int64_t processing_time2 = current_timestamp - info->recv_timestamp - total_queuing_delay;
+    if (processing_time2 > 0) {
+        local_func_stat->processing_time2.push_back(gsl::narrow_cast<int32_t>(processing_time2));
+    }
+    SampleAdded(local_stat, current_timestamp);
+
     return info;
 }
 
 Tracer::FuncCallInfo* Tracer::OnFuncCallFailed(const FuncCall& func_call, int32_t dispatch_delay) {
     int64_t current_timestamp = GetMonotonicMicroTimestamp();
-    FuncCallInfo* info;
-    FuncCallInfo* parent_info = nullptr;
-
-    {
-        absl::MutexLock lk(&mu_);
-        if (!func_call_infos_.contains(func_call.full_call_id)) {
-            HLOG(WARNING) << "Cannot find FuncCall: " << FuncCallDebugString(func_call);
-            return nullptr;
-        }
-        info = func_call_infos_[func_call.full_call_id];
-        absl::ReaderMutexLock info_lk(&info->mu);
-        dispatch_delay_stat_.AddSample(dispatch_delay);
-        if (func_call_infos_.contains(info->parent_func_call.full_call_id)) {
-            parent_info = func_call_infos_[info->parent_func_call.full_call_id];
-        }
-    }
-
-    int32_t total_queuing_delay;
-    {
-        absl::MutexLock lk(&info->mu);
-        info->state = FuncCallState::kFailed;
-        info->finish_timestamp = current_timestamp;
-        info->dispatch_delay = dispatch_delay;
-        total_queuing_delay = info->total_queuing_delay;
+    FuncCallInfo* info = FindFuncCallInfo(func_call);
+    if (info == nullptr) {
+        HLOG(WARNING) << "Cannot find FuncCall: " << FuncCallDebugString(func_call);
+        return nullptr;
     }
+    tracing::EndSpan(func_call.full_call_id, tracing::Span::kEngineCall);
+    uint32_t parent_generation;
+    FuncCallInfo* parent_info = FindFuncCallInfo(info->parent_func_call, &parent_generation);
+
+    info->state = FuncCallState::kFailed;
+    info->finish_timestamp = current_timestamp;
+    info->dispatch_delay = dispatch_delay;
+    int32_t total_queuing_delay = info->total_queuing_delay();
     if (parent_info != nullptr) {
-        absl::MutexLock lk(&parent_info->mu);
-        parent_info->total_queuing_delay += total_queuing_delay;
+        // Dropped if parent has finished meanwhile
+        AddQueuingDelay(parent_info, parent_generation, total_queuing_delay);
     }
 
     PerFuncStatistics* per_func_stat = per_func_stats_[func_call.func_id];
-    {
-        absl::MutexLock lk(&per_func_stat->mu);
-        per_func_stat->failed_requests_stat.Tick();
-        per_func_stat->inflight_requests--;
-        if (per_func_stat->inflight_requests < 0) {
-            HLOG(ERROR) << "Negative inflight_requests for func_id " << per_func_stat->func_id;
-            per_func_stat->inflight_requests = 0;
-        }
+    if (per_func_stat->inflight_requests.fetch_sub(1, std::memory_order_relaxed) <= 0) {
+        HLOG(ERROR) << "Negative inflight_requests for func_id " << per_func_stat->func_id;
+        per_func_stat->inflight_requests.fetch_add(1, std::memory_order_relaxed);
     }
 
+    LocalStatistics* local_stat = GetLocalStatistics();
+    absl::MutexLock lk(&local_stat->mu);
+    local_stat->dispatch_delay.push_back(dispatch_delay);
+    LocalFuncStatistics* local_func_stat = GetLocalFuncStatistics(local_stat, func_call.func_id);
+    local_func_stat->failed_requests++;
+    SampleAdded(local_stat, current_timestamp);
+
     return info;
 }
 
 void Tracer::DiscardFuncCallInfo(const protocol::FuncCall& func_call) {
-    absl::MutexLock lk(&mu_);
-    if (!func_call_infos_.contains(func_call.full_call_id)) {
-        HLOG(WARNING) << "Cannot find FuncCall: " << FuncCallDebugString(func_call);
-        return;
+    uint64_t full_call_id = func_call.full_call_id;
+    if (full_call_id != 0) {
+        size_t base = FuncCallSlotIndex(full_call_id);
+        for (size_t i = 0; i < kMaxSlotProbes; i++) {
+            FuncCallInfo* info = &func_call_slots_[(base + i) & (kNumFuncCallSlots - 1)];
+            if (info->slot_tag.load(std::memory_order_relaxed) == full_call_id) {
+                info->slot_tag.store(0, std::memory_order_release);
+                return;
+            }
+        }
+        if (num_overflow_func_call_infos_.load(std::memory_order_acquire) > 0) {
+            absl::MutexLock lk(&mu_);
+            if (overflow_func_call_infos_.contains(full_call_id)) {
+                FuncCallInfo* info = overflow_func_call_infos_[full_call_id];
+                overflow_func_call_infos_.erase(full_call_id);
+                func_call_info_pool_.Return(info);
+                num_overflow_func_call_infos_.fetch_sub(1, std::memory_order_release);
+                return;
+            }
+        }
     }
-    func_call_infos_.erase(func_call.full_call_id);
+    HLOG(WARNING) << "Cannot find FuncCall: " << FuncCallDebugString(func_call);
 }
 
 double Tracer::GetAverageInstantRps(uint16_t func_id) {
     DCHECK_LT(func_id, protocol::kMaxFuncId);
     DCHECK(per_func_stats_[func_id] != nullptr);
-    PerFuncStatistics* per_func_stat = per_func_stats_[func_id];
-    {
-        absl::MutexLock lk(&per_func_stat->mu);
-        return per_func_stat->instant_rps_ema.GetValue();
-    }
+    return per_func_stats_[func_id]->avg_instant_rps.load(std::memory_order_relaxed);
 }
 
 double Tracer::GetAverageRunningDelay(uint16_t func_id) {
     DCHECK_LT(func_id, protocol::kMaxFuncId);
     DCHECK(per_func_stats_[func_id] != nullptr);
-    PerFuncStatistics* per_func_stat = per_func_stats_[func_id];
-    {
-        absl::MutexLock lk(&per_func_stat->mu);
-        return per_func_stat->running_delay_ema.GetValue();
-    }
+    return per_func_stats_[func_id]->avg_running_delay.load(std::memory_order_relaxed);
 }
 
 double Tracer::GetAverageProcessingTime(uint16_t func_id) {
     DCHECK_LT(func_id, protocol::kMaxFuncId);
     DCHECK(per_func_stats_[func_id] != nullptr);
-    PerFuncStatistics* per_func_stat = per_func_stats_[func_id];
-    {
-        absl::MutexLock lk(&per_func_stat->mu);
-        return per_func_stat->processing_time_ema.GetValue();
-    }
+    return per_func_stats_[func_id]->avg_processing_time.load(std::memory_order_relaxed);
 }
 
 double Tracer::GetAverageProcessingTime2(uint16_t func_id) {
     DCHECK_LT(func_id, protocol::kMaxFuncId);
     DCHECK(per_func_stats_[func_id] != nullptr);
-    PerFuncStatistics* per_func_stat = per_func_stats_[func_id];
-    {
-        absl::MutexLock lk(&per_func_stat->mu);
-        return per_func_stat->processing_time2_ema.GetValue();
+    return per_func_stats_[func_id]->avg_processing_time2.load(std::memory_order_relaxed);
+}
+
+Tracer::LocalStatistics* Tracer::GetLocalStatistics() {
+    static thread_local Tracer* owner = nullptr;
+    static thread_local LocalStatistics* local_stat = nullptr;
+    if (__FAAS_PREDICT_FALSE(owner != this)) {
+        local_stat = new LocalStatistics;
+        local_stat->last_flush_timestamp = GetMonotonicMicroTimestamp();
+        local_stat->num_samples = 0;
+        absl::MutexLock lk(&local_stats_mu_);
+        local_stats_.emplace_back(local_stat);
+        owner = this;
+    }
+    return local_stat;
+}
+
+Tracer::LocalFuncStatistics* Tracer::GetLocalFuncStatistics(LocalStatistics* local_stat,
+                                                            uint16_t func_id) {
+    DCHECK_LT(func_id, protocol::kMaxFuncId);
+    LocalFuncStatistics* local_func_stat = local_stat->per_func[func_id].get();
+    if (local_func_stat == nullptr) {
+        local_func_stat = new LocalFuncStatistics;
+        local_func_stat->incoming_requests = 0;
+        local_func_stat->failed_requests = 0;
+        local_func_stat->dirty = false;
+        local_stat->per_func[func_id].reset(local_func_stat);
+    }
+    if (!local_func_stat->dirty) {
+        local_func_stat->dirty = true;
+        local_stat->dirty_func_ids.push_back(func_id);
+    }
+    return local_func_stat;
+}
+
+void Tracer::SampleAdded(LocalStatistics* local_stat, int64_t current_timestamp) {
+    local_stat->num_samples++;
+    if (local_stat->num_samples >= kLocalStatBatchSize
+            || current_timestamp - local_stat->last_flush_timestamp >= kLocalStatFlushIntervalUs) {
+        FlushLocalStatistics(local_stat);
+        local_stat->num_samples = 0;
+        local_stat->last_flush_timestamp = current_timestamp;
+    }
+}
+
+void Tracer::FlushAllLocalStatistics() {
+    int64_t current_timestamp = GetMonotonicMicroTimestamp();
+    absl::MutexLock lk(&local_stats_mu_);
+    for (const auto& local_stat : local_stats_) {
+        absl::MutexLock local_lk(&local_stat->mu);
+        if (local_stat->num_samples > 0) {
+            FlushLocalStatistics(local_stat.get());
+            local_stat->num_samples = 0;
+            local_stat->last_flush_timestamp = current_timestamp;
+        }
+    }
+}
+
+void Tracer::FlushLocalStatistics(LocalStatistics* local_stat) {
+    if (!local_stat->dispatch_delay.empty() || !local_stat->dispatch_overhead.empty()) {
+        absl::MutexLock lk(&stat_mu_);
+        for (int32_t sample : local_stat->dispatch_delay) {
+            dispatch_delay_stat_.AddSample(sample);
+        }
+        for (int32_t sample : local_stat->dispatch_overhead) {
+            dispatch_overhead_stat_.AddSample(sample);
+        }
+    }
+    local_stat->dispatch_delay.clear();
+    local_stat->dispatch_overhead.clear();
+
+    for (uint16_t func_id : local_stat->dirty_func_ids) {
+        LocalFuncStatistics* local_func_stat = local_stat->per_func[func_id].get();
+        PerFuncStatistics* per_func_stat = per_func_stats_[func_id];
+        {
+            absl::MutexLock lk(&per_func_stat->mu);
+            if (local_func_stat->incoming_requests > 0) {
+                per_func_stat->incoming_requests_stat.Tick(local_func_stat->incoming_requests);
+            }
+            if (local_func_stat->failed_requests > 0) {
+                per_func_stat->failed_requests_stat.Tick(local_func_stat->failed_requests);
+            }
+            for (size_t i = 0; i < local_func_stat->instant_rps.size(); i++) {
+                float instant_rps = local_func_stat->instant_rps[i];
+                // Samples merged from other threads may be older than the last
+                // one seen by the EMA, which would be dropped otherwise
+                int64_t timestamp = std::max(local_func_stat->instant_rps_timestamps[i],
+                                             per_func_stat->instant_rps_ema_timestamp + 1);
+                per_func_stat->instant_rps_stat.AddSample(instant_rps);
+                per_func_stat->instant_rps_ema.AddSample(timestamp, instant_rps);
+                per_func_stat->instant_rps_ema_timestamp = timestamp;
+            }
+            for (uint32_t sample : local_func_stat->input_size) {
+                per_func_stat->input_size_stat.AddSample(sample);
+            }
+            for (uint32_t sample : local_func_stat->output_size) {
+                per_func_stat->output_size_stat.AddSample(sample);
+            }
+            for (int32_t sample : local_func_stat->queueing_delay) {
+                per_func_stat->queueing_delay_stat.AddSample(sample);
+            }
+            for (int32_t sample : local_func_stat->running_delay) {
+                per_func_stat->running_delay_stat.AddSample(sample);
+                per_func_stat->running_delay_ema.AddSample(sample);
+            }
+            for (uint16_t sample : local_func_stat->inflight_requests) {
+                per_func_stat->inflight_requests_stat.AddSample(sample);
+            }
+            for (int32_t sample : local_func_stat->processing_time) {
+                per_func_stat->processing_time_ema.AddSample(sample);
+            }
+            for (int32_t sample : local_func_stat->processing_time2) {
+                per_func_stat->processing_time2_ema.AddSample(sample);
+            }
+            per_func_stat->avg_instant_rps.store(
+                per_func_stat->instant_rps_ema.GetValue(), std::memory_order_relaxed);
+            per_func_stat->avg_running_delay.store(
+                per_func_stat->running_delay_ema.GetValue(), std::memory_order_relaxed);
+            per_func_stat->avg_processing_time.store(
+                per_func_stat->processing_time_ema.GetValue(), std::memory_order_relaxed);
+            per_func_stat->avg_processing_time2.store(
+                per_func_stat->processing_time2_ema.GetValue(), std::memory_order_relaxed);
+        }
+        local_func_stat->incoming_requests = 0;
+        local_func_stat->failed_requests = 0;
+        local_func_stat->instant_rps.clear();
+        local_func_stat->instant_rps_timestamps.clear();
+        local_func_stat->input_size.clear();
+        local_func_stat->output_size.clear();
+        local_func_stat->queueing_delay.clear();
+        local_func_stat->running_delay.clear();
+        local_func_stat->inflight_requests.clear();
+        local_func_stat->processing_time.clear();
+        local_func_stat->processing_time2.clear();
+        local_func_stat->dirty = false;
     }
+    local_stat->dirty_func_ids.clear();
 }
 
 Tracer::PerFuncStatistics::PerFuncStatistics(uint16_t func_id)
     : func_id(func_id),
       inflight_requests(0),
       last_request_timestamp(-1),
+      avg_instant_rps(0),
+      avg_running_delay(0),
+      avg_processing_time(0),
+      avg_processing_time2(0),
       incoming_requests_stat(stat::Counter::StandardReportCallback(
           fmt::format("incoming_requests[{}]", func_id))),
       failed_requests_stat(stat::Counter::StandardReportCallback(
@@ -319,7 +549,8 @@ Tracer::PerFuncStatistics::PerFuncStatistics(uint16_t func_id)
                       absl::GetFlag(FLAGS_instant_rps_p_norm)),
       running_delay_ema(/* alpha= */ 0.001),
       processing_time_ema(/* alpha= */ 0.001),
-      processing_time2_ema(/* alpha= */ 0.001) {}
+      processing_time2_ema(/* alpha= */ 0.001),
+      instant_rps_ema_timestamp(-1) {}
 
 }  // namespace engine
 }  // namespace faas
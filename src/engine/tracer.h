@@ -27,25 +27,44 @@ public:
         kFailed
     };
 
+    // Besides slot_tag, generation, deadline and queuing_delay_state, fields
+    // are only accessed by successive stages of the same func call, which are
+    // already ordered by message passing among them, thus no lock is needed.
+    // The other atomic fields are also read or updated by child func calls.
     struct FuncCallInfo {
-        absl::Mutex        mu;
-        FuncCallState      state               ABSL_GUARDED_BY(mu);
-        protocol::FuncCall func_call           ABSL_GUARDED_BY(mu);
-        protocol::FuncCall parent_func_call    ABSL_GUARDED_BY(mu);
-        size_t             input_size          ABSL_GUARDED_BY(mu);
-        size_t             output_size         ABSL_GUARDED_BY(mu);
-        int64_t            recv_timestamp      ABSL_GUARDED_BY(mu);
-        int64_t            dispatch_timestamp  ABSL_GUARDED_BY(mu);
-        int64_t            finish_timestamp    ABSL_GUARDED_BY(mu);
-        uint16_t           assigned_worker     ABSL_GUARDED_BY(mu);  // Saved as client_id
-        int32_t            processing_time     ABSL_GUARDED_BY(mu);
-        int32_t            dispatch_delay      ABSL_GUARDED_BY(mu);
-        int32_t            total_queuing_delay ABSL_GUARDED_BY(mu);
+        // full_call_id of the func call occupying this slot, 0 if free, and
+        // kReservedSlotTag while being initialized
+        std::atomic<uint64_t> slot_tag;
+        // Incremented every time the slot is taken
+        std::atomic<uint32_t> generation;
+        FuncCallState         state;
+        protocol::FuncCall    func_call;
+        protocol::FuncCall    parent_func_call;
+        size_t                input_size;
+        size_t                output_size;
+        int64_t               recv_timestamp;
+        int64_t               dispatch_timestamp;
+        int64_t               finish_timestamp;
+        uint16_t              assigned_worker;  // Saved as client_id
+        int32_t               processing_time;
+        int32_t               dispatch_delay;
+        // Absolute monotonic timestamp, 0 if none. Inherited from the parent
+        // func call if not given.
+        std::atomic<int64_t>  deadline;
+        // Generation in the high 32 bits, and total queuing delay in the low
+        // 32 bits, which is also updated when child func calls finish. Updates
+        // from children are dropped if the generation no longer matches.
+        std::atomic<uint64_t> queuing_delay_state;
+
+        int32_t total_queuing_delay() const {
+            return static_cast<int32_t>(static_cast<uint32_t>(
+                queuing_delay_state.load(std::memory_order_relaxed)));
+        }
     };
 
     FuncCallInfo* OnNewFuncCall(const protocol::FuncCall& func_call,
                                 const protocol::FuncCall& parent_func_call,
-                                size_t input_size);
+                                size_t input_size, int64_t deadline);
     FuncCallInfo* OnFuncCallDispatched(const protocol::FuncCall& func_call,
                                        FuncWorker* func_worker);
     FuncCallInfo* OnFuncCallCompleted(const protocol::FuncCall& func_call,
@@ -55,28 +74,58 @@ public:
 
     void DiscardFuncCallInfo(const protocol::FuncCall& func_call);
 
+    // Lock-free, values may lag behind latest samples by up to
+    // kStatFlushIntervalMs, provided FlushAllLocalStatistics is called
+    // periodically
     double GetAverageInstantRps(uint16_t func_id);
     double GetAverageRunningDelay(uint16_t func_id);
     double GetAverageProcessingTime(uint16_t func_id);
     double GetAverageProcessingTime2(uint16_t func_id);
 
+    // Samples buffered by threads are merged at least this often
+    static constexpr int kStatFlushIntervalMs = 10;
+    // Merge samples buffered by all threads, including idle ones. Should be
+    // called every kStatFlushIntervalMs.
+    void FlushAllLocalStatistics();
+
 private:
+    // FuncCallInfo slots are indexed by hash of full_call_id, with limited
+    // linear probing
+    static constexpr size_t kNumFuncCallSlots = 16384;
+    static constexpr size_t kMaxSlotProbes = 8;
+    // Not a valid full_call_id, as func_id cannot be kMaxFuncId
+    static constexpr uint64_t kReservedSlotTag = ~uint64_t{0};
+    // Thread-local samples are merged by the owner thread once this many are
+    // buffered, or the flush interval has passed
+    static constexpr size_t kLocalStatBatchSize = 64;
+    static constexpr int64_t kLocalStatFlushIntervalUs = kStatFlushIntervalMs * 1000;
+
     Engine* engine_;
-    absl::Mutex mu_;
+    std::unique_ptr<FuncCallInfo[]> func_call_slots_;
 
+    // Fallback for func calls not fitting in slots
+    absl::Mutex mu_;
+    std::atomic<size_t> num_overflow_func_call_infos_;
     utils::SimpleObjectPool<FuncCallInfo> func_call_info_pool_ ABSL_GUARDED_BY(mu_);
     absl::flat_hash_map</* full_call_id */ uint64_t, FuncCallInfo*>
-        func_call_infos_ ABSL_GUARDED_BY(mu_);
+        overflow_func_call_infos_ ABSL_GUARDED_BY(mu_);
 
-    stat::StatisticsCollector<int32_t> dispatch_delay_stat_    ABSL_GUARDED_BY(mu_);
-    stat::StatisticsCollector<int32_t> dispatch_overhead_stat_ ABSL_GUARDED_BY(mu_);
+    absl::Mutex stat_mu_;
+    stat::StatisticsCollector<int32_t> dispatch_delay_stat_    ABSL_GUARDED_BY(stat_mu_);
+    stat::StatisticsCollector<int32_t> dispatch_overhead_stat_ ABSL_GUARDED_BY(stat_mu_);
 
     struct PerFuncStatistics {
         absl::Mutex mu;
         uint16_t    func_id;
 
-        int      inflight_requests      ABSL_GUARDED_BY(mu);
-        int64_t  last_request_timestamp ABSL_GUARDED_BY(mu);
+        std::atomic<int>     inflight_requests;
+        std::atomic<int64_t> last_request_timestamp;
+
+        // Published values of EMAs below
+        std::atomic<double> avg_instant_rps;
+        std::atomic<double> avg_running_delay;
+        std::atomic<double> avg_processing_time;
+        std::atomic<double> avg_processing_time2;
 
         stat::Counter                       incoming_requests_stat ABSL_GUARDED_BY(mu);
         stat::Counter                       failed_requests_stat   ABSL_GUARDED_BY(mu);
@@ -91,11 +140,59 @@ private:
         utils::ExpMovingAvg    running_delay_ema    ABSL_GUARDED_BY(mu);
         utils::ExpMovingAvg    processing_time_ema  ABSL_GUARDED_BY(mu);
         utils::ExpMovingAvg    processing_time2_ema ABSL_GUARDED_BY(mu);
+        int64_t                instant_rps_ema_timestamp ABSL_GUARDED_BY(mu);
 
         explicit PerFuncStatistics(uint16_t func_id);
     };
     PerFuncStatistics* per_func_stats_[protocol::kMaxFuncId];
 
+    // Samples buffered by one thread, before merged into PerFuncStatistics
+    struct LocalFuncStatistics {
+        int                   incoming_requests;
+        int                   failed_requests;
+        std::vector<float>    instant_rps;
+        std::vector<int64_t>  instant_rps_timestamps;
+        std::vector<uint32_t> input_size;
+        std::vector<uint32_t> output_size;
+        std::vector<int32_t>  queueing_delay;
+        std::vector<int32_t>  running_delay;
+        std::vector<uint16_t> inflight_requests;
+        std::vector<int32_t>  processing_time;
+        std::vector<int32_t>  processing_time2;
+        bool                  dirty;
+    };
+    struct LocalStatistics {
+        // Held by the owner thread when adding samples, and by
+        // FlushAllLocalStatistics, thus rarely contended
+        absl::Mutex          mu;
+        int64_t              last_flush_timestamp;
+        size_t               num_samples;
+        std::vector<int32_t> dispatch_delay;
+        std::vector<int32_t> dispatch_overhead;
+        std::vector<uint16_t> dirty_func_ids;
+        std::unique_ptr<LocalFuncStatistics> per_func[protocol::kMaxFuncId];
+    };
+    absl::Mutex local_stats_mu_;
+    std::vector<std::unique_ptr<LocalStatistics>> local_stats_ ABSL_GUARDED_BY(local_stats_mu_);
+
+    // Returned FuncCallInfo is not visible to FindFuncCallInfo until
+    // PublishFuncCallInfo is called after initializing it
+    FuncCallInfo* NewFuncCallInfo(const protocol::FuncCall& func_call);
+    void PublishFuncCallInfo(FuncCallInfo* info, uint64_t full_call_id);
+    // If generation is given, it is set to the generation of returned
+    // FuncCallInfo, read before matching its slot_tag
+    FuncCallInfo* FindFuncCallInfo(const protocol::FuncCall& func_call,
+                                   uint32_t* generation = nullptr);
+    bool IsSlotFuncCallInfo(const FuncCallInfo* info) const;
+    // Returns false if info has been taken by another func call since
+    // generation was read
+    static bool AddQueuingDelay(FuncCallInfo* info, uint32_t generation, int32_t delay);
+
+    LocalStatistics* GetLocalStatistics();
+    LocalFuncStatistics* GetLocalFuncStatistics(LocalStatistics* local_stat, uint16_t func_id);
+    void SampleAdded(LocalStatistics* local_stat, int64_t current_timestamp);
+    void FlushLocalStatistics(LocalStatistics* local_stat);
+
     DISALLOW_COPY_AND_ASSIGN(Tracer);
 };
 
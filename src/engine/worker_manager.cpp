@@ -4,9 +4,15 @@
 #include "ipc/fifo.h"
 #include "engine/engine.h"
 
+#include <absl/flags/flag.h>
+
 #define HLOG(l) LOG(l) << "WorkerManager: "
 #define HVLOG(l) VLOG(l) << "WorkerManager: "
 
+ABSL_FLAG(int, func_worker_handshake_timeout_ms, 60000,
+          "client_id of a requested func worker is reclaimed if it does not connect "
+          "within this time, 0 disables");
+
 namespace faas {
 namespace engine {
 
@@ -14,7 +20,8 @@ using protocol::Message;
 using protocol::NewCreateFuncWorkerMessage;
 
 WorkerManager::WorkerManager(Engine* engine)
-    : engine_(engine), next_client_id_(1) {}
+    : engine_(engine), next_client_id_(1),
+      client_id_generations_(protocol::kMaxClientId + 1, 0) {}
 
 WorkerManager::~WorkerManager() {}
 
@@ -66,13 +73,22 @@ bool WorkerManager::OnFuncWorkerConnected(MessageConnection* worker_connection)
             HLOG(ERROR) << fmt::format("FuncWorker of client_id {} already exists", client_id);
             return false;
         }
-        func_worker = std::make_shared<FuncWorker>(worker_connection);
+        if (!pending_func_workers_.contains(client_id)) {
+            // Its client_id may have been given to another func worker
+            HLOG(ERROR) << fmt::format("FuncWorker of client_id {} is not requested, "
+                                       "or connects after handshake timeout", client_id);
+            return false;
+        }
+        pending_func_workers_.erase(client_id);
+        func_worker = std::make_shared<FuncWorker>(
+            worker_connection, client_id_generations_[client_id]);
         func_workers_[client_id] = func_worker;
     }
     Dispatcher* dispatcher = engine_->GetOrCreateDispatcher(func_id);
     if (dispatcher == nullptr || !dispatcher->OnFuncWorkerConnected(func_worker)) {
         absl::MutexLock lk(&mu_);
         func_workers_.erase(client_id);
+        free_client_ids_.push_back(client_id);
         return false;
     }
     return true;
@@ -92,15 +108,30 @@ void WorkerManager::OnFuncWorkerDisconnected(MessageConnection* worker_connectio
         }
         func_worker = std::move(func_workers_[client_id]);
         func_workers_.erase(client_id);
+        free_client_ids_.push_back(client_id);
     }
     Dispatcher* dispatcher = engine_->GetOrCreateDispatcher(func_id);
     if (dispatcher != nullptr) {
         dispatcher->OnFuncWorkerDisconnected(func_worker.get());
     }
+    engine_->ReleaseShmArenaInputsOfCaller(client_id, func_worker->client_id_generation());
     ipc::FifoRemove(ipc::GetFuncWorkerInputFifoName(client_id));
     ipc::FifoRemove(ipc::GetFuncWorkerOutputFifoName(client_id));
 }
 
+std::unique_ptr<ipc::SPSCQueue<Message>> WorkerManager::GrabFuncWorkerOutputQueue(
+        uint16_t client_id) {
+    absl::MutexLock lk(&mu_);
+    if (!func_worker_output_queues_.contains(client_id)) {
+        HLOG(ERROR) << fmt::format("Cannot find output queue for client_id {}", client_id);
+        return nullptr;
+    }
+    std::unique_ptr<ipc::SPSCQueue<Message>> queue =
+        std::move(func_worker_output_queues_[client_id]);
+    func_worker_output_queues_.erase(client_id);
+    return queue;
+}
+
 bool WorkerManager::RequestNewFuncWorker(uint16_t func_id, uint16_t* client_id) {
     std::shared_ptr<server::ConnectionBase> connection;
     {
@@ -114,6 +145,65 @@ bool WorkerManager::RequestNewFuncWorker(uint16_t func_id, uint16_t* client_id)
     return RequestNewFuncWorkerInternal(connection->as_ptr<MessageConnection>(), client_id);
 }
 
+uint32_t WorkerManager::GetClientIdGeneration(uint16_t client_id) {
+    absl::MutexLock lk(&mu_);
+    return client_id_generations_[client_id];
+}
+
+bool WorkerManager::AllocateClientId(uint16_t* client_id) {
+    absl::MutexLock lk(&mu_);
+    if (next_client_id_ <= protocol::kMaxClientId) {
+        *client_id = next_client_id_++;
+        return true;
+    }
+    if (free_client_ids_.empty()) {
+        return false;
+    }
+    *client_id = free_client_ids_.front();
+    free_client_ids_.pop_front();
+    uint8_t& generation = client_id_generations_[*client_id];
+    generation = static_cast<uint8_t>((generation + 1) & protocol::kMaxCallIdGeneration);
+    HLOG(INFO) << fmt::format("Reuse client_id {} with generation {}", *client_id, generation);
+    return true;
+}
+
+void WorkerManager::ReclaimTimedOutClientIds() {
+    int64_t timeout_us = int64_t{absl::GetFlag(FLAGS_func_worker_handshake_timeout_ms)} * 1000;
+    if (timeout_us <= 0) {
+        return;
+    }
+    int64_t current_timestamp = GetMonotonicMicroTimestamp();
+    std::vector<std::pair</* client_id */ uint16_t, PendingFuncWorker>> timed_out;
+    {
+        absl::MutexLock lk(&mu_);
+        for (const auto& entry : pending_func_workers_) {
+            if (current_timestamp - entry.second.request_timestamp >= timeout_us) {
+                timed_out.push_back(entry);
+            }
+        }
+        for (const auto& entry : timed_out) {
+            uint16_t client_id = entry.first;
+            pending_func_workers_.erase(client_id);
+            func_worker_output_queues_.erase(client_id);
+            free_client_ids_.push_back(client_id);
+        }
+    }
+    for (const auto& [client_id, pending_func_worker] : timed_out) {
+        int64_t elapsed_us = current_timestamp - pending_func_worker.request_timestamp;
+        HLOG(WARNING) << fmt::format("FuncWorker of func_id {}, client_id {} does not connect "
+                                     "in {}ms, reclaim its client_id",
+                                     pending_func_worker.func_id, client_id, elapsed_us / 1000);
+        if (!engine_->func_worker_use_engine_socket()) {
+            ipc::FifoRemove(ipc::GetFuncWorkerInputFifoName(client_id));
+            ipc::FifoRemove(ipc::GetFuncWorkerOutputFifoName(client_id));
+        }
+        Dispatcher* dispatcher = engine_->GetOrCreateDispatcher(pending_func_worker.func_id);
+        if (dispatcher != nullptr) {
+            dispatcher->OnFuncWorkerLaunchFailed(client_id);
+        }
+    }
+}
+
 std::shared_ptr<FuncWorker> WorkerManager::GetFuncWorker(uint16_t client_id) {
     absl::MutexLock lk(&mu_);
     if (!func_workers_.contains(client_id)) {
@@ -126,8 +216,11 @@ std::shared_ptr<FuncWorker> WorkerManager::GetFuncWorker(uint16_t client_id) {
 
 bool WorkerManager::RequestNewFuncWorkerInternal(MessageConnection* launcher_connection,
                                                  uint16_t* out_client_id) {
-    uint16_t client_id = next_client_id_.fetch_add(1);
-    CHECK_LE(client_id, protocol::kMaxClientId) << "Reach maximum number of clients!";
+    uint16_t client_id;
+    if (!AllocateClientId(&client_id)) {
+        HLOG(ERROR) << "Reach maximum number of clients!";
+        return false;
+    }
     HLOG(INFO) << fmt::format("Request new FuncWorker for func_id {} with client_id {}",
                               launcher_connection->func_id(), client_id);
     if (!engine_->func_worker_use_engine_socket()) {
@@ -136,17 +229,45 @@ bool WorkerManager::RequestNewFuncWorkerInternal(MessageConnection* launcher_con
         CHECK(ipc::FifoCreate(ipc::GetFuncWorkerOutputFifoName(client_id)))
             << "FifoCreate failed";
     }
+    std::unique_ptr<ipc::SPSCQueue<Message>> output_queue;
+    if (engine_->func_worker_use_shm_queue()) {
+        // Left by a previous func worker with the same client_id, e.g. one
+        // that never connected, or an engine that did not exit cleanly
+        ipc::SPSCQueue<Message>::RemoveIfExists(ipc::GetFuncWorkerOutputQueueName(client_id));
+        output_queue = ipc::SPSCQueue<Message>::Create(
+            ipc::GetFuncWorkerOutputQueueName(client_id),
+            protocol::kFuncWorkerMessageQueueSize);
+        // Engine only reads this queue when the worker rings the doorbell
+        output_queue->ConsumerEnterSleep();
+    }
+    {
+        absl::MutexLock lk(&mu_);
+        if (output_queue != nullptr) {
+            func_worker_output_queues_[client_id] = std::move(output_queue);
+        }
+        pending_func_workers_[client_id] = {
+            .func_id = launcher_connection->func_id(),
+            .request_timestamp = GetMonotonicMicroTimestamp()
+        };
+    }
     Message message = NewCreateFuncWorkerMessage(client_id);
     launcher_connection->WriteMessage(message);
     *out_client_id = client_id;
     return true;
 }
 
-FuncWorker::FuncWorker(MessageConnection* message_connection)
+FuncWorker::FuncWorker(MessageConnection* message_connection, uint32_t client_id_generation)
     : func_id_(message_connection->func_id()),
       client_id_(message_connection->client_id()),
+      client_id_generation_(client_id_generation),
+      use_shm_arena_(message_connection->use_shm_arena()),
+      retirable_(message_connection->retirable()),
       message_connection_(message_connection->ref_self()) {}
 
+FuncWorker::FuncWorker(uint16_t func_id, uint16_t client_id, bool retirable)
+    : func_id_(func_id), client_id_(client_id), client_id_generation_(0),
+      use_shm_arena_(false), retirable_(retirable) {}
+
 FuncWorker::~FuncWorker() {}
 
 void FuncWorker::SendMessage(Message* message) {
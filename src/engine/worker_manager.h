@@ -2,6 +2,7 @@
 
 #include "base/common.h"
 #include "common/protocol.h"
+#include "ipc/spsc_queue.h"
 #include "engine/message_connection.h"
 
 namespace faas {
@@ -13,6 +14,7 @@ class FuncWorker;
 class WorkerManager {
 public:
     static constexpr int kDefaultMinWorkersPerFunc = 4;
+    static constexpr int kHandshakeTimeoutCheckIntervalMs = 1000;
 
     explicit WorkerManager(Engine* engine);
     ~WorkerManager();
@@ -24,36 +26,71 @@ public:
     void OnFuncWorkerDisconnected(MessageConnection* worker_connection);
     bool RequestNewFuncWorker(uint16_t func_id, uint16_t* client_id);
     std::shared_ptr<FuncWorker> GetFuncWorker(uint16_t client_id);
+    // Generation of client_id, see protocol::kCallIdGenerationBits
+    uint32_t GetClientIdGeneration(uint16_t client_id);
+    // Output queue is created by engine (the consumer) before the func worker
+    // is launched, and handed to its MessageConnection once handshake is done
+    std::unique_ptr<ipc::SPSCQueue<protocol::Message>> GrabFuncWorkerOutputQueue(
+        uint16_t client_id);
+    // Reclaims client_ids of requested func workers that have not connected
+    // within --func_worker_handshake_timeout_ms. Called periodically.
+    void ReclaimTimedOutClientIds();
 
 private:
     Engine* engine_;
-    std::atomic<uint16_t> next_client_id_;
 
     absl::Mutex mu_;
+    uint16_t next_client_id_ ABSL_GUARDED_BY(mu_);
+    // client_ids released by disconnected func workers, reused in FIFO order
+    // once fresh ones run out, which maximizes the time before reuse
+    std::deque<uint16_t> free_client_ids_ ABSL_GUARDED_BY(mu_);
+    std::vector<uint8_t> client_id_generations_ ABSL_GUARDED_BY(mu_);
+    struct PendingFuncWorker {
+        uint16_t func_id;
+        int64_t  request_timestamp;
+    };
+    // Func workers requested from launchers, which have not connected yet
+    absl::flat_hash_map</* client_id */ uint16_t, PendingFuncWorker>
+        pending_func_workers_ ABSL_GUARDED_BY(mu_);
     absl::flat_hash_map</* func_id */ uint16_t, std::shared_ptr<server::ConnectionBase>>
         launcher_connections_ ABSL_GUARDED_BY(mu_);
     absl::flat_hash_map</* client_id */ uint16_t, std::shared_ptr<FuncWorker>>
         func_workers_ ABSL_GUARDED_BY(mu_);
-    
+    absl::flat_hash_map</* client_id */ uint16_t,
+                        std::unique_ptr<ipc::SPSCQueue<protocol::Message>>>
+        func_worker_output_queues_ ABSL_GUARDED_BY(mu_);
+
     bool RequestNewFuncWorkerInternal(MessageConnection* launcher_connection, uint16_t* client_id);
+    bool AllocateClientId(uint16_t* client_id);
 
     DISALLOW_COPY_AND_ASSIGN(WorkerManager);
 };
 
 class FuncWorker {
 public:
-    explicit FuncWorker(MessageConnection* message_connection);
-    ~FuncWorker();
+    FuncWorker(MessageConnection* message_connection, uint32_t client_id_generation);
+    virtual ~FuncWorker();
 
     uint16_t func_id() const { return func_id_; }
     uint16_t client_id() const { return client_id_; }
+    uint32_t client_id_generation() const { return client_id_generation_; }
+    bool use_shm_arena() const { return use_shm_arena_; }
+    bool retirable() const { return retirable_; }
 
     // Must be thread-safe
-    void SendMessage(protocol::Message* message);
+    virtual void SendMessage(protocol::Message* message);
+
+protected:
+    // For subclasses without a MessageConnection, e.g. fake func workers in
+    // benchmarks, which must override SendMessage
+    FuncWorker(uint16_t func_id, uint16_t client_id, bool retirable);
 
 private:
     uint16_t func_id_;
     uint16_t client_id_;
+    uint32_t client_id_generation_;
+    bool use_shm_arena_;
+    bool retirable_;
     std::shared_ptr<server::ConnectionBase> message_connection_;
 
     DISALLOW_COPY_AND_ASSIGN(FuncWorker);
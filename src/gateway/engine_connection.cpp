@@ -8,6 +8,10 @@ ABSL_FLAG(bool, engine_conn_enable_nodelay, true,
           "Enable TCP_NODELAY for connections to engines");
 ABSL_FLAG(bool, engine_conn_enable_keepalive, true,
           "Enable TCP keep-alive for connections to engines");
+ABSL_FLAG(int, engine_conn_batch_flush_us, -1,
+          "If non-negative, messages to engines sent within one event loop iteration are "
+          "coalesced into one write, which may wait up to this many microseconds for "
+          "more messages. Negative to write each message separately");
 
 #define HLOG(l) LOG(l) << log_header_
 #define HVLOG(l) VLOG(l) << log_header_
@@ -18,11 +22,16 @@ namespace gateway {
 using protocol::GatewayMessage;
 
 EngineConnection::EngineConnection(Server* server, uint16_t node_id, uint16_t conn_id,
-                                   std::span<const char> initial_data)
+                                   std::span<const char> initial_data,
+                                   stat::Counter* dispatched_requests_stat)
     : server::ConnectionBase(type_id(node_id)),
-      server_(server), node_id_(node_id), conn_id_(conn_id), state_(kCreated),
-      log_header_(fmt::format("EngineConnection[{}-{}]: ", node_id, conn_id)) {
-    read_buffer_.AppendData(initial_data);
+      server_(server), node_id_(node_id), conn_id_(conn_id),
+      dispatched_requests_stat_(dispatched_requests_stat), state_(kCreated),
+      log_header_(fmt::format("EngineConnection[{}-{}]: ", node_id, conn_id)),
+      message_reader_(absl::bind_front(&EngineConnection::OnRecvMessage, this)),
+      message_writer_(absl::GetFlag(FLAGS_engine_conn_batch_flush_us),
+                      absl::bind_front(&EngineConnection::OnWriteError, this)) {
+    message_reader_.AppendData(initial_data);
 }
 
 EngineConnection::~EngineConnection() {
@@ -39,6 +48,8 @@ void EngineConnection::Start(server::IOWorker* io_worker) {
     DCHECK_IN_EVENT_LOOP_THREAD(uv_tcp_handle_.loop);
     io_worker_ = io_worker;
     uv_tcp_handle_.data = this;
+    message_reader_.Start(io_worker_);
+    message_writer_.Start(io_worker_, UV_AS_STREAM(&uv_tcp_handle_));
     if (absl::GetFlag(FLAGS_engine_conn_enable_nodelay)) {
         UV_DCHECK_OK(uv_tcp_nodelay(&uv_tcp_handle_, 1));
     }
@@ -49,7 +60,7 @@ void EngineConnection::Start(server::IOWorker* io_worker) {
                                &EngineConnection::BufferAllocCallback,
                                &EngineConnection::RecvDataCallback));
     state_ = kRunning;
-    ProcessGatewayMessages();
+    message_reader_.ProcessMessages();
 }
 
 void EngineConnection::ScheduleClose() {
@@ -59,6 +70,7 @@ void EngineConnection::ScheduleClose() {
         return;
     }
     DCHECK(state_ == kRunning);
+    message_writer_.Stop();
     uv_close(UV_AS_HANDLE(&uv_tcp_handle_), &EngineConnection::CloseCallback);
     state_ = kClosing;
 }
@@ -69,59 +81,40 @@ void EngineConnection::SendMessage(const GatewayMessage& message, std::span<cons
         HLOG(WARNING) << "EngineConnection is closing or has closed, will not send this message";
         return;
     }
-    DCHECK_EQ(message.payload_size, gsl::narrow_cast<int32_t>(payload.size()));
-    size_t pos = 0;
-    while (pos < sizeof(GatewayMessage) + payload.size()) {
-        uv_buf_t buf;
-        io_worker_->NewWriteBuffer(&buf);
-        size_t write_size;
-        if (pos == 0) {
-            DCHECK(sizeof(GatewayMessage) <= buf.len);
-            memcpy(buf.base, &message, sizeof(GatewayMessage));
-            size_t copy_size = std::min(buf.len - sizeof(GatewayMessage), payload.size());
-            memcpy(buf.base + sizeof(GatewayMessage), payload.data(), copy_size);
-            write_size = sizeof(GatewayMessage) + copy_size;
-        } else {
-            size_t copy_size = std::min(buf.len, payload.size() + sizeof(GatewayMessage) - pos);
-            memcpy(buf.base, payload.data() + pos - sizeof(GatewayMessage), copy_size);
-            write_size = copy_size;
-        }
-        DCHECK_LE(write_size, buf.len);
-        buf.len = write_size;
-        uv_write_t* write_req = io_worker_->NewWriteRequest();
-        write_req->data = buf.base;
-        UV_DCHECK_OK(uv_write(write_req, UV_AS_STREAM(&uv_tcp_handle_),
-                              &buf, 1, &EngineConnection::DataSentCallback));
-        pos += write_size;
-    }
+    message_writer_.Write(message, payload);
 }
 
-void EngineConnection::ProcessGatewayMessages() {
+void EngineConnection::SendMessage(const GatewayMessage& message,
+                                   const utils::PayloadRef& payload) {
     DCHECK_IN_EVENT_LOOP_THREAD(uv_tcp_handle_.loop);
-    while (read_buffer_.length() >= sizeof(GatewayMessage)) {
-        GatewayMessage* message = reinterpret_cast<GatewayMessage*>(read_buffer_.data());
-        size_t full_size = sizeof(GatewayMessage) + std::max<size_t>(0, message->payload_size);
-        if (read_buffer_.length() >= full_size) {
-            std::span<const char> payload(read_buffer_.data() + sizeof(GatewayMessage),
-                                          full_size - sizeof(GatewayMessage));
-            server_->OnRecvEngineMessage(this, *message, payload);
-            read_buffer_.ConsumeFront(full_size);
-        } else {
-            break;
-        }
+    if (state_ != kRunning) {
+        HLOG(WARNING) << "EngineConnection is closing or has closed, will not send this message";
+        return;
+    }
+    message_writer_.Write(message, payload);
+}
+
+void EngineConnection::OnRecvMessage(const GatewayMessage& message,
+                                     const utils::PayloadRef& payload) {
+    server_->OnRecvEngineMessage(this, message, payload);
+}
+
+void EngineConnection::OnWriteError(int status) {
+    if (status == UV_ECANCELED || state_ != kRunning) {
+        // Pending writes are cancelled when the connection is closing
+        return;
     }
+    HLOG(ERROR) << "Failed to send data, will close this connection: "
+                << uv_strerror(status);
+    ScheduleClose();
 }
 
 UV_ALLOC_CB_FOR_CLASS(EngineConnection, BufferAlloc) {
-    io_worker_->NewReadBuffer(suggested_size, buf);
+    message_reader_.NewReadBuffer(suggested_size, buf);
 }
 
 UV_READ_CB_FOR_CLASS(EngineConnection, RecvData) {
-    auto reclaim_worker_resource = gsl::finally([this, buf] {
-        if (buf->base != 0) {
-            io_worker_->ReturnReadBuffer(buf);
-        }
-    });
+    message_reader_.OnRead(nread, buf);
     if (nread < 0) {
         if (nread == UV_EOF) {
             HLOG(INFO) << "Connection closed remotely";
@@ -130,24 +123,6 @@ UV_READ_CB_FOR_CLASS(EngineConnection, RecvData) {
                         << uv_strerror(nread);
         }
         ScheduleClose();
-        return;
-    }
-    if (nread == 0) {
-        return;
-    }
-    read_buffer_.AppendData(buf->base, nread);
-    ProcessGatewayMessages();
-}
-
-UV_WRITE_CB_FOR_CLASS(EngineConnection, DataSent) {
-    auto reclaim_worker_resource = gsl::finally([this, req] {
-        io_worker_->ReturnWriteBuffer(reinterpret_cast<char*>(req->data));
-        io_worker_->ReturnWriteRequest(req);
-    });
-    if (status != 0) {
-        HLOG(ERROR) << "Failed to send data, will close this connection: "
-                    << uv_strerror(status);
-        ScheduleClose();
     }
 }
 
@@ -4,9 +4,10 @@
 #include "common/uv.h"
 #include "common/protocol.h"
 #include "common/stat.h"
-#include "utils/appendable_buffer.h"
+#include "utils/payload_ref.h"
 #include "server/io_worker.h"
 #include "server/connection_base.h"
+#include "server/gateway_message_stream.h"
 
 namespace faas {
 namespace gateway {
@@ -19,18 +20,26 @@ public:
 
     static int type_id(uint16_t node_id) { return kBaseTypeId + node_id; }
 
+    // dispatched_requests_stat is shared by connections of the node, and
+    // ticked for each func call dispatched through this connection
     EngineConnection(Server* server, uint16_t node_id, uint16_t conn_id,
-                     std::span<const char> initial_data);
+                     std::span<const char> initial_data,
+                     stat::Counter* dispatched_requests_stat);
     ~EngineConnection();
 
     uint16_t node_id() const { return node_id_; }
     uint16_t conn_id() const { return conn_id_; }
+    stat::Counter* dispatched_requests_stat() { return dispatched_requests_stat_; }
 
     uv_stream_t* InitUVHandle(uv_loop_t* uv_loop) override;
     void Start(server::IOWorker* io_worker) override;
     void ScheduleClose() override;
 
     void SendMessage(const protocol::GatewayMessage& message, std::span<const char> payload);
+    // Payload is written without copying if it is owned and no smaller than
+    // server::kGatewayZeroCopyPayloadThreshold, in which case its reference
+    // is held until the write finishes
+    void SendMessage(const protocol::GatewayMessage& message, const utils::PayloadRef& payload);
 
 private:
     enum State { kCreated, kRunning, kClosing, kClosed };
@@ -38,19 +47,22 @@ private:
     Server* server_;
     uint16_t node_id_;
     uint16_t conn_id_;
+    stat::Counter* dispatched_requests_stat_;
     server::IOWorker* io_worker_;
     State state_;
     uv_tcp_t uv_tcp_handle_;
 
     std::string log_header_;
 
-    utils::AppendableBuffer read_buffer_;
+    server::GatewayMessageReader message_reader_;
+    server::GatewayMessageWriter message_writer_;
 
-    void ProcessGatewayMessages();
+    void OnRecvMessage(const protocol::GatewayMessage& message,
+                       const utils::PayloadRef& payload);
+    void OnWriteError(int status);
 
     DECLARE_UV_ALLOC_CB_FOR_CLASS(BufferAlloc);
     DECLARE_UV_READ_CB_FOR_CLASS(RecvData);
-    DECLARE_UV_WRITE_CB_FOR_CLASS(DataSent);
     DECLARE_UV_CLOSE_CB_FOR_CLASS(Close);
 
     DISALLOW_COPY_AND_ASSIGN(EngineConnection);
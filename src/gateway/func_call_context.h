@@ -3,6 +3,7 @@
 #include "base/common.h"
 #include "common/protocol.h"
 #include "utils/appendable_buffer.h"
+#include "utils/payload_ref.h"
 #include "server/connection_base.h"
 
 namespace faas {
@@ -19,32 +20,59 @@ public:
         kNotFound = 4
     };
 
-    explicit FuncCallContext() {}
+    explicit FuncCallContext() : input_(new utils::AppendableBuffer()) {}
     ~FuncCallContext() {}
 
     void set_func_name(std::string_view func_name) { func_name_.assign(func_name); }
     void set_method_name(std::string_view method_name) { method_name_.assign(method_name); }
     void set_h2_stream_id(int32_t h2_stream_id) { h2_stream_id_ = h2_stream_id; }
     void set_func_call(const protocol::FuncCall& func_call) { func_call_ = func_call; }
-    void append_input(std::span<const char> input) { input_.AppendData(input); }
-    void append_output(std::span<const char> output) { output_.AppendData(output); }
+    void append_input(std::span<const char> input) { input_->AppendData(input); }
+    void append_output(std::span<const char> output) {
+        DCHECK(output_ref_.empty());
+        output_.AppendData(output);
+    }
+    // Keep a reference to output if it is owned, otherwise copy it
+    void set_output(utils::PayloadRef output) {
+        output_.Reset();
+        if (output.owned()) {
+            output_ref_ = std::move(output);
+        } else {
+            output_ref_.Reset();
+            output_.AppendData(output.span());
+        }
+    }
     void set_status(Status status) { status_ = status; }
+    // Absolute monotonic timestamp in microseconds, 0 if there is no deadline
+    void set_deadline(int64_t deadline) { deadline_ = deadline; }
 
     std::string_view func_name() const { return func_name_; }
     std::string_view method_name() const { return method_name_; }
     int32_t h2_stream_id() const { return h2_stream_id_; }
     protocol::FuncCall func_call() const { return func_call_; }
-    std::span<const char> input() const { return input_.to_span(); }
-    std::span<const char> output() const { return output_.to_span(); }
+    std::span<const char> input() const { return input_->to_span(); }
+    // Input reference remains valid after Reset()
+    utils::PayloadRef input_ref() const { return utils::PayloadRef(input_, input_->to_span()); }
+    std::span<const char> output() const {
+        return output_ref_.empty() ? output_.to_span() : output_ref_.span();
+    }
     Status status() const { return status_; }
+    int64_t deadline() const { return deadline_; }
 
     void Reset() {
         status_ = kCreated;
         func_name_.clear();
         method_name_.clear();
         func_call_ = protocol::kInvalidFuncCall;
-        input_.Reset();
+        deadline_ = 0;
+        if (input_.use_count() > 1) {
+            // Input is still referenced by in-flight writes
+            input_.reset(new utils::AppendableBuffer());
+        } else {
+            input_->Reset();
+        }
         output_.Reset();
+        output_ref_.Reset();
     }
 
 private:
@@ -53,8 +81,10 @@ private:
     std::string method_name_;
     int32_t h2_stream_id_;
     protocol::FuncCall func_call_;
-    utils::AppendableBuffer input_;
+    int64_t deadline_;
+    std::shared_ptr<utils::AppendableBuffer> input_;
     utils::AppendableBuffer output_;
+    utils::PayloadRef output_ref_;
 
     DISALLOW_COPY_AND_ASSIGN(FuncCallContext);
 };
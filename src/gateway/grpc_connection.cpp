@@ -48,6 +48,7 @@ struct GrpcConnection::H2StreamContext {
     std::string service_name;
     std::string method_name;
     absl::flat_hash_map<std::string, std::string> headers;
+    int64_t timeout_us;  // From grpc-timeout, 0 if not set
     bool first_data_chunk;
     size_t body_size;
     utils::AppendableBuffer body_buffer;
@@ -65,6 +66,7 @@ struct GrpcConnection::H2StreamContext {
         this->service_name.clear();
         this->method_name.clear();
         this->headers.clear();
+        this->timeout_us = 0;
         this->first_data_chunk = true;
         this->body_size = 0;
         this->body_buffer.Reset();
@@ -288,6 +290,30 @@ void GrpcConnection::H2SendSettingsFrame() {
     H2SendPendingDataIfNecessary();
 }
 
+namespace {
+// grpc-timeout is at most 8 digits followed by a unit, see
+// https://github.com/grpc/grpc/blob/master/doc/PROTOCOL-HTTP2.md
+static bool ParseGrpcTimeout(std::string_view value, int64_t* timeout_us) {
+    if (value.size() < 2 || value.size() > 9) {
+        return false;
+    }
+    int64_t amount;
+    if (!absl::SimpleAtoi(value.substr(0, value.size() - 1), &amount) || amount < 0) {
+        return false;
+    }
+    switch (value.back()) {
+    case 'H': *timeout_us = amount * 3600 * 1000000; break;
+    case 'M': *timeout_us = amount * 60 * 1000000; break;
+    case 'S': *timeout_us = amount * 1000000; break;
+    case 'm': *timeout_us = amount * 1000; break;
+    case 'u': *timeout_us = amount; break;
+    case 'n': *timeout_us = std::max<int64_t>(amount / 1000, 1); break;
+    default: return false;
+    }
+    return true;
+}
+}
+
 bool GrpcConnection::H2ValidateAndPopulateHeader(H2StreamContext* context,
                                                  std::string_view name, std::string_view value) {
     if (absl::StartsWith(name, ":")) {
@@ -331,8 +357,7 @@ bool GrpcConnection::H2ValidateAndPopulateHeader(H2StreamContext* context,
             // grpc-message-type is ignored
             return true;
         } else if (name == "grpc-timeout") {
-            // grpc-timeout is ignored
-            return true;
+            return ParseGrpcTimeout(value, &context->timeout_us);
         } else if (name == "grpc-trace-bin") {
             // grpc-trace-bin is ignored
             return true;
@@ -408,6 +433,9 @@ void GrpcConnection::OnNewGrpcCall(H2StreamContext* context) {
     func_call_context->set_func_name(absl::StrCat("grpc:", context->service_name));
     func_call_context->set_method_name(context->method_name);
     func_call_context->set_h2_stream_id(context->stream_id);
+    if (context->timeout_us > 0) {
+        func_call_context->set_deadline(GetMonotonicMicroTimestamp() + context->timeout_us);
+    }
     func_call_context->append_input(context->body_buffer.to_span());
 
     grpc_calls_[context->stream_id] = func_call_context;
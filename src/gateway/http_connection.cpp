@@ -1,11 +1,20 @@
 #include "gateway/http_connection.h"
 
 #include "common/time.h"
+#include "common/http_deadline.h"
+#include "common/metrics.h"
+#include "common/span_recorder.h"
 #include "gateway/server.h"
 
+#include <absl/flags/flag.h>
+
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
 
+ABSL_FLAG(int, http_max_pipelined_requests, 16,
+          "Max number of requests in flight on one HTTP connection. Further "
+          "pipelined requests are not read until earlier responses are written.");
+
 #define HLOG(l) LOG(l) << log_header_
 #define HVLOG(l) VLOG(l) << log_header_
 
@@ -14,7 +23,11 @@ namespace gateway {
 
 HttpConnection::HttpConnection(Server* server, int connection_id)
     : server::ConnectionBase(kTypeId), server_(server), io_worker_(nullptr), state_(kCreated),
-      log_header_(fmt::format("HttpConnection[{}]: ", connection_id)) {
+      log_header_(fmt::format("HttpConnection[{}]: ", connection_id)),
+      parser_paused_(false), keep_alive_(true),
+      max_pipelined_requests_(gsl::narrow_cast<size_t>(
+          std::max(1, absl::GetFlag(FLAGS_http_max_pipelined_requests)))),
+      num_writing_requests_(0) {
     http_parser_init(&http_parser_, HTTP_REQUEST);
     http_parser_.data = this;
     http_parser_settings_init(&http_parser_settings_);
@@ -53,6 +66,11 @@ void HttpConnection::ScheduleClose() {
         return;
     }
     DCHECK(state_ == kRunning);
+    for (PipelinedRequest* request : pipeline_) {
+        if (request->func_call_context != nullptr && !request->finished) {
+            server_->DiscardFuncCall(request->func_call_context);
+        }
+    }
     uv_close(UV_AS_HANDLE(&uv_tcp_handle_), &HttpConnection::CloseCallback);
     state_ = kClosing;
 }
@@ -77,6 +95,40 @@ void HttpConnection::StopRecvData() {
     UV_DCHECK_OK(uv_read_stop(UV_AS_STREAM(&uv_tcp_handle_)));
 }
 
+void HttpConnection::PauseParsing() {
+    DCHECK(!parser_paused_);
+    // http_parser_execute returns right after the current request
+    http_parser_pause(&http_parser_, 1);
+    parser_paused_ = true;
+    StopRecvData();
+}
+
+void HttpConnection::ResumeParsing() {
+    DCHECK(parser_paused_);
+    http_parser_pause(&http_parser_, 0);
+    parser_paused_ = false;
+    if (unparsed_buffer_.length() > 0) {
+        size_t length = gsl::narrow_cast<size_t>(unparsed_buffer_.length());
+        size_t parsed = http_parser_execute(&http_parser_, &http_parser_settings_,
+                                            unparsed_buffer_.data(), length);
+        if (state_ != kRunning) {
+            return;
+        }
+        if (HTTP_PARSER_ERRNO(&http_parser_) == HPE_PAUSED) {
+            unparsed_buffer_.ConsumeFront(gsl::narrow_cast<int>(parsed));
+            return;
+        }
+        if (parsed < length) {
+            HLOG(WARNING) << fmt::format("HTTP parsing failed: {}, will close the connection",
+                                         http_errno_name(HTTP_PARSER_ERRNO(&http_parser_)));
+            ScheduleClose();
+            return;
+        }
+        unparsed_buffer_.Reset();
+    }
+    StartRecvData();
+}
+
 UV_READ_CB_FOR_CLASS(HttpConnection, RecvData) {
     auto reclaim_worker_resource = gsl::finally([this, buf] {
         if (buf->base != 0) {
@@ -96,9 +148,21 @@ UV_READ_CB_FOR_CLASS(HttpConnection, RecvData) {
         HLOG(WARNING) << "nread=0, will do nothing";
         return;
     }
+    if (parser_paused_) {
+        // Data read before reading is stopped
+        unparsed_buffer_.AppendData(buf->base, gsl::narrow_cast<int>(nread));
+        return;
+    }
     const char* data = buf->base;
     size_t length = gsl::narrow_cast<size_t>(nread);
     size_t parsed = http_parser_execute(&http_parser_, &http_parser_settings_, data, length);
+    if (state_ != kRunning) {
+        return;
+    }
+    if (HTTP_PARSER_ERRNO(&http_parser_) == HPE_PAUSED) {
+        unparsed_buffer_.AppendData(data + parsed, gsl::narrow_cast<int>(length - parsed));
+        return;
+    }
     if (parsed < length) {
         HLOG(WARNING) << fmt::format("HTTP parsing failed: {}, will close the connection",
                                      http_errno_name(static_cast<http_errno>(http_parser_.http_errno)));
@@ -107,13 +171,39 @@ UV_READ_CB_FOR_CLASS(HttpConnection, RecvData) {
 }
 
 UV_WRITE_CB_FOR_CLASS(HttpConnection, DataWritten) {
-    HVLOG(1) << "Successfully write response, will resume receiving new data";
-    if (status == 0) {
-        StartRecvData();
-    } else {
+    bool keep_alive = true;
+    DCHECK_LE(num_writing_requests_, pipeline_.size());
+    for (size_t i = 0; i < num_writing_requests_; i++) {
+        PipelinedRequest* request = pipeline_.front();
+        pipeline_.pop_front();
+        if (request->traced_call_id != 0) {
+            tracing::EndSpan(request->traced_call_id, tracing::Span::kGatewayResponseWrite);
+        }
+        keep_alive = keep_alive && request->keep_alive;
+        if (request->func_call_context != nullptr) {
+            func_call_contexts_.Return(request->func_call_context);
+        }
+        pipelined_request_pool_.Return(request);
+    }
+    HVLOG(1) << fmt::format("Successfully write {} responses", num_writing_requests_);
+    num_writing_requests_ = 0;
+    if (state_ != kRunning) {
+        return;
+    }
+    if (status != 0) {
         HLOG(WARNING) << "Write error, will close the connection: " << uv_strerror(status);
         ScheduleClose();
+        return;
+    }
+    if (!keep_alive) {
+        HVLOG(1) << "Connection not kept alive, will close it";
+        ScheduleClose();
+        return;
     }
+    if (parser_paused_ && keep_alive_ && pipeline_.size() < max_pipelined_requests_) {
+        ResumeParsing();
+    }
+    SendHttpResponses();
 }
 
 UV_ALLOC_CB_FOR_CLASS(HttpConnection, BufferAlloc) {
@@ -250,7 +340,9 @@ static std::string QueryStringToJSON(std::string_view qs) {
 }
 
 void HttpConnection::HttpParserOnMessageComplete() {
-    StopRecvData();
+    if (state_ != kRunning) {
+        return;
+    }
     HVLOG(1) << "Start parsing URL: " << std::string(url_buffer_.data(), url_buffer_.length());
     http_parser_url parsed_url;
     if (http_parser_parse_url(url_buffer_.data(), url_buffer_.length(), 0, &parsed_url) != 0) {
@@ -264,13 +356,30 @@ void HttpConnection::HttpParserOnMessageComplete() {
         ScheduleClose();
         return;
     }
+    PipelinedRequest* request = pipelined_request_pool_.Get();
+    request->func_call_context = nullptr;
+    request->finished = false;
+    request->keep_alive = http_should_keep_alive(&http_parser_) != 0;
+    request->body.clear();
+    request->traced_call_id = 0;
+    pipeline_.push_back(request);
+    std::string_view method = http_method_str(static_cast<http_method>(http_parser_.method));
     std::string_view qs;
     if (ReadParsedUrlField(&parsed_url, UF_QUERY, url_buffer_.data(), &qs)) {
-        OnNewHttpRequest(http_method_str(static_cast<http_method>(http_parser_.method)), path, qs);
+        OnNewHttpRequest(request, method, path, qs);
     } else {
-        OnNewHttpRequest(http_method_str(static_cast<http_method>(http_parser_.method)), path);
+        OnNewHttpRequest(request, method, path);
+    }
+    if (state_ != kRunning) {
+        return;
+    }
+    if (!request->keep_alive) {
+        // Requests after this one are never served
+        keep_alive_ = false;
+        PauseParsing();
+    } else if (pipeline_.size() >= max_pipelined_requests_) {
+        PauseParsing();
     }
-    ResetHttpParser();   
 }
 
 void HttpConnection::HttpParserOnNewHeader() {
@@ -284,97 +393,136 @@ void HttpConnection::HttpParserOnNewHeader() {
     headers_[field] = value;
 }
 
-void HttpConnection::ResetHttpParser() {
-    http_parser_init(&http_parser_, HTTP_REQUEST);
-}
-
 // Modify this function in engine 
-void HttpConnection::OnNewHttpRequest(std::string_view method, std::string_view path,
+void HttpConnection::OnNewHttpRequest(PipelinedRequest* request,
+                                      std::string_view method, std::string_view path,
                                       std::string_view qs) {
     DCHECK_IN_EVENT_LOOP_THREAD(uv_tcp_handle_.loop);
     HVLOG(1) << "New HTTP request: " << method << " " << path;
 
+    if (method == "GET" && path == stat::MetricsRegistry::kHttpPath) {
+        request->body = stat::MetricsRegistry::instance()->ExportPrometheusText();
+        FinishRequest(request, HttpStatus::OK, stat::MetricsRegistry::kHttpContentType);
+        return;
+    }
     if (!(method == "GET" || method == "POST") || !absl::StartsWith(path, "/function/")) {
-        SendHttpResponse(HttpStatus::NOT_FOUND);
+        FinishRequest(request, HttpStatus::NOT_FOUND);
         return;
     }
     std::string_view func_name = absl::StripPrefix(path, "/function/");
     auto func_entry = server_->func_config()->find_by_func_name(func_name);
     if (func_entry == nullptr || (!func_entry->allow_http_get && method == "GET")) {
-        SendHttpResponse(HttpStatus::NOT_FOUND);
+        FinishRequest(request, HttpStatus::NOT_FOUND);
         return;
     }
 
-    func_call_context_.Reset();
-    func_call_context_.set_func_name(func_name);
+    FuncCallContext* func_call_context = func_call_contexts_.Get();
+    func_call_context->Reset();
+    func_call_context->set_func_name(func_name);
+    int64_t deadline;
+    if (ReadDeadlineHttpHeader(headers_, &deadline)) {
+        func_call_context->set_deadline(deadline);
+    }
     if (func_entry->qs_as_input) {
         if (body_buffer_.length() > 0) {
             HLOG(WARNING) << "Body not empty, but qsAsInput is set for func " << func_name;
         }
         std::string encoded_json(QueryStringToJSON(qs));
-        func_call_context_.append_input(std::span<const char>(encoded_json.data(),
+        func_call_context->append_input(std::span<const char>(encoded_json.data(),
                                                               encoded_json.length()));
     } else {
-        func_call_context_.append_input(body_buffer_.to_span());
+        func_call_context->append_input(body_buffer_.to_span());
     }
-    server_->OnNewHttpFuncCall(this, &func_call_context_);
+    request->func_call_context = func_call_context;
+    server_->OnNewHttpFuncCall(this, func_call_context);
 }
 
 void HttpConnection::OnFuncCallFinished(FuncCallContext* func_call_context) {
-    DCHECK(func_call_context == &func_call_context_);
     io_worker_->ScheduleFunction(
-        this, absl::bind_front(&HttpConnection::OnFuncCallFinishedInternal, this));
+        this, absl::bind_front(&HttpConnection::OnFuncCallFinishedInternal, this,
+                               func_call_context));
 }
 
-void HttpConnection::SendHttpResponse(HttpStatus status, std::span<const char> body) {
+void HttpConnection::FinishRequest(PipelinedRequest* request, HttpStatus status,
+                                   std::string_view content_type) {
+    DCHECK(!request->finished);
+    request->finished = true;
+    request->status = status;
+    request->content_type = content_type;
+    SendHttpResponses();
+}
+
+void HttpConnection::SendHttpResponses() {
     DCHECK_IN_EVENT_LOOP_THREAD(uv_tcp_handle_.loop);
-    response_header_ = fmt::format(
-        "HTTP/1.1 {}\r\n"
-        "Date: {}\r\n"
-        "Server: {}\r\n"
-        "Connection: Keep-Alive\r\n"
-        "Content-Type: {}\r\n"
-        "Content-Length: {}\r\n"
-        "\r\n",
-        GetHttpStatusString(status),
-        absl::FormatTime(absl::RFC1123_full, absl::Now(), absl::UTCTimeZone()),
-        kServerString,
-        kResponseContentType,
-        body.size()
-    );
-    if (body.size() > 0) {
-        uv_buf_t bufs[] = {
-            { .base = const_cast<char*>(response_header_.data()), .len = response_header_.length() },
-            { .base = const_cast<char*>(body.data()), .len = body.size() }
-        };
-        UV_DCHECK_OK(uv_write(&response_write_req_, UV_AS_STREAM(&uv_tcp_handle_),
-                              bufs, 2, &HttpConnection::DataWrittenCallback));
-    } else {
-        uv_buf_t buf = {
-            .base = const_cast<char*>(response_header_.data()),
-            .len = response_header_.length()
-        };
-        UV_DCHECK_OK(uv_write(&response_write_req_, UV_AS_STREAM(&uv_tcp_handle_),
-                              &buf, 1, &HttpConnection::DataWrittenCallback));
+    if (state_ != kRunning || num_writing_requests_ > 0) {
+        // Remaining responses are sent once the ongoing write finishes
+        return;
     }
+    // Header and body of each response
+    absl::InlinedVector<uv_buf_t, 8> bufs;
+    while (num_writing_requests_ < pipeline_.size()) {
+        PipelinedRequest* request = pipeline_[num_writing_requests_];
+        if (!request->finished) {
+            break;
+        }
+        std::span<const char> body(request->body.data(), request->body.size());
+        if (request->func_call_context != nullptr) {
+            if (request->status == HttpStatus::OK) {
+                body = request->func_call_context->output();
+            }
+            uint64_t full_call_id = request->func_call_context->func_call().full_call_id;
+            if (tracing::IsSampled(full_call_id)) {
+                tracing::BeginSpan(full_call_id, tracing::Span::kGatewayResponseWrite);
+                request->traced_call_id = full_call_id;
+            }
+        }
+        io_worker_->http_header_cache()->BuildHeader(
+            request->status, request->content_type, request->keep_alive,
+            body.size(), &request->response_header);
+        bufs.push_back({
+            .base = const_cast<char*>(request->response_header.data()),
+            .len = request->response_header.length()
+        });
+        if (body.size() > 0) {
+            bufs.push_back({ .base = const_cast<char*>(body.data()), .len = body.size() });
+        }
+        num_writing_requests_++;
+        if (!request->keep_alive) {
+            break;
+        }
+    }
+    if (num_writing_requests_ == 0) {
+        return;
+    }
+    UV_DCHECK_OK(uv_write(&response_write_req_, UV_AS_STREAM(&uv_tcp_handle_),
+                          bufs.data(), gsl::narrow_cast<unsigned int>(bufs.size()),
+                          &HttpConnection::DataWrittenCallback));
 }
 
-void HttpConnection::OnFuncCallFinishedInternal() {
+void HttpConnection::OnFuncCallFinishedInternal(FuncCallContext* func_call_context) {
     DCHECK_IN_EVENT_LOOP_THREAD(uv_tcp_handle_.loop);
     if (state_ != kRunning) {
         HLOG(WARNING) << "HttpConnection is closing or has closed, will not send response";
         return;
     }
-    switch (func_call_context_.status()) {
+    auto iter = absl::c_find_if(pipeline_, [func_call_context] (PipelinedRequest* request) {
+        return request->func_call_context == func_call_context;
+    });
+    if (iter == pipeline_.end()) {
+        HLOG(ERROR) << "Cannot find the request of finished func call";
+        return;
+    }
+    PipelinedRequest* request = *iter;
+    switch (func_call_context->status()) {
     case FuncCallContext::kSuccess:
-        SendHttpResponse(HttpStatus::OK, func_call_context_.output());
+        FinishRequest(request, HttpStatus::OK);
         break;
     case FuncCallContext::kNotFound:
-        SendHttpResponse(HttpStatus::NOT_FOUND);
+        FinishRequest(request, HttpStatus::NOT_FOUND);
         break;
     case FuncCallContext::kNoNode:
     case FuncCallContext::kFailed:
-        SendHttpResponse(HttpStatus::INTERNAL_SERVER_ERROR);
+        FinishRequest(request, HttpStatus::INTERNAL_SERVER_ERROR);
         break;
     default:
         HLOG(ERROR) << "Invalid FuncCallContext status, will close the connection";
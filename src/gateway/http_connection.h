@@ -4,6 +4,7 @@
 #include "common/uv.h"
 #include "common/http_status.h"
 #include "utils/appendable_buffer.h"
+#include "utils/object_pool.h"
 #include "server/io_worker.h"
 #include "server/connection_base.h"
 #include "gateway/func_call_context.h"
@@ -15,11 +16,12 @@ namespace gateway {
 
 class Server;
 
+// Pipelined requests are parsed and dispatched without waiting for earlier
+// responses, and responses are written back in the order of requests
 class HttpConnection final : public server::ConnectionBase {
 public:
     static constexpr int kTypeId = 0;
 
-    static constexpr const char* kServerString = "FaaS/0.1";
     static constexpr const char* kResponseContentType = "text/plain";
 
     HttpConnection(Server* server, int connection_id);
@@ -41,10 +43,15 @@ private:
 
     std::string log_header_;
 
-    FuncCallContext func_call_context_;
     http_parser_settings http_parser_settings_;
     http_parser http_parser_;
     int header_field_value_flag_;
+    // Parsing is paused when too many requests are in the pipeline, or after
+    // a request not keeping the connection alive
+    bool parser_paused_;
+    bool keep_alive_;
+    // Received data not parsed because the parser is paused
+    utils::AppendableBuffer unparsed_buffer_;
 
     // For request
     utils::AppendableBuffer url_buffer_;
@@ -55,12 +62,31 @@ private:
     size_t header_value_buffer_pos_;
     absl::flat_hash_map<std::string_view, std::string_view> headers_;
 
-    // For response
-    std::string response_header_;
+    // Request in the pipeline, until its response is written
+    struct PipelinedRequest {
+        FuncCallContext* func_call_context;  // nullptr if not a func call
+        bool             finished;
+        bool             keep_alive;
+        HttpStatus       status;
+        std::string_view content_type;
+        std::string      body;  // Used if not a func call
+        std::string      response_header;
+        // full_call_id if response writing is traced, otherwise 0
+        uint64_t         traced_call_id;
+    };
+    size_t max_pipelined_requests_;
+    std::deque<PipelinedRequest*> pipeline_;
+    // Number of requests at the front of pipeline_, whose responses are
+    // being written by response_write_req_
+    size_t num_writing_requests_;
+    utils::SimpleObjectPool<PipelinedRequest> pipelined_request_pool_;
+    utils::SimpleObjectPool<FuncCallContext> func_call_contexts_;
     uv_write_t response_write_req_;
 
     void StartRecvData();
     void StopRecvData();
+    void PauseParsing();
+    void ResumeParsing();
 
     DECLARE_UV_READ_CB_FOR_CLASS(RecvData);
     DECLARE_UV_WRITE_CB_FOR_CLASS(DataWritten);
@@ -76,11 +102,15 @@ private:
     void HttpParserOnMessageComplete();
 
     void HttpParserOnNewHeader();
-    void ResetHttpParser();
-    void OnNewHttpRequest(std::string_view method, std::string_view path,
+    void OnNewHttpRequest(PipelinedRequest* request,
+                          std::string_view method, std::string_view path,
                           std::string_view qs = std::string_view{});
-    void SendHttpResponse(HttpStatus status, std::span<const char> body = std::span<const char>());
-    void OnFuncCallFinishedInternal();
+    void FinishRequest(PipelinedRequest* request, HttpStatus status,
+                       std::string_view content_type = kResponseContentType);
+    // Write responses of finished requests at the front of the pipeline
+    // with a single write
+    void SendHttpResponses();
+    void OnFuncCallFinishedInternal(FuncCallContext* func_call_context);
 
     static int HttpParserOnMessageBeginCallback(http_parser* http_parser);
     static int HttpParserOnUrlCallback(http_parser* http_parser, const char* data, size_t length);
@@ -0,0 +1,244 @@
+#include "gateway/load_balancer.h"
+
+#include <math.h>
+
+namespace faas {
+namespace gateway {
+
+namespace {
+// Finalizer of SplitMix64, hashes are stable across processes
+uint64_t Mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+}  // namespace
+
+bool LoadBalancer::ParsePolicy(std::string_view str, Policy* policy) {
+    if (str == "random") {
+        *policy = kRandom;
+    } else if (str == "per_fn_round_robin") {
+        *policy = kPerFuncRoundRobin;
+    } else if (str == "least_load") {
+        *policy = kLeastLoad;
+    } else if (str == "p2c") {
+        *policy = kPowerOfTwoChoices;
+    } else if (str == "consistent_hash") {
+        *policy = kConsistentHash;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+LoadBalancer::AtomicMovingAvg::AtomicMovingAvg(double alpha, size_t min_samples)
+    : alpha_(alpha), min_samples_(min_samples), avg_(0), n_samples_(0) {}
+
+void LoadBalancer::AtomicMovingAvg::AddSample(double sample) {
+    // Decides the update rule, concurrent samples may be counted in either way
+    size_t n_samples = n_samples_.fetch_add(1, std::memory_order_relaxed);
+    double avg = avg_.load(std::memory_order_relaxed);
+    double new_avg;
+    do {
+        if (n_samples < min_samples_) {
+            new_avg = avg + sample / min_samples_;
+        } else {
+            new_avg = avg + alpha_ * (sample - avg);
+        }
+    } while (!avg_.compare_exchange_weak(avg, new_avg, std::memory_order_relaxed));
+}
+
+double LoadBalancer::AtomicMovingAvg::GetValue() const {
+    if (n_samples_.load(std::memory_order_relaxed) < min_samples_) {
+        return 0;
+    } else {
+        return avg_.load(std::memory_order_relaxed);
+    }
+}
+
+LoadBalancer::Node::Node(uint16_t node_id)
+    : node_id(node_id), inflight_requests(0),
+      latency(/* alpha= */ 0.05, /* min_samples= */ 8) {}
+
+LoadBalancer::LoadBalancer(Policy policy, double load_factor, uint64_t random_seed)
+    : policy_(policy), load_factor_(std::max(load_factor, 1.0)),
+      random_state_(random_seed), total_inflight_requests_(0),
+      overall_latency_(/* alpha= */ 0.01, /* min_samples= */ 8),
+      next_node_idx_(new std::atomic<size_t>[protocol::kMaxFuncId + 1]) {
+    for (int i = 0; i <= protocol::kMaxFuncId; i++) {
+        next_node_idx_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+LoadBalancer::~LoadBalancer() {}
+
+size_t LoadBalancer::num_nodes() {
+    absl::ReaderMutexLock lk(&mu_);
+    return nodes_.size();
+}
+
+void LoadBalancer::AddNode(uint16_t node_id) {
+    absl::WriterMutexLock lk(&mu_);
+    if (node_indices_.contains(node_id)) {
+        LOG(WARNING) << "Node " << node_id << " already added";
+        return;
+    }
+    size_t idx = nodes_.size();
+    nodes_.push_back(std::make_unique<Node>(node_id));
+    node_indices_[node_id] = idx;
+    for (size_t i = 0; i < kNumVirtualNodes; i++) {
+        hash_ring_.push_back(std::make_pair(Mix64((uint64_t{node_id} << 32) | i), idx));
+    }
+    std::sort(hash_ring_.begin(), hash_ring_.end());
+}
+
+void LoadBalancer::RemoveNode(uint16_t node_id) {
+    absl::WriterMutexLock lk(&mu_);
+    auto iter = node_indices_.find(node_id);
+    if (iter == node_indices_.end()) {
+        LOG(WARNING) << "Node " << node_id << " not added";
+        return;
+    }
+    size_t idx = iter->second;
+    size_t last_idx = nodes_.size() - 1;
+    node_indices_.erase(iter);
+    total_inflight_requests_.fetch_sub(nodes_[idx]->inflight_requests.load(),
+                                       std::memory_order_relaxed);
+    // Move the last node into the vacant index, which keeps the hash ring
+    // sorted as only indices change
+    hash_ring_.erase(std::remove_if(hash_ring_.begin(), hash_ring_.end(),
+                                    [idx] (const auto& entry) { return entry.second == idx; }),
+                     hash_ring_.end());
+    if (idx != last_idx) {
+        nodes_[idx] = std::move(nodes_[last_idx]);
+        node_indices_[nodes_[idx]->node_id] = idx;
+        for (auto& entry : hash_ring_) {
+            if (entry.second == last_idx) {
+                entry.second = idx;
+            }
+        }
+    }
+    nodes_.pop_back();
+}
+
+bool LoadBalancer::PickNode(uint16_t func_id, uint16_t* node_id) {
+    absl::ReaderMutexLock lk(&mu_);
+    if (nodes_.empty()) {
+        return false;
+    }
+    size_t idx = 0;
+    switch (policy_) {
+    case kRandom:
+        idx = NextRandom(nodes_.size());
+        break;
+    case kPerFuncRoundRobin:
+        DCHECK_LE(func_id, protocol::kMaxFuncId);
+        idx = next_node_idx_[func_id].fetch_add(1, std::memory_order_relaxed) % nodes_.size();
+        break;
+    case kLeastLoad:
+        for (size_t i = 1; i < nodes_.size(); i++) {
+            if (nodes_[i]->inflight_requests.load(std::memory_order_relaxed)
+                    < nodes_[idx]->inflight_requests.load(std::memory_order_relaxed)) {
+                idx = i;
+            }
+        }
+        break;
+    case kPowerOfTwoChoices:
+        idx = PickPowerOfTwoChoices();
+        break;
+    case kConsistentHash:
+        idx = PickConsistentHash(func_id);
+        break;
+    default:
+        LOG(FATAL) << "Unknown load balancing policy";
+    }
+    Node* node = nodes_[idx].get();
+    node->inflight_requests.fetch_add(1, std::memory_order_relaxed);
+    total_inflight_requests_.fetch_add(1, std::memory_order_relaxed);
+    *node_id = node->node_id;
+    return true;
+}
+
+void LoadBalancer::OnRequestFinished(uint16_t node_id, int64_t latency_us) {
+    absl::ReaderMutexLock lk(&mu_);
+    auto iter = node_indices_.find(node_id);
+    if (iter == node_indices_.end()) {
+        // The node may have been removed after dispatching the call
+        VLOG(1) << "Unknown node " << node_id;
+        return;
+    }
+    Node* node = nodes_[iter->second].get();
+    size_t inflight_requests = node->inflight_requests.load(std::memory_order_relaxed);
+    DCHECK_GT(inflight_requests, 0U);
+    while (inflight_requests > 0) {
+        if (node->inflight_requests.compare_exchange_weak(
+                inflight_requests, inflight_requests - 1, std::memory_order_relaxed)) {
+            total_inflight_requests_.fetch_sub(1, std::memory_order_relaxed);
+            break;
+        }
+    }
+    // Latencies are only used for picking by power of two choices
+    if (latency_us > 0 && policy_ == kPowerOfTwoChoices) {
+        node->latency.AddSample(static_cast<double>(latency_us));
+        overall_latency_.AddSample(static_cast<double>(latency_us));
+    }
+}
+
+size_t LoadBalancer::NextRandom(size_t n) {
+    uint64_t x = random_state_.fetch_add(0x9e3779b97f4a7c15ULL, std::memory_order_relaxed);
+    return static_cast<size_t>(Mix64(x + 0x9e3779b97f4a7c15ULL) % n);
+}
+
+double LoadBalancer::NodeLatency(Node* node) {
+    double latency = node->latency.GetValue();
+    if (latency == 0) {
+        // Not enough samples yet, e.g. for newly added nodes
+        latency = overall_latency_.GetValue();
+    }
+    return std::max(latency, 1.0);
+}
+
+size_t LoadBalancer::PickPowerOfTwoChoices() {
+    size_t n = nodes_.size();
+    if (n == 1) {
+        return 0;
+    }
+    size_t a = NextRandom(n);
+    size_t b = NextRandom(n - 1);
+    if (b >= a) {
+        b++;
+    }
+    // Expected time to drain the node after adding this call
+    double cost_a = (nodes_[a]->inflight_requests.load(std::memory_order_relaxed) + 1)
+                    * NodeLatency(nodes_[a].get());
+    double cost_b = (nodes_[b]->inflight_requests.load(std::memory_order_relaxed) + 1)
+                    * NodeLatency(nodes_[b].get());
+    return cost_b < cost_a ? b : a;
+}
+
+size_t LoadBalancer::PickConsistentHash(uint16_t func_id) {
+    // As load_factor_ >= 1, capacity summed over nodes exceeds total inflight
+    // calls, thus some node is always below capacity
+    size_t capacity = static_cast<size_t>(
+        ceil(load_factor_ * static_cast<double>(
+            total_inflight_requests_.load(std::memory_order_relaxed) + 1) / nodes_.size()));
+    auto iter = std::lower_bound(hash_ring_.begin(), hash_ring_.end(),
+                                 std::make_pair(Mix64(func_id), size_t{0}));
+    for (size_t i = 0; i < hash_ring_.size(); i++) {
+        if (iter == hash_ring_.end()) {
+            iter = hash_ring_.begin();
+        }
+        if (nodes_[iter->second]->inflight_requests.load(std::memory_order_relaxed) < capacity) {
+            return iter->second;
+        }
+        ++iter;
+    }
+    // Inflight counts may change while scanning
+    return iter == hash_ring_.end() ? hash_ring_.begin()->second : iter->second;
+}
+
+}  // namespace gateway
+}  // namespace faas
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "base/common.h"
+#include "common/protocol.h"
+
+namespace faas {
+namespace gateway {
+
+// Picks the engine node for each func call. Nodes are tracked by their
+// inflight func calls, and by recent latencies of finished calls.
+//
+// Thread-safe. Picking nodes and finishing calls only take the reader side of
+// its lock, and update per-node states with atomics, so that concurrent IO
+// workers do not serialize on it. Adding and removing nodes take the writer
+// side.
+class LoadBalancer {
+public:
+    enum Policy {
+        kRandom,
+        kPerFuncRoundRobin,
+        kLeastLoad,          // Scan all nodes for the fewest inflight calls
+        kPowerOfTwoChoices,  // Better of two random nodes, by inflight calls and latency
+        kConsistentHash      // Consistent hashing of func_id with bounded load
+    };
+
+    static constexpr double kDefaultLoadFactor = 1.25;
+
+    static bool ParsePolicy(std::string_view str, Policy* policy);
+
+    // For kConsistentHash, a node takes a new call only if its inflight calls
+    // are below load_factor times the average of all nodes, otherwise the
+    // call goes to the next node on the hash ring
+    explicit LoadBalancer(Policy policy, double load_factor = kDefaultLoadFactor,
+                          uint64_t random_seed = 0);
+    ~LoadBalancer();
+
+    Policy policy() const { return policy_; }
+    size_t num_nodes();
+
+    void AddNode(uint16_t node_id);
+    // Inflight calls of the removed node are dropped, OnRequestFinished
+    // for them is ignored
+    void RemoveNode(uint16_t node_id);
+    // Pick a node for a new call of func_id, which is counted as inflight
+    // until OnRequestFinished. Returns false if there is no node.
+    bool PickNode(uint16_t func_id, uint16_t* node_id);
+    // latency_us is from dispatching the call to receiving its result
+    void OnRequestFinished(uint16_t node_id, int64_t latency_us);
+
+private:
+    // Virtual nodes of each node on the hash ring
+    static constexpr size_t kNumVirtualNodes = 64;
+
+    const Policy policy_;
+    const double load_factor_;
+
+    // Exponential moving average updated by compare-and-swap, as latencies
+    // of one node are reported by all IO workers
+    class AtomicMovingAvg {
+    public:
+        AtomicMovingAvg(double alpha, size_t min_samples);
+        void AddSample(double sample);
+        double GetValue() const;
+    private:
+        const double alpha_;
+        const size_t min_samples_;
+        std::atomic<double> avg_;
+        std::atomic<size_t> n_samples_;
+        DISALLOW_COPY_AND_ASSIGN(AtomicMovingAvg);
+    };
+
+    absl::Mutex mu_;
+    // SplitMix64 state, advanced atomically by each draw
+    std::atomic<uint64_t> random_state_;
+
+    struct Node {
+        uint16_t node_id;
+        std::atomic<size_t> inflight_requests;
+        AtomicMovingAvg latency;
+        explicit Node(uint16_t node_id);
+    } __attribute__ ((aligned (__FAAS_CACHE_LINE_SIZE)));
+    std::vector<std::unique_ptr<Node>> nodes_ ABSL_GUARDED_BY(mu_);
+    absl::flat_hash_map</* node_id */ uint16_t, /* index */ size_t>
+        node_indices_ ABSL_GUARDED_BY(mu_);
+    std::atomic<size_t> total_inflight_requests_;
+    // Latency of all nodes, used for nodes without enough samples
+    AtomicMovingAvg overall_latency_;
+
+    // Indexed by func_id
+    std::unique_ptr<std::atomic<size_t>[]> next_node_idx_;
+    // Sorted by hash value
+    std::vector<std::pair</* hash */ uint64_t, /* index */ size_t>>
+        hash_ring_ ABSL_GUARDED_BY(mu_);
+
+    // Uniformly random in [0, n)
+    size_t NextRandom(size_t n);
+    size_t PickPowerOfTwoChoices() ABSL_SHARED_LOCKS_REQUIRED(mu_);
+    size_t PickConsistentHash(uint16_t func_id) ABSL_SHARED_LOCKS_REQUIRED(mu_);
+    double NodeLatency(Node* node);
+
+    DISALLOW_COPY_AND_ASSIGN(LoadBalancer);
+};
+
+}  // namespace gateway
+}  // namespace faas
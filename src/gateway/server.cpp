@@ -3,6 +3,7 @@
 #include "ipc/base.h"
 #include "ipc/shm_region.h"
 #include "common/time.h"
+#include "common/span_recorder.h"
 #include "utils/fs.h"
 #include "utils/io.h"
 #include "utils/docker.h"
@@ -13,6 +14,13 @@
 ABSL_FLAG(size_t, max_running_requests, 0, "");
 ABSL_FLAG(bool, lb_per_fn_round_robin, false, "");
 ABSL_FLAG(bool, lb_pick_least_load, false, "");
+ABSL_FLAG(std::string, lb_policy, "",
+          "Policy for picking engine nodes: random, per_fn_round_robin, least_load, "
+          "p2c (power of two choices weighted by node latency) or consistent_hash "
+          "(by function, with bounded load). If empty, decided by lb_per_fn_round_robin "
+          "and lb_pick_least_load, or random");
+ABSL_FLAG(double, lb_hash_load_factor, faas::gateway::LoadBalancer::kDefaultLoadFactor,
+          "For consistent_hash, max inflight calls of a node relative to the average");
 
 #define HLOG(l) LOG(l) << "Server: "
 #define HVLOG(l) VLOG(l) << "Server: "
@@ -31,6 +39,24 @@ using protocol::IsFuncCallCompleteMessage;
 using protocol::IsFuncCallFailedMessage;
 using protocol::NewDispatchFuncCallGatewayMessage;
 
+namespace {
+LoadBalancer::Policy GetLoadBalancerPolicy() {
+    std::string policy_str = absl::GetFlag(FLAGS_lb_policy);
+    LoadBalancer::Policy policy = LoadBalancer::kRandom;
+    if (!policy_str.empty()) {
+        if (!LoadBalancer::ParsePolicy(policy_str, &policy)) {
+            LOG(FATAL) << "Unknown load balancing policy: " << policy_str;
+        }
+    } else if (absl::GetFlag(FLAGS_lb_per_fn_round_robin)) {
+        policy = LoadBalancer::kPerFuncRoundRobin;
+    } else if (absl::GetFlag(FLAGS_lb_pick_least_load)) {
+        policy = LoadBalancer::kLeastLoad;
+    }
+    return policy;
+}
+
+}  // namespace
+
 Server::Server()
     : engine_conn_port_(-1),
       http_port_(-1),
@@ -44,6 +70,10 @@ Server::Server()
       next_grpc_connection_id_(0),
       read_buffer_pool_("HandshakeRead", 128),
       next_call_id_(1),
+      num_running_func_calls_(0),
+      load_balancer_(GetLoadBalancerPolicy(), absl::GetFlag(FLAGS_lb_hash_load_factor),
+                     /* random_seed= */ std::random_device()()),
+      num_connected_nodes_(0),
       last_request_timestamp_(-1),
       incoming_requests_stat_(
           stat::Counter::StandardReportCallback("incoming_requests")),
@@ -75,6 +105,12 @@ void Server::StartInternal() {
     CHECK(fs_utils::ReadContents(func_config_file_, &func_config_json_))
         << "Failed to read from file " << func_config_file_;
     CHECK(func_config_.Load(func_config_json_));
+    for (int func_id = 0; func_id <= FuncConfig::kMaxFuncId; func_id++) {
+        if (func_config_.find_by_func_id(func_id) != nullptr) {
+            uint16_t id = gsl::narrow_cast<uint16_t>(func_id);
+            per_func_stats_[id] = std::make_unique<PerFuncStat>(id);
+        }
+    }
     // Start IO workers
     CHECK_GT(num_io_workers_, 0);
     HLOG(INFO) << fmt::format("Start {} IO workers", num_io_workers_);
@@ -94,6 +130,23 @@ void Server::StartInternal() {
     UV_CHECK_OK(uv_listen(
         UV_AS_STREAM(&uv_engine_conn_handle_), listen_backlog_,
         &Server::EngineConnectionCallback));
+    if (reuseport_accept()) {
+        // Engine connections stay with the server thread, as their IO workers
+        // are decided by handshake messages
+        HLOG(INFO) << fmt::format("IO workers listen on {}:{} for HTTP requests",
+                                  address_, http_port_);
+        ListenOnIOWorkers(io_workers_, address_, http_port_, listen_backlog_, [this] {
+            return OnIOWorkerAccept(std::shared_ptr<server::ConnectionBase>(
+                new HttpConnection(this, next_http_connection_id_.fetch_add(1))));
+        });
+        HLOG(INFO) << fmt::format("IO workers listen on {}:{} for gRPC requests",
+                                  address_, grpc_port_);
+        ListenOnIOWorkers(io_workers_, address_, grpc_port_, listen_backlog_, [this] {
+            return OnIOWorkerAccept(std::shared_ptr<server::ConnectionBase>(
+                new GrpcConnection(this, next_grpc_connection_id_.fetch_add(1))));
+        });
+        return;
+    }
     // Listen on address:http_port for HTTP requests
     UV_CHECK_OK(uv_ip4_addr(address_.c_str(), http_port_, &bind_addr));
     UV_CHECK_OK(uv_tcp_bind(&uv_http_handle_, (const struct sockaddr *)&bind_addr, 0));
@@ -120,16 +173,32 @@ void Server::OnConnectionClose(server::ConnectionBase* connection) {
     DCHECK_IN_EVENT_LOOP_THREAD(uv_loop());
     if (connection->type() == HttpConnection::kTypeId
           || connection->type() == GrpcConnection::kTypeId) {
-        absl::MutexLock lk(&mu_);
-        DCHECK(connections_.contains(connection->id()));
-        connections_.erase(connection->id());
+        Shard* shard = connection_shard(connection->id());
+        absl::MutexLock lk(&shard->mu);
+        DCHECK(shard->connections.contains(connection->id()));
+        shard->connections.erase(connection->id());
     } else if (connection->type() >= EngineConnection::kBaseTypeId) {
         EngineConnection* engine_connection = connection->as_ptr<EngineConnection>();
+        uint16_t node_id = engine_connection->node_id();
         HLOG(WARNING) << fmt::format("EngineConnection (node_id={}, conn_id={}) disconnected",
-                                     engine_connection->node_id(), engine_connection->conn_id());
-        absl::MutexLock lk(&mu_);
+                                     node_id, engine_connection->conn_id());
         DCHECK(engine_connections_.contains(connection->id()));
         engine_connections_.erase(connection->id());
+        for (const auto& [id, other] : engine_connections_) {
+            if (other->as_ptr<EngineConnection>()->node_id() == node_id) {
+                return;
+            }
+        }
+        // The last connection of the node is closed
+        connected_node_set_.erase(node_id);
+        load_balancer_.RemoveNode(node_id);
+        connected_nodes_.erase(absl::c_find(connected_nodes_, node_id));
+        num_connected_nodes_.store(connected_nodes_.size());
+        HLOG(INFO) << "Number of connected nodes: " << connected_nodes_.size();
+        if (!connected_nodes_.empty()) {
+            max_running_requests_ = absl::GetFlag(FLAGS_max_running_requests)
+                                    * connected_nodes_.size();
+        }
     } else {
         HLOG(FATAL) << "Unreachable";
     }
@@ -169,70 +238,110 @@ void Server::OnNewGrpcFuncCall(GrpcConnection* connection, FuncCallContext* func
 }
 
 void Server::DiscardFuncCall(FuncCallContext* func_call_context) {
-    absl::MutexLock lk(&mu_);
-    discarded_func_calls_.insert(func_call_context->func_call().full_call_id);
+    FuncCall func_call = func_call_context->func_call();
+    Shard* shard = func_call_shard(func_call);
+    absl::MutexLock lk(&shard->mu);
+    shard->discarded_func_calls.insert(func_call.full_call_id);
+}
+
+std::shared_ptr<server::ConnectionBase> Server::GetConnection(int connection_id) {
+    Shard* shard = connection_shard(connection_id);
+    absl::MutexLock lk(&shard->mu);
+    auto iter = shard->connections.find(connection_id);
+    return iter == shard->connections.end() ? nullptr : iter->second;
+}
+
+bool Server::GrabDiscardedFuncCall(const FuncCall& func_call) {
+    Shard* shard = func_call_shard(func_call);
+    absl::MutexLock lk(&shard->mu);
+    return shard->discarded_func_calls.erase(func_call.full_call_id) > 0;
+}
+
+bool Server::PopPendingFuncCall(FuncCallState* state,
+                                std::shared_ptr<server::ConnectionBase>* connection) {
+    while (!pending_func_calls_.empty()) {
+        *state = std::move(pending_func_calls_.front());
+        pending_func_calls_.pop();
+        if (GrabDiscardedFuncCall(state->func_call)) {
+            continue;
+        }
+        *connection = GetConnection(state->connection_id);
+        if (*connection != nullptr) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void Server::OnRecvEngineMessage(EngineConnection* src_connection, const GatewayMessage& message,
-                                 std::span<const char> payload) {
+                                 const utils::PayloadRef& payload) {
     int64_t current_timestamp = GetMonotonicMicroTimestamp();
     if (IsFuncCallCompleteMessage(message)
             || IsFuncCallFailedMessage(message)) {
         FuncCall func_call = GetFuncCallFromMessage(message);
         FuncCallContext* func_call_context = nullptr;
         std::shared_ptr<server::ConnectionBase> connection;
+        FuncCallState full_call_state;
+        bool discarded = false;
+        {
+            Shard* shard = func_call_shard(func_call);
+            absl::MutexLock lk(&shard->mu);
+            auto iter = shard->running_func_calls.find(func_call.full_call_id);
+            if (iter == shard->running_func_calls.end()) {
+                return;
+            }
+            full_call_state = iter->second;
+            shard->running_func_calls.erase(iter);
+            discarded = shard->discarded_func_calls.erase(func_call.full_call_id) > 0;
+        }
+        // Check if corresponding connection is still active
+        if (!discarded) {
+            connection = GetConnection(full_call_state.connection_id);
+            if (connection != nullptr) {
+                func_call_context = full_call_state.context;
+            }
+        }
+        FuncCallState next_state;
         FuncCallContext* next_func_call = nullptr;
         std::shared_ptr<server::ConnectionBase> next_connection;
-        uint16_t node_id = 0;
-        {
-            absl::MutexLock lk(&mu_);
-            if (running_func_calls_.contains(func_call.full_call_id)) {
-                const FuncCallState& full_call_state = running_func_calls_[func_call.full_call_id];
-                // Check if corresponding connection is still active
-                if (connections_.contains(full_call_state.connection_id)
-                      && !discarded_func_calls_.contains(func_call.full_call_id)) {
-                    connection = connections_[full_call_state.connection_id];
-                    func_call_context = full_call_state.context;
-                }
-                if (discarded_func_calls_.contains(func_call.full_call_id)) {
-                    discarded_func_calls_.erase(func_call.full_call_id);
-                }
-                dispatch_overhead_stat_.AddSample(gsl::narrow_cast<int32_t>(
-                    current_timestamp - full_call_state.dispatch_timestamp - message.processing_time));
-                running_func_calls_.erase(func_call.full_call_id);
-                FuncCallState state;
-                if (max_running_requests_ == 0 || running_func_calls_.size() < max_running_requests_) {
-                    while (!pending_func_calls_.empty()) {
-                        state = std::move(pending_func_calls_.front());
-                        pending_func_calls_.pop();
-                        if (discarded_func_calls_.contains(state.func_call.full_call_id)) {
-                            discarded_func_calls_.erase(state.func_call.full_call_id);
-                            continue;
-                        }
-                        if (connections_.contains(state.connection_id)) {
-                            next_connection = connections_[state.connection_id];
-                            next_func_call = state.context;
-                            break;
-                        }
-                    }
-                }
-                inflight_requests_per_node_[src_connection->node_id()]--;
-                if (next_func_call != nullptr) {
-                    FuncCall func_call = next_func_call->func_call();
-                    state.dispatch_timestamp = current_timestamp;
-                    queueing_delay_stat_.AddSample(gsl::narrow_cast<int32_t>(
-                        current_timestamp - state.recv_timestamp));
-                    running_func_calls_[func_call.full_call_id] = std::move(state);
-                    node_id = PickNextNode(func_call);
-                    running_requests_stat_.AddSample(
-                        gsl::narrow_cast<uint16_t>(running_func_calls_.size()));
-                }
+        if (max_running_requests_.load() > 0) {
+            absl::MutexLock lk(&pending_mu_);
+            if (PopPendingFuncCall(&next_state, &next_connection)) {
+                next_func_call = next_state.context;
+            } else {
+                num_running_func_calls_.fetch_sub(1);
             }
+        } else {
+            num_running_func_calls_.fetch_sub(1);
+        }
+        if (next_func_call != nullptr) {
+            next_state.dispatch_timestamp = current_timestamp;
+            Shard* shard = func_call_shard(next_state.func_call);
+            absl::MutexLock lk(&shard->mu);
+            shard->running_func_calls[next_state.func_call.full_call_id] = next_state;
+        }
+        load_balancer_.OnRequestFinished(
+            src_connection->node_id(),
+            current_timestamp - full_call_state.dispatch_timestamp);
+        uint16_t node_id = 0;
+        bool no_connected_nodes = false;
+        if (next_func_call != nullptr) {
+            no_connected_nodes = !load_balancer_.PickNode(next_state.func_call.func_id, &node_id);
+        }
+#ifndef __FAAS_DISABLE_STAT
+        dispatch_overhead_stat_.AddSample(gsl::narrow_cast<int32_t>(
+            current_timestamp - full_call_state.dispatch_timestamp - message.processing_time));
+        if (next_func_call != nullptr) {
+            queueing_delay_stat_.AddSample(gsl::narrow_cast<int32_t>(
+                current_timestamp - next_state.recv_timestamp));
+            running_requests_stat_.AddSample(
+                gsl::narrow_cast<uint16_t>(num_running_func_calls_.load()));
         }
+#endif
         if (func_call_context != nullptr) {
             if (IsFuncCallCompleteMessage(message)) {
                 func_call_context->set_status(FuncCallContext::kSuccess);
-                func_call_context->append_output(payload);
+                func_call_context->set_output(payload);
             } else if (IsFuncCallFailedMessage(message)) {
                 func_call_context->set_status(FuncCallContext::kFailed);
             } else {
@@ -241,7 +350,13 @@ void Server::OnRecvEngineMessage(EngineConnection* src_connection, const Gateway
             FinishFuncCall(std::move(connection), func_call_context);
         }
         if (next_func_call != nullptr) {
-            DispatchFuncCall(std::move(next_connection), next_func_call, node_id);
+            if (no_connected_nodes) {
+                HLOG(ERROR) << "There is no node connected";
+                AbortFuncCall(std::move(next_connection), next_func_call,
+                              FuncCallContext::kNoNode);
+            } else {
+                DispatchFuncCall(std::move(next_connection), next_func_call, node_id);
+            }
         }
     } else {
         HLOG(ERROR) << "Unknown engine message type";
@@ -256,98 +371,88 @@ Server::PerFuncStat::PerFuncStat(uint16_t func_id)
           fmt::format("request_interval[{}]", func_id))) {}
 
 void Server::TickNewFuncCall(uint16_t func_id, int64_t current_timestamp) {
-    if (!per_func_stats_.contains(func_id)) {
-        per_func_stats_[func_id] = std::unique_ptr<PerFuncStat>(new PerFuncStat(func_id));
+    auto iter = per_func_stats_.find(func_id);
+    if (iter == per_func_stats_.end()) {
+        return;
     }
-    PerFuncStat* per_func_stat = per_func_stats_[func_id].get();
+    PerFuncStat* per_func_stat = iter->second.get();
     per_func_stat->incoming_requests_stat.Tick();
-    if (current_timestamp <= per_func_stat->last_request_timestamp) {
-        current_timestamp = per_func_stat->last_request_timestamp + 1;
-    }
-    if (last_request_timestamp_ != -1) {
+    int64_t last_timestamp = stat::AdvanceTimestamp(
+        &per_func_stat->last_request_timestamp, &current_timestamp);
+    if (last_timestamp != -1) {
         per_func_stat->request_interval_stat.AddSample(gsl::narrow_cast<int32_t>(
-            current_timestamp - per_func_stat->last_request_timestamp));
+            current_timestamp - last_timestamp));
     }
-    per_func_stat->last_request_timestamp = current_timestamp;
-}
-
-uint16_t Server::PickNextNode(const protocol::FuncCall& func_call) {
-    size_t idx;
-    if (absl::GetFlag(FLAGS_lb_per_fn_round_robin)) {
-        idx = next_dispatch_node_idx_[func_call.func_id];
-        next_dispatch_node_idx_[func_call.func_id] = (idx + 1) % connected_nodes_.size();
-    } else if (absl::GetFlag(FLAGS_lb_pick_least_load)) {
-        idx = 0;
-        for (size_t i = 1; i < connected_nodes_.size(); i++) {
-            if (inflight_requests_per_node_[connected_nodes_[i]]
-                  < inflight_requests_per_node_[connected_nodes_[idx]]) {
-                idx = i;
-            }
-        }
-    } else {
-        idx = absl::Uniform<size_t>(random_bit_gen_, 0, connected_nodes_.size());
-    }
-    dispatched_requests_stat_[idx]->Tick();
-    uint16_t node_id = connected_nodes_[idx];
-    inflight_requests_per_node_[node_id]++;
-    return node_id;
 }
 
 void Server::OnNewFuncCallCommon(std::shared_ptr<server::ConnectionBase> parent_connection,
                                  FuncCallContext* func_call_context) {
     FuncCall func_call = func_call_context->func_call();
-    uint16_t node_id = 0;
+    tracing::BeginSpan(func_call.full_call_id, tracing::Span::kGatewayRequest);
+    int64_t current_timestamp = GetMonotonicMicroTimestamp();
+    FuncCallState state = {
+        .func_call = func_call,
+        .connection_id = parent_connection->id(),
+        .context = func_call_context,
+        .recv_timestamp = current_timestamp,
+        .dispatch_timestamp = current_timestamp
+    };
     bool server_overloaded = false;
-    bool no_connected_nodes = false;
-    {
-        absl::MutexLock lk(&mu_);
-        int64_t current_timestamp = GetMonotonicMicroTimestamp();
-        incoming_requests_stat_.Tick();
-        if (current_timestamp <= last_request_timestamp_) {
-            current_timestamp = last_request_timestamp_ + 1;
-        }
-        if (last_request_timestamp_ != -1) {
-            requests_instant_rps_stat_.AddSample(gsl::narrow_cast<float>(
-                1e6 / (current_timestamp - last_request_timestamp_)));
-            request_interval_stat_.AddSample(gsl::narrow_cast<int32_t>(
-                current_timestamp - last_request_timestamp_));
-        }
-        last_request_timestamp_ = current_timestamp;
-        TickNewFuncCall(func_call.func_id, current_timestamp);
-        if (connected_nodes_.size() == 0) {
-            no_connected_nodes = true;
+    size_t num_inflight_requests;
+    if (max_running_requests_.load() > 0) {
+        absl::MutexLock lk(&pending_mu_);
+        if (num_running_func_calls_.load() >= max_running_requests_.load()) {
+            pending_func_calls_.push(state);
+            server_overloaded = true;
         } else {
-            FuncCallState state = {
-                .func_call = func_call,
-                .connection_id = parent_connection->id(),
-                .context = func_call_context,
-                .recv_timestamp = current_timestamp,
-                .dispatch_timestamp = 0
-            };
-            if (max_running_requests_ > 0 && running_func_calls_.size() >= max_running_requests_) {
-                pending_func_calls_.push(std::move(state));
-                server_overloaded = true;
-            } else {
-                state.dispatch_timestamp = current_timestamp;
-                running_func_calls_[func_call.full_call_id] = std::move(state);
-                node_id = PickNextNode(func_call);
-                running_requests_stat_.AddSample(
-                    gsl::narrow_cast<uint16_t>(running_func_calls_.size()));
-            }
-            inflight_requests_stat_.AddSample(
-                gsl::narrow_cast<uint16_t>(running_func_calls_.size() + pending_func_calls_.size()));
+            num_running_func_calls_.fetch_add(1);
         }
+        num_inflight_requests = num_running_func_calls_.load() + pending_func_calls_.size();
+    } else {
+        num_inflight_requests = num_running_func_calls_.fetch_add(1) + 1;
+    }
+    uint16_t node_id = 0;
+    bool no_connected_nodes = false;
+    if (!server_overloaded) {
+        no_connected_nodes = !load_balancer_.PickNode(func_call.func_id, &node_id);
     }
+#ifndef __FAAS_DISABLE_STAT
+    incoming_requests_stat_.Tick();
+    TickNewFuncCall(func_call.func_id, current_timestamp);
+    int64_t last_timestamp = stat::AdvanceTimestamp(&last_request_timestamp_,
+                                                    &current_timestamp);
+    if (last_timestamp != -1) {
+        requests_instant_rps_stat_.AddSample(gsl::narrow_cast<float>(
+            1e6 / (current_timestamp - last_timestamp)));
+        request_interval_stat_.AddSample(gsl::narrow_cast<int32_t>(
+            current_timestamp - last_timestamp));
+    }
+    if (!server_overloaded && !no_connected_nodes) {
+        running_requests_stat_.AddSample(
+            gsl::narrow_cast<uint16_t>(num_running_func_calls_.load()));
+    }
+    if (num_connected_nodes_.load(std::memory_order_relaxed) > 0) {
+        inflight_requests_stat_.AddSample(gsl::narrow_cast<uint16_t>(num_inflight_requests));
+    }
+#else
+    (void) num_inflight_requests;
+#endif
     if (server_overloaded) {
         return;
     }
     if (no_connected_nodes) {
+        num_running_func_calls_.fetch_sub(1);
         HLOG(ERROR) << "There is no node connected";
         func_call_context->set_status(FuncCallContext::kNoNode);
         FinishFuncCall(std::move(parent_connection), func_call_context);
-    } else {
-        DispatchFuncCall(std::move(parent_connection), func_call_context, node_id);
+        return;
     }
+    {
+        Shard* shard = func_call_shard(func_call);
+        absl::MutexLock lk(&shard->mu);
+        shard->running_func_calls[func_call.full_call_id] = std::move(state);
+    }
+    DispatchFuncCall(std::move(parent_connection), func_call_context, node_id);
 }
 
 void Server::DispatchFuncCall(std::shared_ptr<server::ConnectionBase> parent_connection,
@@ -358,24 +463,44 @@ void Server::DispatchFuncCall(std::shared_ptr<server::ConnectionBase> parent_con
     server::ConnectionBase* engine_connection = io_worker->PickConnection(
         EngineConnection::type_id(node_id));
     if (engine_connection != nullptr) {
+        tracing::InstantSpan(func_call.full_call_id, tracing::Span::kGatewayDispatch);
         GatewayMessage dispatch_message = NewDispatchFuncCallGatewayMessage(func_call);
         dispatch_message.payload_size = func_call_context->input().size();
-        engine_connection->as_ptr<EngineConnection>()->SendMessage(
-            dispatch_message, func_call_context->input());
+        if (func_call_context->deadline() > 0) {
+            // Time spent in gateway is deducted from the budget
+            int64_t budget = func_call_context->deadline() - GetMonotonicMicroTimestamp();
+            dispatch_message.deadline_budget = gsl::narrow_cast<int32_t>(
+                std::clamp<int64_t>(budget, 1, std::numeric_limits<int32_t>::max()));
+        }
+        EngineConnection* connection = engine_connection->as_ptr<EngineConnection>();
+        connection->dispatched_requests_stat()->Tick();
+        connection->SendMessage(dispatch_message, func_call_context->input_ref());
     } else {
         HLOG(WARNING) << "There is no engine connection for node_id=" << node_id;
-        {
-            absl::MutexLock lk(&mu_);
-            DCHECK(running_func_calls_.contains(func_call.full_call_id));
-            running_func_calls_.erase(func_call.full_call_id);
-        }
-        func_call_context->set_status(FuncCallContext::kNotFound);
-        FinishFuncCall(std::move(parent_connection), func_call_context);
+        load_balancer_.OnRequestFinished(node_id, /* latency_us= */ 0);
+        AbortFuncCall(std::move(parent_connection), func_call_context,
+                      FuncCallContext::kNotFound);
+    }
+}
+
+void Server::AbortFuncCall(std::shared_ptr<server::ConnectionBase> parent_connection,
+                           FuncCallContext* func_call_context, FuncCallContext::Status status) {
+    FuncCall func_call = func_call_context->func_call();
+    {
+        Shard* shard = func_call_shard(func_call);
+        absl::MutexLock lk(&shard->mu);
+        DCHECK(shard->running_func_calls.contains(func_call.full_call_id));
+        shard->running_func_calls.erase(func_call.full_call_id);
     }
+    num_running_func_calls_.fetch_sub(1);
+    func_call_context->set_status(status);
+    FinishFuncCall(std::move(parent_connection), func_call_context);
 }
 
 void Server::FinishFuncCall(std::shared_ptr<server::ConnectionBase> parent_connection,
                             FuncCallContext* func_call_context) {
+    tracing::EndSpan(func_call_context->func_call().full_call_id,
+                     tracing::Span::kGatewayRequest);
     switch (parent_connection->type()) {
     case HttpConnection::kTypeId:
         parent_connection->as_ptr<HttpConnection>()->OnFuncCallFinished(func_call_context);
@@ -400,14 +525,20 @@ bool Server::OnEngineHandshake(uv_tcp_t* uv_handle, std::span<const char> data)
     uint16_t conn_id = message->conn_id;
     std::span<const char> remaining_data(data.data() + sizeof(GatewayMessage),
                                          data.size() - sizeof(GatewayMessage));
+    // Counter is kept after the node disconnects, and reused if it reconnects
+    if (!dispatched_requests_stat_.contains(node_id)) {
+        dispatched_requests_stat_[node_id] = std::make_unique<stat::Counter>(
+            stat::Counter::StandardReportCallback(
+                fmt::format("dispatched_requests[{}]", node_id)));
+    }
     std::shared_ptr<server::ConnectionBase> connection(
-        new EngineConnection(this, node_id, conn_id, remaining_data));
+        new EngineConnection(this, node_id, conn_id, remaining_data,
+                             dispatched_requests_stat_[node_id].get()));
     if (!connected_node_set_.contains(node_id)) {
         connected_node_set_.insert(node_id);
-        absl::MutexLock lk(&mu_);
         connected_nodes_.push_back(node_id);
-        dispatched_requests_stat_.emplace_back(new stat::Counter(
-            stat::Counter::StandardReportCallback(fmt::format("dispatched_requests[{}]", node_id))));
+        num_connected_nodes_.store(connected_nodes_.size());
+        load_balancer_.AddNode(node_id);
         HLOG(INFO) << "Number of connected nodes: " << connected_nodes_.size();
         max_running_requests_ = absl::GetFlag(FLAGS_max_running_requests) * connected_nodes_.size();
     }
@@ -422,6 +553,17 @@ bool Server::OnEngineHandshake(uv_tcp_t* uv_handle, std::span<const char> data)
     return true;
 }
 
+server::ConnectionBase* Server::OnIOWorkerAccept(
+        std::shared_ptr<server::ConnectionBase> connection) {
+    AssignConnectionId(connection.get());
+    server::ConnectionBase* ret = connection.get();
+    Shard* shard = connection_shard(connection->id());
+    absl::MutexLock lk(&shard->mu);
+    DCHECK(!shard->connections.contains(connection->id()));
+    shard->connections[connection->id()] = std::move(connection);
+    return ret;
+}
+
 UV_CONNECTION_CB_FOR_CLASS(Server, HttpConnection) {
     if (status != 0) {
         HLOG(WARNING) << "Failed to open HTTP connection: " << uv_strerror(status);
@@ -438,9 +580,10 @@ UV_CONNECTION_CB_FOR_CLASS(Server, HttpConnection) {
         RegisterConnection(io_worker, connection.get(), UV_AS_STREAM(client));
         DCHECK_GE(connection->id(), 0);
         {
-            absl::MutexLock lk(&mu_);
-            DCHECK(!connections_.contains(connection->id()));
-            connections_[connection->id()] = std::move(connection);
+            Shard* shard = connection_shard(connection->id());
+            absl::MutexLock lk(&shard->mu);
+            DCHECK(!shard->connections.contains(connection->id()));
+            shard->connections[connection->id()] = std::move(connection);
         }
     } else {
         LOG(ERROR) << "Failed to accept new HTTP connection";
@@ -464,9 +607,10 @@ UV_CONNECTION_CB_FOR_CLASS(Server, GrpcConnection) {
         RegisterConnection(io_worker, connection.get(), UV_AS_STREAM(client));
         DCHECK_GE(connection->id(), 0);
         {
-            absl::MutexLock lk(&mu_);
-            DCHECK(!connections_.contains(connection->id()));
-            connections_[connection->id()] = std::move(connection);
+            Shard* shard = connection_shard(connection->id());
+            absl::MutexLock lk(&shard->mu);
+            DCHECK(!shard->connections.contains(connection->id()));
+            shard->connections[connection->id()] = std::move(connection);
         }
     } else {
         LOG(ERROR) << "Failed to accept new gRPC connection";
@@ -8,6 +8,7 @@
 #include "common/func_config.h"
 #include "server/server_base.h"
 #include "gateway/func_call_context.h"
+#include "gateway/load_balancer.h"
 #include "gateway/http_connection.h"
 #include "gateway/grpc_connection.h"
 #include "gateway/engine_connection.h"
@@ -19,6 +20,7 @@ class Server final : public server::ServerBase {
 public:
     static constexpr int kDefaultListenBackLog = 64;
     static constexpr int kDefaultNumIOWorkers = 1;
+    static constexpr size_t kNumShards = 16;
 
     Server();
     ~Server();
@@ -40,7 +42,7 @@ public:
     void DiscardFuncCall(FuncCallContext* func_call_context);
     void OnRecvEngineMessage(EngineConnection* connection,
                              const protocol::GatewayMessage& message,
-                             std::span<const char> payload);
+                             const utils::PayloadRef& payload);
 
 private:
     std::string address_;
@@ -49,7 +51,7 @@ private:
     int grpc_port_;
     int listen_backlog_;
     int num_io_workers_;
-    size_t max_running_requests_;
+    std::atomic<size_t> max_running_requests_;
     std::string func_config_file_;
     std::string func_config_json_;
     FuncConfig func_config_;
@@ -61,8 +63,9 @@ private:
 
     size_t next_http_conn_worker_id_;
     size_t next_grpc_conn_worker_id_;
-    int next_http_connection_id_;
-    int next_grpc_connection_id_;
+    // Incremented within IO workers if reuseport_accept is on
+    std::atomic<int> next_http_connection_id_;
+    std::atomic<int> next_grpc_connection_id_;
 
     class OngoingEngineHandshake;
     friend class OngoingEngineHandshake;
@@ -74,9 +77,6 @@ private:
 
     std::atomic<uint32_t> next_call_id_;
 
-    absl::Mutex mu_;
-    std::vector</* node_id */ uint16_t> connected_nodes_ ABSL_GUARDED_BY(mu_);
-
     struct FuncCallState {
         protocol::FuncCall func_call;
         int                connection_id;  // of HttpConnection or GrpcConnection
@@ -85,52 +85,86 @@ private:
         int64_t            dispatch_timestamp;
     };
 
+    // Per-call tables are split into shards, each with its own lock, keyed by
+    // full_call_id (or connection id for client connections). Thus func calls
+    // handled by different IO workers rarely contend.
+    struct Shard {
+        absl::Mutex mu;
+        absl::flat_hash_map</* full_call_id */ uint64_t, FuncCallState>
+            running_func_calls ABSL_GUARDED_BY(mu);
+        absl::flat_hash_set</* full_call_id */ uint64_t>
+            discarded_func_calls ABSL_GUARDED_BY(mu);
+        absl::flat_hash_map</* connection_id */ int,
+                            std::shared_ptr<server::ConnectionBase>>
+            connections ABSL_GUARDED_BY(mu);
+    } __attribute__ ((aligned (__FAAS_CACHE_LINE_SIZE)));
+    Shard shards_[kNumShards];
+
+    std::atomic<size_t> num_running_func_calls_;
+    // Only used when max_running_requests_ is set
+    absl::Mutex pending_mu_;
+    std::queue<FuncCallState> pending_func_calls_ ABSL_GUARDED_BY(pending_mu_);
+
+    // Has its own lock
+    LoadBalancer load_balancer_;
+
+    // Only accessed in the server thread
+    std::vector</* node_id */ uint16_t> connected_nodes_;
+    absl::flat_hash_map</* node_id */ uint16_t, std::unique_ptr<stat::Counter>>
+        dispatched_requests_stat_;
+    // Updated in the server thread, and read within IO workers
+    std::atomic<size_t> num_connected_nodes_;
+
+    // Statistics below are thread-safe themselves, thus recorded by IO
+    // workers without locking
     struct PerFuncStat {
-        int64_t last_request_timestamp;
+        std::atomic<int64_t> last_request_timestamp;
         stat::Counter incoming_requests_stat;
         stat::StatisticsCollector<int32_t> request_interval_stat;
         explicit PerFuncStat(uint16_t func_id);
     };
 
-    absl::BitGen random_bit_gen_ ABSL_GUARDED_BY(mu_);
-    absl::flat_hash_map</* func_id */ uint16_t, size_t>
-        next_dispatch_node_idx_  ABSL_GUARDED_BY(mu_);
-    absl::flat_hash_map</* func_id */ uint16_t, size_t>
-        inflight_requests_per_node_  ABSL_GUARDED_BY(mu_);
-    absl::flat_hash_map</* full_call_id */ uint64_t, FuncCallState>
-        running_func_calls_ ABSL_GUARDED_BY(mu_);
-    std::queue<FuncCallState> pending_func_calls_ ABSL_GUARDED_BY(mu_);
-    absl::flat_hash_set</* full_call_id */ uint64_t>
-        discarded_func_calls_ ABSL_GUARDED_BY(mu_);
-    absl::flat_hash_map</* connection_id */ int,
-                        std::shared_ptr<server::ConnectionBase>>
-        connections_ ABSL_GUARDED_BY(mu_);
-
-    int64_t last_request_timestamp_ ABSL_GUARDED_BY(mu_);
-    stat::Counter incoming_requests_stat_ ABSL_GUARDED_BY(mu_);
-    stat::StatisticsCollector<int32_t> request_interval_stat_ ABSL_GUARDED_BY(mu_);
-    stat::StatisticsCollector<float> requests_instant_rps_stat_ ABSL_GUARDED_BY(mu_);
-    stat::StatisticsCollector<uint16_t> inflight_requests_stat_ ABSL_GUARDED_BY(mu_);
-    stat::StatisticsCollector<uint16_t> running_requests_stat_ ABSL_GUARDED_BY(mu_);
-    std::vector<std::unique_ptr<stat::Counter>> dispatched_requests_stat_ ABSL_GUARDED_BY(mu_);
-    stat::StatisticsCollector<int32_t> queueing_delay_stat_ ABSL_GUARDED_BY(mu_);
-    stat::StatisticsCollector<int32_t> dispatch_overhead_stat_ ABSL_GUARDED_BY(mu_);
-    absl::flat_hash_map</* func_id */ uint16_t, std::unique_ptr<PerFuncStat>>
-        per_func_stats_ ABSL_GUARDED_BY(mu_);
+    std::atomic<int64_t> last_request_timestamp_;
+    stat::Counter incoming_requests_stat_;
+    stat::StatisticsCollector<int32_t> request_interval_stat_;
+    stat::StatisticsCollector<float> requests_instant_rps_stat_;
+    stat::StatisticsCollector<uint16_t> inflight_requests_stat_;
+    stat::StatisticsCollector<uint16_t> running_requests_stat_;
+    stat::StatisticsCollector<int32_t> queueing_delay_stat_;
+    stat::StatisticsCollector<int32_t> dispatch_overhead_stat_;
+    // Created for all functions on start, and not modified afterwards
+    absl::flat_hash_map</* func_id */ uint16_t, std::unique_ptr<PerFuncStat>> per_func_stats_;
+
+    Shard* func_call_shard(const protocol::FuncCall& func_call) {
+        return &shards_[absl::Hash<uint64_t>()(func_call.full_call_id) % kNumShards];
+    }
+    Shard* connection_shard(int connection_id) {
+        return &shards_[gsl::narrow_cast<size_t>(connection_id) % kNumShards];
+    }
+    std::shared_ptr<server::ConnectionBase> GetConnection(int connection_id);
+    // Returns true if func_call was discarded, and clears the mark
+    bool GrabDiscardedFuncCall(const protocol::FuncCall& func_call);
+    // Pop the next pending func call to run, returns false if there is none
+    bool PopPendingFuncCall(FuncCallState* state,
+                            std::shared_ptr<server::ConnectionBase>* connection)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(pending_mu_);
 
     void StartInternal() override;
     void StopInternal() override;
     void OnConnectionClose(server::ConnectionBase* connection) override;
     bool OnEngineHandshake(uv_tcp_t* uv_handle, std::span<const char> data);
+    // Called within IO workers for connections accepted by them
+    server::ConnectionBase* OnIOWorkerAccept(std::shared_ptr<server::ConnectionBase> connection);
     void OnNewFuncCallCommon(std::shared_ptr<server::ConnectionBase> parent_connection,
                              FuncCallContext* func_call_context);
     void DispatchFuncCall(std::shared_ptr<server::ConnectionBase> parent_connection,
                           FuncCallContext* func_call_context, uint16_t node_id);
     void FinishFuncCall(std::shared_ptr<server::ConnectionBase> parent_connection,
                         FuncCallContext* func_call_context);
-    void TickNewFuncCall(uint16_t func_id, int64_t current_timestamp)
-        ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
-    uint16_t PickNextNode(const protocol::FuncCall& func_call) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    // For func calls in running_func_calls that cannot be dispatched
+    void AbortFuncCall(std::shared_ptr<server::ConnectionBase> parent_connection,
+                       FuncCallContext* func_call_context, FuncCallContext::Status status);
+    void TickNewFuncCall(uint16_t func_id, int64_t current_timestamp);
 
     DECLARE_UV_CONNECTION_CB_FOR_CLASS(HttpConnection);
     DECLARE_UV_CONNECTION_CB_FOR_CLASS(GrpcConnection);
@@ -66,6 +66,18 @@ std::string GetFuncWorkerOutputFifoName(uint16_t client_id) {
     return fmt::format("worker_{}_output", client_id);
 }
 
+std::string GetFuncWorkerInputQueueName(uint16_t client_id) {
+    return fmt::format("worker_{}_input", client_id);
+}
+
+std::string GetFuncWorkerOutputQueueName(uint16_t client_id) {
+    return fmt::format("worker_{}_output", client_id);
+}
+
+std::string GetFuncWorkerResponseFifoName(uint16_t client_id) {
+    return fmt::format("worker_{}_response", client_id);
+}
+
 std::string GetFuncCallInputShmName(uint64_t full_call_id) {
     return fmt::format("{}.i", full_call_id);
 }
@@ -74,9 +86,6 @@ std::string GetFuncCallOutputShmName(uint64_t full_call_id) {
     return fmt::format("{}.o", full_call_id);
 }
 
-std::string GetFuncCallOutputFifoName(uint64_t full_call_id) {
-    return fmt::format("{}.o", full_call_id);
-}
 
 }  // namespace ipc
 }  // namespace faas
@@ -14,10 +14,12 @@ std::string_view GetRootPathForFifo();
 
 std::string GetFuncWorkerInputFifoName(uint16_t client_id);
 std::string GetFuncWorkerOutputFifoName(uint16_t client_id);
+std::string GetFuncWorkerInputQueueName(uint16_t client_id);
+std::string GetFuncWorkerOutputQueueName(uint16_t client_id);
+std::string GetFuncWorkerResponseFifoName(uint16_t client_id);
 
 std::string GetFuncCallInputShmName(uint64_t full_call_id);
 std::string GetFuncCallOutputShmName(uint64_t full_call_id);
-std::string GetFuncCallOutputFifoName(uint64_t full_call_id);
 
 }  // namespace ipc
 }  // namespace faas
@@ -95,5 +95,21 @@ bool FifoPollForRead(int fd, int timeout_ms) {
     return true;
 }
 
+bool FifoPollForWrite(int fd, int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret == -1) {
+        PLOG(ERROR) << "poll failed";
+        return false;
+    }
+    if (ret == 0) {
+        LOG(ERROR) << "poll on given fifo timeout";
+        return false;
+    }
+    return true;
+}
+
 }  // namespace ipc
 }  // namespace faas
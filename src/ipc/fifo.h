@@ -14,6 +14,9 @@ int FifoOpenForReadWrite(std::string_view name, bool nonblocking = true);
 
 void FifoUnsetNonblocking(int fd);
 bool FifoPollForRead(int fd, int timeout_ms = -1);
+// Returns false on timeout. Errors of the fifo, e.g. no reader, are reported
+// by the following write instead.
+bool FifoPollForWrite(int fd, int timeout_ms = -1);
 
 }  // namespace ipc
 }  // namespace faas
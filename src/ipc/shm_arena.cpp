@@ -0,0 +1,215 @@
+#define __FAAS_USED_IN_BINDING
+#include "ipc/shm_arena.h"
+
+#include "ipc/base.h"
+#include "utils/fs.h"
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+namespace faas {
+namespace ipc {
+
+struct ShmArena::SegmentHeader {
+    uint64_t buffer_size;
+    uint64_t num_buffers;
+    uint64_t data_offset;
+    // Free list head is (aba_tag << 32) | (index + 1), where 0 in the lower
+    // 32 bits means the free list is empty
+    uint64_t free_list_head __attribute__ ((aligned (__FAAS_CACHE_LINE_SIZE)));
+};
+
+ShmArena::ShmArena(bool creator) : creator_(creator) {
+    memset(segments_, 0, sizeof(segments_));
+}
+
+ShmArena::~ShmArena() {
+    for (size_t i = 0; i < kNumSizeClasses; i++) {
+        Segment* segment = &segments_[i];
+        if (segment->base != nullptr) {
+            PCHECK(munmap(segment->base, segment->total_size) == 0);
+        }
+        if (creator_) {
+            std::string full_path = fs_utils::JoinPath(GetRootPathForShm(), segment_shm_name(i));
+            if (!fs_utils::Remove(full_path)) {
+                PLOG(ERROR) << "Failed to remove " << full_path;
+            }
+        }
+    }
+}
+
+std::string ShmArena::segment_shm_name(size_t size_class) {
+    return fmt::format("ShmArena_{}", size_class);
+}
+
+std::unique_ptr<ShmArena> ShmArena::Create(size_t segment_size, bool prefault) {
+    std::unique_ptr<ShmArena> arena(new ShmArena(/* creator= */ true));
+    for (size_t i = 0; i < kNumSizeClasses; i++) {
+        size_t buffer_size = buffer_size_of_class(i);
+        size_t num_buffers = std::max<size_t>(1, segment_size / buffer_size);
+        CHECK_LT(num_buffers, std::numeric_limits<uint32_t>::max());
+        size_t data_offset = sizeof(SegmentHeader) + sizeof(uint32_t) * num_buffers;
+        data_offset = (data_offset + kMinBufferSize - 1) / kMinBufferSize * kMinBufferSize;
+        size_t total_size = data_offset + buffer_size * num_buffers;
+        CHECK_LE(total_size, std::numeric_limits<uint32_t>::max())
+            << "Offsets within a segment must fit in 32 bits";
+        // Segments left by a previous engine that did not exit cleanly
+        ShmRemoveIfExists(segment_shm_name(i));
+        std::string full_path = fs_utils::JoinPath(GetRootPathForShm(), segment_shm_name(i));
+        int fd = open(full_path.c_str(), O_CREAT|O_EXCL|O_RDWR, __FAAS_FILE_CREAT_MODE);
+        PCHECK(fd != -1) << "open " << full_path << " failed";
+        PCHECK(ftruncate(fd, total_size) == 0) << "ftruncate failed";
+        CHECK(arena->MapSegment(i, fd, total_size, prefault));
+        PCHECK(close(fd) == 0) << "close failed";
+        // Build the memory layout, and link all buffers into the free list
+        Segment* segment = &arena->segments_[i];
+        segment->header->buffer_size = buffer_size;
+        segment->header->num_buffers = num_buffers;
+        segment->header->data_offset = data_offset;
+        segment->buffer_size = buffer_size;
+        segment->num_buffers = num_buffers;
+        segment->data_offset = data_offset;
+        for (size_t j = 0; j < num_buffers; j++) {
+            segment->next_links[j] = (j + 1 < num_buffers) ? gsl::narrow_cast<uint32_t>(j + 2) : 0;
+        }
+        __atomic_store_n(&segment->header->free_list_head, uint64_t{1}, __ATOMIC_RELEASE);
+        LOG(INFO) << fmt::format("ShmArena: size class {} has {} buffers of {} bytes",
+                                 i, num_buffers, buffer_size);
+    }
+    return arena;
+}
+
+std::unique_ptr<ShmArena> ShmArena::Open() {
+    std::unique_ptr<ShmArena> arena(new ShmArena(/* creator= */ false));
+    for (size_t i = 0; i < kNumSizeClasses; i++) {
+        std::string full_path = fs_utils::JoinPath(GetRootPathForShm(), segment_shm_name(i));
+        int fd = open(full_path.c_str(), O_RDWR);
+        if (fd == -1) {
+            PLOG(ERROR) << "open " << full_path << " failed";
+            return nullptr;
+        }
+        auto close_fd = gsl::finally([fd] {
+            PCHECK(close(fd) == 0) << "close failed";
+        });
+        struct stat statbuf;
+        PCHECK(fstat(fd, &statbuf) == 0) << "fstat failed";
+        size_t total_size = gsl::narrow_cast<size_t>(statbuf.st_size);
+        if (total_size < sizeof(SegmentHeader)
+              || !arena->MapSegment(i, fd, total_size, /* prefault= */ false)) {
+            LOG(ERROR) << "Failed to map " << full_path;
+            return nullptr;
+        }
+        Segment* segment = &arena->segments_[i];
+        segment->buffer_size = segment->header->buffer_size;
+        segment->num_buffers = segment->header->num_buffers;
+        segment->data_offset = segment->header->data_offset;
+        if (segment->buffer_size != buffer_size_of_class(i)
+              || segment->data_offset + segment->buffer_size * segment->num_buffers != total_size) {
+            LOG(ERROR) << "Invalid memory layout of " << full_path;
+            return nullptr;
+        }
+    }
+    return arena;
+}
+
+bool ShmArena::MapSegment(size_t size_class, int fd, size_t total_size, bool prefault) {
+    int flags = MAP_SHARED;
+    if (prefault) {
+        flags |= MAP_POPULATE;
+    }
+    void* ptr = mmap(0, total_size, PROT_READ|PROT_WRITE, flags, fd, 0);
+    if (ptr == MAP_FAILED) {
+        PLOG(ERROR) << "mmap failed";
+        return false;
+    }
+    Segment* segment = &segments_[size_class];
+    segment->base = reinterpret_cast<char*>(ptr);
+    segment->total_size = total_size;
+    segment->header = reinterpret_cast<SegmentHeader*>(ptr);
+    segment->next_links = reinterpret_cast<uint32_t*>(segment->base + sizeof(SegmentHeader));
+    return true;
+}
+
+bool ShmArena::PopFreeBuffer(Segment* segment, size_t* index) {
+    uint64_t* head_ptr = &segment->header->free_list_head;
+    uint64_t head = __atomic_load_n(head_ptr, __ATOMIC_ACQUIRE);
+    while (true) {
+        uint32_t link = static_cast<uint32_t>(head);
+        if (link == 0) {
+            return false;
+        }
+        uint32_t next = __atomic_load_n(&segment->next_links[link - 1], __ATOMIC_RELAXED);
+        uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (__atomic_compare_exchange_n(head_ptr, &head, new_head, /* weak= */ true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *index = link - 1;
+            return true;
+        }
+    }
+}
+
+void ShmArena::PushFreeBuffer(Segment* segment, size_t index) {
+    uint64_t* head_ptr = &segment->header->free_list_head;
+    uint64_t head = __atomic_load_n(head_ptr, __ATOMIC_RELAXED);
+    uint64_t new_head;
+    do {
+        __atomic_store_n(&segment->next_links[index], static_cast<uint32_t>(head),
+                         __ATOMIC_RELAXED);
+        new_head = (((head >> 32) + 1) << 32) | (index + 1);
+    } while (!__atomic_compare_exchange_n(head_ptr, &head, new_head, /* weak= */ true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+std::unique_ptr<ShmRegion> ShmArena::Allocate(size_t size, ShmArenaBuffer* buffer) {
+    for (size_t i = 0; i < kNumSizeClasses; i++) {
+        Segment* segment = &segments_[i];
+        if (segment->buffer_size < size) {
+            continue;
+        }
+        // Fall back to larger size classes if this one is used up
+        size_t index;
+        if (PopFreeBuffer(segment, &index)) {
+            size_t offset = segment->data_offset + segment->buffer_size * index;
+            buffer->segment = gsl::narrow_cast<uint16_t>(i);
+            buffer->offset = gsl::narrow_cast<uint32_t>(offset);
+            return std::unique_ptr<ShmRegion>(new ShmRegion(this, segment->base + offset, size));
+        }
+    }
+    return nullptr;
+}
+
+std::unique_ptr<ShmRegion> ShmArena::Get(const ShmArenaBuffer& buffer, size_t size) {
+    if (buffer.segment >= kNumSizeClasses) {
+        LOG(ERROR) << "Invalid segment " << buffer.segment;
+        return nullptr;
+    }
+    Segment* segment = &segments_[buffer.segment];
+    size_t offset = buffer.offset;
+    if (offset < segment->data_offset
+          || (offset - segment->data_offset) % segment->buffer_size != 0
+          || offset + segment->buffer_size > segment->total_size
+          || size > segment->buffer_size) {
+        LOG(ERROR) << fmt::format("Invalid buffer (segment={}, offset={}, size={})",
+                                  buffer.segment, buffer.offset, size);
+        return nullptr;
+    }
+    return std::unique_ptr<ShmRegion>(new ShmRegion(this, segment->base + offset, size));
+}
+
+void ShmArena::Free(char* base) {
+    for (size_t i = 0; i < kNumSizeClasses; i++) {
+        Segment* segment = &segments_[i];
+        char* data_base = segment->base + segment->data_offset;
+        if (base >= data_base && base < segment->base + segment->total_size) {
+            size_t index = gsl::narrow_cast<size_t>(base - data_base) / segment->buffer_size;
+            PushFreeBuffer(segment, index);
+            return;
+        }
+    }
+    LOG(FATAL) << "Pointer does not belong to ShmArena";
+}
+
+}  // namespace ipc
+}  // namespace faas
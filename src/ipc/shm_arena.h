@@ -0,0 +1,82 @@
+#pragma once
+
+#include "base/common.h"
+#include "ipc/shm_region.h"
+
+namespace faas {
+namespace ipc {
+
+// Descriptor of a buffer inside ShmArena, meaningful across processes
+struct ShmArenaBuffer {
+    uint16_t segment;
+    uint32_t offset;
+};
+
+// ShmArena holds one shared memory segment per size class, created by engine
+// and mapped once by every func worker. Each segment is carved into fixed-size
+// buffers, whose free list lives inside the segment itself and is manipulated
+// with lock-free operations from any process. Payloads are thus exchanged as
+// ShmArenaBuffer descriptors, without creating, mapping, or unlinking a shm
+// file per call.
+class ShmArena {
+public:
+    static constexpr size_t kNumSizeClasses = 6;
+    // Buffer sizes are 4KB, 16KB, 64KB, 256KB, 1MB, and 4MB
+    static constexpr size_t kMinBufferSize = 4096;
+    static constexpr size_t kSizeClassShift = 2;
+
+    static size_t buffer_size_of_class(size_t size_class) {
+        return kMinBufferSize << (size_class * kSizeClassShift);
+    }
+    static size_t max_buffer_size() {
+        return buffer_size_of_class(kNumSizeClasses - 1);
+    }
+
+    // Called by engine. Every segment has a size of roughly segment_size bytes,
+    // and contains at least one buffer. If prefault is set, all pages are
+    // populated upfront to avoid page faults on the critical path.
+    static std::unique_ptr<ShmArena> Create(size_t segment_size, bool prefault);
+    // Called by func workers, returns nullptr on failure
+    static std::unique_ptr<ShmArena> Open();
+
+    ~ShmArena();
+
+    // Returns nullptr if no free buffer can hold size bytes, in which case
+    // callers are expected to fall back to ShmCreate. The buffer is given back
+    // to the arena when the returned region is destructed with
+    // EnableRemoveOnDestruction() set, either in this process or in the
+    // process obtaining it via Get().
+    std::unique_ptr<ShmRegion> Allocate(size_t size, ShmArenaBuffer* buffer);
+    // Returns nullptr if buffer or size is invalid
+    std::unique_ptr<ShmRegion> Get(const ShmArenaBuffer& buffer, size_t size);
+
+private:
+    struct SegmentHeader;
+    struct Segment {
+        char*          base;
+        size_t         total_size;
+        SegmentHeader* header;
+        uint32_t*      next_links;
+        size_t         buffer_size;
+        size_t         num_buffers;
+        size_t         data_offset;
+    };
+
+    bool creator_;
+    Segment segments_[kNumSizeClasses];
+
+    explicit ShmArena(bool creator);
+
+    static std::string segment_shm_name(size_t size_class);
+    bool MapSegment(size_t size_class, int fd, size_t total_size, bool prefault);
+    bool PopFreeBuffer(Segment* segment, size_t* index);
+    void PushFreeBuffer(Segment* segment, size_t index);
+    void Free(char* base);
+
+    friend class ShmRegion;
+
+    DISALLOW_COPY_AND_ASSIGN(ShmArena);
+};
+
+}  // namespace ipc
+}  // namespace faas
@@ -2,7 +2,7 @@
 #include "ipc/shm_region.h"
 
 #include "ipc/base.h"
-#include "common/stat.h"
+#include "ipc/shm_arena.h"
 #include "common/time.h"
 #include "utils/fs.h"
 
@@ -51,7 +51,20 @@ std::unique_ptr<ShmRegion> ShmOpen(std::string_view name, bool readonly) {
     return std::unique_ptr<ShmRegion>(new ShmRegion(name, reinterpret_cast<char*>(ptr), size));
 }
 
+void ShmRemoveIfExists(std::string_view name) {
+    std::string full_path = fs_utils::JoinPath(GetRootPathForShm(), name);
+    if (fs_utils::Exists(full_path) && !fs_utils::Remove(full_path)) {
+        PLOG(ERROR) << "Failed to remove " << full_path;
+    }
+}
+
 ShmRegion::~ShmRegion() {
+    if (arena_ != nullptr) {
+        if (remove_on_destruction_) {
+            arena_->Free(base_);
+        }
+        return;
+    }
     if (size_ > 0) {
         PCHECK(munmap(base_, size_) == 0);
     }
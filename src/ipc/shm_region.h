@@ -7,10 +7,13 @@ namespace faas {
 namespace ipc {
 
 class ShmRegion;
+class ShmArena;
 
 // Shm{Create, Open} returns nullptr on failure
 std::unique_ptr<ShmRegion> ShmCreate(std::string_view name, size_t size);
 std::unique_ptr<ShmRegion> ShmOpen(std::string_view name, bool readonly = true);
+// Remove the shm file if it exists
+void ShmRemoveIfExists(std::string_view name);
 
 class ShmRegion {
 public:
@@ -29,15 +32,22 @@ public:
 
 private:
     ShmRegion(std::string_view name, char* base, size_t size)
-        : name_(name), base_(base), size_(size), remove_on_destruction_(false) {}
+        : name_(name), arena_(nullptr), base_(base), size_(size),
+          remove_on_destruction_(false) {}
+    // Region backed by a buffer of ShmArena, for which "remove" means
+    // giving the buffer back to the arena
+    ShmRegion(ShmArena* arena, char* base, size_t size)
+        : arena_(arena), base_(base), size_(size), remove_on_destruction_(false) {}
 
     std::string name_;
+    ShmArena* arena_;
     char* base_;
     size_t size_;
     bool remove_on_destruction_;
 
     friend std::unique_ptr<ShmRegion> ShmCreate(std::string_view name, size_t size);
     friend std::unique_ptr<ShmRegion> ShmOpen(std::string_view name, bool readonly);
+    friend class ShmArena;
 
     DISALLOW_COPY_AND_ASSIGN(ShmRegion);
 };
@@ -22,6 +22,11 @@ std::unique_ptr<SPSCQueue<T>> SPSCQueue<T>::Open(std::string_view name) {
     return std::unique_ptr<SPSCQueue<T>>(new SPSCQueue<T>(false, std::move(region)));
 }
 
+template<class T>
+void SPSCQueue<T>::RemoveIfExists(std::string_view name) {
+    ShmRemoveIfExists(fmt::format("SPSCQueue_{}", name));
+}
+
 template<class T>
 SPSCQueue<T>::SPSCQueue(bool consumer, std::unique_ptr<ShmRegion> shm_region) {
     consumer_ = consumer;
@@ -37,7 +42,6 @@ SPSCQueue<T>::SPSCQueue(bool consumer, std::unique_ptr<ShmRegion> shm_region) {
     head_ = reinterpret_cast<size_t*>(base_ptr + __FAAS_CACHE_LINE_SIZE);
     tail_ = reinterpret_cast<size_t*>(base_ptr + __FAAS_CACHE_LINE_SIZE * 2);
     cell_base_ = reinterpret_cast<char*>(base_ptr + __FAAS_CACHE_LINE_SIZE * 3);
-    wakeup_consumer_flag_ = false;
 }
 
 template<class T>
@@ -64,26 +68,28 @@ bool SPSCQueue<T>::Push(const T& message) {
     if (next == queue_size_) {
         next = 0;
     }
-    size_t head = __atomic_load_n(head_, __ATOMIC_ACQUIRE);
+    size_t head = __atomic_load_n(head_, __ATOMIC_ACQUIRE) & ~kConsumerSleepMask;
+    if (next == head) {
+        // Queue is full
+        return false;
+    }
+    STORE(T, cell(current), message);
+    __atomic_store_n(tail_, next, __ATOMIC_RELEASE);
+    // Pairs with ConsumerEnterSleep: the new tail must be visible before
+    // we check the sleep bit, otherwise the wakeup can be lost
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    head = __atomic_load_n(head_, __ATOMIC_RELAXED);
     if ((head & kConsumerSleepMask) == kConsumerSleepMask) {
-        if (!wakeup_consumer_flag_) {
+        // Clear the sleep bit ourselves, so that only one wakeup is issued
+        // for every time the consumer enters sleep
+        head = __atomic_fetch_and(head_, ~kConsumerSleepMask, __ATOMIC_ACQ_REL);
+        if ((head & kConsumerSleepMask) == kConsumerSleepMask) {
             VLOG(1) << "Consumer is sleeping, and will call wake function";
-            wakeup_consumer_flag_ = true;
             wakeup_consumer_fn_();
         }
-        head ^= kConsumerSleepMask;
-    } else {
-        wakeup_consumer_flag_ = false;
-    }
-    if (next != head) {
-        STORE(T, cell(current), message);
-        __atomic_store_n(tail_, next, __ATOMIC_RELEASE);
-        asm_volatile_memory();
-        return true;
-    } else {
-        // Queue is full
-        return false;
     }
+    asm_volatile_memory();
+    return true;
 }
 
 template<class T>
@@ -98,7 +104,7 @@ bool SPSCQueue<T>::Pop(T* message) {
     size_t current = __atomic_load_n(head_, __ATOMIC_RELAXED);
     if ((current & kConsumerSleepMask) == kConsumerSleepMask) {
         current ^= kConsumerSleepMask;
-        __atomic_fetch_xor(head_, kConsumerSleepMask, __ATOMIC_RELEASE);
+        __atomic_fetch_and(head_, ~kConsumerSleepMask, __ATOMIC_RELEASE);
         asm_volatile_memory();
     }
     if (current == __atomic_load_n(tail_, __ATOMIC_ACQUIRE)) {
@@ -117,10 +123,14 @@ bool SPSCQueue<T>::Pop(T* message) {
 }
 
 template<class T>
-void SPSCQueue<T>::ConsumerEnterSleep() {
+bool SPSCQueue<T>::ConsumerEnterSleep() {
     DCHECK(consumer_);
-    __atomic_fetch_or(head_, kConsumerSleepMask, __ATOMIC_RELEASE);
+    size_t head = __atomic_fetch_or(head_, kConsumerSleepMask, __ATOMIC_SEQ_CST);
     asm_volatile_memory();
+    head &= ~kConsumerSleepMask;
+    // Check again after setting the sleep bit, as the producer may have pushed
+    // a message without noticing our intention to sleep
+    return head == __atomic_load_n(tail_, __ATOMIC_SEQ_CST);
 }
 
 }  // namespace ipc
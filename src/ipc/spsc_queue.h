@@ -1,9 +1,5 @@
 #pragma once
 
-#ifndef __FAAS_SRC
-#error ipc/spsc_queue.h cannot be included outside
-#endif
-
 #include "base/common.h"
 #include "ipc/shm_region.h"
 
@@ -21,13 +17,17 @@ public:
     static std::unique_ptr<SPSCQueue<T>> Create(std::string_view name, size_t queue_size);
     // Called by the producer
     static std::unique_ptr<SPSCQueue<T>> Open(std::string_view name);
+    // Remove the queue left by a crashed consumer
+    static void RemoveIfExists(std::string_view name);
 
     // Methods called by the producer
     void SetWakeupConsumerFn(std::function<void()> fn);
     bool Push(const T& message);  // Return false if queue is full
 
     // Methods called by the consumer
-    void ConsumerEnterSleep();
+    // Return false if new messages arrive while entering sleep, in which case
+    // the consumer should keep popping instead of waiting for wakeup
+    bool ConsumerEnterSleep();
     bool Pop(T* message);  // Return false if queue is empty
 
 private:
@@ -39,7 +39,6 @@ private:
     char* cell_base_;
 
     std::function<void()> wakeup_consumer_fn_;
-    bool wakeup_consumer_flag_;
 
     SPSCQueue(bool producer, std::unique_ptr<ShmRegion> shm_region);
     static size_t compute_total_bytesize(size_t queue_size);
@@ -37,6 +37,12 @@ bool FuncProcess::Start(uv_loop_t* uv_loop, utils::BufferPool* read_buffer_pool)
     if (launcher_->func_worker_use_engine_socket()) {
         subprocess_.AddEnvVariable("FAAS_USE_ENGINE_SOCKET", "1");
     }
+    if (launcher_->func_worker_use_shm_queue()) {
+        subprocess_.AddEnvVariable("FAAS_USE_SHM_QUEUE", "1");
+    }
+    if (launcher_->fprocess_use_zygote()) {
+        subprocess_.AddEnvVariable("FAAS_ZYGOTE", "1");
+    }
     if (launcher_->engine_tcp_port() != -1) {
         subprocess_.AddEnvVariable("FAAS_ENGINE_TCP_PORT", launcher_->engine_tcp_port());
     }
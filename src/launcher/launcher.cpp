@@ -21,10 +21,12 @@ using protocol::ComputeMessageDelay;
 
 Launcher::Launcher()
     : state_(kCreated), func_id_(-1), fprocess_mode_(kInvalidMode), engine_tcp_port_(-1),
+      fprocess_use_zygote_(false),
       event_loop_thread_("Launcher/EL",
                          absl::bind_front(&Launcher::EventLoopThreadMain, this)),
       buffer_pool_("Launcher", kBufferSize),
       func_worker_use_engine_socket_(false),
+      func_worker_use_shm_queue_(false),
       engine_connection_(this),
       engine_message_delay_stat_(
           stat::StatisticsCollector<int32_t>::StandardReportCallback("engine_message_delay")) {
@@ -83,6 +85,9 @@ void Launcher::OnFuncProcessExit(FuncProcess* func_process) {
     if (fprocess_mode_ == kPythonMode) {
         HLOG(FATAL) << "Python fprocess exited";
     }
+    if (fprocess_use_zygote_) {
+        HLOG(FATAL) << "Zygote fprocess exited";
+    }
     int id = func_process->id();
     HLOG(WARNING) << "Function process " << id << " terminated";
     DCHECK_GE(id, 0);
@@ -113,6 +118,9 @@ bool Launcher::OnRecvHandshakeResponse(const Message& handshake_response,
     if (handshake_response.flags & protocol::kFuncWorkerUseEngineSocketFlag) {
         func_worker_use_engine_socket_ = true;
     }
+    if (handshake_response.flags & protocol::kFuncWorkerUseShmQueueFlag) {
+        func_worker_use_shm_queue_ = true;
+    }
     if (!func_config_.Load(std::string_view(payload.data(), payload.size()))) {
         HLOG(ERROR) << "Failed to load function config from handshake response, will close the connection";
         engine_connection_.ScheduleClose();
@@ -126,7 +134,7 @@ void Launcher::OnRecvMessage(const protocol::Message& message) {
     DCHECK_IN_EVENT_LOOP_THREAD(&uv_loop_);
     engine_message_delay_stat_.AddSample(ComputeMessageDelay(message));
     if (IsCreateFuncWorkerMessage(message)) {
-        if (fprocess_mode_ == kCppMode) {
+        if (fprocess_mode_ == kCppMode && !fprocess_use_zygote_) {
             auto func_process = std::make_unique<FuncProcess>(
                 this, /* id= */ func_processes_.size(),
                 /* initial_client_id= */ message.client_id);
@@ -135,7 +143,8 @@ void Launcher::OnRecvMessage(const protocol::Message& message) {
             } else {
                 HLOG(FATAL) << "Failed to start function process!";
             }
-        } else if (fprocess_mode_ == kGoMode
+        } else if (fprocess_mode_ == kCppMode
+                   || fprocess_mode_ == kGoMode
                    || fprocess_mode_ == kNodeJsMode
                    || fprocess_mode_ == kPythonMode) {
             if (func_processes_.empty()) {
@@ -47,12 +47,16 @@ public:
     void set_engine_tcp_port(int port) {
         engine_tcp_port_ = port;
     }
+    void set_fprocess_use_zygote(bool value) {
+        fprocess_use_zygote_ = value;
+    }
 
     int func_id() const { return func_id_; }
     std::string_view fprocess() const { return fprocess_; }
     std::string_view fprocess_working_dir() const { return fprocess_working_dir_; }
     std::string_view fprocess_output_dir() const { return fprocess_output_dir_; }
     int engine_tcp_port() const { return engine_tcp_port_; }
+    bool fprocess_use_zygote() const { return fprocess_use_zygote_; }
 
     std::string_view func_name() const {
         const FuncConfig::Entry* entry = func_config_.find_by_func_id(func_id_);
@@ -60,6 +64,7 @@ public:
     }
     std::string_view func_config_json() const { return func_config_json_; }
     bool func_worker_use_engine_socket() const { return func_worker_use_engine_socket_; }
+    bool func_worker_use_shm_queue() const { return func_worker_use_shm_queue_; }
 
     void Start();
     void ScheduleStop();
@@ -89,6 +94,9 @@ private:
     std::string fprocess_output_dir_;
     Mode fprocess_mode_;
     int engine_tcp_port_;
+    // In cpp mode, the only fprocess is a zygote, which forks new func
+    // workers upon CREATE_FUNC_WORKER messages
+    bool fprocess_use_zygote_;
 
     uv_loop_t uv_loop_;
     uv_async_t stop_event_;
@@ -99,6 +107,7 @@ private:
     FuncConfig func_config_;
     std::string func_config_json_;
     bool func_worker_use_engine_socket_;
+    bool func_worker_use_shm_queue_;
     EngineConnection engine_connection_;
     std::vector<std::unique_ptr<FuncProcess>> func_processes_;
 
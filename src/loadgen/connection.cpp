@@ -0,0 +1,366 @@
+#include "loadgen/connection.h"
+
+#include "common/time.h"
+#include "loadgen/load_generator.h"
+
+#define HLOG(l) LOG(l) << log_header_
+#define HVLOG(l) VLOG(l) << log_header_
+
+namespace faas {
+namespace loadgen {
+
+ClientConnection::ClientConnection(LoadGenerator* generator, int id)
+    : generator_(generator), id_(id), state_(kCreated),
+      log_header_(fmt::format("ClientConnection[{}]: ", id)) {}
+
+ClientConnection::~ClientConnection() {
+    DCHECK(state_ == kCreated || state_ == kClosed);
+}
+
+void ClientConnection::Connect(const struct sockaddr* addr) {
+    DCHECK(state_ == kCreated);
+    UV_CHECK_OK(uv_tcp_init(generator_->uv_loop(), &uv_tcp_handle_));
+    uv_tcp_handle_.data = this;
+    uv_connect_t* req = new uv_connect_t;
+    UV_CHECK_OK(uv_tcp_connect(req, &uv_tcp_handle_, addr, &ClientConnection::ConnectCallback));
+    state_ = kConnecting;
+}
+
+void ClientConnection::ScheduleClose() {
+    if (state_ == kClosing || state_ == kClosed) {
+        return;
+    }
+    if (state_ == kCreated) {
+        state_ = kClosed;
+        generator_->OnConnectionClosed(this);
+        return;
+    }
+    state_ = kClosing;
+    FailInflightRequests();
+    uv_close(UV_AS_HANDLE(&uv_tcp_handle_), &ClientConnection::CloseCallback);
+}
+
+void ClientConnection::WriteStatic(std::span<const char> data) {
+    uv_write_t* req = new uv_write_t;
+    uv_buf_t buf = uv_buf_init(const_cast<char*>(data.data()),
+                               gsl::narrow_cast<unsigned int>(data.size()));
+    UV_DCHECK_OK(uv_write(req, UV_AS_STREAM(&uv_tcp_handle_), &buf, 1,
+                          &ClientConnection::WriteStaticCallback));
+}
+
+void ClientConnection::WriteCopy(std::span<const char> data) {
+    uv_write_t* req = new uv_write_t;
+    char* copy = new char[data.size()];
+    memcpy(copy, data.data(), data.size());
+    req->data = copy;
+    uv_buf_t buf = uv_buf_init(copy, gsl::narrow_cast<unsigned int>(data.size()));
+    UV_DCHECK_OK(uv_write(req, UV_AS_STREAM(&uv_tcp_handle_), &buf, 1,
+                          &ClientConnection::WriteCopyCallback));
+}
+
+UV_CONNECT_CB_FOR_CLASS(ClientConnection, Connect) {
+    delete req;
+    if (state_ != kConnecting) {
+        return;
+    }
+    if (status != 0) {
+        HLOG(ERROR) << "Failed to connect: " << uv_strerror(status);
+        ScheduleClose();
+        return;
+    }
+    UV_CHECK_OK(uv_tcp_nodelay(&uv_tcp_handle_, 1));
+    UV_CHECK_OK(uv_read_start(UV_AS_STREAM(&uv_tcp_handle_),
+                              &ClientConnection::BufferAllocCallback,
+                              &ClientConnection::RecvDataCallback));
+    state_ = kConnected;
+    OnConnected();
+    generator_->OnConnectionReady(this);
+}
+
+UV_ALLOC_CB_FOR_CLASS(ClientConnection, BufferAlloc) {
+    buf->base = read_buffer_;
+    buf->len = sizeof(read_buffer_);
+}
+
+UV_READ_CB_FOR_CLASS(ClientConnection, RecvData) {
+    if (nread < 0) {
+        if (nread == UV_EOF) {
+            HLOG(WARNING) << "Connection closed by gateway";
+        } else {
+            HLOG(ERROR) << "Read error: " << uv_strerror(nread);
+        }
+        ScheduleClose();
+        return;
+    }
+    if (nread == 0 || state_ != kConnected) {
+        return;
+    }
+    OnDataReceived(std::span<const char>(buf->base, static_cast<size_t>(nread)));
+}
+
+UV_WRITE_CB_FOR_CLASS(ClientConnection, WriteStatic) {
+    delete req;
+    if (status != 0) {
+        HLOG(ERROR) << "Failed to write: " << uv_strerror(status);
+        ScheduleClose();
+    }
+}
+
+UV_WRITE_CB_FOR_CLASS(ClientConnection, WriteCopy) {
+    delete[] reinterpret_cast<char*>(req->data);
+    delete req;
+    if (status != 0) {
+        HLOG(ERROR) << "Failed to write: " << uv_strerror(status);
+        ScheduleClose();
+    }
+}
+
+UV_CLOSE_CB_FOR_CLASS(ClientConnection, Close) {
+    DCHECK(state_ == kClosing);
+    state_ = kClosed;
+    generator_->OnConnectionClosed(this);
+}
+
+HttpClientConnection::HttpClientConnection(LoadGenerator* generator, int id)
+    : ClientConnection(generator, id), has_inflight_request_(false) {
+    http_parser_init(&http_parser_, HTTP_RESPONSE);
+    http_parser_.data = this;
+    http_parser_settings_init(&http_parser_settings_);
+    http_parser_settings_.on_message_complete =
+        &HttpClientConnection::HttpParserOnMessageCompleteCallback;
+}
+
+HttpClientConnection::~HttpClientConnection() {}
+
+bool HttpClientConnection::CanSend() const {
+    return state_ == kConnected && !has_inflight_request_;
+}
+
+void HttpClientConnection::SendRequest(const Request& request) {
+    DCHECK(CanSend());
+    has_inflight_request_ = true;
+    inflight_request_ = request;
+    inflight_request_.send_timestamp = GetMonotonicMicroTimestamp();
+    WriteStatic(generator_->request_data());
+}
+
+void HttpClientConnection::OnConnected() {}
+
+void HttpClientConnection::OnDataReceived(std::span<const char> data) {
+    size_t parsed = http_parser_execute(&http_parser_, &http_parser_settings_,
+                                        data.data(), data.size());
+    if (parsed < data.size() && state_ == kConnected) {
+        HLOG(ERROR) << fmt::format("HTTP parsing failed: {}, will close the connection",
+                                   http_errno_name(static_cast<http_errno>(http_parser_.http_errno)));
+        ScheduleClose();
+    }
+}
+
+void HttpClientConnection::FailInflightRequests() {
+    if (has_inflight_request_) {
+        has_inflight_request_ = false;
+        generator_->OnRequestFinished(this, inflight_request_, false);
+    }
+}
+
+int HttpClientConnection::HttpParserOnMessageCompleteCallback(http_parser* http_parser) {
+    HttpClientConnection* self = reinterpret_cast<HttpClientConnection*>(http_parser->data);
+    if (!self->has_inflight_request_) {
+        LOG(ERROR) << self->log_header_ << "Receive response without request";
+        return -1;
+    }
+    bool success = (http_parser->status_code == 200);
+    if (!success) {
+        VLOG(1) << self->log_header_ << "HTTP status " << http_parser->status_code;
+    }
+    self->has_inflight_request_ = false;
+    self->generator_->OnRequestFinished(self, self->inflight_request_, success);
+    return 0;
+}
+
+namespace {
+static nghttp2_nv make_h2_nv(std::string_view name, std::string_view value) {
+    return {
+        .name = (uint8_t*) name.data(),
+        .value = (uint8_t*) value.data(),
+        .namelen = name.length(),
+        .valuelen = value.length(),
+        .flags = NGHTTP2_NV_FLAG_NONE
+    };
+}
+}
+
+GrpcClientConnection::GrpcClientConnection(LoadGenerator* generator, int id,
+                                           size_t max_streams)
+    : ClientConnection(generator, id), max_streams_(max_streams), h2_session_(nullptr),
+      within_h2_recv_(false) {}
+
+GrpcClientConnection::~GrpcClientConnection() {
+    DCHECK(streams_.empty());
+    if (h2_session_ != nullptr) {
+        nghttp2_session_del(h2_session_);
+    }
+}
+
+bool GrpcClientConnection::CanSend() const {
+    return state_ == kConnected && streams_.size() < max_streams_;
+}
+
+void GrpcClientConnection::OnConnected() {
+    nghttp2_session_callbacks* callbacks;
+    CHECK_EQ(nghttp2_session_callbacks_new(&callbacks), 0);
+    nghttp2_session_callbacks_set_on_header_callback(
+        callbacks, &GrpcClientConnection::H2OnHeaderCallback);
+    nghttp2_session_callbacks_set_on_stream_close_callback(
+        callbacks, &GrpcClientConnection::H2OnStreamCloseCallback);
+    CHECK_EQ(nghttp2_session_client_new(&h2_session_, callbacks, this), 0);
+    nghttp2_session_callbacks_del(callbacks);
+    nghttp2_settings_entry settings[] = {
+        { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, gsl::narrow_cast<uint32_t>(max_streams_) }
+    };
+    CHECK_EQ(nghttp2_submit_settings(h2_session_, NGHTTP2_FLAG_NONE, settings, 1), 0);
+    H2SendPendingData();
+}
+
+void GrpcClientConnection::SendRequest(const Request& request) {
+    DCHECK(CanSend());
+    const LoadGenerator::Config& config = generator_->config();
+    std::string path = fmt::format("/{}/{}", config.func_name, config.grpc_method);
+    std::string authority = fmt::format("{}:{}", config.address, config.port);
+    std::vector<nghttp2_nv> headers = {
+        make_h2_nv(":method", "POST"),
+        make_h2_nv(":scheme", "http"),
+        make_h2_nv(":path", path),
+        make_h2_nv(":authority", authority),
+        make_h2_nv("content-type", "application/grpc"),
+        make_h2_nv("te", "trailers")
+    };
+    auto stream = std::make_unique<Stream>();
+    stream->request = request;
+    stream->request.send_timestamp = GetMonotonicMicroTimestamp();
+    stream->body_offset = 0;
+    stream->http_status = 0;
+    stream->grpc_status = -1;
+    nghttp2_data_provider data_provider;
+    data_provider.source.ptr = stream.get();
+    data_provider.read_callback = &GrpcClientConnection::H2DataSourceReadCallback;
+    int32_t stream_id = nghttp2_submit_request(h2_session_, nullptr, headers.data(),
+                                               headers.size(), &data_provider, nullptr);
+    if (stream_id < 0) {
+        HLOG(ERROR) << "nghttp2_submit_request failed: " << nghttp2_strerror(stream_id);
+        generator_->OnRequestFinished(this, stream->request, false);
+        return;
+    }
+    streams_[stream_id] = std::move(stream);
+    // nghttp2 does not allow sending within callbacks of receiving, pending
+    // data will be sent after nghttp2_session_mem_recv returns
+    if (!within_h2_recv_) {
+        H2SendPendingData();
+    }
+}
+
+void GrpcClientConnection::OnDataReceived(std::span<const char> data) {
+    within_h2_recv_ = true;
+    ssize_t ret = nghttp2_session_mem_recv(
+        h2_session_, reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    within_h2_recv_ = false;
+    if (ret < 0) {
+        HLOG(ERROR) << "nghttp2_session_mem_recv failed: "
+                    << nghttp2_strerror(static_cast<int>(ret));
+        ScheduleClose();
+        return;
+    }
+    if (state_ == kConnected) {
+        H2SendPendingData();
+    }
+}
+
+void GrpcClientConnection::FailInflightRequests() {
+    auto streams = std::move(streams_);
+    streams_.clear();
+    for (const auto& entry : streams) {
+        generator_->OnRequestFinished(this, entry.second->request, false);
+    }
+}
+
+void GrpcClientConnection::H2SendPendingData() {
+    while (true) {
+        const uint8_t* data;
+        ssize_t size = nghttp2_session_mem_send(h2_session_, &data);
+        if (size < 0) {
+            HLOG(ERROR) << "nghttp2_session_mem_send failed: "
+                        << nghttp2_strerror(static_cast<int>(size));
+            ScheduleClose();
+            return;
+        }
+        if (size == 0) {
+            break;
+        }
+        WriteCopy(std::span<const char>(reinterpret_cast<const char*>(data),
+                                        static_cast<size_t>(size)));
+    }
+}
+
+int GrpcClientConnection::H2OnHeaderCallback(nghttp2_session* session,
+                                             const nghttp2_frame* frame,
+                                             const uint8_t* name, size_t namelen,
+                                             const uint8_t* value, size_t valuelen,
+                                             uint8_t flags, void* user_data) {
+    GrpcClientConnection* self = reinterpret_cast<GrpcClientConnection*>(user_data);
+    if (frame->hd.type != NGHTTP2_HEADERS) {
+        return 0;
+    }
+    auto iter = self->streams_.find(frame->hd.stream_id);
+    if (iter == self->streams_.end()) {
+        return 0;
+    }
+    Stream* stream = iter->second.get();
+    std::string_view name_view(reinterpret_cast<const char*>(name), namelen);
+    std::string value_str(reinterpret_cast<const char*>(value), valuelen);
+    if (name_view == ":status") {
+        stream->http_status = atoi(value_str.c_str());
+    } else if (name_view == "grpc-status") {
+        stream->grpc_status = atoi(value_str.c_str());
+    }
+    return 0;
+}
+
+int GrpcClientConnection::H2OnStreamCloseCallback(nghttp2_session* session, int32_t stream_id,
+                                                  uint32_t error_code, void* user_data) {
+    GrpcClientConnection* self = reinterpret_cast<GrpcClientConnection*>(user_data);
+    auto iter = self->streams_.find(stream_id);
+    if (iter == self->streams_.end()) {
+        return 0;
+    }
+    std::unique_ptr<Stream> stream = std::move(iter->second);
+    self->streams_.erase(iter);
+    bool success = (error_code == NGHTTP2_NO_ERROR && stream->http_status == 200
+                      && stream->grpc_status == 0);
+    if (!success) {
+        VLOG(1) << self->log_header_
+                << fmt::format("Stream {} failed: error_code={}, http_status={}, grpc_status={}",
+                               stream_id, error_code, stream->http_status, stream->grpc_status);
+    }
+    self->generator_->OnRequestFinished(self, stream->request, success);
+    return 0;
+}
+
+ssize_t GrpcClientConnection::H2DataSourceReadCallback(nghttp2_session* session,
+                                                       int32_t stream_id, uint8_t* buf,
+                                                       size_t length, uint32_t* data_flags,
+                                                       nghttp2_data_source* source,
+                                                       void* user_data) {
+    GrpcClientConnection* self = reinterpret_cast<GrpcClientConnection*>(user_data);
+    Stream* stream = reinterpret_cast<Stream*>(source->ptr);
+    std::span<const char> body = self->generator_->request_data();
+    size_t copy_size = std::min(length, body.size() - stream->body_offset);
+    memcpy(buf, body.data() + stream->body_offset, copy_size);
+    stream->body_offset += copy_size;
+    if (stream->body_offset == body.size()) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return static_cast<ssize_t>(copy_size);
+}
+
+}  // namespace loadgen
+}  // namespace faas
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "base/common.h"
+#include "common/uv.h"
+
+#include <http_parser.h>
+#include <nghttp2/nghttp2.h>
+
+namespace faas {
+namespace loadgen {
+
+class LoadGenerator;
+
+struct Request {
+    int64_t intended_timestamp;  // When the request should be sent, in microseconds
+    int64_t send_timestamp;      // When the request is actually sent
+};
+
+// Client connection to the gateway. Request bodies are prepared once by
+// LoadGenerator and shared by all connections.
+class ClientConnection : public uv::Base {
+public:
+    ClientConnection(LoadGenerator* generator, int id);
+    virtual ~ClientConnection();
+
+    int id() const { return id_; }
+    bool connected() const { return state_ == kConnected; }
+
+    void Connect(const struct sockaddr* addr);
+    void ScheduleClose();
+
+    // Whether a new request can be sent now
+    virtual bool CanSend() const = 0;
+    virtual void SendRequest(const Request& request) = 0;
+    virtual size_t num_inflight_requests() const = 0;
+
+protected:
+    enum State { kCreated, kConnecting, kConnected, kClosing, kClosed };
+
+    LoadGenerator* generator_;
+    int id_;
+    State state_;
+    std::string log_header_;
+    uv_tcp_t uv_tcp_handle_;
+
+    // Write data owned by the caller, which should outlive the write
+    void WriteStatic(std::span<const char> data);
+    // Copy data into an internal buffer before writing
+    void WriteCopy(std::span<const char> data);
+
+    virtual void OnConnected() = 0;
+    virtual void OnDataReceived(std::span<const char> data) = 0;
+    // Fail all inflight requests, called once the connection is closing
+    virtual void FailInflightRequests() = 0;
+
+private:
+    char read_buffer_[65536];
+
+    DECLARE_UV_CONNECT_CB_FOR_CLASS(Connect);
+    DECLARE_UV_ALLOC_CB_FOR_CLASS(BufferAlloc);
+    DECLARE_UV_READ_CB_FOR_CLASS(RecvData);
+    DECLARE_UV_WRITE_CB_FOR_CLASS(WriteStatic);
+    DECLARE_UV_WRITE_CB_FOR_CLASS(WriteCopy);
+    DECLARE_UV_CLOSE_CB_FOR_CLASS(Close);
+
+    DISALLOW_COPY_AND_ASSIGN(ClientConnection);
+};
+
+// HTTP/1.1 keep-alive connection, with at most one outstanding request
+class HttpClientConnection final : public ClientConnection {
+public:
+    HttpClientConnection(LoadGenerator* generator, int id);
+    ~HttpClientConnection();
+
+    bool CanSend() const override;
+    void SendRequest(const Request& request) override;
+    size_t num_inflight_requests() const override { return has_inflight_request_ ? 1 : 0; }
+
+private:
+    http_parser_settings http_parser_settings_;
+    http_parser http_parser_;
+    bool has_inflight_request_;
+    Request inflight_request_;
+
+    void OnConnected() override;
+    void OnDataReceived(std::span<const char> data) override;
+    void FailInflightRequests() override;
+
+    static int HttpParserOnMessageCompleteCallback(http_parser* http_parser);
+
+    DISALLOW_COPY_AND_ASSIGN(HttpClientConnection);
+};
+
+// HTTP/2 connection for gRPC calls, multiplexing up to max_streams requests
+class GrpcClientConnection final : public ClientConnection {
+public:
+    GrpcClientConnection(LoadGenerator* generator, int id, size_t max_streams);
+    ~GrpcClientConnection();
+
+    bool CanSend() const override;
+    void SendRequest(const Request& request) override;
+    size_t num_inflight_requests() const override { return streams_.size(); }
+
+private:
+    struct Stream {
+        Request request;
+        size_t body_offset;
+        int http_status;
+        int grpc_status;
+    };
+
+    size_t max_streams_;
+    nghttp2_session* h2_session_;
+    bool within_h2_recv_;
+    absl::flat_hash_map</* stream_id */ int32_t, std::unique_ptr<Stream>> streams_;
+
+    void OnConnected() override;
+    void OnDataReceived(std::span<const char> data) override;
+    void FailInflightRequests() override;
+
+    void H2SendPendingData();
+
+    static int H2OnHeaderCallback(nghttp2_session* session, const nghttp2_frame* frame,
+                                  const uint8_t* name, size_t namelen,
+                                  const uint8_t* value, size_t valuelen,
+                                  uint8_t flags, void* user_data);
+    static int H2OnStreamCloseCallback(nghttp2_session* session, int32_t stream_id,
+                                       uint32_t error_code, void* user_data);
+    static ssize_t H2DataSourceReadCallback(nghttp2_session* session, int32_t stream_id,
+                                            uint8_t* buf, size_t length, uint32_t* data_flags,
+                                            nghttp2_data_source* source, void* user_data);
+
+    DISALLOW_COPY_AND_ASSIGN(GrpcClientConnection);
+};
+
+}  // namespace loadgen
+}  // namespace faas
@@ -0,0 +1,253 @@
+#include "loadgen/load_generator.h"
+
+#include "common/time.h"
+
+#include <arpa/inet.h>
+
+#define HLOG(l) LOG(l) << log_header_
+#define HVLOG(l) VLOG(l) << log_header_
+
+namespace faas {
+namespace loadgen {
+
+LoadGenerator::LoadGenerator(std::string_view name, const Config& config)
+    : name_(name), config_(config), log_header_(fmt::format("{}: ", name)),
+      event_loop_thread_(fmt::format("{}/EL", name),
+                         absl::bind_front(&LoadGenerator::EventLoopThreadMain, this)),
+      next_connection_(0), num_connections_ready_(0), num_connections_closed_(0),
+      random_engine_(config.random_seed), interarrival_dist_(config.qps / 1e6),
+      next_arrival_timestamp_(0), start_timestamp_(0), measure_start_timestamp_(0),
+      end_timestamp_(0), arrival_finished_(false), closing_(false),
+      num_inflight_requests_(0) {
+    CHECK_GT(config_.qps, 0);
+    CHECK_GT(config_.num_connections, 0);
+    result_.num_scheduled = 0;
+    result_.num_succeeded = 0;
+    result_.num_failed = 0;
+    result_.num_dropped = 0;
+    result_.num_unfinished = 0;
+    UV_CHECK_OK(uv_loop_init(&uv_loop_));
+    uv_loop_.data = &event_loop_thread_;
+    UV_CHECK_OK(uv_timer_init(&uv_loop_, &arrival_timer_));
+    arrival_timer_.data = this;
+    UV_CHECK_OK(uv_timer_init(&uv_loop_, &drain_timer_));
+    drain_timer_.data = this;
+    BuildRequestData();
+}
+
+LoadGenerator::~LoadGenerator() {
+    UV_CHECK_OK(uv_loop_close(&uv_loop_));
+}
+
+void LoadGenerator::Start() {
+    event_loop_thread_.Start();
+}
+
+void LoadGenerator::WaitForFinish() {
+    event_loop_thread_.Join();
+}
+
+void LoadGenerator::BuildRequestData() {
+    std::string payload(config_.payload_size, '\0');
+    for (size_t i = 0; i < payload.size(); i++) {
+        payload[i] = static_cast<char>('a' + random_engine_() % 26);
+    }
+    if (config_.protocol == kHttp) {
+        request_data_ = fmt::format("POST /function/{} HTTP/1.1\r\n"
+                                    "Host: {}:{}\r\n"
+                                    "Content-Type: application/octet-stream\r\n"
+                                    "Content-Length: {}\r\n\r\n",
+                                    config_.func_name, config_.address, config_.port,
+                                    payload.size());
+        request_data_.append(payload);
+    } else {
+        // gRPC message framing: 1-byte compressed flag and 4-byte big-endian length
+        uint32_t length = htonl(gsl::narrow_cast<uint32_t>(payload.size()));
+        request_data_.assign(1, '\0');
+        request_data_.append(reinterpret_cast<const char*>(&length), sizeof(uint32_t));
+        request_data_.append(payload);
+    }
+}
+
+void LoadGenerator::EventLoopThreadMain() {
+    struct sockaddr_in addr;
+    UV_CHECK_OK(uv_ip4_addr(config_.address.c_str(), config_.port, &addr));
+    for (int i = 0; i < config_.num_connections; i++) {
+        std::unique_ptr<ClientConnection> connection;
+        if (config_.protocol == kHttp) {
+            connection = std::make_unique<HttpClientConnection>(this, i);
+        } else {
+            connection = std::make_unique<GrpcClientConnection>(
+                this, i, config_.max_streams_per_connection);
+        }
+        connection->Connect(reinterpret_cast<const struct sockaddr*>(&addr));
+        connections_.push_back(std::move(connection));
+    }
+    HLOG(INFO) << "Event loop starts";
+    int ret = uv_run(&uv_loop_, UV_RUN_DEFAULT);
+    if (ret != 0) {
+        HLOG(WARNING) << "uv_run returns non-zero value: " << ret;
+    }
+    HLOG(INFO) << "Event loop finishes";
+    connections_.clear();
+}
+
+void LoadGenerator::OnConnectionReady(ClientConnection* connection) {
+    num_connections_ready_++;
+    if (num_connections_ready_ == 1) {
+        // Start arrivals once the first connection is ready, so that
+        // connection setup is not measured
+        start_timestamp_ = GetMonotonicMicroTimestamp();
+        measure_start_timestamp_ = start_timestamp_ + absl::ToInt64Microseconds(config_.warmup);
+        end_timestamp_ = measure_start_timestamp_ + absl::ToInt64Microseconds(config_.duration);
+        next_arrival_timestamp_ = static_cast<double>(start_timestamp_);
+        HLOG(INFO) << fmt::format("Start sending requests at {} QPS", config_.qps);
+        ScheduleNextArrival();
+    }
+    DispatchQueuedRequests();
+}
+
+void LoadGenerator::OnRequestFinished(ClientConnection* connection, const Request& request,
+                                      bool success) {
+    DCHECK_GT(num_inflight_requests_, 0U);
+    num_inflight_requests_--;
+    if (request.intended_timestamp >= measure_start_timestamp_) {
+        if (success) {
+            int64_t current_timestamp = GetMonotonicMicroTimestamp();
+            result_.num_succeeded++;
+            result_.corrected_latency.Add(current_timestamp - request.intended_timestamp);
+            result_.uncorrected_latency.Add(current_timestamp - request.send_timestamp);
+        } else {
+            result_.num_failed++;
+        }
+    }
+    if (!closing_) {
+        DispatchQueuedRequests();
+    }
+    CheckFinished();
+}
+
+void LoadGenerator::OnConnectionClosed(ClientConnection* connection) {
+    num_connections_closed_++;
+    if (!closing_) {
+        HLOG(WARNING) << fmt::format("Connection {} closed, {} connections remain",
+                                     connection->id(),
+                                     config_.num_connections - num_connections_closed_);
+        if (num_connections_closed_ == config_.num_connections) {
+            HLOG(ERROR) << "All connections closed";
+            CloseAll();
+        }
+    }
+}
+
+void LoadGenerator::ScheduleNextArrival() {
+    int64_t current_timestamp = GetMonotonicMicroTimestamp();
+    int64_t wait_us = static_cast<int64_t>(next_arrival_timestamp_) - current_timestamp;
+    // libuv timers have millisecond resolution, a timeout of 0 makes the event
+    // loop poll without blocking until the exact arrival time
+    uint64_t timeout_ms = wait_us > 1000 ? static_cast<uint64_t>(wait_us / 1000) : 0;
+    UV_DCHECK_OK(uv_timer_start(&arrival_timer_, &LoadGenerator::ArrivalCallback,
+                                timeout_ms, 0));
+}
+
+bool LoadGenerator::TrySendRequest(const Request& request) {
+    size_t n = connections_.size();
+    for (size_t i = 0; i < n; i++) {
+        ClientConnection* connection = connections_[(next_connection_ + i) % n].get();
+        if (connection->CanSend()) {
+            next_connection_ = (next_connection_ + i + 1) % n;
+            num_inflight_requests_++;
+            connection->SendRequest(request);
+            return true;
+        }
+    }
+    return false;
+}
+
+void LoadGenerator::DispatchQueuedRequests() {
+    while (!queued_requests_.empty()) {
+        if (!TrySendRequest(queued_requests_.front())) {
+            break;
+        }
+        queued_requests_.pop_front();
+    }
+}
+
+void LoadGenerator::CheckFinished() {
+    if (arrival_finished_ && !closing_
+          && num_inflight_requests_ == 0 && queued_requests_.empty()) {
+        HLOG(INFO) << "All requests finished";
+        CloseAll();
+    }
+}
+
+void LoadGenerator::CloseAll() {
+    if (closing_) {
+        return;
+    }
+    closing_ = true;
+    for (const Request& request : queued_requests_) {
+        if (request.intended_timestamp >= measure_start_timestamp_) {
+            result_.num_unfinished++;
+        }
+    }
+    queued_requests_.clear();
+    uint64_t num_failed = result_.num_failed;
+    for (const auto& connection : connections_) {
+        connection->ScheduleClose();
+    }
+    // Requests still inflight are failed by closing connections
+    result_.num_unfinished += result_.num_failed - num_failed;
+    result_.num_failed = num_failed;
+    uv_close(UV_AS_HANDLE(&arrival_timer_), nullptr);
+    uv_close(UV_AS_HANDLE(&drain_timer_), nullptr);
+}
+
+UV_TIMER_CB_FOR_CLASS(LoadGenerator, Arrival) {
+    if (closing_) {
+        return;
+    }
+    int64_t current_timestamp = GetMonotonicMicroTimestamp();
+    while (next_arrival_timestamp_ <= current_timestamp
+             && next_arrival_timestamp_ < end_timestamp_) {
+        Request request = {
+            .intended_timestamp = static_cast<int64_t>(next_arrival_timestamp_),
+            .send_timestamp = 0
+        };
+        bool measured = request.intended_timestamp >= measure_start_timestamp_;
+        if (measured) {
+            result_.num_scheduled++;
+        }
+        if (!queued_requests_.empty() || !TrySendRequest(request)) {
+            if (queued_requests_.size() < config_.max_queued_requests) {
+                queued_requests_.push_back(request);
+            } else if (measured) {
+                result_.num_dropped++;
+            }
+        }
+        if (config_.arrival == kFixed) {
+            next_arrival_timestamp_ += 1e6 / config_.qps;
+        } else {
+            next_arrival_timestamp_ += interarrival_dist_(random_engine_);
+        }
+    }
+    if (next_arrival_timestamp_ < end_timestamp_) {
+        ScheduleNextArrival();
+    } else {
+        HLOG(INFO) << fmt::format("Arrivals finished, {} requests outstanding",
+                                  num_inflight_requests_ + queued_requests_.size());
+        arrival_finished_ = true;
+        UV_DCHECK_OK(uv_timer_start(&drain_timer_, &LoadGenerator::DrainTimeoutCallback,
+                                    absl::ToInt64Milliseconds(config_.drain_timeout), 0));
+        CheckFinished();
+    }
+}
+
+UV_TIMER_CB_FOR_CLASS(LoadGenerator, DrainTimeout) {
+    HLOG(WARNING) << fmt::format("{} requests not finished after drain timeout",
+                                 num_inflight_requests_ + queued_requests_.size());
+    CloseAll();
+}
+
+}  // namespace loadgen
+}  // namespace faas
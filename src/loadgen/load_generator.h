@@ -0,0 +1,124 @@
+#pragma once
+
+#include "base/common.h"
+#include "base/thread.h"
+#include "common/uv.h"
+#include "utils/histogram.h"
+#include "loadgen/connection.h"
+
+#include <random>
+
+namespace faas {
+namespace loadgen {
+
+// Open-loop load generator: requests are issued following a fixed or
+// Poisson arrival schedule, regardless of completion of earlier requests.
+// Requests due when all connections are busy wait in a queue, and latency is
+// measured from the scheduled time (correcting coordinated omission), in
+// addition to the latency from the actual send time.
+class LoadGenerator final : public uv::Base {
+public:
+    enum Protocol { kHttp, kGrpc };
+    enum Arrival { kFixed, kPoisson };
+
+    struct Config {
+        Protocol protocol;
+        Arrival arrival;
+        std::string address;
+        int port;
+        // For HTTP, request path is /function/<func_name>. For gRPC, request
+        // path is /<func_name>/<grpc_method>, where func_name is the service
+        // name without the "grpc:" prefix
+        std::string func_name;
+        std::string grpc_method;
+        size_t payload_size;
+        double qps;
+        absl::Duration warmup;
+        absl::Duration duration;
+        // Wait for outstanding requests after the last arrival
+        absl::Duration drain_timeout;
+        int num_connections;
+        size_t max_streams_per_connection;  // gRPC only
+        // Requests arriving when the wait queue is full are dropped
+        size_t max_queued_requests;
+        uint64_t random_seed;
+    };
+
+    struct Result {
+        // Requests scheduled after warmup
+        uint64_t num_scheduled;
+        uint64_t num_succeeded;
+        uint64_t num_failed;
+        uint64_t num_dropped;
+        uint64_t num_unfinished;
+        // Latencies in microseconds of succeeded requests
+        utils::Histogram corrected_latency;    // From the scheduled time
+        utils::Histogram uncorrected_latency;  // From the actual send time
+    };
+
+    LoadGenerator(std::string_view name, const Config& config);
+    ~LoadGenerator();
+
+    void Start();
+    void WaitForFinish();
+
+    // Can be read after WaitForFinish
+    const Result& result() const { return result_; }
+
+    const Config& config() const { return config_; }
+    uv_loop_t* uv_loop() { return &uv_loop_; }
+    // HTTP request or gRPC message frame, shared by all requests
+    std::span<const char> request_data() const {
+        return std::span<const char>(request_data_.data(), request_data_.size());
+    }
+
+    // Called by ClientConnection
+    void OnConnectionReady(ClientConnection* connection);
+    void OnRequestFinished(ClientConnection* connection, const Request& request, bool success);
+    void OnConnectionClosed(ClientConnection* connection);
+
+private:
+    std::string name_;
+    Config config_;
+    std::string log_header_;
+
+    base::Thread event_loop_thread_;
+    uv_loop_t uv_loop_;
+    uv_timer_t arrival_timer_;
+    uv_timer_t drain_timer_;
+
+    std::string request_data_;
+    std::vector<std::unique_ptr<ClientConnection>> connections_;
+    size_t next_connection_;
+    int num_connections_ready_;
+    int num_connections_closed_;
+
+    std::mt19937_64 random_engine_;
+    std::exponential_distribution<double> interarrival_dist_;
+    double next_arrival_timestamp_;
+    int64_t start_timestamp_;
+    int64_t measure_start_timestamp_;
+    int64_t end_timestamp_;
+    bool arrival_finished_;
+    bool closing_;
+
+    std::deque<Request> queued_requests_;
+    uint64_t num_inflight_requests_;
+    Result result_;
+
+    void EventLoopThreadMain();
+    void BuildRequestData();
+    void ScheduleNextArrival();
+    bool TrySendRequest(const Request& request);
+    void DispatchQueuedRequests();
+    void CheckFinished();
+    void CloseAll();
+
+    DECLARE_UV_TIMER_CB_FOR_CLASS(Arrival);
+    DECLARE_UV_TIMER_CB_FOR_CLASS(DrainTimeout);
+
+    DISALLOW_COPY_AND_ASSIGN(LoadGenerator);
+};
+
+}  // namespace loadgen
+}  // namespace faas
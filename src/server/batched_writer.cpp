@@ -0,0 +1,160 @@
+#include "server/batched_writer.h"
+
+#include "server/io_worker.h"
+
+namespace faas {
+namespace server {
+
+BatchedWriter::BatchedWriter(int flush_delay_us, WriteErrorCallback error_cb)
+    : flush_delay_us_(flush_delay_us), error_cb_(error_cb), state_(kCreated),
+      io_worker_(nullptr), stream_(nullptr), flush_scheduled_(false),
+      pending_write_(nullptr), pending_size_(0), pending_timestamp_(0),
+      current_buf_(nullptr), current_buf_size_(0),
+      current_buf_used_(0), current_region_start_(0) {}
+
+BatchedWriter::~BatchedWriter() {
+    DCHECK(state_ != kRunning);
+    DCHECK(pending_write_ == nullptr);
+}
+
+void BatchedWriter::Start(IOWorker* io_worker, uv_stream_t* stream) {
+    DCHECK(state_ == kCreated);
+    io_worker_ = io_worker;
+    stream_ = stream;
+    state_ = kRunning;
+}
+
+void BatchedWriter::Stop() {
+    if (state_ != kRunning) {
+        return;
+    }
+    if (flush_scheduled_) {
+        io_worker_->CancelBatchFlush(this);
+        flush_scheduled_ = false;
+    }
+    if (pending_write_ != nullptr) {
+        ReturnWrite(pending_write_);
+        pending_write_ = nullptr;
+        pending_bufs_.clear();
+        pending_size_ = 0;
+        current_buf_ = nullptr;
+    }
+    state_ = kStopped;
+}
+
+void BatchedWriter::Append(std::span<const char> data) {
+    DCHECK(state_ == kRunning);
+    EnsurePendingWrite();
+    pending_size_ += data.size();
+    while (!data.empty()) {
+        if (current_buf_ == nullptr || current_buf_used_ == current_buf_size_) {
+            SealCurrentRegion();
+            uv_buf_t buf;
+            io_worker_->NewWriteBuffer(&buf);
+            pending_write_->buffers.push_back(buf.base);
+            current_buf_ = buf.base;
+            current_buf_size_ = buf.len;
+            current_buf_used_ = 0;
+            current_region_start_ = 0;
+        }
+        size_t copy_size = std::min(data.size(), current_buf_size_ - current_buf_used_);
+        memcpy(current_buf_ + current_buf_used_, data.data(), copy_size);
+        current_buf_used_ += copy_size;
+        data = data.subspan(copy_size);
+    }
+    if (pending_size_ >= kMaxBatchSize) {
+        Flush();
+    }
+}
+
+void BatchedWriter::AppendZeroCopy(const utils::PayloadRef& payload) {
+    DCHECK(state_ == kRunning);
+    if (payload.size() == 0) {
+        return;
+    }
+    EnsurePendingWrite();
+    SealCurrentRegion();
+    pending_bufs_.push_back({
+        .base = const_cast<char*>(payload.data()), .len = payload.size()
+    });
+    pending_write_->payloads.push_back(payload);
+    pending_size_ += payload.size();
+    if (pending_size_ >= kMaxBatchSize) {
+        Flush();
+    }
+}
+
+void BatchedWriter::Flush() {
+    DCHECK(state_ == kRunning);
+    if (pending_write_ == nullptr) {
+        return;
+    }
+    SealCurrentRegion();
+    Write* write = pending_write_;
+    pending_write_ = nullptr;
+    current_buf_ = nullptr;
+    write->write_req.data = write;
+    // uv_write copies the array of bufs
+    UV_DCHECK_OK(uv_write(&write->write_req, stream_,
+                          pending_bufs_.data(), pending_bufs_.size(),
+                          &BatchedWriter::DataSentCallback));
+    pending_bufs_.clear();
+    pending_size_ = 0;
+}
+
+bool BatchedWriter::OnLoopIterationEnd(int64_t current_timestamp) {
+    DCHECK(flush_scheduled_);
+    if (pending_write_ != nullptr && flush_delay_us_ > 0
+          && current_timestamp - pending_timestamp_ < flush_delay_us_) {
+        return true;
+    }
+    Flush();
+    flush_scheduled_ = false;
+    return false;
+}
+
+void BatchedWriter::EnsurePendingWrite() {
+    if (pending_write_ != nullptr) {
+        return;
+    }
+    pending_write_ = write_pool_.Get();
+    pending_write_->writer = this;
+    if (flush_delay_us_ > 0) {
+        pending_timestamp_ = GetMonotonicMicroTimestamp();
+    }
+    if (!flush_scheduled_) {
+        io_worker_->ScheduleBatchFlush(this);
+        flush_scheduled_ = true;
+    }
+}
+
+void BatchedWriter::SealCurrentRegion() {
+    if (current_buf_ != nullptr && current_buf_used_ > current_region_start_) {
+        pending_bufs_.push_back({
+            .base = current_buf_ + current_region_start_,
+            .len = current_buf_used_ - current_region_start_
+        });
+        current_region_start_ = current_buf_used_;
+    }
+}
+
+void BatchedWriter::ReturnWrite(Write* write) {
+    for (char* buf : write->buffers) {
+        io_worker_->ReturnWriteBuffer(buf);
+    }
+    write->buffers.clear();
+    write->payloads.clear();
+    write_pool_.Return(write);
+}
+
+void BatchedWriter::DataSentCallback(uv_write_t* req, int status) {
+    Write* write = reinterpret_cast<Write*>(req->data);
+    BatchedWriter* self = write->writer;
+    self->ReturnWrite(write);
+    if (status != 0) {
+        self->error_cb_(status);
+    }
+}
+
+}  // namespace server
+}  // namespace faas
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "base/common.h"
+#include "common/uv.h"
+#include "utils/object_pool.h"
+#include "utils/payload_ref.h"
+
+namespace faas {
+namespace server {
+
+class IOWorker;
+
+// Coalesces data written to a stream into vectored writes. Appended data is
+// copied into write buffers of the IO worker, except payloads passed to
+// AppendZeroCopy, which are referenced until the write finishes.
+//
+// Pending data is written in one uv_write at the end of the event loop
+// iteration it is appended in. If flush_delay_us is positive, it is instead
+// held until the oldest pending data has waited that long, and the event loop
+// keeps polling without blocking meanwhile.
+//
+// Not thread-safe, should only be used within the event loop thread of the
+// IO worker.
+class BatchedWriter {
+public:
+    typedef std::function<void(int /* status */)> WriteErrorCallback;
+
+    // Pending data is written right away once reaching this size
+    static constexpr size_t kMaxBatchSize = 262144;
+
+    BatchedWriter(int flush_delay_us, WriteErrorCallback error_cb);
+    ~BatchedWriter();
+
+    int flush_delay_us() const { return flush_delay_us_; }
+
+    void Start(IOWorker* io_worker, uv_stream_t* stream);
+    // Pending data is dropped. Should be called before closing the stream.
+    void Stop();
+
+    void Append(std::span<const char> data);
+    void AppendZeroCopy(const utils::PayloadRef& payload);
+    void Flush();
+
+    // Called by IOWorker at the end of event loop iterations. Returns true
+    // if pending data is held for later iterations.
+    bool OnLoopIterationEnd(int64_t current_timestamp);
+
+private:
+    enum State { kCreated, kRunning, kStopped };
+
+    struct Write {
+        uv_write_t                      write_req;
+        BatchedWriter*                  writer;
+        std::vector<char*>              buffers;
+        std::vector<utils::PayloadRef>  payloads;
+    };
+
+    int flush_delay_us_;
+    WriteErrorCallback error_cb_;
+    State state_;
+    IOWorker* io_worker_;
+    uv_stream_t* stream_;
+    bool flush_scheduled_;
+
+    // Write being built, nullptr if there is no pending data
+    Write* pending_write_;
+    std::vector<uv_buf_t> pending_bufs_;
+    size_t pending_size_;
+    int64_t pending_timestamp_;
+
+    // Write buffer being filled, whose data in [region_start, used) are not
+    // yet added to pending_bufs_
+    char* current_buf_;
+    size_t current_buf_size_;
+    size_t current_buf_used_;
+    size_t current_region_start_;
+
+    utils::SimpleObjectPool<Write> write_pool_;
+
+    void EnsurePendingWrite();
+    void SealCurrentRegion();
+    void ReturnWrite(Write* write);
+
+    static void DataSentCallback(uv_write_t* req, int status);
+
+    DISALLOW_COPY_AND_ASSIGN(BatchedWriter);
+};
+
+}  // namespace server
+}  // namespace faas
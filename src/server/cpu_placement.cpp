@@ -0,0 +1,153 @@
+#include "server/cpu_placement.h"
+
+#define HLOG(l) LOG(l) << "CpuPlacement: "
+#define HVLOG(l) VLOG(l) << "CpuPlacement: "
+
+namespace faas {
+namespace server {
+
+using cpu_utils::CpuInfo;
+using cpu_utils::FormatCpuList;
+
+bool CpuPlacement::ParsePolicy(std::string_view str, Policy* policy) {
+    if (str == "none") {
+        *policy = kNone;
+    } else if (str == "spread") {
+        *policy = kSpread;
+    } else if (str == "compact") {
+        *policy = kCompact;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+CpuPlacement::CpuPlacement()
+    : policy_(kNone), next_node_index_(0) {}
+
+CpuPlacement::~CpuPlacement() {}
+
+void CpuPlacement::Init(Policy policy, const std::vector<int>& excluded_cpus) {
+    policy_ = policy;
+    if (policy_ == kNone) {
+        return;
+    }
+    std::vector<CpuInfo> cpus;
+    if (!cpu_utils::ReadCpuTopology(&cpus)) {
+        HLOG(WARNING) << "Failed to read CPU topology, disable CPU placement";
+        policy_ = kNone;
+        return;
+    }
+    for (const CpuInfo& info : cpus) {
+        if (std::find(excluded_cpus.begin(), excluded_cpus.end(), info.cpu)
+                == excluded_cpus.end()) {
+            cpus_.push_back(info);
+            numa_nodes_.push_back(info.numa_node);
+        }
+    }
+    std::sort(numa_nodes_.begin(), numa_nodes_.end());
+    numa_nodes_.erase(std::unique(numa_nodes_.begin(), numa_nodes_.end()), numa_nodes_.end());
+    if (cpus_.empty()) {
+        HLOG(WARNING) << "No CPU left for placement, disable CPU placement";
+        policy_ = kNone;
+    }
+}
+
+int CpuPlacement::AssignIOWorker(std::string_view worker_name) {
+    if (!enabled()) {
+        return -1;
+    }
+    const CpuInfo* picked = nullptr;
+    for (size_t i = 0; i < numa_nodes_.size() && picked == nullptr; i++) {
+        size_t node_index = (policy_ == kSpread) ? (next_node_index_ + i) % numa_nodes_.size()
+                                                 : i;
+        picked = PickFreeCore(numa_nodes_[node_index]);
+        if (picked != nullptr && policy_ == kSpread) {
+            next_node_index_ = node_index + 1;
+        }
+    }
+    if (picked == nullptr) {
+        HLOG(WARNING) << "No free core for " << worker_name << ", leave it unpinned";
+        return -1;
+    }
+    reserved_cores_.insert(std::make_pair(picked->package_id, picked->core_id));
+    io_workers_.push_back({
+        .worker_name = std::string(worker_name),
+        .cpu = picked->cpu,
+        .numa_node = picked->numa_node
+    });
+    return picked->cpu;
+}
+
+std::vector<int> CpuPlacement::GetFuncWorkerCpus(int io_worker_cpu) const {
+    if (!enabled() || io_worker_cpu == -1) {
+        return std::vector<int>();
+    }
+    const CpuInfo* info = FindCpu(io_worker_cpu);
+    if (info == nullptr) {
+        return std::vector<int>();
+    }
+    std::vector<int> cpus = GetFreeCpus(info->numa_node);
+    if (cpus.empty()) {
+        // All cores of the node are taken by IO workers, fall back to other nodes
+        cpus = GetFreeCpus(-1);
+    }
+    return cpus;
+}
+
+void CpuPlacement::ReportLayout() const {
+    if (!enabled()) {
+        HLOG(INFO) << "Disabled";
+        return;
+    }
+    for (int node : numa_nodes_) {
+        std::vector<int> node_cpus;
+        for (const CpuInfo& info : cpus_) {
+            if (info.numa_node == node) {
+                node_cpus.push_back(info.cpu);
+            }
+        }
+        HLOG(INFO) << fmt::format("NUMA node {}: cpus={}, free_cpus={}",
+                                  node, FormatCpuList(node_cpus),
+                                  FormatCpuList(GetFreeCpus(node)));
+    }
+    for (const IOWorkerPlacement& io_worker : io_workers_) {
+        HLOG(INFO) << fmt::format("{} is pinned to CPU {} (NUMA node {}), "
+                                  "its func workers use CPUs {}",
+                                  io_worker.worker_name, io_worker.cpu, io_worker.numa_node,
+                                  FormatCpuList(GetFuncWorkerCpus(io_worker.cpu)));
+    }
+}
+
+const CpuInfo* CpuPlacement::FindCpu(int cpu) const {
+    for (const CpuInfo& info : cpus_) {
+        if (info.cpu == cpu) {
+            return &info;
+        }
+    }
+    return nullptr;
+}
+
+const CpuInfo* CpuPlacement::PickFreeCore(int numa_node) const {
+    for (const CpuInfo& info : cpus_) {
+        if (info.numa_node == numa_node
+              && !reserved_cores_.contains(std::make_pair(info.package_id, info.core_id))) {
+            return &info;
+        }
+    }
+    return nullptr;
+}
+
+std::vector<int> CpuPlacement::GetFreeCpus(int numa_node) const {
+    std::vector<int> cpus;
+    for (const CpuInfo& info : cpus_) {
+        if ((numa_node == -1 || info.numa_node == numa_node)
+              && !reserved_cores_.contains(std::make_pair(info.package_id, info.core_id))) {
+            cpus.push_back(info.cpu);
+        }
+    }
+    return cpus;
+}
+
+}  // namespace server
+}  // namespace faas
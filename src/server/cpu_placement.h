@@ -0,0 +1,66 @@
+#pragma once
+
+#include "base/common.h"
+#include "utils/cpu_topology.h"
+
+namespace faas {
+namespace server {
+
+// Decides CPUs for IO worker threads, and for func workers served by them.
+// Each IO worker is pinned to its own physical core, while func workers are
+// confined to the remaining CPUs of the NUMA node of the IO worker owning
+// their connection, so that messages and payloads stay within one node.
+class CpuPlacement {
+public:
+    enum Policy {
+        kNone,     // No pinning
+        kSpread,   // IO workers are distributed across NUMA nodes round-robin
+        kCompact   // IO workers fill up one NUMA node before moving to the next
+    };
+
+    static bool ParsePolicy(std::string_view str, Policy* policy);
+
+    CpuPlacement();
+    ~CpuPlacement();
+
+    // Read CPU topology. CPUs in excluded_cpus are never assigned. Placement
+    // is disabled if topology is unavailable.
+    void Init(Policy policy, const std::vector<int>& excluded_cpus);
+
+    bool enabled() const { return policy_ != kNone; }
+
+    // Returns -1 if not pinned. Not thread-safe, all IO workers are assigned
+    // before any func worker.
+    int AssignIOWorker(std::string_view worker_name);
+    // Thread-safe after IO workers are assigned. Returns an empty list
+    // if func workers are not confined.
+    std::vector<int> GetFuncWorkerCpus(int io_worker_cpu) const;
+
+    void ReportLayout() const;
+
+private:
+    Policy policy_;
+    std::vector<cpu_utils::CpuInfo> cpus_;
+    std::vector</* numa_node */ int> numa_nodes_;
+
+    struct IOWorkerPlacement {
+        std::string worker_name;
+        int cpu;
+        int numa_node;
+    };
+    std::vector<IOWorkerPlacement> io_workers_;
+    // Physical cores taken by IO workers, as (package_id, core_id)
+    absl::flat_hash_set<std::pair<int, int>> reserved_cores_;
+    size_t next_node_index_;
+
+    const cpu_utils::CpuInfo* FindCpu(int cpu) const;
+    // Returns nullptr if no free core on the node
+    const cpu_utils::CpuInfo* PickFreeCore(int numa_node) const;
+    // CPUs not taken by IO workers, numa_node of -1 means all nodes
+    std::vector<int> GetFreeCpus(int numa_node) const;
+
+    DISALLOW_COPY_AND_ASSIGN(CpuPlacement);
+};
+
+}  // namespace server
+}  // namespace faas
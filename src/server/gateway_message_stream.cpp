@@ -0,0 +1,201 @@
+#include "server/gateway_message_stream.h"
+
+#include "server/io_worker.h"
+#include "server/batched_writer.h"
+
+namespace faas {
+namespace server {
+
+using protocol::GatewayMessage;
+
+GatewayMessageReader::GatewayMessageReader(MessageCallback message_cb)
+    : message_cb_(message_cb), io_worker_(nullptr),
+      large_payload_buf_(nullptr), large_payload_pos_(0) {}
+
+GatewayMessageReader::~GatewayMessageReader() {}
+
+void GatewayMessageReader::Start(IOWorker* io_worker) {
+    io_worker_ = io_worker;
+}
+
+void GatewayMessageReader::AppendData(std::span<const char> data) {
+    read_buffer_.AppendData(data);
+}
+
+void GatewayMessageReader::ProcessMessages() {
+    // A single read can carry a batch of many messages. They are processed
+    // in place, and consumed from read_buffer_ at once afterwards.
+    size_t pos = 0;
+    while (large_payload_buf_ == nullptr
+             && read_buffer_.length() - pos >= sizeof(GatewayMessage)) {
+        const char* data = read_buffer_.data() + pos;
+        size_t length = read_buffer_.length() - pos;
+        const GatewayMessage* message = reinterpret_cast<const GatewayMessage*>(data);
+        size_t payload_size = gsl::narrow_cast<size_t>(
+            std::max<int32_t>(0, message->payload_size));
+        size_t full_size = sizeof(GatewayMessage) + payload_size;
+        if (length >= full_size) {
+            std::span<const char> payload(data + sizeof(GatewayMessage), payload_size);
+            ScopedMessagePerf perf(io_worker_->perf_counters(), message->func_id);
+            message_cb_(*message, utils::PayloadRef(payload));
+            pos += full_size;
+        } else if (payload_size >= kGatewayZeroCopyPayloadThreshold) {
+            // Following reads go directly into a dedicated buffer for the payload
+            large_payload_message_ = *message;
+            large_payload_ = utils::PayloadRef::Allocate(payload_size, &large_payload_buf_);
+            large_payload_pos_ = length - sizeof(GatewayMessage);
+            memcpy(large_payload_buf_, data + sizeof(GatewayMessage), large_payload_pos_);
+            read_buffer_.Reset();
+            pos = 0;
+        } else {
+            break;
+        }
+    }
+    if (pos > 0) {
+        read_buffer_.ConsumeFront(gsl::narrow_cast<int>(pos));
+    }
+}
+
+void GatewayMessageReader::NewReadBuffer(size_t suggested_size, uv_buf_t* buf) {
+    if (large_payload_buf_ != nullptr) {
+        buf->base = large_payload_buf_ + large_payload_pos_;
+        buf->len = large_payload_.size() - large_payload_pos_;
+        return;
+    }
+    io_worker_->NewReadBuffer(suggested_size, buf);
+}
+
+void GatewayMessageReader::OnRead(ssize_t nread, const uv_buf_t* buf) {
+    bool read_into_large_payload = large_payload_buf_ != nullptr
+                                   && buf->base == large_payload_buf_ + large_payload_pos_;
+    auto reclaim_worker_resource = gsl::finally([this, buf, read_into_large_payload] {
+        if (buf->base != 0 && !read_into_large_payload) {
+            io_worker_->ReturnReadBuffer(buf);
+        }
+    });
+    if (nread <= 0) {
+        return;
+    }
+    if (read_into_large_payload) {
+        large_payload_pos_ += nread;
+        if (large_payload_pos_ == large_payload_.size()) {
+            OnLargePayloadReceived();
+        }
+        return;
+    }
+    read_buffer_.AppendData(buf->base, nread);
+    ProcessMessages();
+}
+
+void GatewayMessageReader::OnLargePayloadReceived() {
+    DCHECK_EQ(large_payload_pos_, large_payload_.size());
+    utils::PayloadRef payload = std::move(large_payload_);
+    large_payload_.Reset();
+    large_payload_buf_ = nullptr;
+    large_payload_pos_ = 0;
+    ScopedMessagePerf perf(io_worker_->perf_counters(), large_payload_message_.func_id);
+    message_cb_(large_payload_message_, payload);
+}
+
+GatewayMessageWriter::GatewayMessageWriter(int batch_flush_us, WriteErrorCallback error_cb)
+    : error_cb_(error_cb), io_worker_(nullptr), stream_(nullptr) {
+    if (batch_flush_us >= 0) {
+        batched_writer_ = std::make_unique<BatchedWriter>(batch_flush_us, error_cb);
+    }
+}
+
+GatewayMessageWriter::~GatewayMessageWriter() {}
+
+void GatewayMessageWriter::Start(IOWorker* io_worker, uv_stream_t* stream) {
+    io_worker_ = io_worker;
+    stream_ = stream;
+    if (batched_writer_ != nullptr) {
+        batched_writer_->Start(io_worker, stream);
+    }
+}
+
+void GatewayMessageWriter::Stop() {
+    if (batched_writer_ != nullptr) {
+        batched_writer_->Stop();
+    }
+}
+
+void GatewayMessageWriter::Write(const GatewayMessage& message, std::span<const char> payload) {
+    DCHECK_EQ(message.payload_size, gsl::narrow_cast<int32_t>(payload.size()));
+    if (batched_writer_ != nullptr) {
+        batched_writer_->Append(std::span<const char>(
+            reinterpret_cast<const char*>(&message), sizeof(GatewayMessage)));
+        batched_writer_->Append(payload);
+        return;
+    }
+    size_t pos = 0;
+    while (pos < sizeof(GatewayMessage) + payload.size()) {
+        uv_buf_t buf;
+        io_worker_->NewWriteBuffer(&buf);
+        size_t write_size;
+        if (pos == 0) {
+            DCHECK(sizeof(GatewayMessage) <= buf.len);
+            memcpy(buf.base, &message, sizeof(GatewayMessage));
+            size_t copy_size = std::min(buf.len - sizeof(GatewayMessage), payload.size());
+            memcpy(buf.base + sizeof(GatewayMessage), payload.data(), copy_size);
+            write_size = sizeof(GatewayMessage) + copy_size;
+        } else {
+            size_t copy_size = std::min(buf.len, payload.size() + sizeof(GatewayMessage) - pos);
+            memcpy(buf.base, payload.data() + pos - sizeof(GatewayMessage), copy_size);
+            write_size = copy_size;
+        }
+        DCHECK_LE(write_size, buf.len);
+        buf.len = write_size;
+        WriteRequest* write = write_pool_.Get();
+        write->writer = this;
+        write->buf = buf.base;
+        write->write_req.data = write;
+        UV_DCHECK_OK(uv_write(&write->write_req, stream_,
+                              &buf, 1, &GatewayMessageWriter::DataSentCallback));
+        pos += write_size;
+    }
+}
+
+void GatewayMessageWriter::Write(const GatewayMessage& message,
+                                 const utils::PayloadRef& payload) {
+    if (!payload.owned() || payload.size() < kGatewayZeroCopyPayloadThreshold) {
+        Write(message, payload.span());
+        return;
+    }
+    DCHECK_EQ(message.payload_size, gsl::narrow_cast<int32_t>(payload.size()));
+    if (batched_writer_ != nullptr) {
+        batched_writer_->Append(std::span<const char>(
+            reinterpret_cast<const char*>(&message), sizeof(GatewayMessage)));
+        batched_writer_->AppendZeroCopy(payload);
+        return;
+    }
+    WriteRequest* write = write_pool_.Get();
+    write->writer = this;
+    write->buf = nullptr;
+    write->message = message;
+    write->payload = payload;
+    uv_buf_t bufs[] = {
+        { .base = reinterpret_cast<char*>(&write->message), .len = sizeof(GatewayMessage) },
+        { .base = const_cast<char*>(payload.data()), .len = payload.size() }
+    };
+    write->write_req.data = write;
+    UV_DCHECK_OK(uv_write(&write->write_req, stream_,
+                          bufs, 2, &GatewayMessageWriter::DataSentCallback));
+}
+
+void GatewayMessageWriter::DataSentCallback(uv_write_t* req, int status) {
+    WriteRequest* write = reinterpret_cast<WriteRequest*>(req->data);
+    GatewayMessageWriter* self = write->writer;
+    if (write->buf != nullptr) {
+        self->io_worker_->ReturnWriteBuffer(write->buf);
+        write->buf = nullptr;
+    }
+    write->payload.Reset();
+    self->write_pool_.Return(write);
+    if (status != 0) {
+        self->error_cb_(status);
+    }
+}
+
+}  // namespace server
+}  // namespace faas
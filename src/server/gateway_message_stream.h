@@ -0,0 +1,108 @@
+#pragma once
+
+#include "base/common.h"
+#include "common/uv.h"
+#include "common/protocol.h"
+#include "utils/appendable_buffer.h"
+#include "utils/object_pool.h"
+#include "utils/payload_ref.h"
+
+namespace faas {
+namespace server {
+
+class IOWorker;
+class BatchedWriter;
+
+// Payloads of GatewayMessage no smaller than this are read into dedicated
+// buffers, and written directly from the buffers holding them
+constexpr size_t kGatewayZeroCopyPayloadThreshold = 16384;
+
+// Parses GatewayMessages with payloads from data read from a stream, used by
+// both ends of gateway-engine connections. Large payloads do not go through
+// the read buffer, but are read directly into their own buffers.
+//
+// Not thread-safe, should only be used within the event loop thread of the
+// IO worker.
+class GatewayMessageReader {
+public:
+    typedef std::function<void(const protocol::GatewayMessage& /* message */,
+                               const utils::PayloadRef& /* payload */)> MessageCallback;
+
+    explicit GatewayMessageReader(MessageCallback message_cb);
+    ~GatewayMessageReader();
+
+    void Start(IOWorker* io_worker);
+
+    // Data received before Start, processed by ProcessMessages
+    void AppendData(std::span<const char> data);
+    void ProcessMessages();
+
+    // Should be called within alloc and read callbacks of the stream. OnRead
+    // processes read data if nread is positive, and reclaims buf anyway.
+    void NewReadBuffer(size_t suggested_size, uv_buf_t* buf);
+    void OnRead(ssize_t nread, const uv_buf_t* buf);
+
+private:
+    MessageCallback message_cb_;
+    IOWorker* io_worker_;
+    utils::AppendableBuffer read_buffer_;
+
+    // Large payload being read, which does not go through read_buffer_
+    protocol::GatewayMessage large_payload_message_;
+    utils::PayloadRef large_payload_;
+    char* large_payload_buf_;
+    size_t large_payload_pos_;
+
+    void OnLargePayloadReceived();
+
+    DISALLOW_COPY_AND_ASSIGN(GatewayMessageReader);
+};
+
+// Writes GatewayMessages with payloads to a stream, through BatchedWriter if
+// batch_flush_us is non-negative, otherwise with one uv_write per message.
+// Owned payloads no smaller than kGatewayZeroCopyPayloadThreshold are
+// written without copying, in which case their references are held until
+// writes finish.
+//
+// Not thread-safe, should only be used within the event loop thread of the
+// IO worker.
+class GatewayMessageWriter {
+public:
+    typedef std::function<void(int /* status */)> WriteErrorCallback;
+
+    GatewayMessageWriter(int batch_flush_us, WriteErrorCallback error_cb);
+    ~GatewayMessageWriter();
+
+    void Start(IOWorker* io_worker, uv_stream_t* stream);
+    // Should be called before closing the stream
+    void Stop();
+
+    void Write(const protocol::GatewayMessage& message, std::span<const char> payload);
+    void Write(const protocol::GatewayMessage& message, const utils::PayloadRef& payload);
+
+private:
+    WriteErrorCallback error_cb_;
+    IOWorker* io_worker_;
+    uv_stream_t* stream_;
+
+    // nullptr if batching is disabled
+    std::unique_ptr<BatchedWriter> batched_writer_;
+
+    // Either buf is a write buffer of the IO worker holding copied data, or
+    // message and payload are written without copying
+    struct WriteRequest {
+        uv_write_t               write_req;
+        GatewayMessageWriter*    writer;
+        char*                    buf;
+        protocol::GatewayMessage message;
+        utils::PayloadRef        payload;
+    };
+    utils::SimpleObjectPool<WriteRequest> write_pool_;
+
+    static void DataSentCallback(uv_write_t* req, int status);
+
+    DISALLOW_COPY_AND_ASSIGN(GatewayMessageWriter);
+};
+
+}  // namespace server
+}  // namespace faas
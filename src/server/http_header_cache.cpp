@@ -0,0 +1,61 @@
+#include "server/http_header_cache.h"
+
+namespace faas {
+namespace server {
+
+HttpHeaderCache::HttpHeaderCache() {
+    UpdateDate(absl::Now());
+}
+
+HttpHeaderCache::~HttpHeaderCache() {}
+
+void HttpHeaderCache::UpdateDate(absl::Time now) {
+    date_ = absl::FormatTime(absl::RFC1123_full, now, absl::UTCTimeZone());
+    for (const auto& entry : entries_) {
+        FormatPrefix(entry.get());
+    }
+}
+
+void HttpHeaderCache::BuildHeader(HttpStatus status, std::string_view content_type,
+                                  bool keep_alive, size_t content_length,
+                                  std::string* header) {
+    const Entry* entry = GetOrCreateEntry(status, content_type, keep_alive);
+    header->assign(entry->prefix);
+    absl::StrAppend(header, content_length, "\r\n\r\n");
+}
+
+const HttpHeaderCache::Entry* HttpHeaderCache::GetOrCreateEntry(
+        HttpStatus status, std::string_view content_type, bool keep_alive) {
+    for (const auto& entry : entries_) {
+        if (entry->status == status && entry->keep_alive == keep_alive
+                && entry->content_type == content_type) {
+            return entry.get();
+        }
+    }
+    entries_.push_back(std::make_unique<Entry>());
+    Entry* entry = entries_.back().get();
+    entry->status = status;
+    entry->content_type = std::string(content_type);
+    entry->keep_alive = keep_alive;
+    FormatPrefix(entry);
+    return entry;
+}
+
+void HttpHeaderCache::FormatPrefix(Entry* entry) {
+    entry->prefix = fmt::format(
+        "HTTP/1.1 {}\r\n"
+        "Date: {}\r\n"
+        "Server: {}\r\n"
+        "Connection: {}\r\n"
+        "Content-Type: {}\r\n"
+        "Content-Length: ",
+        GetHttpStatusString(entry->status),
+        date_,
+        kServerString,
+        entry->keep_alive ? "Keep-Alive" : "close",
+        entry->content_type
+    );
+}
+
+}  // namespace server
+}  // namespace faas
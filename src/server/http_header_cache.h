@@ -0,0 +1,50 @@
+#pragma once
+
+#include "base/common.h"
+#include "common/http_status.h"
+
+namespace faas {
+namespace server {
+
+// Preformatted HTTP/1.1 response headers, owned by each IO worker. Headers
+// are cached per (status, content type, keep-alive), with all fields except
+// Content-Length formatted ahead of time. The Date field is refreshed by
+// UpdateDate, which the IO worker calls from a timer once per second.
+//
+// Not thread-safe, should only be used within the owning event loop thread.
+class HttpHeaderCache {
+public:
+    static constexpr const char* kServerString = "FaaS/0.1";
+
+    HttpHeaderCache();
+    ~HttpHeaderCache();
+
+    // Refresh the Date field of all cached headers
+    void UpdateDate(absl::Time now);
+
+    // Write the complete response header (ending with an empty line) into header
+    void BuildHeader(HttpStatus status, std::string_view content_type, bool keep_alive,
+                     size_t content_length, std::string* header);
+
+private:
+    struct Entry {
+        HttpStatus status;
+        std::string content_type;
+        bool keep_alive;
+        // All header lines up to "Content-Length: "
+        std::string prefix;
+    };
+
+    std::string date_;
+    // Only a few combinations are used, linear search is fast enough
+    std::vector<std::unique_ptr<Entry>> entries_;
+
+    const Entry* GetOrCreateEntry(HttpStatus status, std::string_view content_type,
+                                  bool keep_alive);
+    void FormatPrefix(Entry* entry);
+
+    DISALLOW_COPY_AND_ASSIGN(HttpHeaderCache);
+};
+
+}  // namespace server
+}  // namespace faas
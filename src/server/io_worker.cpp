@@ -1,5 +1,11 @@
 #include "server/io_worker.h"
 
+#include "server/batched_writer.h"
+#include "utils/cpu_topology.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+
 #define HLOG(l) LOG(l) << log_header_
 #define HVLOG(l) VLOG(l) << log_header_
 
@@ -8,16 +14,20 @@ namespace server {
 
 IOWorker::IOWorker(std::string_view worker_name,
                    size_t read_buffer_size, size_t write_buffer_size)
-    : worker_name_(worker_name), state_(kCreated),
+    : worker_name_(worker_name), cpu_(-1), state_(kCreated),
       log_header_(fmt::format("{}: ", worker_name)),
       event_loop_thread_(fmt::format("{}/EL", worker_name),
                          absl::bind_front(&IOWorker::EventLoopThreadMain, this)),
       read_buffer_pool_(fmt::format("{}_Read", worker_name), read_buffer_size),
       write_buffer_pool_(fmt::format("{}_Write", worker_name), write_buffer_size),
       connections_on_closing_(0),
+      pooled_functions_(new ScheduledFunction[kNumPooledFunctions]),
+      free_functions_head_(1),
+      run_fn_event_pending_(false),
       async_event_recv_timestamp_(0),
       uv_async_delay_stat_(stat::StatisticsCollector<int32_t>::StandardReportCallback(
-          fmt::format("uv_async_delay[{}]", worker_name))) {
+          fmt::format("uv_async_delay[{}]", worker_name))),
+      perf_sample_interval_(0) {
     UV_DCHECK_OK(uv_loop_init(&uv_loop_));
     uv_loop_.data = &event_loop_thread_;
     UV_DCHECK_OK(uv_async_init(&uv_loop_, &stop_event_, &IOWorker::StopCallback));
@@ -25,6 +35,13 @@ IOWorker::IOWorker(std::string_view worker_name,
     UV_DCHECK_OK(uv_async_init(&uv_loop_, &run_fn_event_,
                                &IOWorker::RunScheduledFunctionsCallback));
     run_fn_event_.data = this;
+    for (size_t i = 0; i < kNumPooledFunctions; i++) {
+        ScheduledFunction* function = &pooled_functions_[i];
+        function->pooled = true;
+        function->free_next.store(
+            (i + 1 < kNumPooledFunctions) ? gsl::narrow_cast<uint32_t>(i + 2) : 0,
+            std::memory_order_relaxed);
+    }
 }
 
 IOWorker::~IOWorker() {
@@ -33,6 +50,9 @@ IOWorker::~IOWorker() {
     DCHECK(connections_.empty());
     DCHECK_EQ(connections_on_closing_, 0);
     UV_DCHECK_OK(uv_loop_close(&uv_loop_));
+    while (ScheduledFunction* function = scheduled_functions_.Pop()) {
+        FreeScheduledFunction(function);
+    }
 }
 
 thread_local IOWorker* IOWorker::current_ = nullptr;
@@ -43,6 +63,15 @@ void PipeReadBufferAllocCallback(uv_handle_t* handle, size_t suggested_size, uv_
     buf->base = reinterpret_cast<char*>(malloc(buf_size));
     buf->len = buf_size;
 }
+
+// Milliseconds until the next wall clock second, when the Date of
+// HTTP responses changes
+uint64_t MillisToNextSecond(absl::Time now) {
+    int64_t millis = absl::ToUnixMillis(now) % 1000;
+    return gsl::narrow_cast<uint64_t>(1000 - millis);
+}
+
+void BatchFlushIdleCallback(uv_idle_t* handle) {}
 }
 
 void IOWorker::Start(int pipe_to_server_fd) {
@@ -57,6 +86,11 @@ void IOWorker::Start(int pipe_to_server_fd) {
     state_.store(kRunning);
 }
 
+void IOWorker::EnablePerfCounters(int sample_interval) {
+    DCHECK(state_.load() == kCreated);
+    perf_sample_interval_ = sample_interval;
+}
+
 void IOWorker::ScheduleStop() {
     UV_DCHECK_OK(uv_async_send(&stop_event_));
 }
@@ -118,23 +152,144 @@ ConnectionBase* IOWorker::PickConnection(int type) {
     return connections_for_pick_[type][idx];
 }
 
-void IOWorker::ScheduleFunction(ConnectionBase* owner, std::function<void()> fn) {
+void IOWorker::ScheduleBatchFlush(BatchedWriter* writer) {
+    DCHECK_IN_EVENT_LOOP_THREAD(&uv_loop_);
     if (state_.load(std::memory_order_consume) != kRunning) {
-        HLOG(WARNING) << "Cannot schedule function in non-running state, will ignore it";
+        HLOG(WARNING) << "Cannot flush writers in non-running state, will ignore it";
         return;
     }
-    if (uv::WithinEventLoop(&uv_loop_)) {
-        fn();
+    if (writers_to_flush_.empty()) {
+        UV_DCHECK_OK(uv_check_start(&batch_flush_check_handle_,
+                                    &IOWorker::BatchFlushCheckCallback));
+        UV_DCHECK_OK(uv_idle_start(&batch_flush_idle_handle_, &BatchFlushIdleCallback));
+    }
+    writers_to_flush_.push_back(writer);
+}
+
+void IOWorker::CancelBatchFlush(BatchedWriter* writer) {
+    DCHECK_IN_EVENT_LOOP_THREAD(&uv_loop_);
+    auto iter = absl::c_find(writers_to_flush_, writer);
+    if (iter != writers_to_flush_.end()) {
+        writers_to_flush_.erase(iter);
+    }
+}
+
+IOWorker::ScheduledFunction* IOWorker::NewScheduledFunction() {
+    uint64_t head = free_functions_head_.load(std::memory_order_acquire);
+    while (true) {
+        uint32_t link = static_cast<uint32_t>(head);
+        if (link == 0) {
+            // Pool is used up
+            ScheduledFunction* function = new ScheduledFunction;
+            function->pooled = false;
+            return function;
+        }
+        ScheduledFunction* function = &pooled_functions_[link - 1];
+        uint32_t next = function->free_next.load(std::memory_order_relaxed);
+        uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (free_functions_head_.compare_exchange_weak(head, new_head,
+                                                       std::memory_order_acq_rel,
+                                                       std::memory_order_acquire)) {
+            return function;
+        }
+    }
+}
+
+void IOWorker::FreeScheduledFunction(ScheduledFunction* function) {
+    function->destroy_fn(function);
+    if (!function->pooled) {
+        delete function;
         return;
     }
-    std::unique_ptr<ScheduledFunction> function = std::make_unique<ScheduledFunction>();
-    function->owner_id = (owner == nullptr) ? -1 : owner->id();
-    function->fn = fn;
-    absl::MutexLock lk(&scheduled_function_mu_);
-    scheduled_functions_.push_back(std::move(function));
-    int64_t empty = 0;
-    async_event_recv_timestamp_.compare_exchange_strong(empty, GetMonotonicMicroTimestamp());
-    UV_DCHECK_OK(uv_async_send(&run_fn_event_));
+    uint32_t link = gsl::narrow_cast<uint32_t>(function - pooled_functions_.get()) + 1;
+    uint64_t head = free_functions_head_.load(std::memory_order_relaxed);
+    uint64_t new_head;
+    do {
+        function->free_next.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        new_head = (((head >> 32) + 1) << 32) | link;
+    } while (!free_functions_head_.compare_exchange_weak(head, new_head,
+                                                          std::memory_order_release,
+                                                          std::memory_order_relaxed));
+}
+
+void IOWorker::PushScheduledFunction(ScheduledFunction* function) {
+    scheduled_functions_.Push(function);
+    // Skip uv_async_send if the event loop is already signaled and has not
+    // finished draining scheduled functions
+    if (!run_fn_event_pending_.exchange(true, std::memory_order_seq_cst)) {
+        async_event_recv_timestamp_.store(GetMonotonicMicroTimestamp(),
+                                          std::memory_order_relaxed);
+        UV_DCHECK_OK(uv_async_send(&run_fn_event_));
+    }
+}
+
+void IOWorker::RunScheduledFunction(ScheduledFunction* function) {
+    if (function->owner_id < 0 || connections_.contains(function->owner_id)) {
+        function->run_fn(function);
+    } else {
+        HLOG(WARNING) << "Owner connection has closed";
+    }
+    FreeScheduledFunction(function);
+}
+
+void IOWorker::AddListener(int listen_fd, AcceptCallback accept_cb) {
+    int flags = fcntl(listen_fd, F_GETFL, 0);
+    PCHECK(flags != -1 && fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == 0)
+        << "Failed to set O_NONBLOCK on listening socket";
+    auto listener = std::make_unique<Listener>();
+    listener->fd = listen_fd;
+    listener->accept_cb = std::move(accept_cb);
+    ScheduleFunction(nullptr, [this, listener = std::move(listener)] () mutable {
+        UV_DCHECK_OK(uv_poll_init_socket(&uv_loop_, &listener->uv_poll_handle, listener->fd));
+        listener->uv_poll_handle.data = this;
+        UV_DCHECK_OK(uv_poll_start(&listener->uv_poll_handle, UV_READABLE,
+                                   &IOWorker::ListenerPollCallback));
+        listeners_.push_back(std::move(listener));
+    });
+}
+
+void IOWorker::AcceptConnections(Listener* listener) {
+    for (int i = 0; i < kMaxAcceptsPerPoll; i++) {
+        int fd = accept4(listener->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                PLOG(ERROR) << log_header_ << "Failed to accept new connection";
+            }
+            return;
+        }
+        ConnectionBase* connection = listener->accept_cb();
+        if (connection == nullptr) {
+            close(fd);
+            continue;
+        }
+        uv_stream_t* client = connection->InitUVHandle(&uv_loop_);
+        DCHECK(client->type == UV_TCP);
+        UV_DCHECK_OK(uv_tcp_open(reinterpret_cast<uv_tcp_t*>(client), fd));
+        StartConnection(connection);
+    }
+}
+
+void IOWorker::StartConnection(ConnectionBase* connection) {
+    connection->Start(this);
+    DCHECK(connection->id() >= 0);
+    DCHECK(!connections_.contains(connection->id()));
+    connections_[connection->id()] = connection;
+    if (connection->type() >= 0) {
+        connections_by_type_[connection->type()].insert(connection->id());
+        if (connections_for_pick_.contains(connection->type())) {
+            connections_for_pick_[connection->type()].push_back(connection);
+        }
+        HLOG(INFO) << fmt::format("New connection of type {0}, total of type {0} is {1}",
+                                  connection->type(),
+                                  connections_by_type_[connection->type()].size());
+    }
+    if (state_.load(std::memory_order_consume) == kStopping) {
+        HLOG(WARNING) << "Receive new connection in stopping state, will close it directly";
+        connection->ScheduleClose();
+    }
 }
 
 void IOWorker::OnConnectionClose(ConnectionBase* connection) {
@@ -164,6 +319,31 @@ void IOWorker::OnConnectionClose(ConnectionBase* connection) {
 
 void IOWorker::EventLoopThreadMain() {
     current_ = this;
+    if (cpu_ != -1 && cpu_utils::SetCurrentThreadAffinity({cpu_})) {
+        HLOG(INFO) << "Pinned to CPU " << cpu_;
+    }
+    if (perf_sample_interval_ > 0) {
+        // Perf events measure the calling thread, thus opened here
+        auto perf_counters = std::make_unique<PerfCounters>(worker_name_, perf_sample_interval_);
+        if (perf_counters->Open()) {
+            perf_counters_ = std::move(perf_counters);
+            UV_DCHECK_OK(uv_prepare_init(&uv_loop_, &perf_prepare_handle_));
+            perf_prepare_handle_.data = this;
+            UV_DCHECK_OK(uv_prepare_start(&perf_prepare_handle_,
+                                          &IOWorker::PerfLoopPrepareCallback));
+            UV_DCHECK_OK(uv_check_init(&uv_loop_, &perf_check_handle_));
+            perf_check_handle_.data = this;
+            UV_DCHECK_OK(uv_check_start(&perf_check_handle_, &IOWorker::PerfLoopCheckCallback));
+        }
+    }
+    UV_DCHECK_OK(uv_timer_init(&uv_loop_, &http_date_timer_));
+    http_date_timer_.data = this;
+    UV_DCHECK_OK(uv_timer_start(&http_date_timer_, &IOWorker::HttpDateTimerCallback,
+                                MillisToNextSecond(absl::Now()), 0));
+    UV_DCHECK_OK(uv_check_init(&uv_loop_, &batch_flush_check_handle_));
+    batch_flush_check_handle_.data = this;
+    UV_DCHECK_OK(uv_idle_init(&uv_loop_, &batch_flush_idle_handle_));
+    batch_flush_idle_handle_.data = this;
     HLOG(INFO) << "Event loop starts";
     int ret = uv_run(&uv_loop_, UV_RUN_DEFAULT);
     if (ret != 0) {
@@ -191,6 +371,17 @@ UV_ASYNC_CB_FOR_CLASS(IOWorker, Stop) {
     }
     uv_close(UV_AS_HANDLE(&stop_event_), nullptr);
     uv_close(UV_AS_HANDLE(&run_fn_event_), nullptr);
+    uv_close(UV_AS_HANDLE(&http_date_timer_), nullptr);
+    uv_close(UV_AS_HANDLE(&batch_flush_check_handle_), nullptr);
+    uv_close(UV_AS_HANDLE(&batch_flush_idle_handle_), nullptr);
+    for (const auto& listener : listeners_) {
+        uv_close(UV_AS_HANDLE(&listener->uv_poll_handle), nullptr);
+        close(listener->fd);
+    }
+    if (perf_counters_ != nullptr) {
+        uv_close(UV_AS_HANDLE(&perf_prepare_handle_), nullptr);
+        uv_close(UV_AS_HANDLE(&perf_check_handle_), nullptr);
+    }
     state_.store(kStopping);
 }
 
@@ -201,23 +392,7 @@ UV_READ_CB_FOR_CLASS(IOWorker, NewConnection) {
     free(buf->base);
     uv_stream_t* client = connection->InitUVHandle(&uv_loop_);
     UV_DCHECK_OK(uv_accept(UV_AS_STREAM(&pipe_to_server_), client));
-    connection->Start(this);
-    DCHECK(connection->id() >= 0);
-    DCHECK(!connections_.contains(connection->id()));
-    connections_[connection->id()] = connection;
-    if (connection->type() >= 0) {
-        connections_by_type_[connection->type()].insert(connection->id());
-        if (connections_for_pick_.contains(connection->type())) {
-            connections_for_pick_[connection->type()].push_back(connection);
-        }
-        HLOG(INFO) << fmt::format("New connection of type {0}, total of type {0} is {1}",
-                                  connection->type(),
-                                  connections_by_type_[connection->type()].size());
-    }
-    if (state_.load(std::memory_order_consume) == kStopping) {
-        HLOG(WARNING) << "Receive new connection in stopping state, will close it directly";
-        connection->ScheduleClose();
-    }
+    StartConnection(connection);
 }
 
 UV_WRITE_CB_FOR_CLASS(IOWorker, PipeWrite) {
@@ -237,24 +412,74 @@ UV_ASYNC_CB_FOR_CLASS(IOWorker, RunScheduledFunctions) {
     if (state_.load(std::memory_order_consume) != kRunning) {
         return;
     }
-    int64_t async_event_recv_timestamp = async_event_recv_timestamp_.fetch_and(0);
+    int64_t async_event_recv_timestamp = async_event_recv_timestamp_.exchange(0);
     if (async_event_recv_timestamp != 0) {
         uv_async_delay_stat_.AddSample(gsl::narrow_cast<int32_t>(
             GetMonotonicMicroTimestamp() - async_event_recv_timestamp));
     }
-    absl::InlinedVector<std::unique_ptr<ScheduledFunction>, 16> functions;
-    {
-        absl::MutexLock lk(&scheduled_function_mu_);
-        functions = std::move(scheduled_functions_);
-        scheduled_functions_.clear();
+    while (true) {
+        while (ScheduledFunction* function = scheduled_functions_.Pop()) {
+            RunScheduledFunction(function);
+        }
+        run_fn_event_pending_.store(false, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // Functions pushed before the flag is cleared have not signaled us
+        ScheduledFunction* function = scheduled_functions_.Pop();
+        if (function == nullptr) {
+            break;
+        }
+        // If the flag is taken by a producer, it will signal us again
+        bool keep_draining = !run_fn_event_pending_.exchange(true, std::memory_order_seq_cst);
+        RunScheduledFunction(function);
+        if (!keep_draining) {
+            break;
+        }
+    }
+}
+
+UV_PREPARE_CB_FOR_CLASS(IOWorker, PerfLoopPrepare) {
+    perf_counters_->OnLoopPrepare();
+}
+
+UV_CHECK_CB_FOR_CLASS(IOWorker, PerfLoopCheck) {
+    perf_counters_->OnLoopCheck();
+}
+
+UV_POLL_CB_FOR_CLASS(IOWorker, ListenerPoll) {
+    if (status != 0) {
+        HLOG(ERROR) << "Error on listening socket: " << uv_strerror(status);
+        return;
+    }
+    for (const auto& listener : listeners_) {
+        if (&listener->uv_poll_handle == handle) {
+            AcceptConnections(listener.get());
+            return;
+        }
     }
-    for (const auto& function : functions) {
-        if (function->owner_id < 0 || connections_.contains(function->owner_id)) {
-            function->fn();
-        } else {
-            HLOG(WARNING) << "Owner connection has closed";
+    HLOG(FATAL) << "Unknown listener";
+}
+
+UV_TIMER_CB_FOR_CLASS(IOWorker, HttpDateTimer) {
+    absl::Time now = absl::Now();
+    http_header_cache_.UpdateDate(now);
+    UV_DCHECK_OK(uv_timer_start(&http_date_timer_, &IOWorker::HttpDateTimerCallback,
+                                MillisToNextSecond(now), 0));
+}
+
+UV_CHECK_CB_FOR_CLASS(IOWorker, BatchFlushCheck) {
+    int64_t current_timestamp = GetMonotonicMicroTimestamp();
+    DCHECK(writers_flushing_.empty());
+    writers_flushing_.swap(writers_to_flush_);
+    for (BatchedWriter* writer : writers_flushing_) {
+        if (writer->OnLoopIterationEnd(current_timestamp)) {
+            writers_to_flush_.push_back(writer);
         }
     }
+    writers_flushing_.clear();
+    if (writers_to_flush_.empty()) {
+        UV_DCHECK_OK(uv_check_stop(&batch_flush_check_handle_));
+        UV_DCHECK_OK(uv_idle_stop(&batch_flush_idle_handle_));
+    }
 }
 
 }  // namespace server
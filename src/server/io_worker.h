@@ -6,17 +6,32 @@
 #include "common/stat.h"
 #include "utils/buffer_pool.h"
 #include "utils/object_pool.h"
+#include "utils/mpsc_queue.h"
 #include "server/connection_base.h"
+#include "server/perf_counters.h"
+#include "server/http_header_cache.h"
 
 namespace faas {
 namespace server {
 
+class BatchedWriter;
+
 class IOWorker final : public uv::Base {
 public:
     IOWorker(std::string_view worker_name, size_t read_buffer_size, size_t write_buffer_size);
     ~IOWorker();
 
     std::string_view worker_name() const { return worker_name_; }
+    // CPU the event loop thread is pinned to, -1 if not pinned
+    int cpu() const { return cpu_; }
+    void set_cpu(int cpu) { cpu_ = cpu; }
+    // Measure the event loop thread with perf counters, sampling one of every
+    // sample_interval loop iterations and messages. Should be called before Start.
+    void EnablePerfCounters(int sample_interval);
+    // nullptr if perf counters are not enabled or not available
+    PerfCounters* perf_counters() { return perf_counters_.get(); }
+    // Can only be called from uv_loop_
+    HttpHeaderCache* http_header_cache() { return &http_header_cache_; }
 
     // Return current IOWorker within event loop thread
     static IOWorker* current() { return current_; }
@@ -25,6 +40,14 @@ public:
     void ScheduleStop();
     void WaitForFinish();
 
+    // Create the connection for a socket accepted by this IOWorker, or
+    // return nullptr to reject it. Called within the event loop thread.
+    typedef std::function<ConnectionBase*()> AcceptCallback;
+    // Accept connections from listen_fd within this IOWorker, instead of
+    // receiving them from Server. listen_fd will be owned by this IOWorker.
+    // Can be called from other threads.
+    void AddListener(int listen_fd, AcceptCallback accept_cb);
+
     // Called by Connection for ONLY once
     void OnConnectionClose(ConnectionBase* connection);
 
@@ -37,18 +60,24 @@ public:
     void ReturnWriteRequest(uv_write_t* write_req);
     // Pick a connection of given type managed by this IOWorker
     ConnectionBase* PickConnection(int type);
+    // Called by BatchedWriter having pending data, which will be asked to
+    // flush at the end of event loop iterations until it no longer holds data
+    void ScheduleBatchFlush(BatchedWriter* writer);
+    void CancelBatchFlush(BatchedWriter* writer);
 
     // Schedule a function to run on this IO worker's event loop
     // thread. It can be called safely from other threads.
     // When the function is ready to run, IO worker will check if its
     // owner connection is still active, and will not run the function
     // if it is closed.
-    void ScheduleFunction(ConnectionBase* owner, std::function<void()> fn);
+    template<class Fn>
+    void ScheduleFunction(ConnectionBase* owner, Fn&& fn);
 
 private:
     enum State { kCreated, kRunning, kStopping, kStopped };
 
     std::string worker_name_;
+    int cpu_;
     std::atomic<State> state_;
     static thread_local IOWorker* current_;
 
@@ -58,6 +87,13 @@ private:
     uv_async_t stop_event_;
     uv_pipe_t pipe_to_server_;
     uv_async_t run_fn_event_;
+    uv_prepare_t perf_prepare_handle_;
+    uv_check_t perf_check_handle_;
+    uv_timer_t http_date_timer_;
+    uv_check_t batch_flush_check_handle_;
+    // Active while there are writers to flush, so that event loop does not
+    // block in polling before they are flushed
+    uv_idle_t batch_flush_idle_handle_;
 
     base::Thread event_loop_thread_;
     absl::flat_hash_map</* id */ int, ConnectionBase*> connections_;
@@ -68,27 +104,121 @@ private:
     utils::BufferPool write_buffer_pool_;
     utils::SimpleObjectPool<uv_write_t> write_req_pool_;
     int connections_on_closing_;
+    std::vector<BatchedWriter*> writers_to_flush_;
+    std::vector<BatchedWriter*> writers_flushing_;
+
+    // Scheduled functions are passed through a lock-free queue of nodes taken
+    // from a pre-allocated pool. Closures small enough are stored inline in
+    // nodes, avoiding heap allocations.
+    static constexpr size_t kNumPooledFunctions = 1024;
+    static constexpr size_t kInlineClosureSize = 48;
 
     struct ScheduledFunction {
+        std::atomic<ScheduledFunction*> next;
+        // Link in the free list, as (index + 1), 0 for the end
+        std::atomic<uint32_t> free_next;
+        bool pooled;
         int owner_id;
-        std::function<void()> fn;
+        void (*run_fn)(ScheduledFunction*);
+        void (*destroy_fn)(ScheduledFunction*);
+        alignas(std::max_align_t) char storage[kInlineClosureSize];
+
+        template<class Fn>
+        void SetClosure(Fn&& fn);
     };
-    absl::Mutex scheduled_function_mu_;
-    absl::InlinedVector<std::unique_ptr<ScheduledFunction>, 16>
-        scheduled_functions_ ABSL_GUARDED_BY(scheduled_function_mu_);
+    std::unique_ptr<ScheduledFunction[]> pooled_functions_;
+    // Free list head is (aba_tag << 32) | (index + 1)
+    std::atomic<uint64_t> free_functions_head_;
+    utils::MPSCQueue<ScheduledFunction> scheduled_functions_;
+    // Set when run_fn_event_ is signaled and functions are not yet drained,
+    // so that other producers need not to signal again
+    std::atomic<bool> run_fn_event_pending_;
     std::atomic<int64_t> async_event_recv_timestamp_;
 
     stat::StatisticsCollector<int32_t> uv_async_delay_stat_;
 
+    // Bound the work of one poll callback during connection bursts
+    static constexpr int kMaxAcceptsPerPoll = 64;
+
+    struct Listener {
+        int fd;
+        uv_poll_t uv_poll_handle;
+        AcceptCallback accept_cb;
+    };
+    std::vector<std::unique_ptr<Listener>> listeners_;
+
+    int perf_sample_interval_;
+    std::unique_ptr<PerfCounters> perf_counters_;
+
+    HttpHeaderCache http_header_cache_;
+
     void EventLoopThreadMain();
+    void StartConnection(ConnectionBase* connection);
+    void AcceptConnections(Listener* listener);
+    // Thread-safe
+    ScheduledFunction* NewScheduledFunction();
+    void PushScheduledFunction(ScheduledFunction* function);
+    // Called by the event loop thread
+    void FreeScheduledFunction(ScheduledFunction* function);
+    void RunScheduledFunction(ScheduledFunction* function);
 
     DECLARE_UV_ASYNC_CB_FOR_CLASS(Stop);
     DECLARE_UV_READ_CB_FOR_CLASS(NewConnection);
     DECLARE_UV_WRITE_CB_FOR_CLASS(PipeWrite);
     DECLARE_UV_ASYNC_CB_FOR_CLASS(RunScheduledFunctions);
+    DECLARE_UV_PREPARE_CB_FOR_CLASS(PerfLoopPrepare);
+    DECLARE_UV_CHECK_CB_FOR_CLASS(PerfLoopCheck);
+    DECLARE_UV_TIMER_CB_FOR_CLASS(HttpDateTimer);
+    DECLARE_UV_CHECK_CB_FOR_CLASS(BatchFlushCheck);
+    DECLARE_UV_POLL_CB_FOR_CLASS(ListenerPoll);
 
     DISALLOW_COPY_AND_ASSIGN(IOWorker);
 };
 
+template<class Fn>
+void IOWorker::ScheduledFunction::SetClosure(Fn&& fn) {
+    typedef std::decay_t<Fn> Closure;
+    if constexpr (sizeof(Closure) <= kInlineClosureSize
+                    && alignof(Closure) <= alignof(std::max_align_t)) {
+        new (storage) Closure(std::forward<Fn>(fn));
+        run_fn = [] (ScheduledFunction* self) {
+            (*std::launder(reinterpret_cast<Closure*>(self->storage)))();
+        };
+        destroy_fn = [] (ScheduledFunction* self) {
+            std::launder(reinterpret_cast<Closure*>(self->storage))->~Closure();
+        };
+    } else {
+        Closure* closure = new Closure(std::forward<Fn>(fn));
+        memcpy(storage, &closure, sizeof(Closure*));
+        run_fn = [] (ScheduledFunction* self) {
+            Closure* closure;
+            memcpy(&closure, self->storage, sizeof(Closure*));
+            (*closure)();
+        };
+        destroy_fn = [] (ScheduledFunction* self) {
+            Closure* closure;
+            memcpy(&closure, self->storage, sizeof(Closure*));
+            delete closure;
+        };
+    }
+}
+
+template<class Fn>
+void IOWorker::ScheduleFunction(ConnectionBase* owner, Fn&& fn) {
+    if (state_.load(std::memory_order_consume) != kRunning) {
+        LOG(WARNING) << log_header_
+                     << "Cannot schedule function in non-running state, will ignore it";
+        return;
+    }
+    if (uv::WithinEventLoop(&uv_loop_)) {
+        fn();
+        return;
+    }
+    ScheduledFunction* function = NewScheduledFunction();
+    function->owner_id = (owner == nullptr) ? -1 : owner->id();
+    function->SetClosure(std::forward<Fn>(fn));
+    PushScheduledFunction(function);
+}
+
 }  // namespace server
 }  // namespace faas
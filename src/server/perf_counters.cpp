@@ -0,0 +1,144 @@
+#include "server/perf_counters.h"
+
+#include <absl/strings/str_join.h>
+
+#define HLOG(l) LOG(l) << log_header_
+#define HVLOG(l) VLOG(l) << log_header_
+
+namespace faas {
+namespace server {
+
+namespace {
+struct EventDesc {
+    uint32_t type;
+    uint64_t config;
+    const char* name;
+};
+
+const EventDesc kEventDescs[PerfCounters::kNumEvents] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,       "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,     "instructions" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,     "cache_misses" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context_switches" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,      "page_faults" }
+};
+}  // namespace
+
+PerfCounters::PerfCounters(std::string_view worker_name, int sample_interval)
+    : worker_name_(worker_name), log_header_(fmt::format("{}: ", worker_name)),
+      sample_interval_(std::max(sample_interval, 1)),
+      loop_iterations_(0), loop_sampled_(false), messages_(0) {
+    memset(loop_start_values_, 0, sizeof(loop_start_values_));
+    memset(message_start_values_, 0, sizeof(message_start_values_));
+    memset(last_report_values_, 0, sizeof(last_report_values_));
+    memset(values_, 0, sizeof(values_));
+}
+
+PerfCounters::~PerfCounters() {}
+
+bool PerfCounters::Open() {
+    std::vector<std::string> opened;
+    for (int i = 0; i < kNumEvents; i++) {
+        const EventDesc& desc = kEventDescs[i];
+        if (perf_event_group_.AddEvent(desc.type, desc.config)) {
+            opened_events_.push_back(static_cast<Event>(i));
+            opened.push_back(desc.name);
+            loop_stats_[i] = CreateStat("io_loop", static_cast<Event>(i), worker_name_);
+        } else {
+            PLOG(WARNING) << log_header_ << "Failed to open perf event " << desc.name;
+        }
+    }
+    if (opened_events_.empty()) {
+        HLOG(ERROR) << "No perf event available";
+        return false;
+    }
+    perf_event_group_.ResetAndEnable();
+    HLOG(INFO) << fmt::format("Perf events enabled: {}, sample every {} iterations and messages",
+                              absl::StrJoin(opened, ","), sample_interval_);
+    return true;
+}
+
+void PerfCounters::ReadValues(uint64_t* values) {
+    uint64_t buffer[kNumEvents];
+    perf_event_group_.ReadValues(buffer);
+    for (size_t i = 0; i < opened_events_.size(); i++) {
+        values[opened_events_[i]] = buffer[i];
+    }
+}
+
+std::unique_ptr<PerfCounters::EventStat> PerfCounters::CreateStat(std::string_view prefix,
+                                                                   Event event,
+                                                                   std::string_view id) {
+    auto stat = std::make_unique<EventStat>(EventStat::StandardReportCallback(
+        fmt::format("{}_{}[{}]", prefix, kEventDescs[event].name, id)));
+    // Perf counters are enabled explicitly, thus always collected
+    stat->set_force_enabled(true);
+    return stat;
+}
+
+void PerfCounters::OnLoopPrepare() {
+    loop_sampled_ = (++loop_iterations_ % sample_interval_ == 0);
+    if (loop_sampled_) {
+        ReadValues(loop_start_values_);
+    }
+}
+
+void PerfCounters::OnLoopCheck() {
+    if (!loop_sampled_) {
+        return;
+    }
+    loop_sampled_ = false;
+    ReadValues(values_);
+    for (Event event : opened_events_) {
+        loop_stats_[event]->AddSample(
+            static_cast<int64_t>(values_[event] - loop_start_values_[event]));
+    }
+    if (report_timer_.Check()) {
+        int duration_ms;
+        report_timer_.MarkReport(&duration_ms);
+        ReportTotals();
+    }
+}
+
+bool PerfCounters::BeginMessage() {
+    if (++messages_ % sample_interval_ != 0) {
+        return false;
+    }
+    ReadValues(message_start_values_);
+    return true;
+}
+
+void PerfCounters::EndMessage(uint16_t func_id) {
+    ReadValues(values_);
+    auto& stats = message_stats_[func_id];
+    if (stats.empty()) {
+        stats.resize(kNumEvents);
+        std::string id = fmt::format("{}/{}", worker_name_, func_id);
+        for (Event event : opened_events_) {
+            stats[event] = CreateStat("message", event, id);
+        }
+    }
+    for (Event event : opened_events_) {
+        stats[event]->AddSample(
+            static_cast<int64_t>(values_[event] - message_start_values_[event]));
+    }
+}
+
+void PerfCounters::ReportTotals() {
+    stat::MetricsRegistry* registry = stat::MetricsRegistry::instance();
+    for (Event event : opened_events_) {
+        registry->UpdateCounter(
+            fmt::format("io_worker_perf_{}[{}]", kEventDescs[event].name, worker_name_),
+            static_cast<int64_t>(values_[event]));
+    }
+    uint64_t cycles = values_[kCycles] - last_report_values_[kCycles];
+    uint64_t instructions = values_[kInstructions] - last_report_values_[kInstructions];
+    if (cycles > 0 && instructions > 0) {
+        registry->UpdateGauge(fmt::format("io_worker_ipc[{}]", worker_name_),
+                              static_cast<double>(instructions) / static_cast<double>(cycles));
+    }
+    memcpy(last_report_values_, values_, sizeof(values_));
+}
+
+}  // namespace server
+}  // namespace faas
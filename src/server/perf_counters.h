@@ -0,0 +1,104 @@
+#pragma once
+
+#include "base/common.h"
+#include "common/stat.h"
+#include "utils/perf_event.h"
+
+namespace faas {
+namespace server {
+
+// Hardware and software perf counters of one IO worker thread. Counters are
+// read around sampled event loop iterations and sampled message handling,
+// and reported per thread (io_loop_<event>[<worker>]) and per function
+// (message_<event>[<worker>/<func_id>]). Totals are exported as
+// io_worker_perf_<event>_total counters, along with an io_worker_ipc gauge.
+// Events not supported by the machine (e.g. hardware events within VMs)
+// are skipped.
+//
+// Must be opened and used within the measured thread.
+class PerfCounters {
+public:
+    enum Event {
+        kCycles          = 0,
+        kInstructions    = 1,
+        kCacheMisses     = 2,
+        kContextSwitches = 3,
+        kPageFaults      = 4,
+        kNumEvents       = 5
+    };
+
+    PerfCounters(std::string_view worker_name, int sample_interval);
+    ~PerfCounters();
+
+    // Return false if no event can be opened
+    bool Open();
+
+    // Called by uv_prepare_t and uv_check_t handles, so that the measured
+    // interval covers the poll phase, where IO callbacks run
+    void OnLoopPrepare();
+    void OnLoopCheck();
+
+    // Return true if this message is sampled, in which case EndMessage
+    // should be called after it is handled
+    bool BeginMessage();
+    void EndMessage(uint16_t func_id);
+
+private:
+    typedef stat::StatisticsCollector<int64_t> EventStat;
+
+    std::string worker_name_;
+    std::string log_header_;
+    int sample_interval_;
+    utils::PerfEventGroup perf_event_group_;
+    // Events successfully opened, in the order of values read from the group
+    std::vector<Event> opened_events_;
+
+    uint64_t loop_iterations_;
+    bool loop_sampled_;
+    uint64_t messages_;
+    uint64_t loop_start_values_[kNumEvents];
+    uint64_t message_start_values_[kNumEvents];
+    uint64_t last_report_values_[kNumEvents];
+    uint64_t values_[kNumEvents];
+
+    std::unique_ptr<EventStat> loop_stats_[kNumEvents];
+    absl::flat_hash_map</* func_id */ uint16_t,
+                        std::vector<std::unique_ptr<EventStat>>> message_stats_;
+    stat::ReportTimer report_timer_;
+
+    void ReadValues(uint64_t* values);
+    // Stats are named "<prefix>_<event>[<id>]"
+    std::unique_ptr<EventStat> CreateStat(std::string_view prefix, Event event,
+                                          std::string_view id);
+    void ReportTotals();
+
+    DISALLOW_COPY_AND_ASSIGN(PerfCounters);
+};
+
+// Measures handling of one message with perf counters of the current IO
+// worker, if enabled and the message is sampled
+class ScopedMessagePerf {
+public:
+    ScopedMessagePerf(PerfCounters* perf_counters, uint16_t func_id)
+        : perf_counters_(perf_counters), func_id_(func_id) {
+        if (__FAAS_PREDICT_FALSE(perf_counters_ != nullptr)
+              && !perf_counters_->BeginMessage()) {
+            perf_counters_ = nullptr;
+        }
+    }
+
+    ~ScopedMessagePerf() {
+        if (perf_counters_ != nullptr) {
+            perf_counters_->EndMessage(func_id_);
+        }
+    }
+
+private:
+    PerfCounters* perf_counters_;
+    uint16_t func_id_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedMessagePerf);
+};
+
+}  // namespace server
+}  // namespace faas
@@ -1,5 +1,33 @@
 #include "server/server_base.h"
 
+#include "utils/socket.h"
+
+#include <absl/flags/flag.h>
+
+ABSL_FLAG(std::string, cpu_placement, "none",
+          "Pin each IO worker to a physical core, and confine func workers to "
+          "the NUMA node of their IO worker. Can be none, spread (distribute IO "
+          "workers across NUMA nodes) or compact (fill one NUMA node first)");
+ABSL_FLAG(std::string, cpu_placement_exclude, "",
+          "CPUs never used by CPU placement, in the format of cpuset, e.g. 0-1,8");
+ABSL_FLAG(std::string, metrics_snapshot_path, "",
+          "If set, periodically write exported metrics into this file (preferably "
+          "under /dev/shm), for local scrapers");
+ABSL_FLAG(int, metrics_snapshot_interval_ms, 1000, "Interval for updating metrics snapshot");
+ABSL_FLAG(bool, io_worker_perf_counters, false,
+          "Measure IO worker threads with hardware and software perf counters "
+          "(cycles, instructions, cache misses, context switches, page faults)");
+ABSL_FLAG(int, io_worker_perf_sample_interval, 64,
+          "Read perf counters around one of every N event loop iterations and messages");
+ABSL_FLAG(bool, reuseport_accept, false,
+          "Each IO worker listens on client-facing ports with its own SO_REUSEPORT "
+          "socket and accepts connections by itself, skipping the handoff from "
+          "the server thread");
+ABSL_FLAG(bool, reuseport_cpu_steering, false,
+          "With reuseport_accept, attach a BPF program that hands each new connection "
+          "to the IO worker pinned to the CPU receiving it. Requires IO workers "
+          "pinned by cpu_placement");
+
 #define HLOG(l) LOG(l) << "Server: "
 #define HVLOG(l) VLOG(l) << "Server: "
 
@@ -25,7 +53,10 @@ ServerBase::~ServerBase() {
 
 void ServerBase::Start() {
     DCHECK(state_.load() == kCreated);
+    InitCpuPlacement();
     StartInternal();
+    cpu_placement_.ReportLayout();
+    InitMetricsSnapshot();
     // Start thread for running event loop
     event_loop_thread_.Start();
     state_.store(kRunning);
@@ -56,6 +87,38 @@ void ServerBase::EventLoopThreadMain() {
     state_.store(kStopped);
 }
 
+void ServerBase::InitCpuPlacement() {
+    CpuPlacement::Policy policy;
+    if (!CpuPlacement::ParsePolicy(absl::GetFlag(FLAGS_cpu_placement), &policy)) {
+        HLOG(FATAL) << "Unknown CPU placement policy: " << absl::GetFlag(FLAGS_cpu_placement);
+    }
+    std::vector<int> excluded_cpus;
+    if (!cpu_utils::ParseCpuList(absl::GetFlag(FLAGS_cpu_placement_exclude), &excluded_cpus)) {
+        HLOG(FATAL) << "Invalid cpu_placement_exclude: "
+                    << absl::GetFlag(FLAGS_cpu_placement_exclude);
+    }
+    cpu_placement_.Init(policy, excluded_cpus);
+}
+
+void ServerBase::InitMetricsSnapshot() {
+    std::string path = absl::GetFlag(FLAGS_metrics_snapshot_path);
+    if (path.empty()) {
+        return;
+    }
+    auto writer = std::make_unique<stat::MetricsSnapshotWriter>(path);
+    if (!writer->Init()) {
+        HLOG(ERROR) << "Failed to create metrics snapshot, will not write it";
+        return;
+    }
+    metrics_snapshot_writer_ = std::move(writer);
+    UV_CHECK_OK(uv_timer_init(&uv_loop_, &metrics_snapshot_timer_));
+    metrics_snapshot_timer_.data = this;
+    uint64_t interval_ms = gsl::narrow_cast<uint64_t>(
+        absl::GetFlag(FLAGS_metrics_snapshot_interval_ms));
+    UV_CHECK_OK(uv_timer_start(&metrics_snapshot_timer_, &ServerBase::MetricsSnapshotCallback,
+                               interval_ms, interval_ms));
+}
+
 namespace {
 static void PipeReadBufferAllocCallback(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
     size_t buf_size = 256;
@@ -68,6 +131,10 @@ IOWorker* ServerBase::CreateIOWorker(std::string_view worker_name,
                                      size_t read_buffer_size, size_t write_buffer_size) {
     DCHECK(state_.load() == kCreated);
     auto io_worker = std::make_unique<IOWorker>(worker_name, read_buffer_size, write_buffer_size);
+    io_worker->set_cpu(cpu_placement_.AssignIOWorker(worker_name));
+    if (absl::GetFlag(FLAGS_io_worker_perf_counters)) {
+        io_worker->EnablePerfCounters(absl::GetFlag(FLAGS_io_worker_perf_sample_interval));
+    }
     int pipe_fds[2] = { -1, -1 };
     if (socketpair(AF_UNIX, SOCK_STREAM, 0, pipe_fds) < 0) {
         PLOG(FATAL) << "socketpair failed";
@@ -95,12 +162,52 @@ void ServerBase::RegisterConnection(IOWorker* io_worker, ConnectionBase* connect
     uv_buf_t uv_buf = uv_buf_init(reinterpret_cast<char*>(buf), sizeof(void*));
     uv_pipe_t* pipe_to_worker = pipes_to_io_worker_[io_worker].get();
     write_req->data = uv_handle;
-    connection->set_id(next_connection_id_++);
+    AssignConnectionId(connection);
     UV_DCHECK_OK(uv_write2(write_req, UV_AS_STREAM(pipe_to_worker),
                            &uv_buf, 1, UV_AS_STREAM(uv_handle),
                            &PipeWrite2Callback));
 }
 
+bool ServerBase::reuseport_accept() const {
+    return absl::GetFlag(FLAGS_reuseport_accept);
+}
+
+void ServerBase::ListenOnIOWorkers(const std::vector<IOWorker*>& io_workers,
+                                   std::string_view address, int port, int backlog,
+                                   IOWorker::AcceptCallback accept_cb) {
+    DCHECK(state_.load() == kCreated);
+    CHECK(!io_workers.empty());
+    // Sockets join the SO_REUSEPORT group in the order of listen, which
+    // is the order of io_workers
+    std::vector<int> listen_fds;
+    for (size_t i = 0; i < io_workers.size(); i++) {
+        int fd = utils::TcpSocketBindAndListen(address, gsl::narrow_cast<uint16_t>(port),
+                                               backlog, /* reuse_port= */ true);
+        if (fd == -1) {
+            HLOG(FATAL) << fmt::format("Failed to listen on {}:{}", address, port);
+        }
+        listen_fds.push_back(fd);
+    }
+    if (absl::GetFlag(FLAGS_reuseport_cpu_steering)) {
+        std::vector<int> cpus;
+        for (IOWorker* io_worker : io_workers) {
+            cpus.push_back(io_worker->cpu());
+        }
+        if (absl::c_linear_search(cpus, -1)) {
+            HLOG(WARNING) << "IO workers are not pinned, will not steer connections by CPU";
+        } else if (!utils::AttachReusePortCpuSteering(listen_fds[0], cpus)) {
+            HLOG(WARNING) << "Will distribute connections by hash";
+        }
+    }
+    for (size_t i = 0; i < io_workers.size(); i++) {
+        io_workers[i]->AddListener(listen_fds[i], accept_cb);
+    }
+}
+
+void ServerBase::AssignConnectionId(ConnectionBase* connection) {
+    connection->set_id(next_connection_id_.fetch_add(1, std::memory_order_relaxed));
+}
+
 UV_ASYNC_CB_FOR_CLASS(ServerBase, Stop) {
     if (state_.load(std::memory_order_consume) == kStopping) {
         HLOG(WARNING) << "Already in stopping state";
@@ -114,10 +221,17 @@ UV_ASYNC_CB_FOR_CLASS(ServerBase, Stop) {
         uv_close(UV_AS_HANDLE(pipe), nullptr);
     }
     uv_close(UV_AS_HANDLE(&stop_event_), nullptr);
+    if (metrics_snapshot_writer_ != nullptr) {
+        uv_close(UV_AS_HANDLE(&metrics_snapshot_timer_), nullptr);
+    }
     StopInternal();
     state_.store(kStopping);
 }
 
+UV_TIMER_CB_FOR_CLASS(ServerBase, MetricsSnapshot) {
+    metrics_snapshot_writer_->Update(stat::MetricsRegistry::instance()->ExportPrometheusText());
+}
+
 UV_READ_CB_FOR_CLASS(ServerBase, ReturnConnection) {
     if (nread < 0) {
         if (nread == UV_EOF) {
@@ -2,9 +2,11 @@
 
 #include "base/common.h"
 #include "common/uv.h"
+#include "common/metrics.h"
 #include "utils/appendable_buffer.h"
 #include "server/connection_base.h"
 #include "server/io_worker.h"
+#include "server/cpu_placement.h"
 
 namespace faas {
 namespace server {
@@ -25,6 +27,7 @@ protected:
     std::atomic<State> state_;
 
     uv_loop_t* uv_loop() { return &uv_loop_; }
+    const CpuPlacement* cpu_placement() const { return &cpu_placement_; }
 
     IOWorker* CreateIOWorker(std::string_view worker_name,
                              size_t read_buffer_size = kDefaultIOWorkerBufferSize,
@@ -32,6 +35,20 @@ protected:
     void RegisterConnection(IOWorker* io_worker, ConnectionBase* connection,
                             uv_stream_t* uv_handle);
 
+    // If true, client-facing ports are listened by IO workers with
+    // ListenOnIOWorkers, instead of accepting connections in Server
+    bool reuseport_accept() const;
+    // Each of io_workers listens on address:port with its own SO_REUSEPORT
+    // socket, and the kernel distributes new connections among them.
+    // accept_cb is called within the accepting IO worker, and should create
+    // the connection, call AssignConnectionId, and keep it alive until
+    // OnConnectionClose, as for connections passed to RegisterConnection.
+    void ListenOnIOWorkers(const std::vector<IOWorker*>& io_workers,
+                           std::string_view address, int port, int backlog,
+                           IOWorker::AcceptCallback accept_cb);
+    // Thread-safe
+    void AssignConnectionId(ConnectionBase* connection);
+
     // Supposed to be implemented by sub-class
     virtual void StartInternal() {}
     virtual void StopInternal() {}
@@ -41,15 +58,21 @@ private:
     uv_loop_t uv_loop_;
     uv_async_t stop_event_;
     base::Thread event_loop_thread_;
+    CpuPlacement cpu_placement_;
+    std::unique_ptr<stat::MetricsSnapshotWriter> metrics_snapshot_writer_;
+    uv_timer_t metrics_snapshot_timer_;
 
     absl::flat_hash_set<std::unique_ptr<IOWorker>> io_workers_;
     absl::flat_hash_map<IOWorker*, std::unique_ptr<uv_pipe_t>> pipes_to_io_worker_;
     utils::AppendableBuffer return_connection_read_buffer_;
-    int next_connection_id_;
+    std::atomic<int> next_connection_id_;
 
+    void InitCpuPlacement();
+    void InitMetricsSnapshot();
     void EventLoopThreadMain();
 
     DECLARE_UV_ASYNC_CB_FOR_CLASS(Stop);
+    DECLARE_UV_TIMER_CB_FOR_CLASS(MetricsSnapshot);
     DECLARE_UV_READ_CB_FOR_CLASS(ReturnConnection);
     DECLARE_UV_WRITE_CB_FOR_CLASS(PipeWrite2);
 
@@ -0,0 +1,146 @@
+#include "utils/cpu_topology.h"
+
+#include "utils/fs.h"
+
+#include <sched.h>
+#include <absl/strings/str_join.h>
+
+namespace faas {
+namespace cpu_utils {
+
+namespace {
+static constexpr const char* kSysCpuPath = "/sys/devices/system/cpu";
+static constexpr const char* kSysNodePath = "/sys/devices/system/node";
+
+bool ReadIntFromFile(std::string_view path, int* value) {
+    std::string contents;
+    if (!fs_utils::ReadContents(path, &contents)) {
+        return false;
+    }
+    return absl::SimpleAtoi(absl::StripAsciiWhitespace(contents), value);
+}
+
+bool ReadCpuListFromFile(std::string_view path, std::vector<int>* cpus) {
+    std::string contents;
+    if (!fs_utils::ReadContents(path, &contents)) {
+        return false;
+    }
+    return ParseCpuList(absl::StripAsciiWhitespace(contents), cpus);
+}
+}
+
+bool ReadCpuTopology(std::vector<CpuInfo>* cpus) {
+    std::vector<int> online_cpus;
+    if (!ReadCpuListFromFile(fs_utils::JoinPath(kSysCpuPath, "online"), &online_cpus)) {
+        LOG(ERROR) << "Failed to read online CPUs";
+        return false;
+    }
+    cpu_set_t allowed_set;
+    CPU_ZERO(&allowed_set);
+    if (sched_getaffinity(0, sizeof(allowed_set), &allowed_set) != 0) {
+        PLOG(ERROR) << "sched_getaffinity failed";
+        return false;
+    }
+    absl::flat_hash_map</* cpu */ int, /* numa_node */ int> numa_nodes;
+    std::vector<int> online_nodes;
+    if (ReadCpuListFromFile(fs_utils::JoinPath(kSysNodePath, "online"), &online_nodes)) {
+        for (int node : online_nodes) {
+            std::vector<int> node_cpus;
+            std::string path = fs_utils::JoinPath(
+                kSysNodePath, fmt::format("node{}", node), "cpulist");
+            if (!ReadCpuListFromFile(path, &node_cpus)) {
+                LOG(ERROR) << "Failed to read " << path;
+                return false;
+            }
+            for (int cpu : node_cpus) {
+                numa_nodes[cpu] = node;
+            }
+        }
+    } else {
+        LOG(WARNING) << "NUMA information not available, assume a single node";
+    }
+    cpus->clear();
+    for (int cpu : online_cpus) {
+        if (!CPU_ISSET(cpu, &allowed_set)) {
+            continue;
+        }
+        std::string topology_path = fs_utils::JoinPath(
+            kSysCpuPath, fmt::format("cpu{}", cpu), "topology");
+        CpuInfo info;
+        info.cpu = cpu;
+        if (!ReadIntFromFile(fs_utils::JoinPath(topology_path, "core_id"), &info.core_id)
+              || !ReadIntFromFile(fs_utils::JoinPath(topology_path, "physical_package_id"),
+                                  &info.package_id)) {
+            LOG(ERROR) << "Failed to read topology of CPU " << cpu;
+            return false;
+        }
+        info.numa_node = numa_nodes.contains(cpu) ? numa_nodes[cpu] : 0;
+        cpus->push_back(info);
+    }
+    return !cpus->empty();
+}
+
+bool ParseCpuList(std::string_view str, std::vector<int>* cpus) {
+    cpus->clear();
+    for (std::string_view part : absl::StrSplit(str, ',', absl::SkipWhitespace())) {
+        std::vector<std::string_view> range = absl::StrSplit(part, '-');
+        int first, last;
+        if (range.size() == 1) {
+            if (!absl::SimpleAtoi(range[0], &first)) {
+                return false;
+            }
+            last = first;
+        } else if (range.size() == 2) {
+            if (!absl::SimpleAtoi(range[0], &first) || !absl::SimpleAtoi(range[1], &last)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+        if (first < 0 || first > last || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus->push_back(cpu);
+        }
+    }
+    std::sort(cpus->begin(), cpus->end());
+    cpus->erase(std::unique(cpus->begin(), cpus->end()), cpus->end());
+    return true;
+}
+
+std::string FormatCpuList(const std::vector<int>& cpus) {
+    std::vector<int> sorted_cpus(cpus);
+    std::sort(sorted_cpus.begin(), sorted_cpus.end());
+    std::vector<std::string> parts;
+    size_t i = 0;
+    while (i < sorted_cpus.size()) {
+        size_t j = i;
+        while (j + 1 < sorted_cpus.size() && sorted_cpus[j + 1] <= sorted_cpus[j] + 1) {
+            j++;
+        }
+        if (sorted_cpus[i] == sorted_cpus[j]) {
+            parts.push_back(fmt::format("{}", sorted_cpus[i]));
+        } else {
+            parts.push_back(fmt::format("{}-{}", sorted_cpus[i], sorted_cpus[j]));
+        }
+        i = j + 1;
+    }
+    return absl::StrJoin(parts, ",");
+}
+
+bool SetCurrentThreadAffinity(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        PLOG(ERROR) << "Failed to set CPU affinity to " << FormatCpuList(cpus);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace cpu_utils
+}  // namespace faas
@@ -0,0 +1,30 @@
+#pragma once
+
+#ifndef __FAAS_SRC
+#error utils/cpu_topology.h cannot be included outside
+#endif
+
+#include "base/common.h"
+
+namespace faas {
+namespace cpu_utils {
+
+struct CpuInfo {
+    int cpu;
+    int core_id;     // from /sys/devices/system/cpu/cpu[N]/topology/core_id
+    int package_id;  // from /sys/devices/system/cpu/cpu[N]/topology/physical_package_id
+    int numa_node;   // 0 if NUMA information is not available
+};
+
+// Read topology of online CPUs that current thread is allowed to run on,
+// sorted by CPU number
+bool ReadCpuTopology(std::vector<CpuInfo>* cpus);
+
+// Parse and format CPU lists in the format of sysfs and cpuset, e.g. "0-3,8,10-11"
+bool ParseCpuList(std::string_view str, std::vector<int>* cpus);
+std::string FormatCpuList(const std::vector<int>& cpus);
+
+bool SetCurrentThreadAffinity(const std::vector<int>& cpus);
+
+}  // namespace cpu_utils
+}  // namespace faas
@@ -37,6 +37,12 @@ public:
         return reinterpret_cast<T>(ptr);
     }
 
+    // Returns nullptr if the symbol does not exist
+    template<class T>
+    T LoadOptionalSymbol(std::string_view name) {
+        return reinterpret_cast<T>(dlsym(handle_, std::string(name).c_str()));
+    }
+
 private:
     void* handle_;
     explicit DynamicLibrary(void* handle): handle_(handle) {}
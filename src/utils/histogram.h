@@ -0,0 +1,182 @@
+#pragma once
+
+#include "base/common.h"
+
+#include <math.h>
+
+namespace faas {
+namespace utils {
+
+// Fixed-size log-linear histogram, in the spirit of HdrHistogram. Every
+// power-of-two range [2^e, 2^(e+1)) is split into 2^kSubBucketBits equal
+// sub-buckets, so the relative error of reported values is bounded by
+// 2^-(kSubBucketBits+1) (< 0.8%), while integers below 2^kSubBucketBits are
+// kept exactly. Bucket index comes directly from the bits of the double,
+// so Add is O(1) and touches a single cache line besides the totals.
+//
+// A histogram has a single writer (Add and Reset). Counters are atomics
+// accessed with relaxed ordering, so other threads can MergeFrom or read
+// it at any time without locking. Such readers may observe a sample in
+// the bucket but not yet in the totals, which is fine for reporting.
+class Histogram {
+public:
+    static constexpr int kSubBucketBits = 6;
+    static constexpr int kMinExponent = -8;   // Values below 2^-8 go to the underflow bucket
+    static constexpr int kMaxExponent = 40;   // Values from 2^40 go to the overflow bucket
+    static constexpr size_t kNumBuckets =
+        (size_t{kMaxExponent - kMinExponent} << kSubBucketBits) + 2;
+
+    Histogram() { Reset(); }
+    ~Histogram() {}
+
+    template<class T>
+    void Add(T sample) {
+        double value = static_cast<double>(sample);
+        Increment(&buckets_[BucketIndex(value)], uint32_t{1});
+        uint64_t count = count_.load(std::memory_order_relaxed);
+        if (count == 0 || value < min_.load(std::memory_order_relaxed)) {
+            min_.store(value, std::memory_order_relaxed);
+        }
+        if (count == 0 || value > max_.load(std::memory_order_relaxed)) {
+            max_.store(value, std::memory_order_relaxed);
+        }
+        sum_.store(sum_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        count_.store(count + 1, std::memory_order_relaxed);
+    }
+
+    void Reset() {
+        for (size_t i = 0; i < kNumBuckets; i++) {
+            buckets_[i].store(0, std::memory_order_relaxed);
+        }
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        min_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    // Add samples of other into this histogram. other may be concurrently
+    // written by its owner thread, while this histogram must be owned by
+    // the calling thread.
+    void MergeFrom(const Histogram& other) {
+        uint64_t other_count = other.count_.load(std::memory_order_relaxed);
+        if (other_count == 0) {
+            return;
+        }
+        for (size_t i = 0; i < kNumBuckets; i++) {
+            uint32_t value = other.buckets_[i].load(std::memory_order_relaxed);
+            if (value > 0) {
+                Increment(&buckets_[i], value);
+            }
+        }
+        double other_min = other.min_.load(std::memory_order_relaxed);
+        double other_max = other.max_.load(std::memory_order_relaxed);
+        uint64_t count = count_.load(std::memory_order_relaxed);
+        if (count == 0 || other_min < min_.load(std::memory_order_relaxed)) {
+            min_.store(other_min, std::memory_order_relaxed);
+        }
+        if (count == 0 || other_max > max_.load(std::memory_order_relaxed)) {
+            max_.store(other_max, std::memory_order_relaxed);
+        }
+        sum_.store(sum_.load(std::memory_order_relaxed)
+                     + other.sum_.load(std::memory_order_relaxed),
+                   std::memory_order_relaxed);
+        count_.store(count + other_count, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    double sum() const { return sum_.load(std::memory_order_relaxed); }
+    double min() const { return min_.load(std::memory_order_relaxed); }
+    double max() const { return max_.load(std::memory_order_relaxed); }
+    double mean() const {
+        uint64_t n = count();
+        return n > 0 ? sum() / static_cast<double>(n) : 0;
+    }
+
+    // Value at quantile p (0 <= p <= 1). Reported values are midpoints of
+    // buckets, clamped to the exact [min, max] of samples.
+    double Percentile(double p) const {
+        uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(ceil(p * static_cast<double>(n)));
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t sum = 0;
+        size_t idx = kNumBuckets - 1;
+        for (size_t i = 0; i < kNumBuckets; i++) {
+            sum += buckets_[i].load(std::memory_order_relaxed);
+            if (sum >= rank) {
+                idx = i;
+                break;
+            }
+        }
+        double value = BucketMidpoint(idx);
+        return std::min(std::max(value, min()), max());
+    }
+
+    // For exporting buckets, cumulative counts are taken by summing
+    // bucket_count(i) for all i <= idx
+    uint32_t bucket_count(size_t idx) const {
+        return buckets_[idx].load(std::memory_order_relaxed);
+    }
+
+    // Lower bound of bucket idx, the underflow bucket has lower bound of 0
+    static double BucketLowerBound(size_t idx) {
+        if (idx == 0) {
+            return 0;
+        }
+        size_t linear_idx = idx - 1;
+        int exponent = static_cast<int>(linear_idx >> kSubBucketBits) + kMinExponent;
+        size_t sub_bucket = linear_idx & kSubBucketMask;
+        return ldexp(1.0 + static_cast<double>(sub_bucket) / kSubBuckets, exponent);
+    }
+
+    static size_t BucketIndex(double value) {
+        // Also catches NaN, negative values and zero
+        if (!(value >= kMinValue)) {
+            return 0;
+        }
+        if (value >= kMaxValue) {
+            return kNumBuckets - 1;
+        }
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        int exponent = static_cast<int>((bits >> 52) & 0x7ff) - 1023;
+        size_t sub_bucket = static_cast<size_t>(bits >> (52 - kSubBucketBits)) & kSubBucketMask;
+        return (size_t{static_cast<uint32_t>(exponent - kMinExponent)} << kSubBucketBits)
+               + sub_bucket + 1;
+    }
+
+private:
+    static constexpr size_t kSubBuckets = size_t{1} << kSubBucketBits;
+    static constexpr size_t kSubBucketMask = kSubBuckets - 1;
+    static constexpr double kMinValue = 1.0 / (1 << -kMinExponent);
+    static constexpr double kMaxValue = static_cast<double>(int64_t{1} << kMaxExponent);
+
+    std::atomic<uint32_t> buckets_[kNumBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<double> sum_;
+    std::atomic<double> min_;
+    std::atomic<double> max_;
+
+    // Single-writer increment, compiles to plain load and store
+    static void Increment(std::atomic<uint32_t>* counter, uint32_t delta) {
+        counter->store(counter->load(std::memory_order_relaxed) + delta,
+                       std::memory_order_relaxed);
+    }
+
+    static double BucketMidpoint(size_t idx) {
+        if (idx == 0) {
+            return 0;
+        }
+        if (idx == kNumBuckets - 1) {
+            return kMaxValue;
+        }
+        return (BucketLowerBound(idx) + BucketLowerBound(idx + 1)) / 2;
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(Histogram);
+};
+
+}  // namespace utils
+}  // namespace faas
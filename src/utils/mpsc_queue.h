@@ -0,0 +1,66 @@
+#pragma once
+
+#include "base/common.h"
+
+namespace faas {
+namespace utils {
+
+// Intrusive, lock-free multi-producer single-consumer queue (Vyukov's
+// algorithm). T must be default constructible, and have a member
+// `std::atomic<T*> next` reserved for the queue. Nodes are not owned by
+// the queue.
+template<class T>
+class MPSCQueue {
+public:
+    MPSCQueue() : head_(&stub_), tail_(&stub_) {
+        stub_.next.store(nullptr, std::memory_order_relaxed);
+    }
+    ~MPSCQueue() {}
+
+    // Can be called from any thread
+    void Push(T* node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        T* prev = tail_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // Called by the consumer. Returns nullptr if the queue is empty, or if
+    // the most recent Push has not finished linking its node
+    T* Pop() {
+        T* head = head_;
+        T* next = head->next.load(std::memory_order_acquire);
+        if (head == &stub_) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            head_ = next;
+            head = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            head_ = next;
+            return head;
+        }
+        if (head != tail_.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        Push(&stub_);
+        next = head->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            head_ = next;
+            return head;
+        }
+        return nullptr;
+    }
+
+private:
+    T* head_;
+    char padding_[__FAAS_CACHE_LINE_SIZE];
+    std::atomic<T*> tail_;
+    T stub_;
+
+    DISALLOW_COPY_AND_ASSIGN(MPSCQueue);
+};
+
+}  // namespace utils
+}  // namespace faas
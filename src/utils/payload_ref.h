@@ -0,0 +1,51 @@
+#pragma once
+
+#include "base/common.h"
+
+namespace faas {
+namespace utils {
+
+// PayloadRef is a reference-counted view of payload bytes. The owner keeps the
+// underlying storage (a heap buffer, a shm region, ...) alive, so that payloads
+// can be handed across components and written with scatter/gather IO, without
+// copying. A PayloadRef without owner merely borrows the bytes, and is only
+// valid within the current call.
+class PayloadRef {
+public:
+    PayloadRef() : data_() {}
+    explicit PayloadRef(std::span<const char> data) : data_(data) {}
+    PayloadRef(std::shared_ptr<const void> owner, std::span<const char> data)
+        : owner_(std::move(owner)), data_(data) {}
+
+    // Take ownership of obj, which holds the storage of data
+    template<class T>
+    static PayloadRef Wrap(std::unique_ptr<T> obj, std::span<const char> data) {
+        return PayloadRef(std::shared_ptr<const void>(std::move(obj)), data);
+    }
+
+    // Allocate an owned buffer of given size, returned via buf for filling in
+    static PayloadRef Allocate(size_t size, char** buf) {
+        std::shared_ptr<char[]> storage(new char[std::max<size_t>(size, 1)]);
+        *buf = storage.get();
+        return PayloadRef(std::shared_ptr<const void>(storage, storage.get()),
+                          std::span<const char>(*buf, size));
+    }
+
+    bool owned() const { return owner_ != nullptr; }
+    std::span<const char> span() const { return data_; }
+    const char* data() const { return data_.data(); }
+    size_t size() const { return data_.size(); }
+    bool empty() const { return data_.empty(); }
+
+    void Reset() {
+        owner_.reset();
+        data_ = std::span<const char>();
+    }
+
+private:
+    std::shared_ptr<const void> owner_;
+    std::span<const char> data_;
+};
+
+}  // namespace utils
+}  // namespace faas
@@ -78,5 +78,16 @@ std::vector<uint64_t> PerfEventGroup::ReadValues() {
     return ret;
 }
 
+void PerfEventGroup::ReadValues(uint64_t* values) {
+    CHECK(group_fd_ != -1) << "No event has been added yet";
+    static constexpr size_t kMaxEvents = 16;
+    CHECK_LE(event_fds_.size(), kMaxEvents);
+    uint64_t buffer[kMaxEvents + 1];
+    ssize_t read_size = sizeof(uint64_t) * (event_fds_.size() + 1);
+    PCHECK(read(group_fd_, buffer, read_size) == read_size);
+    CHECK_EQ(static_cast<size_t>(buffer[0]), event_fds_.size());
+    memcpy(values, buffer + 1, sizeof(uint64_t) * event_fds_.size());
+}
+
 }  // namespace utils
 }  // namespace faas
@@ -26,6 +26,9 @@ public:
     void Enable();
     void Disable();
     std::vector<uint64_t> ReadValues(); 
+    // Same as above, but reads into values[0..num_events()) without allocations
+    void ReadValues(uint64_t* values);
+    size_t num_events() const { return event_fds_.size(); }
 
     void ResetAndEnable() {
         Reset();
@@ -5,6 +5,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netdb.h>
+#include <linux/filter.h>
 
 namespace faas {
 namespace utils {
@@ -51,7 +52,8 @@ int UnixDomainSocketConnect(std::string_view path) {
     return fd;
 }
 
-int TcpSocketBindAndListen(std::string_view addr, uint16_t port, int backlog) {
+int TcpSocketBindAndListen(std::string_view addr, uint16_t port, int backlog,
+                           bool reuse_port) {
     struct sockaddr_in sockaddr;
     if (!FillTcpSocketAddr(&sockaddr, addr, port)) {
         LOG(ERROR) << "Failed to fill socket addr: " << addr << ":" << port;
@@ -62,6 +64,15 @@ int TcpSocketBindAndListen(std::string_view addr, uint16_t port, int backlog) {
         PLOG(ERROR) << "Failed to create AF_INET socket";
         return -1;
     }
+    if (reuse_port) {
+        int on = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+              || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+            PLOG(ERROR) << "Failed to set SO_REUSEPORT";
+            close(fd);
+            return -1;
+        }
+    }
     if (bind(fd, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) != 0) {
         PLOG(ERROR) << "Failed to bind to " << addr << ":" << port;
         close(fd);
@@ -75,6 +86,29 @@ int TcpSocketBindAndListen(std::string_view addr, uint16_t port, int backlog) {
     return fd;
 }
 
+bool AttachReusePortCpuSteering(int fd, const std::vector<int>& cpus) {
+    // A = current CPU; return i if A == cpus[i]; otherwise return an
+    // out-of-range index, making the kernel fall back to hashing
+    std::vector<struct sock_filter> code;
+    code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                            static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+    for (size_t i = 0; i < cpus.size(); i++) {
+        code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                gsl::narrow_cast<uint32_t>(cpus[i]), 0, 1));
+        code.push_back(BPF_STMT(BPF_RET | BPF_K, gsl::narrow_cast<uint32_t>(i)));
+    }
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, std::numeric_limits<uint32_t>::max()));
+    struct sock_fprog prog = {
+        .len = gsl::narrow_cast<unsigned short>(code.size()),
+        .filter = code.data()
+    };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+        PLOG(ERROR) << "Failed to attach BPF program for SO_REUSEPORT";
+        return false;
+    }
+    return true;
+}
+
 int TcpSocketConnect(std::string_view addr, uint16_t port) {
     struct sockaddr_in sockaddr;
     if (!FillTcpSocketAddr(&sockaddr, addr, port)) {
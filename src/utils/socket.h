@@ -9,11 +9,19 @@ namespace utils {
 
 // Return sockfd on success, and return -1 on error
 int UnixDomainSocketConnect(std::string_view path);
-int TcpSocketBindAndListen(std::string_view addr, uint16_t port, int backlog = 4);
+// With reuse_port, SO_REUSEPORT is set before bind, so that multiple sockets
+// can listen on the same port, and the kernel distributes connections among them
+int TcpSocketBindAndListen(std::string_view addr, uint16_t port, int backlog = 4,
+                           bool reuse_port = false);
 int TcpSocketConnect(std::string_view addr, uint16_t port);
 int Tcp6SocketBindAndListen(std::string_view ip, uint16_t port, int backlog = 4);
 int Tcp6SocketConnect(std::string_view ip, uint16_t port);
 
+// Attach a BPF program to the SO_REUSEPORT group of fd, which selects the
+// i-th listening socket (in the order of listen) for connections received
+// on cpus[i]. Connections received on other CPUs are distributed by hash.
+bool AttachReusePortCpuSteering(int fd, const std::vector<int>& cpus);
+
 // Will use `getaddrinfo` to resolve IP address if necessary
 bool FillTcpSocketAddr(struct sockaddr_in* addr, std::string_view host_or_ip, uint16_t port);
 
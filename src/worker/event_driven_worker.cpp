@@ -36,6 +36,7 @@ EventDrivenWorker::EventDrivenWorker() {
     }
 
     use_fifo_for_nested_call_ = false;
+    use_shm_queue_ = utils::GetEnvVariableAsInt("FAAS_USE_SHM_QUEUE", 0) == 1;
 
     ipc::SetRootPathForIpc(utils::GetEnvVariable("FAAS_ROOT_PATH_FOR_IPC", ""));
     int func_id = utils::GetEnvVariableAsInt("FAAS_FUNC_ID", -1);
@@ -62,7 +63,15 @@ EventDrivenWorker::EventDrivenWorker() {
     initial_client_id_ = gsl::narrow_cast<uint16_t>(client_id);
 }
 
-EventDrivenWorker::~EventDrivenWorker() {}
+EventDrivenWorker::~EventDrivenWorker() {
+    for (const auto& entry : func_workers_) {
+        const FuncWorkerState* worker_state = entry.second.get();
+        if (worker_state->response_fifo_fd != -1) {
+            worker_lib::RemoveResponseFifo(worker_state->client_id,
+                                           worker_state->response_fifo_fd);
+        }
+    }
+}
 
 void EventDrivenWorker::Start() {
     watch_fd_readable_cb_(message_pipe_fd_);
@@ -74,8 +83,8 @@ void EventDrivenWorker::OnFdReadable(int fd) {
         OnMessagePipeReadable();
     } else if (func_worker_by_input_fd_.count(fd) > 0) {
         OnEnginePipeReadable(func_worker_by_input_fd_[fd]);
-    } else if (outgoing_func_call_by_output_pipe_fd_.count(fd) > 0) {
-        OnOutputPipeReadable(outgoing_func_call_by_output_pipe_fd_[fd]);
+    } else if (func_worker_by_response_fifo_fd_.count(fd) > 0) {
+        OnResponseFifoReadable(func_worker_by_response_fifo_fd_[fd]);
     } else {
         LOG(FATAL) << "Unknown fd " << fd;
     }
@@ -108,7 +117,7 @@ void EventDrivenWorker::OnFuncExecutionFinished(int64_t handle, bool success,
     VLOG(1) << "Send response to engine";
     response.dispatch_delay = func_call_state->dispatch_delay;
     response.send_timestamp = GetMonotonicMicroTimestamp();
-    PCHECK(io_utils::SendMessage(worker_state->output_pipe_fd, response));
+    SendMessageToEngine(worker_state, response);
 }
 
 bool EventDrivenWorker::NewOutgoingFuncCall(int64_t parent_handle, std::string_view func_name,
@@ -127,6 +136,7 @@ bool EventDrivenWorker::NewOutgoingFuncCall(int64_t parent_handle, std::string_v
     FuncCall func_call = NewFuncCall(
         gsl::narrow_cast<uint16_t>(func_entry->func_id),
         worker_state->client_id, worker_state->next_call_id++);
+    func_call.client_id_generation = worker_state->call_id_generation;
     *handle = func_call_to_handle(func_call);
     return NewOutgoingFuncCallCommon(parent_call, func_call, worker_state, input);
 }
@@ -156,6 +166,7 @@ bool EventDrivenWorker::NewOutgoingGrpcCall(int64_t parent_handle, std::string_v
         gsl::narrow_cast<uint16_t>(func_entry->func_id),
         gsl::narrow_cast<uint16_t>(method_id),
         worker_state->client_id, worker_state->next_call_id++);
+    func_call.client_id_generation = worker_state->call_id_generation;
     *handle = func_call_to_handle(func_call);
     return NewOutgoingFuncCallCommon(parent_call, func_call, worker_state, request);
 }
@@ -178,8 +189,16 @@ void EventDrivenWorker::NewFuncWorker(uint16_t client_id) {
     int engine_sock_fd = utils::UnixDomainSocketConnect(ipc::GetEngineUnixSocketPath());
     CHECK(engine_sock_fd != -1) << "Failed to connect to engine socket";
     int input_pipe_fd = ipc::FifoOpenForRead(ipc::GetFuncWorkerInputFifoName(client_id));
+    std::unique_ptr<MessageQueue> input_queue;
+    if (use_shm_queue_) {
+        input_queue = worker_lib::CreateInputMessageQueue(client_id);
+    }
     Message message = NewFuncWorkerHandshakeMessage(
         gsl::narrow_cast<uint16_t>(config_entry_->func_id), client_id);
+    if (input_queue != nullptr) {
+        message.flags |= protocol::kFuncWorkerUseShmQueueFlag;
+    }
+    message.flags |= protocol::kShmArenaEnabledFlag;
     PCHECK(io_utils::SendMessage(engine_sock_fd, message));
     Message response;
     CHECK(io_utils::RecvMessage(engine_sock_fd, &response, nullptr))
@@ -188,11 +207,23 @@ void EventDrivenWorker::NewFuncWorker(uint16_t client_id) {
         << "Receive invalid handshake response";
     if (response.flags & protocol::kUseFifoForNestedCallFlag) {
         if (!use_fifo_for_nested_call_) {
-            LOG(INFO) << "Use extra FIFOs for handling nested call";
+            LOG(INFO) << "Use response FIFOs for handling nested call";
             use_fifo_for_nested_call_ = true;
         }
     }
+    if (response.flags & protocol::kShmArenaEnabledFlag) {
+        CHECK(worker_lib::AttachShmArena());
+    }
     int output_pipe_fd = ipc::FifoOpenForWrite(ipc::GetFuncWorkerOutputFifoName(client_id));
+    std::unique_ptr<MessageQueue> output_queue;
+    if (input_queue != nullptr) {
+        if (response.flags & protocol::kFuncWorkerUseShmQueueFlag) {
+            output_queue = worker_lib::OpenOutputMessageQueue(client_id, output_pipe_fd);
+        } else {
+            LOG(WARNING) << "Engine does not accept shared memory queues, fallback to pipes";
+            input_queue.reset(nullptr);
+        }
+    }
     LOG(INFO) << "Handshake done: client_id=" << client_id;
 
     FuncWorkerState* worker_state = new FuncWorkerState;
@@ -200,11 +231,22 @@ void EventDrivenWorker::NewFuncWorker(uint16_t client_id) {
     worker_state->engine_sock_fd = engine_sock_fd;
     worker_state->input_pipe_fd = input_pipe_fd;
     worker_state->output_pipe_fd = output_pipe_fd;
+    worker_state->call_id_generation = response.call_id;
     worker_state->next_call_id = 0;
+    worker_state->response_fifo_fd = -1;
+    worker_state->input_queue = std::move(input_queue);
+    worker_state->output_queue = std::move(output_queue);
     func_workers_[client_id] = std::unique_ptr<FuncWorkerState>(worker_state);
     func_worker_by_input_fd_[input_pipe_fd] = worker_state;
 
     watch_fd_readable_cb_(input_pipe_fd);
+    if (use_fifo_for_nested_call_) {
+        int response_fifo_fd = worker_lib::CreateResponseFifo(client_id);
+        CHECK(response_fifo_fd != -1) << "Failed to create response FIFO";
+        worker_state->response_fifo_fd = response_fifo_fd;
+        func_worker_by_response_fifo_fd_[response_fifo_fd] = worker_state;
+        watch_fd_readable_cb_(response_fifo_fd);
+    }
 }
 
 void EventDrivenWorker::ExecuteFunc(FuncWorkerState* worker_state,
@@ -218,7 +260,7 @@ void EventDrivenWorker::ExecuteFunc(FuncWorkerState* worker_state,
     if (!worker_lib::GetFuncCallInput(dispatch_func_call_message, &input, &input_region)) {
         Message response = NewFuncCallFailedMessage(func_call);
         response.send_timestamp = GetMonotonicMicroTimestamp();
-        PCHECK(io_utils::SendMessage(worker_state->output_pipe_fd, response));
+        SendMessageToEngine(worker_state, response);
         return;
     }
     std::string method;
@@ -250,34 +292,13 @@ bool EventDrivenWorker::NewOutgoingFuncCallCommon(const protocol::FuncCall& pare
         return false;
     }
 
-    int output_fifo = -1;
-    if (use_fifo_for_nested_call_) {
-        // Create fifo for output
-        if (!ipc::FifoCreate(ipc::GetFuncCallOutputFifoName(func_call.full_call_id))) {
-            LOG(ERROR) << "FifoCreate failed";
-            return false;
-        }
-        output_fifo = ipc::FifoOpenForReadWrite(
-            ipc::GetFuncCallOutputFifoName(func_call.full_call_id), /* nonblocking= */ true);
-        if (output_fifo == -1) {
-            LOG(ERROR) << "FifoOpenForReadWrite failed";
-            ipc::FifoRemove(ipc::GetFuncCallOutputFifoName(func_call.full_call_id));
-            return false;
-        }
-        watch_fd_readable_cb_(output_fifo);
-    }
-
     OutgoingFuncCallState* func_call_state = outgoing_func_call_pool_.Get();
     func_call_state->func_call = func_call;
     func_call_state->input_region = std::move(input_region);
-    func_call_state->output_pipe_fd = output_fifo;
     outgoing_func_calls_[func_call.full_call_id] = func_call_state;
-    if (output_fifo != -1) {
-        outgoing_func_call_by_output_pipe_fd_[output_fifo] = func_call_state;
-    }
 
     invoke_func_message.send_timestamp = GetMonotonicMicroTimestamp();
-    PCHECK(io_utils::SendMessage(worker_state->output_pipe_fd, invoke_func_message));
+    SendMessageToEngine(worker_state, invoke_func_message);
     VLOG(1) << "InvokeFuncMessage sent to engine";
     return true;
 }
@@ -293,10 +314,32 @@ void EventDrivenWorker::OnMessagePipeReadable() {
     }
 }
 
+void EventDrivenWorker::SendMessageToEngine(FuncWorkerState* worker_state,
+                                            const Message& message) {
+    if (worker_state->output_queue != nullptr) {
+        worker_lib::SendMessageViaQueue(worker_state->output_queue.get(), message);
+    } else {
+        PCHECK(io_utils::SendMessage(worker_state->output_pipe_fd, message));
+    }
+}
+
 void EventDrivenWorker::OnEnginePipeReadable(FuncWorkerState* worker_state) {
     Message message;
+    if (worker_state->input_queue != nullptr) {
+        CHECK(worker_lib::ConsumeDoorbell(worker_state->input_pipe_fd))
+            << "Failed to receive message from engine";
+        while (worker_lib::PopMessageOrEnterSleep(worker_state->input_queue.get(), &message)) {
+            OnRecvEngineMessage(worker_state, message);
+        }
+        return;
+    }
     CHECK(io_utils::RecvMessage(worker_state->input_pipe_fd, &message, nullptr))
         << "Failed to receive message from engine";
+    OnRecvEngineMessage(worker_state, message);
+}
+
+void EventDrivenWorker::OnRecvEngineMessage(FuncWorkerState* worker_state,
+                                            const Message& message) {
     if (IsDispatchFuncCallMessage(message)) {
         ExecuteFunc(worker_state, message);
     } else if (IsFuncCallCompleteMessage(message) || IsFuncCallFailedMessage(message)) {
@@ -314,29 +357,32 @@ void EventDrivenWorker::OnEnginePipeReadable(FuncWorkerState* worker_state) {
     }
 }
 
-void EventDrivenWorker::OnOutputPipeReadable(OutgoingFuncCallState* func_call_state) {
-    outgoing_func_calls_.erase(func_call_state->func_call.full_call_id);
-    int output_fifo = func_call_state->output_pipe_fd;
-    outgoing_func_call_by_output_pipe_fd_.erase(output_fifo);
-    stop_watch_fd_cb_(output_fifo);
-    auto reclaim_func_call_state = gsl::finally([this, func_call_state] {
+void EventDrivenWorker::OnResponseFifoReadable(FuncWorkerState* worker_state) {
+    while (true) {
+        FuncCall func_call;
+        std::unique_ptr<ipc::ShmRegion> output_region;
+        bool success = false;
+        bool pipe_buffer_used = false;
+        std::span<const char> output;
+        if (!worker_lib::FifoReadFuncCallOutput(
+                worker_state->response_fifo_fd, main_pipe_buf_,
+                &func_call, &success, &output, &output_region, &pipe_buffer_used)) {
+            LOG(ERROR) << "FifoReadFuncCallOutput failed";
+            return;
+        }
+        if (func_call.full_call_id == protocol::kInvalidFuncCall.full_call_id) {
+            // No more outputs for now
+            return;
+        }
+        if (outgoing_func_calls_.count(func_call.full_call_id) == 0) {
+            LOG(ERROR) << "Unknown outgoing func call: " << FuncCallDebugString(func_call);
+            continue;
+        }
+        OutgoingFuncCallState* func_call_state = outgoing_func_calls_[func_call.full_call_id];
+        outgoing_func_calls_.erase(func_call.full_call_id);
         func_call_state->input_region.reset(nullptr);
         outgoing_func_call_pool_.Return(func_call_state);
-    });
-    std::unique_ptr<ipc::ShmRegion> output_region;
-    bool success = false;
-    bool pipe_buffer_used = false;
-    std::span<const char> output;
-    if (worker_lib::FifoGetFuncCallOutput(
-            func_call_state->func_call, output_fifo, main_pipe_buf_,
-            &success, &output, &output_region, &pipe_buffer_used)) {
-        outgoing_func_call_complete_cb_(func_call_to_handle(func_call_state->func_call),
-                                        success, output);
-    } else {
-        LOG(ERROR) << "GetFuncCallOutput failed";
-        outgoing_func_call_complete_cb_(func_call_to_handle(func_call_state->func_call),
-                                        /* success= */ false,
-                                        /* output= */ std::span<const char>());
+        outgoing_func_call_complete_cb_(func_call_to_handle(func_call), success, output);
     }
 }
 
@@ -355,20 +401,9 @@ void EventDrivenWorker::OnOutgoingFuncCallFinished(const Message& message,
     } else if (!IsFuncCallCompleteMessage(message)) {
         LOG(FATAL) << "Unknown message type";
     }
-    std::unique_ptr<ipc::ShmRegion> output_region;
     if (message.payload_size < 0) {
-        auto output_region = ipc::ShmOpen(
-            ipc::GetFuncCallOutputShmName(func_call_state->func_call.full_call_id));
+        auto output_region = worker_lib::GetFuncCallOutputShm(message);
         if (output_region == nullptr) {
-            LOG(ERROR) << "ShmOpen failed";
-            outgoing_func_call_complete_cb_(func_call_to_handle(func_call_state->func_call),
-                                            /* success= */ false,
-                                            /* output= */ std::span<const char>());
-            return;
-        }
-        output_region->EnableRemoveOnDestruction();
-        if (output_region->size() != gsl::narrow_cast<size_t>(-message.payload_size)) {
-            LOG(ERROR) << "Output size mismatch";
             outgoing_func_call_complete_cb_(func_call_to_handle(func_call_state->func_call),
                                             /* success= */ false,
                                             /* output= */ std::span<const char>());
@@ -5,6 +5,7 @@
 #include "common/protocol.h"
 #include "ipc/shm_region.h"
 #include "utils/object_pool.h"
+#include "worker/worker_lib.h"
 
 namespace faas {
 namespace worker_lib {
@@ -60,6 +61,7 @@ private:
     OutgoingFuncCallCompleteCallback  outgoing_func_call_complete_cb_;
 
     bool use_fifo_for_nested_call_;
+    bool use_shm_queue_;
     int message_pipe_fd_;
     FuncConfig func_config_;
     const FuncConfig::Entry* config_entry_;
@@ -71,12 +73,21 @@ private:
         int      engine_sock_fd;
         int      input_pipe_fd;
         int      output_pipe_fd;
+        // Set by engine in handshake response
+        uint32_t call_id_generation;
         uint32_t next_call_id;
+        // Read end of the response FIFO, used with use_fifo_for_nested_call_
+        int      response_fifo_fd;
+        // Non-null if messages are exchanged with engine via shared memory queues
+        std::unique_ptr<MessageQueue> input_queue;
+        std::unique_ptr<MessageQueue> output_queue;
     };
     std::unordered_map</* client_id */ uint16_t, std::unique_ptr<FuncWorkerState>>
         func_workers_;
     std::unordered_map</* input_pipe_fd */ int, FuncWorkerState*>
         func_worker_by_input_fd_;
+    std::unordered_map</* response_fifo_fd */ int, FuncWorkerState*>
+        func_worker_by_response_fifo_fd_;
 
     struct IncomingFuncCallState {
         protocol::FuncCall func_call;
@@ -91,13 +102,10 @@ private:
     struct OutgoingFuncCallState {
         protocol::FuncCall              func_call;
         std::unique_ptr<ipc::ShmRegion> input_region;
-        int                             output_pipe_fd;
     };
     utils::SimpleObjectPool<OutgoingFuncCallState> outgoing_func_call_pool_;
     std::unordered_map</* full_call_id */ uint64_t, OutgoingFuncCallState*>
         outgoing_func_calls_;
-    std::unordered_map</* output_pipe_fd */ int, OutgoingFuncCallState*>
-        outgoing_func_call_by_output_pipe_fd_;
 
     inline int64_t func_call_to_handle(const protocol::FuncCall& func_call) {
         return gsl::narrow_cast<int64_t>(func_call.full_call_id);
@@ -115,9 +123,12 @@ private:
                                    const protocol::FuncCall& func_call,
                                    FuncWorkerState* worker_state, std::span<const char> input);
 
+    void SendMessageToEngine(FuncWorkerState* state, const protocol::Message& message);
+
     void OnMessagePipeReadable();
     void OnEnginePipeReadable(FuncWorkerState* state);
-    void OnOutputPipeReadable(OutgoingFuncCallState* state);
+    void OnRecvEngineMessage(FuncWorkerState* state, const protocol::Message& message);
+    void OnResponseFifoReadable(FuncWorkerState* state);
     void OnOutgoingFuncCallFinished(const protocol::Message& message, OutgoingFuncCallState* state);
 
     DISALLOW_COPY_AND_ASSIGN(EventDrivenWorker);
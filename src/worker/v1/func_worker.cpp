@@ -1,13 +1,17 @@
 #include "worker/v1/func_worker.h"
 
 #include "common/time.h"
+#include "common/span_recorder.h"
 #include "ipc/base.h"
 #include "ipc/fifo.h"
 #include "utils/io.h"
+#include "utils/cpu_topology.h"
 #include "utils/socket.h"
 #include "worker/worker_lib.h"
 
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/prctl.h>
 
 namespace faas {
 namespace worker_v1 {
@@ -21,16 +25,18 @@ using protocol::IsHandshakeResponseMessage;
 using protocol::IsDispatchFuncCallMessage;
 using protocol::IsFuncCallCompleteMessage;
 using protocol::IsFuncCallFailedMessage;
+using protocol::IsRetireFuncWorkerMessage;
 using protocol::NewFuncWorkerHandshakeMessage;
 using protocol::NewFuncCallFailedMessage;
 
 FuncWorker::FuncWorker()
     : func_id_(-1), fprocess_id_(-1), client_id_(0), message_pipe_fd_(-1),
-      use_engine_socket_(false), engine_tcp_port_(-1), use_fifo_for_nested_call_(false),
+      use_engine_socket_(false), use_shm_queue_(false), engine_tcp_port_(-1), use_fifo_for_nested_call_(false),
       func_call_timeout_(kDefaultFuncCallTimeout),
       engine_sock_fd_(-1), input_pipe_fd_(-1), output_pipe_fd_(-1),
-      buffer_pool_for_pipes_("Pipes", PIPE_BUF), ongoing_invoke_func_(false),
-      next_call_id_(0), current_func_call_id_(0) {}
+      buffer_pool_for_pipes_("Pipes", PIPE_BUF), response_fifo_fd_(-1),
+      receiving_results_(false),
+      call_id_generation_(0), next_call_id_(0), current_func_call_id_(0) {}
 
 FuncWorker::~FuncWorker() {
     if (engine_sock_fd_ != -1) {
@@ -42,6 +48,9 @@ FuncWorker::~FuncWorker() {
     if (output_pipe_fd_ != -1 && !use_engine_socket_) {
         close(output_pipe_fd_);
     }
+    if (response_fifo_fd_ != -1) {
+        worker_lib::RemoveResponseFifo(client_id_, response_fifo_fd_);
+    }
 }
 
 void FuncWorker::Serve() {
@@ -49,18 +58,75 @@ void FuncWorker::Serve() {
     CHECK(fprocess_id_ != -1);
     CHECK(client_id_ > 0);
     LOG(INFO) << "My client_id is " << client_id_;
-    // Load function library
+    LoadFuncLibrary();
+    RecvFuncConfig();
+    ConnectToEngineAndServe();
+}
+
+void FuncWorker::ServeAsZygote() {
+    CHECK(func_id_ != -1);
+    CHECK(fprocess_id_ != -1);
+    CHECK(client_id_ > 0);
+    LOG(INFO) << "Running as zygote, initial client_id is " << client_id_;
+    // Everything done before fork is shared by all func workers. The zygote
+    // itself never connects to engine, and stays single-threaded.
+    LoadFuncLibrary();
+    RecvFuncConfig();
+    // Exited func workers are reaped automatically
+    PCHECK(signal(SIGCHLD, SIG_IGN) != SIG_ERR);
+    uint16_t client_id = client_id_;
+    while (true) {
+        pid_t child_pid = fork();
+        PCHECK(child_pid != -1) << "fork failed";
+        if (child_pid == 0) {
+            // Die together with the zygote, as launcher only watches the zygote
+            PCHECK(prctl(PR_SET_PDEATHSIG, SIGKILL) == 0);
+            PCHECK(signal(SIGCHLD, SIG_DFL) != SIG_ERR);
+            close(message_pipe_fd_);
+            message_pipe_fd_ = -1;
+            client_id_ = client_id;
+            LOG(INFO) << "Forked from zygote, my client_id is " << client_id_;
+            ConnectToEngineAndServe();
+            _exit(0);
+        }
+        LOG(INFO) << "Forked func worker with client_id " << client_id
+                  << ", pid=" << child_pid;
+        // Wait for next CREATE_FUNC_WORKER message from launcher
+        while (true) {
+            Message message;
+            bool eof;
+            if (!io_utils::RecvMessage(message_pipe_fd_, &message, &eof)) {
+                if (eof) {
+                    LOG(INFO) << "Message pipe closed by launcher, zygote exits";
+                    exit(0);
+                }
+                PLOG(FATAL) << "Failed to receive message from launcher";
+            }
+            if (protocol::IsCreateFuncWorkerMessage(message)) {
+                client_id = message.client_id;
+                break;
+            }
+            LOG(ERROR) << "Unknown message type from launcher";
+        }
+    }
+}
+
+void FuncWorker::LoadFuncLibrary() {
     CHECK(!func_library_path_.empty());
     func_library_ = utils::DynamicLibrary::Create(func_library_path_);
     init_fn_ = func_library_->LoadSymbol<faas_init_fn_t>("faas_init");
     create_func_worker_fn_ = func_library_->LoadSymbol<faas_create_func_worker_fn_t>(
         "faas_create_func_worker");
+    init_async_invoke_fn_ = func_library_->LoadOptionalSymbol<faas_init_async_invoke_fn_t>(
+        "faas_init_async_invoke");
     destroy_func_worker_fn_ = func_library_->LoadSymbol<faas_destroy_func_worker_fn_t>(
         "faas_destroy_func_worker");
     func_call_fn_ = func_library_->LoadSymbol<faas_func_call_fn_t>(
         "faas_func_call");
     CHECK(init_fn_() == 0) << "Failed to initialize loaded library";
-    // Initialize function configs
+}
+
+void FuncWorker::RecvFuncConfig() {
     uint32_t payload_size;
     CHECK(io_utils::RecvData(message_pipe_fd_, reinterpret_cast<char*>(&payload_size),
                              sizeof(uint32_t), /* eof= */ nullptr))
@@ -71,6 +137,9 @@ void FuncWorker::Serve() {
         << "Failed to receive payload data from launcher";
     CHECK(func_config_.Load(std::string_view(payload, payload_size)))
         << "Failed to load function configs from payload";
+}
+
+void FuncWorker::ConnectToEngineAndServe() {
     // Connect to engine via IPC path
     if (engine_tcp_port_ == -1) {
         engine_sock_fd_ = utils::UnixDomainSocketConnect(ipc::GetEngineUnixSocketPath());
@@ -80,8 +149,10 @@ void FuncWorker::Serve() {
     }
     CHECK(engine_sock_fd_ != -1) << "Failed to connect to engine socket";
     HandshakeWithEngine();
+    tracing::Init(fmt::format("func_worker_{}", client_id_));
     // Enter main serving loop
     MainServingLoop();
+    tracing::Shutdown();
 }
 
 void FuncWorker::MainServingLoop() {
@@ -90,6 +161,12 @@ void FuncWorker::MainServingLoop() {
                                  &FuncWorker::AppendOutputWrapper,
                                  &worker_handle_) == 0)
         << "Failed to create function worker";
+    if (init_async_invoke_fn_ != nullptr) {
+        CHECK(init_async_invoke_fn_(worker_handle_,
+                                    &FuncWorker::InvokeFuncAsyncWrapper,
+                                    &FuncWorker::WaitAnyFuncWrapper) == 0)
+            << "Failed to initialize async invoke";
+    }
 
     if (!use_engine_socket_) {
         ipc::FifoUnsetNonblocking(input_pipe_fd_);
@@ -97,10 +174,13 @@ void FuncWorker::MainServingLoop() {
 
     while (true) {
         Message message;
-        CHECK(io_utils::RecvMessage(input_pipe_fd_, &message, nullptr))
+        CHECK(RecvMessageFromEngine(&message))
             << "Failed to receive message from engine";
         if (IsDispatchFuncCallMessage(message)) {
             ExecuteFunc(message);
+        } else if (IsRetireFuncWorkerMessage(message)) {
+            LOG(INFO) << "Retired by engine";
+            break;
         } else {
             LOG(FATAL) << "Unknown message type";
         }
@@ -117,8 +197,16 @@ void FuncWorker::HandshakeWithEngine() {
     } else {
         LOG(INFO) << "Use extra pipes for messages";
         input_pipe_fd_ = ipc::FifoOpenForRead(ipc::GetFuncWorkerInputFifoName(client_id_));
+        if (use_shm_queue_) {
+            input_queue_ = worker_lib::CreateInputMessageQueue(client_id_);
+        }
     }
     Message message = NewFuncWorkerHandshakeMessage(func_id_, client_id_);
+    if (input_queue_ != nullptr) {
+        message.flags |= protocol::kFuncWorkerUseShmQueueFlag;
+    }
+    message.flags |= protocol::kShmArenaEnabledFlag;
+    message.flags |= protocol::kFuncWorkerRetirableFlag;
     PCHECK(io_utils::SendMessage(engine_sock_fd_, message));
     Message response;
     CHECK(io_utils::RecvMessage(engine_sock_fd_, &response, nullptr))
@@ -130,11 +218,56 @@ void FuncWorker::HandshakeWithEngine() {
     } else {
         output_pipe_fd_ = ipc::FifoOpenForWrite(ipc::GetFuncWorkerOutputFifoName(client_id_));
     }
+    if (input_queue_ != nullptr) {
+        if (response.flags & protocol::kFuncWorkerUseShmQueueFlag) {
+            LOG(INFO) << "Use shared memory queues for messages";
+            absl::MutexLock lk(&output_queue_mu_);
+            output_queue_ = worker_lib::OpenOutputMessageQueue(client_id_, output_pipe_fd_);
+        } else {
+            LOG(WARNING) << "Engine does not accept shared memory queues, fallback to pipes";
+            input_queue_.reset(nullptr);
+        }
+    }
     if (response.flags & protocol::kUseFifoForNestedCallFlag) {
-        LOG(INFO) << "Use extra FIFOs for handling nested call";
+        LOG(INFO) << "Use response FIFO for handling nested call";
         use_fifo_for_nested_call_ = true;
+        response_fifo_fd_ = worker_lib::CreateResponseFifo(client_id_);
+        CHECK(response_fifo_fd_ != -1) << "Failed to create response FIFO";
+    }
+    if (response.flags & protocol::kShmArenaEnabledFlag) {
+        LOG(INFO) << "Use shm arena for large payloads";
+        CHECK(worker_lib::AttachShmArena());
+    }
+    if (response.flags & protocol::kFuncWorkerCpusetFlag) {
+        // Threads created after this point inherit the affinity
+        std::string_view cpuset(response.inline_data,
+                                gsl::narrow_cast<size_t>(response.payload_size));
+        std::vector<int> cpus;
+        if (cpu_utils::ParseCpuList(cpuset, &cpus) && cpu_utils::SetCurrentThreadAffinity(cpus)) {
+            LOG(INFO) << "Run on CPUs " << cpuset;
+        } else {
+            LOG(WARNING) << "Failed to apply cpuset " << cpuset << " from engine";
+        }
+    }
+    call_id_generation_ = response.call_id;
+    LOG(INFO) << "Handshake done: client_id_generation=" << call_id_generation_;
+}
+
+void FuncWorker::SendMessageToEngine(const Message& message) {
+    if (input_queue_ != nullptr) {
+        absl::MutexLock lk(&output_queue_mu_);
+        worker_lib::SendMessageViaQueue(output_queue_.get(), message);
+    } else {
+        PCHECK(io_utils::SendMessage(output_pipe_fd_, message));
+    }
+}
+
+bool FuncWorker::RecvMessageFromEngine(Message* message) {
+    if (input_queue_ != nullptr) {
+        return worker_lib::RecvMessageViaQueue(input_queue_.get(), input_pipe_fd_, message);
+    } else {
+        return io_utils::RecvMessage(input_pipe_fd_, message, nullptr);
     }
-    LOG(INFO) << "Handshake done";
 }
 
 void FuncWorker::ExecuteFunc(const Message& dispatch_func_call_message) {
@@ -144,21 +277,29 @@ void FuncWorker::ExecuteFunc(const Message& dispatch_func_call_message) {
     VLOG(1) << "Execute func_call " << FuncCallDebugString(func_call);
     std::unique_ptr<ipc::ShmRegion> input_region;
     std::span<const char> input;
-    if (!worker_lib::GetFuncCallInput(dispatch_func_call_message, &input, &input_region)) {
+    tracing::BeginSpan(func_call.full_call_id, tracing::Span::kWorkerInput);
+    bool input_ready = worker_lib::GetFuncCallInput(
+        dispatch_func_call_message, &input, &input_region);
+    tracing::EndSpan(func_call.full_call_id, tracing::Span::kWorkerInput);
+    if (!input_ready) {
         Message response = NewFuncCallFailedMessage(func_call);
         response.send_timestamp = GetMonotonicMicroTimestamp();
-        PCHECK(io_utils::SendMessage(output_pipe_fd_, response));
+        SendMessageToEngine(response);
         return;
     }
     func_output_buffer_.Reset();
     current_func_call_id_.store(func_call.full_call_id);
     int64_t start_timestamp = GetMonotonicMicroTimestamp();
+    tracing::BeginSpan(func_call.full_call_id, tracing::Span::kWorkerExecute);
     int ret = func_call_fn_(worker_handle_, input.data(), input.size());
+    tracing::EndSpan(func_call.full_call_id, tracing::Span::kWorkerExecute);
     int32_t processing_time = gsl::narrow_cast<int32_t>(
         GetMonotonicMicroTimestamp() - start_timestamp);
+    DrainAsyncInvokeFuncs();
     ReclaimInvokeFuncResources();
     VLOG(1) << "Finish executing func_call " << FuncCallDebugString(func_call);
     Message response;
+    tracing::BeginSpan(func_call.full_call_id, tracing::Span::kWorkerOutput);
     if (use_fifo_for_nested_call_) {
         worker_lib::FifoFuncCallFinished(
             func_call, /* success= */ ret == 0, func_output_buffer_.to_span(),
@@ -168,14 +309,17 @@ void FuncWorker::ExecuteFunc(const Message& dispatch_func_call_message) {
             func_call, /* success= */ ret == 0, func_output_buffer_.to_span(),
             processing_time, &response);
     }
+    tracing::EndSpan(func_call.full_call_id, tracing::Span::kWorkerOutput);
     VLOG(1) << "Send response to engine";
     response.dispatch_delay = dispatch_delay;
     response.send_timestamp = GetMonotonicMicroTimestamp();
-    PCHECK(io_utils::SendMessage(output_pipe_fd_, response));
+    SendMessageToEngine(response);
 }
 
-bool FuncWorker::InvokeFunc(const char* func_name, const char* input_data, size_t input_length,
-                            const char** output_data, size_t* output_length) {
+bool FuncWorker::PrepareInvokeFunc(const char* func_name,
+                                   const char* input_data, size_t input_length,
+                                   std::unique_ptr<ipc::ShmRegion>* input_region,
+                                   Message* invoke_func_message) {
     const FuncConfig::Entry* func_entry = func_config_.find_by_func_name(
         std::string_view(func_name, strlen(func_name)));
     if (func_entry == nullptr) {
@@ -185,164 +329,247 @@ bool FuncWorker::InvokeFunc(const char* func_name, const char* input_data, size_
     FuncCall func_call = NewFuncCall(
         gsl::narrow_cast<uint16_t>(func_entry->func_id),
         client_id_, next_call_id_.fetch_add(1));
+    func_call.client_id_generation = call_id_generation_;
     VLOG(1) << "Invoke func_call " << FuncCallDebugString(func_call);
+    return worker_lib::PrepareNewFuncCall(
+        func_call, /* parent_func_call= */ current_func_call_id_.load(),
+        std::span<const char>(input_data, input_length),
+        input_region, invoke_func_message);
+}
+
+bool FuncWorker::InvokeFunc(const char* func_name, const char* input_data, size_t input_length,
+                            const char** output_data, size_t* output_length) {
     Message invoke_func_message;
     std::unique_ptr<ipc::ShmRegion> input_region;
-    if (!worker_lib::PrepareNewFuncCall(
-            func_call, /* parent_func_call= */ current_func_call_id_.load(),
-            std::span<const char>(input_data, input_length),
-            &input_region, &invoke_func_message)) {
+    if (!PrepareInvokeFunc(func_name, input_data, input_length,
+                           &input_region, &invoke_func_message)) {
         return false;
     }
-    if (use_fifo_for_nested_call_) {
-        return FifoWaitInvokeFunc(&invoke_func_message, output_data, output_length);
-    } else {
-        return WaitInvokeFunc(&invoke_func_message, output_data, output_length);
-    }
+    return WaitInvokeFunc(&invoke_func_message, output_data, output_length);
 }
 
-bool FuncWorker::WaitInvokeFunc(Message* invoke_func_message,
-                                const char** output_data, size_t* output_length) {
-    FuncCall func_call = GetFuncCallFromMessage(*invoke_func_message);
-    // Send message to engine (dispatcher)
+bool FuncWorker::InvokeFuncAsync(const char* func_name,
+                                 const char* input_data, size_t input_length,
+                                 uint64_t* call_handle) {
+    Message invoke_func_message;
+    std::unique_ptr<ipc::ShmRegion> input_region;
+    if (!PrepareInvokeFunc(func_name, input_data, input_length,
+                           &input_region, &invoke_func_message)) {
+        return false;
+    }
+    FuncCall func_call = GetFuncCallFromMessage(invoke_func_message);
     {
         absl::MutexLock lk(&mu_);
-        if (ongoing_invoke_func_) {
-            // TODO: fix this
-            LOG(FATAL) << "NaiveWaitInvokeFunc cannot execute concurrently";
-        }
-        ongoing_invoke_func_ = true;
-        invoke_func_message->send_timestamp = GetMonotonicMicroTimestamp();
-        PCHECK(io_utils::SendMessage(output_pipe_fd_, *invoke_func_message));
+        async_invoke_funcs_[func_call.full_call_id] = {
+            .func_call = func_call,
+            .input_region = std::move(input_region)
+        };
+        invoke_func_message.send_timestamp = GetMonotonicMicroTimestamp();
+        SendMessageToEngine(invoke_func_message);
     }
     VLOG(1) << "InvokeFuncMessage sent to engine";
-    Message result_message;
-    CHECK(io_utils::RecvMessage(input_pipe_fd_, &result_message, nullptr));
-    if (IsFuncCallFailedMessage(result_message)) {
+    *call_handle = func_call.full_call_id;
+    return true;
+}
+
+bool FuncWorker::WaitAnyFunc(uint64_t* call_handle,
+                             const char** output_data, size_t* output_length) {
+    {
         absl::MutexLock lk(&mu_);
-        ongoing_invoke_func_ = false;
-        return false;
-    } else if (!IsFuncCallCompleteMessage(result_message)) {
-        LOG(FATAL) << "Unknown message type";
-    }
-    InvokeFuncResource invoke_func_resource = {
-        .func_call = func_call,
-        .output_region = nullptr,
-        .pipe_buffer = nullptr
-    };
-    if (result_message.payload_size < 0) {
-        auto output_region = ipc::ShmOpen(
-            ipc::GetFuncCallOutputShmName(func_call.full_call_id));
-        if (output_region == nullptr) {
-            LOG(ERROR) << "ShmOpen failed";
+        if (async_invoke_funcs_.empty() && async_results_.empty()) {
+            *call_handle = 0;
             return false;
         }
-        output_region->EnableRemoveOnDestruction();
-        if (output_region->size() != gsl::narrow_cast<size_t>(-result_message.payload_size)) {
-            LOG(ERROR) << "Output size mismatch";
-            return false;
-        }
-        *output_data = output_region->base();
-        *output_length = output_region->size();
-        invoke_func_resource.output_region = std::move(output_region);
-        absl::MutexLock lk(&mu_);
-        invoke_func_resources_.push_back(std::move(invoke_func_resource));
-        ongoing_invoke_func_ = false;
-    } else {
-        absl::MutexLock lk(&mu_);
-        char* buffer;
-        size_t size;
-        buffer_pool_for_pipes_.Get(&buffer, &size);
-        CHECK(size >= sizeof(Message));
-        memcpy(buffer, &result_message, sizeof(Message));
-        Message* message_copy = reinterpret_cast<Message*>(buffer);
-        std::span<const char> output = GetInlineDataFromMessage(*message_copy);
-        invoke_func_resource.pipe_buffer = buffer;
-        *output_data = output.data();
-        *output_length = output.size();
-        invoke_func_resources_.push_back(std::move(invoke_func_resource));
-        ongoing_invoke_func_ = false;
     }
-    return true;
+    InvokeFuncResult result;
+    bool received = RecvInvokeFuncResult(/* full_call_id= */ 0, &result);
+    *call_handle = result.func_call.full_call_id;
+    if (!received) {
+        return false;
+    }
+    return FinishInvokeFuncResult(&result, output_data, output_length);
 }
 
-bool FuncWorker::FifoWaitInvokeFunc(Message* invoke_func_message,
-                                    const char** output_data, size_t* output_length) {
+bool FuncWorker::WaitInvokeFunc(Message* invoke_func_message,
+                                const char** output_data, size_t* output_length) {
     FuncCall func_call = GetFuncCallFromMessage(*invoke_func_message);
-    // Create fifo for output
-    if (!ipc::FifoCreate(ipc::GetFuncCallOutputFifoName(func_call.full_call_id))) {
-        LOG(ERROR) << "FifoCreate failed";
-        return false;
-    }
-    auto remove_output_fifo = gsl::finally([func_call] {
-        ipc::FifoRemove(ipc::GetFuncCallOutputFifoName(func_call.full_call_id));
-    });
-    int output_fifo = ipc::FifoOpenForReadWrite(
-        ipc::GetFuncCallOutputFifoName(func_call.full_call_id), /* nonblocking= */ true);
-    if (output_fifo == -1) {
-        LOG(ERROR) << "FifoOpenForReadWrite failed";
-        return false;
-    }
-    auto close_output_fifo = gsl::finally([output_fifo] {
-        if (close(output_fifo) != 0) {
-            PLOG(ERROR) << "close failed";
-        }
-    });
     // Send message to engine (dispatcher)
     {
         absl::MutexLock lk(&mu_);
         invoke_func_message->send_timestamp = GetMonotonicMicroTimestamp();
-        PCHECK(io_utils::SendMessage(output_pipe_fd_, *invoke_func_message));
+        SendMessageToEngine(*invoke_func_message);
     }
     VLOG(1) << "InvokeFuncMessage sent to engine";
-    int timeout_ms = -1;
-    if (func_call_timeout_ != absl::InfiniteDuration()) {
-        timeout_ms = gsl::narrow_cast<int>(absl::ToInt64Milliseconds(func_call_timeout_));
-    }
-    if (!ipc::FifoPollForRead(output_fifo, timeout_ms)) {
-        LOG(ERROR) << "FifoPollForRead failed";
+    InvokeFuncResult result;
+    if (!RecvInvokeFuncResult(func_call.full_call_id, &result)) {
         return false;
     }
+    return FinishInvokeFuncResult(&result, output_data, output_length);
+}
+
+bool FuncWorker::RecvInvokeFuncResult(uint64_t full_call_id, InvokeFuncResult* result) {
+    absl::MutexLock lk(&mu_);
+    while (true) {
+        if (full_call_id != 0) {
+            auto iter = received_results_.find(full_call_id);
+            if (iter != received_results_.end()) {
+                *result = std::move(iter->second);
+                received_results_.erase(iter);
+                return true;
+            }
+        } else if (!async_results_.empty()) {
+            *result = std::move(async_results_.front());
+            async_results_.pop_front();
+            return true;
+        }
+        if (receiving_results_) {
+            results_cond_.Wait(&mu_);
+            continue;
+        }
+        receiving_results_ = true;
+        InvokeFuncResult received;
+        mu_.Unlock();
+        bool success = ReceiveInvokeFuncResult(&received);
+        mu_.Lock();
+        receiving_results_ = false;
+        results_cond_.SignalAll();
+        if (!success) {
+            // Give up the call being waited, or the oldest outstanding one
+            FuncCall func_call;
+            if (full_call_id != 0) {
+                func_call.full_call_id = full_call_id;
+            } else if (!async_invoke_funcs_.empty()) {
+                func_call = async_invoke_funcs_.begin()->second.func_call;
+                async_invoke_funcs_.erase(async_invoke_funcs_.begin());
+            } else {
+                continue;
+            }
+            LOG(ERROR) << "Give up waiting for " << FuncCallDebugString(func_call);
+            abandoned_invoke_funcs_.insert(func_call.full_call_id);
+            result->func_call = func_call;
+            return false;
+        }
+        uint64_t received_call_id = received.func_call.full_call_id;
+        if (received_call_id == 0) {
+            continue;
+        }
+        if (received.func_call.client_id_generation != call_id_generation_) {
+            // Sent to a previous func worker with the same client_id
+            LOG(WARNING) << "Drop result of stale nested call: "
+                         << FuncCallDebugString(received.func_call);
+            ReleaseInvokeFuncResult(&received);
+        } else if (abandoned_invoke_funcs_.contains(received_call_id)) {
+            abandoned_invoke_funcs_.erase(received_call_id);
+            ReleaseInvokeFuncResult(&received);
+        } else if (async_invoke_funcs_.contains(received_call_id)) {
+            async_invoke_funcs_.erase(received_call_id);
+            async_results_.push_back(std::move(received));
+        } else {
+            received_results_[received_call_id] = std::move(received);
+        }
+    }
+}
+
+bool FuncWorker::ReceiveInvokeFuncResult(InvokeFuncResult* result) {
+    result->func_call = protocol::kInvalidFuncCall;
+    result->success = false;
+    result->output = std::span<const char>();
+    result->output_region = nullptr;
+    result->pipe_buffer = nullptr;
     char* pipe_buffer;
     {
         absl::MutexLock lk(&mu_);
         size_t size;
         buffer_pool_for_pipes_.Get(&pipe_buffer, &size);
-        DCHECK(size == PIPE_BUF);
+        CHECK(size >= std::max<size_t>(sizeof(Message), PIPE_BUF));
     }
-    std::unique_ptr<ipc::ShmRegion> output_region;
-    bool success = false;
     bool pipe_buffer_used = false;
-    std::span<const char> output;
-    if (worker_lib::FifoGetFuncCallOutput(
-            func_call, output_fifo, pipe_buffer,
-            &success, &output, &output_region, &pipe_buffer_used)) {
-        absl::MutexLock lk(&mu_);
-        InvokeFuncResource invoke_func_resource = {
-            .func_call = func_call,
-            .output_region = nullptr,
-            .pipe_buffer = nullptr
-        };
-        if (pipe_buffer_used) {
-            invoke_func_resource.pipe_buffer = pipe_buffer;
-        } else {
+    auto return_pipe_buffer = gsl::finally([this, pipe_buffer, &pipe_buffer_used] {
+        if (!pipe_buffer_used) {
+            absl::MutexLock lk(&mu_);
             buffer_pool_for_pipes_.Return(pipe_buffer);
         }
-        if (output_region != nullptr) {
-            invoke_func_resource.output_region = std::move(output_region);
+    });
+    if (use_fifo_for_nested_call_) {
+        int timeout_ms = -1;
+        if (func_call_timeout_ != absl::InfiniteDuration()) {
+            timeout_ms = gsl::narrow_cast<int>(absl::ToInt64Milliseconds(func_call_timeout_));
         }
-        invoke_func_resources_.push_back(std::move(invoke_func_resource));
-        if (success) {
-            *output_data = output.data();
-            *output_length = output.size();
-            return true;
-        } else {
+        if (!ipc::FifoPollForRead(response_fifo_fd_, timeout_ms)) {
+            LOG(ERROR) << "FifoPollForRead failed";
+            return false;
+        }
+        if (!worker_lib::FifoReadFuncCallOutput(
+                response_fifo_fd_, pipe_buffer, &result->func_call, &result->success,
+                &result->output, &result->output_region, &pipe_buffer_used)) {
+            LOG(ERROR) << "FifoReadFuncCallOutput failed";
             return false;
         }
     } else {
-        absl::MutexLock lk(&mu_);
-        buffer_pool_for_pipes_.Return(pipe_buffer);
-        return false;
+        Message message;
+        CHECK(RecvMessageFromEngine(&message));
+        if (!IsFuncCallCompleteMessage(message) && !IsFuncCallFailedMessage(message)) {
+            LOG(FATAL) << "Unknown message type";
+        }
+        result->func_call = GetFuncCallFromMessage(message);
+        if (IsFuncCallFailedMessage(message)) {
+            result->success = false;
+        } else if (message.payload_size < 0) {
+            result->output_region = worker_lib::GetFuncCallOutputShm(message);
+            if (result->output_region != nullptr) {
+                result->success = true;
+                result->output = result->output_region->to_span();
+            }
+        } else {
+            memcpy(pipe_buffer, &message, sizeof(Message));
+            Message* message_copy = reinterpret_cast<Message*>(pipe_buffer);
+            result->success = true;
+            result->output = GetInlineDataFromMessage(*message_copy);
+            pipe_buffer_used = true;
+        }
+    }
+    if (pipe_buffer_used) {
+        result->pipe_buffer = pipe_buffer;
+    }
+    return true;
+}
+
+bool FuncWorker::FinishInvokeFuncResult(InvokeFuncResult* result,
+                                        const char** output_data, size_t* output_length) {
+    bool success = result->success;
+    if (success) {
+        *output_data = result->output.data();
+        *output_length = result->output.size();
+    }
+    // Output stays valid until the current func call finishes
+    absl::MutexLock lk(&mu_);
+    invoke_func_resources_.push_back({
+        .func_call = result->func_call,
+        .output_region = std::move(result->output_region),
+        .pipe_buffer = result->pipe_buffer
+    });
+    result->pipe_buffer = nullptr;
+    return success;
+}
+
+void FuncWorker::ReleaseInvokeFuncResult(InvokeFuncResult* result) {
+    if (result->pipe_buffer != nullptr) {
+        buffer_pool_for_pipes_.Return(result->pipe_buffer);
+        result->pipe_buffer = nullptr;
+    }
+    result->output_region.reset(nullptr);
+}
+
+void FuncWorker::DrainAsyncInvokeFuncs() {
+    uint64_t call_handle;
+    const char* output_data;
+    size_t output_length;
+    while (true) {
+        WaitAnyFunc(&call_handle, &output_data, &output_length);
+        if (call_handle == 0) {
+            break;
+        }
+        VLOG(1) << "Discard result of unwaited nested call " << call_handle;
     }
 }
 
@@ -372,5 +599,24 @@ int FuncWorker::InvokeFuncWrapper(void* caller_context, const char* func_name,
     return success ? 0 : -1;
 }
 
+int FuncWorker::InvokeFuncAsyncWrapper(void* caller_context, const char* func_name,
+                                       const char* input_data, size_t input_length,
+                                       uint64_t* call_handle) {
+    *call_handle = 0;
+    FuncWorker* self = reinterpret_cast<FuncWorker*>(caller_context);
+    bool success = self->InvokeFuncAsync(func_name, input_data, input_length, call_handle);
+    return success ? 0 : -1;
+}
+
+int FuncWorker::WaitAnyFuncWrapper(void* caller_context, uint64_t* call_handle,
+                                   const char** output_data, size_t* output_length) {
+    *call_handle = 0;
+    *output_data = nullptr;
+    *output_length = 0;
+    FuncWorker* self = reinterpret_cast<FuncWorker*>(caller_context);
+    bool success = self->WaitAnyFunc(call_handle, output_data, output_length);
+    return success ? 0 : -1;
+}
+
 }  // namespace worker_v1
 }  // namespace faas
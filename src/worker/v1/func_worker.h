@@ -13,6 +13,7 @@
 #include "utils/appendable_buffer.h"
 #include "utils/buffer_pool.h"
 #include "ipc/shm_region.h"
+#include "ipc/spsc_queue.h"
 #include "faas/worker_v1_interface.h"
 
 namespace faas {
@@ -33,9 +34,15 @@ public:
         func_library_path_ = std::string(path);
     }
     void enable_use_engine_socket() { use_engine_socket_ = true; }
+    void enable_use_shm_queue() { use_shm_queue_ = true; }
     void set_engine_tcp_port(int port) { engine_tcp_port_ = port; }
 
     void Serve();
+    // Load and initialize the function library once, then fork a func worker
+    // for every CREATE_FUNC_WORKER message received from launcher. Forked
+    // children share the initialized library copy-on-write. Never returns
+    // in the zygote process.
+    void ServeAsZygote();
 
 private:
     int func_id_;
@@ -44,6 +51,7 @@ private:
     int message_pipe_fd_;
     std::string func_library_path_;
     bool use_engine_socket_;
+    bool use_shm_queue_;
     int engine_tcp_port_;
     bool use_fifo_for_nested_call_;
     absl::Duration func_call_timeout_;
@@ -54,12 +62,19 @@ private:
     int input_pipe_fd_;
     int output_pipe_fd_;
 
+    // Non-null if messages are exchanged with engine via shared memory queues
+    std::unique_ptr<ipc::SPSCQueue<protocol::Message>> input_queue_;
+    absl::Mutex output_queue_mu_;
+    std::unique_ptr<ipc::SPSCQueue<protocol::Message>>
+        output_queue_ ABSL_GUARDED_BY(output_queue_mu_);
+
     FuncConfig func_config_;
     std::unique_ptr<utils::DynamicLibrary> func_library_;
     void* worker_handle_;
 
     faas_init_fn_t init_fn_;
     faas_create_func_worker_fn_t create_func_worker_fn_;
+    faas_init_async_invoke_fn_t init_async_invoke_fn_;
     faas_destroy_func_worker_fn_t destroy_func_worker_fn_;
     faas_func_call_fn_t func_call_fn_;
 
@@ -71,24 +86,78 @@ private:
 
     std::vector<InvokeFuncResource> invoke_func_resources_ ABSL_GUARDED_BY(mu_);
     utils::BufferPool buffer_pool_for_pipes_ ABSL_GUARDED_BY(mu_);
-    bool ongoing_invoke_func_ ABSL_GUARDED_BY(mu_);
+
+    // Read end of the response FIFO, used with use_fifo_for_nested_call_
+    int response_fifo_fd_;
+
+    struct InvokeFuncResult {
+        protocol::FuncCall func_call;
+        bool success;
+        std::span<const char> output;
+        std::unique_ptr<ipc::ShmRegion> output_region;
+        char* pipe_buffer;
+    };
+
+    struct AsyncInvokeFunc {
+        protocol::FuncCall func_call;
+        // Input kept alive until the result is received
+        std::unique_ptr<ipc::ShmRegion> input_region;
+    };
+
+    // Nested calls issued by InvokeFuncAsync, not yet returned by WaitAnyFunc
+    absl::flat_hash_map</* full_call_id */ uint64_t, AsyncInvokeFunc>
+        async_invoke_funcs_ ABSL_GUARDED_BY(mu_);
+    // Nested calls given up after timeout, whose results are dropped
+    absl::flat_hash_set</* full_call_id */ uint64_t> abandoned_invoke_funcs_ ABSL_GUARDED_BY(mu_);
+
+    // Results of nested calls are demultiplexed by full_call_id. At most one
+    // waiter receives results at a time, and stashes results for others.
+    bool receiving_results_ ABSL_GUARDED_BY(mu_);
+    absl::CondVar results_cond_;
+    absl::flat_hash_map</* full_call_id */ uint64_t, InvokeFuncResult>
+        received_results_ ABSL_GUARDED_BY(mu_);
+    std::deque<InvokeFuncResult> async_results_ ABSL_GUARDED_BY(mu_);
     utils::AppendableBuffer func_output_buffer_;
     char main_pipe_buf_[PIPE_BUF];
 
+    // Set by engine in handshake response, see protocol::kCallIdGenerationBits
+    uint32_t call_id_generation_;
     std::atomic<uint32_t> next_call_id_;
     std::atomic<uint64_t> current_func_call_id_;
 
+    void LoadFuncLibrary();
+    void RecvFuncConfig();
+    void ConnectToEngineAndServe();
     void MainServingLoop();
     void HandshakeWithEngine();
+    void SendMessageToEngine(const protocol::Message& message);
+    bool RecvMessageFromEngine(protocol::Message* message);
 
     void ExecuteFunc(const protocol::Message& dispatch_func_call_message);
     bool InvokeFunc(const char* func_name,
                     const char* input_data, size_t input_length,
                     const char** output_data, size_t* output_length);
+    bool InvokeFuncAsync(const char* func_name,
+                         const char* input_data, size_t input_length,
+                         uint64_t* call_handle);
+    bool WaitAnyFunc(uint64_t* call_handle, const char** output_data, size_t* output_length);
+    // Input not inlined in invoke_func_message is held by input_region, which
+    // should be kept until the result of the call is received
+    bool PrepareInvokeFunc(const char* func_name,
+                           const char* input_data, size_t input_length,
+                           std::unique_ptr<ipc::ShmRegion>* input_region,
+                           protocol::Message* invoke_func_message);
     bool WaitInvokeFunc(protocol::Message* invoke_func_message,
                         const char** output_data, size_t* output_length);
-    bool FifoWaitInvokeFunc(protocol::Message* invoke_func_message,
-                            const char** output_data, size_t* output_length);
+    // Block until the result of given nested call is received. If full_call_id
+    // is 0, wait for result of any async nested call. Returns false on timeout.
+    bool RecvInvokeFuncResult(uint64_t full_call_id, InvokeFuncResult* result);
+    // Receive one result from engine messages, or from the response FIFO
+    bool ReceiveInvokeFuncResult(InvokeFuncResult* result);
+    bool FinishInvokeFuncResult(InvokeFuncResult* result,
+                                const char** output_data, size_t* output_length);
+    void ReleaseInvokeFuncResult(InvokeFuncResult* result) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    void DrainAsyncInvokeFuncs();
     void ReclaimInvokeFuncResources();
 
     // Assume caller_context is an instance of FuncWorker
@@ -96,6 +165,11 @@ private:
     static int InvokeFuncWrapper(void* caller_context, const char* func_name,
                                  const char* input_data, size_t input_length,
                                  const char** output_data, size_t* output_length);
+    static int InvokeFuncAsyncWrapper(void* caller_context, const char* func_name,
+                                      const char* input_data, size_t input_length,
+                                      uint64_t* call_handle);
+    static int WaitAnyFuncWrapper(void* caller_context, uint64_t* call_handle,
+                                  const char** output_data, size_t* output_length);
 
     DISALLOW_COPY_AND_ASSIGN(FuncWorker);
 };
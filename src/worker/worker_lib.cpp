@@ -1,7 +1,13 @@
 #define __FAAS_USED_IN_BINDING
 #include "worker/worker_lib.h"
 
+#include "base/asm.h"
 #include "ipc/fifo.h"
+#include "common/time.h"
+
+#include <signal.h>
+#include <time.h>
+#include <mutex>
 
 namespace faas {
 namespace worker_lib {
@@ -12,11 +18,51 @@ using protocol::IsDispatchFuncCallMessage;
 using protocol::GetFuncCallFromMessage;
 using protocol::GetInlineDataFromMessage;
 using protocol::SetInlineDataInMessage;
+using protocol::IsPayloadInShmArena;
+using protocol::SetShmArenaPayloadInMessage;
 using protocol::NewFuncCallCompleteMessage;
 using protocol::NewFuncCallFailedMessage;
 
 namespace {
 
+std::unique_ptr<ipc::ShmArena> shm_arena = nullptr;
+
+// Engine normally drains the output queue fast, thus SendMessageViaQueue
+// spins for a while before sleeping
+constexpr int kMaxSpinsOnFullQueue = 4096;
+constexpr long kMaxSleepNsOnFullQueue = 1000000;  // 1ms
+
+// Callers normally drain their response FIFOs fast. A full FIFO is waited
+// for up to this long, as the output cannot be delivered by other means.
+constexpr int64_t kResponseFifoWriteTimeoutUs = 1000000;  // 1s
+
+inline ipc::ShmArenaBuffer GetShmArenaBufferFromMessage(const Message& message) {
+    return ipc::ShmArenaBuffer {
+        .segment = message.shm_arena_segment,
+        .offset = message.shm_arena_offset
+    };
+}
+
+// Try placing payload in shm arena, returns nullptr if arena is not attached
+// or runs out of buffers
+std::unique_ptr<ipc::ShmRegion> WritePayloadToShmArena(std::span<const char> payload,
+                                                       Message* message) {
+    if (shm_arena == nullptr) {
+        return nullptr;
+    }
+    ipc::ShmArenaBuffer buffer;
+    auto region = shm_arena->Allocate(payload.size(), &buffer);
+    if (region == nullptr) {
+        VLOG(1) << "No free buffer in shm arena for " << payload.size() << " bytes";
+        return nullptr;
+    }
+    if (payload.size() > 0) {
+        memcpy(region->base(), payload.data(), payload.size());
+    }
+    SetShmArenaPayloadInMessage(message, buffer.segment, buffer.offset, payload.size());
+    return region;
+}
+
 bool WriteOutputToShm(const FuncCall& func_call, std::span<const char> output) {
     auto output_region = ipc::ShmCreate(
         ipc::GetFuncCallOutputShmName(func_call.full_call_id), output.size());
@@ -30,48 +76,129 @@ bool WriteOutputToShm(const FuncCall& func_call, std::span<const char> output) {
     return true;
 }
 
+// Write ends of response FIFOs of callers, opened on first use
+std::mutex response_fifo_mu;
+std::unordered_map</* client_id */ uint16_t, int> response_fifos;
+
+int GetResponseFifoForWrite(uint16_t client_id, bool reopen) {
+    std::lock_guard<std::mutex> lk(response_fifo_mu);
+    auto iter = response_fifos.find(client_id);
+    if (iter != response_fifos.end()) {
+        if (!reopen) {
+            return iter->second;
+        }
+        if (close(iter->second) != 0) {
+            PLOG(ERROR) << "close failed";
+        }
+        response_fifos.erase(iter);
+    }
+    int fd = ipc::FifoOpenForWrite(ipc::GetFuncWorkerResponseFifoName(client_id),
+                                   /* nonblocking= */ true);
+    if (fd != -1) {
+        response_fifos[client_id] = fd;
+    }
+    return fd;
+}
+
+// The caller may have exited since the write end was opened, in which case
+// write fails with EPIPE instead of raising SIGPIPE
+ssize_t WriteWithoutSigpipe(int fd, const char* data, size_t size) {
+    sigset_t sigpipe_set, old_set;
+    sigemptyset(&sigpipe_set);
+    sigaddset(&sigpipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe_set, &old_set);
+    ssize_t nwrite = write(fd, data, size);
+    int saved_errno = errno;
+    if (nwrite < 0 && saved_errno == EPIPE) {
+        struct timespec zero_timeout = { 0, 0 };
+        sigtimedwait(&sigpipe_set, nullptr, &zero_timeout);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+    errno = saved_errno;
+    return nwrite;
+}
+
 bool WriteOutputToFifo(const FuncCall& func_call,
                        bool success, std::span<const char> output,
                        char* pipe_buf) {
-    VLOG(1) << "Start writing output to FIFO";
-    int output_fifo = ipc::FifoOpenForWrite(
-        ipc::GetFuncCallOutputFifoName(func_call.full_call_id), /* nonblocking= */ true);
-    if (output_fifo == -1) {
-        LOG(ERROR) << "FifoOpenForWrite failed";
-        return false;
-    }
-    auto close_output_fifo = gsl::finally([output_fifo] {
-        if (close(output_fifo) != 0) {
-            PLOG(ERROR) << "close failed";
-        }
-    });
-    int32_t header = success ? output.size() : -1;
-    size_t write_size = sizeof(int32_t);
-    memcpy(pipe_buf, &header, sizeof(int32_t));
+    VLOG(1) << "Start writing output to response FIFO";
+    NestedCallOutputHeader header = {
+        .full_call_id = func_call.full_call_id,
+        .output_size = success ? gsl::narrow_cast<int32_t>(output.size()) : -1,
+        .padding = 0
+    };
+    size_t write_size = sizeof(NestedCallOutputHeader);
+    memcpy(pipe_buf, &header, sizeof(NestedCallOutputHeader));
     if (success) {
-        if (output.size() + sizeof(int32_t) <= PIPE_BUF) {
+        if (output.size() + sizeof(NestedCallOutputHeader) <= PIPE_BUF) {
             write_size += output.size();
             DCHECK(write_size <= PIPE_BUF);
-            memcpy(pipe_buf + sizeof(uint32_t), output.data(), output.size());
+            memcpy(pipe_buf + sizeof(NestedCallOutputHeader), output.data(), output.size());
         } else {
             if (!WriteOutputToShm(func_call, output)) {
                 return false;
             }
         }
     }
-    ssize_t nwrite = write(output_fifo, pipe_buf, write_size);
-    if (nwrite < 0) {
-        PLOG(ERROR) << "Failed to write to output fifo";
-        return false;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        // Cached write end may belong to a previous worker with the same client_id
+        int response_fifo = GetResponseFifoForWrite(func_call.client_id,
+                                                    /* reopen= */ attempt > 0);
+        if (response_fifo == -1) {
+            LOG(ERROR) << "FifoOpenForWrite failed";
+            return false;
+        }
+        ssize_t nwrite = WriteWithoutSigpipe(response_fifo, pipe_buf, write_size);
+        // Writes no larger than PIPE_BUF are atomic, thus either the whole
+        // record is written, or EAGAIN is returned if the FIFO is full
+        int64_t deadline = -1;
+        while (nwrite < 0 && (errno == EAGAIN || errno == EINTR)) {
+            int64_t current_time = GetMonotonicMicroTimestamp();
+            if (deadline == -1) {
+                deadline = current_time + kResponseFifoWriteTimeoutUs;
+            }
+            int timeout_ms = gsl::narrow_cast<int>((deadline - current_time + 999) / 1000);
+            if (timeout_ms <= 0 || !ipc::FifoPollForWrite(response_fifo, timeout_ms)) {
+                LOG(ERROR) << "Response fifo of client_id " << func_call.client_id
+                           << " stays full";
+                return false;
+            }
+            nwrite = WriteWithoutSigpipe(response_fifo, pipe_buf, write_size);
+        }
+        if (nwrite < 0 && errno == EPIPE) {
+            continue;
+        }
+        if (nwrite < 0) {
+            PLOG(ERROR) << "Failed to write to response fifo";
+            return false;
+        }
+        if (gsl::narrow_cast<size_t>(nwrite) < write_size) {
+            LOG(ERROR) << "Writing " << write_size << " bytes to response fifo is not atomic";
+            return false;
+        }
+        return true;
     }
-    if (gsl::narrow_cast<size_t>(nwrite) < write_size) {
-        LOG(ERROR) << "Writing " << write_size << " bytes to output fifo is not atomic";
+    LOG(ERROR) << "Response fifo of client_id " << func_call.client_id << " is closed";
+    return false;
+}
+
+}  // anonymous namespace
+
+bool AttachShmArena() {
+    if (shm_arena != nullptr) {
+        return true;
+    }
+    shm_arena = ipc::ShmArena::Open();
+    if (shm_arena == nullptr) {
+        LOG(ERROR) << "Failed to attach shm arena";
         return false;
     }
     return true;
 }
 
-}  // anonymous namespace
+ipc::ShmArena* GetShmArena() {
+    return shm_arena.get();
+}
 
 bool GetFuncCallInput(const Message& dispatch_func_call_message,
                       std::span<const char>* input,
@@ -81,7 +208,21 @@ bool GetFuncCallInput(const Message& dispatch_func_call_message,
         return false;
     }
     FuncCall func_call = GetFuncCallFromMessage(dispatch_func_call_message);
-    if (dispatch_func_call_message.payload_size < 0) {
+    if (IsPayloadInShmArena(dispatch_func_call_message)) {
+        // Input in shm arena
+        if (shm_arena == nullptr) {
+            LOG(ERROR) << "Input is in shm arena, but shm arena is not attached";
+            return false;
+        }
+        auto input_region = shm_arena->Get(
+            GetShmArenaBufferFromMessage(dispatch_func_call_message),
+            gsl::narrow_cast<size_t>(-dispatch_func_call_message.payload_size));
+        if (input_region == nullptr) {
+            return false;
+        }
+        *input = input_region->to_span();
+        *shm_region = std::move(input_region);
+    } else if (dispatch_func_call_message.payload_size < 0) {
         // Input in shm
         auto input_region = ipc::ShmOpen(ipc::GetFuncCallInputShmName(func_call.full_call_id));
         if (input_region == nullptr) {
@@ -110,6 +251,8 @@ void FifoFuncCallFinished(const FuncCall& func_call,
         if (success) {
             if (output.size() <= MESSAGE_INLINE_DATA_SIZE) {
                 SetInlineDataInMessage(response, output);
+            } else if (WritePayloadToShmArena(output, response) != nullptr) {
+                // Arena buffer will be released by engine
             } else {
                 if (WriteOutputToShm(func_call, output)) {
                     response->payload_size = -gsl::narrow_cast<int32_t>(output.size());
@@ -135,6 +278,8 @@ void FuncCallFinished(const protocol::FuncCall& func_call,
         *response = NewFuncCallCompleteMessage(func_call, processing_time);
         if (output.size() <= MESSAGE_INLINE_DATA_SIZE) {
             SetInlineDataInMessage(response, output);
+        } else if (WritePayloadToShmArena(output, response) != nullptr) {
+            // Arena buffer will be released by the receiver of output
         } else {
             if (WriteOutputToShm(func_call, output)) {
                 response->payload_size = -gsl::narrow_cast<int32_t>(output.size());
@@ -154,6 +299,10 @@ bool PrepareNewFuncCall(const FuncCall& func_call, uint64_t parent_func_call,
     *invoke_func_message = NewInvokeFuncMessage(func_call, parent_func_call);
     if (input.size() <= MESSAGE_INLINE_DATA_SIZE) {
         SetInlineDataInMessage(invoke_func_message, input);
+    } else if (auto arena_region = WritePayloadToShmArena(input, invoke_func_message)) {
+        // Arena buffer will be released after the call finishes
+        arena_region->EnableRemoveOnDestruction();
+        *shm_region = std::move(arena_region);
     } else {
         // Create shm for input
         auto input_region = ipc::ShmCreate(
@@ -172,40 +321,102 @@ bool PrepareNewFuncCall(const FuncCall& func_call, uint64_t parent_func_call,
     return true;
 }
 
-bool FifoGetFuncCallOutput(const FuncCall& func_call,
-                           int output_fifo_fd, char* pipe_buf,
-                           bool* success, std::span<const char>* output,
-                           std::unique_ptr<ipc::ShmRegion>* shm_region,
-                           bool* pipe_buf_used) {
-    ssize_t nread = read(output_fifo_fd, pipe_buf, PIPE_BUF);
+std::unique_ptr<ipc::ShmRegion> GetFuncCallOutputShm(const Message& message) {
+    DCHECK(message.payload_size < 0);
+    size_t output_size = gsl::narrow_cast<size_t>(-message.payload_size);
+    std::unique_ptr<ipc::ShmRegion> output_region;
+    if (IsPayloadInShmArena(message)) {
+        if (shm_arena == nullptr) {
+            LOG(ERROR) << "Output is in shm arena, but shm arena is not attached";
+            return nullptr;
+        }
+        output_region = shm_arena->Get(GetShmArenaBufferFromMessage(message), output_size);
+        if (output_region == nullptr) {
+            return nullptr;
+        }
+    } else {
+        FuncCall func_call = GetFuncCallFromMessage(message);
+        output_region = ipc::ShmOpen(ipc::GetFuncCallOutputShmName(func_call.full_call_id));
+        if (output_region == nullptr) {
+            LOG(ERROR) << "ShmOpen failed";
+            return nullptr;
+        }
+    }
+    output_region->EnableRemoveOnDestruction();
+    if (output_region->size() != output_size) {
+        LOG(ERROR) << "Output size mismatch";
+        return nullptr;
+    }
+    return output_region;
+}
+
+int CreateResponseFifo(uint16_t client_id) {
+    std::string fifo_name = ipc::GetFuncWorkerResponseFifoName(client_id);
+    // Left by a previous func worker with the same client_id
+    ipc::FifoRemove(fifo_name);
+    if (!ipc::FifoCreate(fifo_name)) {
+        LOG(ERROR) << "FifoCreate failed";
+        return -1;
+    }
+    int fd = ipc::FifoOpenForReadWrite(fifo_name, /* nonblocking= */ true);
+    if (fd == -1) {
+        LOG(ERROR) << "FifoOpenForReadWrite failed";
+        ipc::FifoRemove(fifo_name);
+        return -1;
+    }
+    return fd;
+}
+
+void RemoveResponseFifo(uint16_t client_id, int response_fifo_fd) {
+    if (close(response_fifo_fd) != 0) {
+        PLOG(ERROR) << "close failed";
+    }
+    ipc::FifoRemove(ipc::GetFuncWorkerResponseFifoName(client_id));
+}
+
+bool FifoReadFuncCallOutput(int response_fifo_fd, char* pipe_buf,
+                            FuncCall* func_call, bool* success,
+                            std::span<const char>* output,
+                            std::unique_ptr<ipc::ShmRegion>* shm_region,
+                            bool* pipe_buf_used) {
+    *func_call = protocol::kInvalidFuncCall;
+    *pipe_buf_used = false;
+    // Records are written atomically, thus once the header is readable, the
+    // whole record is
+    NestedCallOutputHeader header;
+    ssize_t nread = read(response_fifo_fd, &header, sizeof(NestedCallOutputHeader));
     if (nread < 0) {
-        PLOG(ERROR) << "Failed to read from fifo";
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        }
+        PLOG(ERROR) << "Failed to read from response fifo";
         return false;
     }
-    if (gsl::narrow_cast<size_t>(nread) < sizeof(int32_t)) {
-        LOG(ERROR) << "Cannot read header from fifo";
+    if (gsl::narrow_cast<size_t>(nread) < sizeof(NestedCallOutputHeader)) {
+        LOG(ERROR) << "Cannot read header from response fifo";
         return false;
     }
-    int32_t header;
-    memcpy(&header, pipe_buf, sizeof(int32_t));
-    if (header < 0) {
+    func_call->full_call_id = header.full_call_id;
+    if (header.output_size < 0) {
         *success = false;
-        *pipe_buf_used = false;
         return true;
     }
     *success = true;
-    size_t output_size = gsl::narrow_cast<size_t>(header);
-    if (sizeof(int32_t) + output_size <= PIPE_BUF) {
-        if (gsl::narrow_cast<size_t>(nread) < sizeof(int32_t) + output_size) {
-            LOG(ERROR) << "Not all fifo data is read?";
-            return false;
+    size_t output_size = gsl::narrow_cast<size_t>(header.output_size);
+    if (sizeof(NestedCallOutputHeader) + output_size <= PIPE_BUF) {
+        if (output_size > 0) {
+            nread = read(response_fifo_fd, pipe_buf, output_size);
+            if (nread < 0 || gsl::narrow_cast<size_t>(nread) < output_size) {
+                LOG(ERROR) << "Not all fifo data is read?";
+                return false;
+            }
         }
-        *output = std::span<const char>(pipe_buf + sizeof(int32_t), output_size);
+        *output = std::span<const char>(pipe_buf, output_size);
         *pipe_buf_used = true;
         return true;
-    } else if (gsl::narrow_cast<size_t>(nread) == sizeof(int32_t)) {
+    } else {
         auto output_region = ipc::ShmOpen(
-            ipc::GetFuncCallOutputShmName(func_call.full_call_id));
+            ipc::GetFuncCallOutputShmName(func_call->full_call_id));
         if (output_region == nullptr) {
             LOG(ERROR) << "ShmOpen failed";
             return false;
@@ -217,12 +428,77 @@ bool FifoGetFuncCallOutput(const FuncCall& func_call,
         }
         *output = output_region->to_span();
         *shm_region = std::move(output_region);
-        *pipe_buf_used = false;
         return true;
-    } else {
-        LOG(ERROR) << "Invalid data read from output fifo";
+    }
+}
+
+std::unique_ptr<MessageQueue> CreateInputMessageQueue(uint16_t client_id) {
+    // Left by a previous func worker with the same client_id
+    MessageQueue::RemoveIfExists(ipc::GetFuncWorkerInputQueueName(client_id));
+    auto queue = MessageQueue::Create(ipc::GetFuncWorkerInputQueueName(client_id),
+                                      protocol::kFuncWorkerMessageQueueSize);
+    // Engine rings the doorbell for the first message
+    queue->ConsumerEnterSleep();
+    return queue;
+}
+
+std::unique_ptr<MessageQueue> OpenOutputMessageQueue(uint16_t client_id, int output_pipe_fd) {
+    auto queue = MessageQueue::Open(ipc::GetFuncWorkerOutputQueueName(client_id));
+    queue->SetWakeupConsumerFn([output_pipe_fd] () {
+        char doorbell = 0;
+        if (write(output_pipe_fd, &doorbell, 1) != 1) {
+            PLOG(ERROR) << "Failed to wake up engine";
+        }
+    });
+    return queue;
+}
+
+void SendMessageViaQueue(MessageQueue* queue, const Message& message) {
+    for (int i = 0; i < kMaxSpinsOnFullQueue; i++) {
+        if (queue->Push(message)) {
+            return;
+        }
+        asm_volatile_pause();
+    }
+    // Engine is behind, there is no signal for free space in the queue, so
+    // sleep with exponential backoff
+    struct timespec sleep_time = { .tv_sec = 0, .tv_nsec = 1000 };
+    while (!queue->Push(message)) {
+        nanosleep(&sleep_time, nullptr);
+        sleep_time.tv_nsec = std::min(sleep_time.tv_nsec * 2, kMaxSleepNsOnFullQueue);
+    }
+}
+
+bool PopMessageOrEnterSleep(MessageQueue* queue, Message* message) {
+    do {
+        if (queue->Pop(message)) {
+            return true;
+        }
+    } while (!queue->ConsumerEnterSleep());
+    return false;
+}
+
+bool ConsumeDoorbell(int input_pipe_fd) {
+    char buf[64];
+    ssize_t nread = read(input_pipe_fd, buf, sizeof(buf));
+    if (nread == 0) {
+        LOG(ERROR) << "Input pipe closed";
         return false;
     }
+    if (nread < 0 && errno != EAGAIN && errno != EINTR) {
+        PLOG(ERROR) << "Failed to read from input pipe";
+        return false;
+    }
+    return true;
+}
+
+bool RecvMessageViaQueue(MessageQueue* queue, int input_pipe_fd, Message* message) {
+    while (!PopMessageOrEnterSleep(queue, message)) {
+        if (!ConsumeDoorbell(input_pipe_fd)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 }  // namespace worker_lib
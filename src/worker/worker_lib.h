@@ -3,10 +3,20 @@
 #include "base/common.h"
 #include "common/protocol.h"
 #include "ipc/shm_region.h"
+#include "ipc/shm_arena.h"
+#include "ipc/spsc_queue.h"
 
 namespace faas {
 namespace worker_lib {
 
+// Engine started with shm arena will set kShmArenaEnabledFlag in handshake
+// response, if func worker sets the flag in its handshake message. Func worker
+// then attaches the arena, and payloads too large for inline data will be
+// placed in arena buffers when possible.
+bool AttachShmArena();
+// Returns nullptr if shm arena is not attached
+ipc::ShmArena* GetShmArena();
+
 bool GetFuncCallInput(const protocol::Message& dispatch_func_call_message,
                       std::span<const char>* input,
                       std::unique_ptr<ipc::ShmRegion>* shm_region);
@@ -25,12 +35,55 @@ bool PrepareNewFuncCall(const protocol::FuncCall& func_call, uint64_t parent_fun
                         std::unique_ptr<ipc::ShmRegion>* shm_region,
                         protocol::Message* invoke_func_message);
 
-// pipe_buf is supposed to have a size of at least PIPE_BUF
-bool FifoGetFuncCallOutput(const protocol::FuncCall& func_call,
-                          int output_fifo_fd, char* pipe_buf,
-                          bool* success, std::span<const char>* output,
-                          std::unique_ptr<ipc::ShmRegion>* shm_region,
-                          bool* pipe_buf_used);
+// For FUNC_CALL_COMPLETE message of nested call with payload in shm. Payload
+// storage is released when the returned region is destructed. Returns nullptr
+// on failure.
+std::unique_ptr<ipc::ShmRegion> GetFuncCallOutputShm(const protocol::Message& message);
+
+// With kUseFifoForNestedCallFlag, outputs of nested calls are written to the
+// response FIFO of the caller, which is created once per func worker. Each
+// output is a record starting with NestedCallOutputHeader, followed by output
+// data if they fit in PIPE_BUF, otherwise output data is placed in shm. As
+// records never exceed PIPE_BUF, writes from concurrent callees are atomic.
+struct NestedCallOutputHeader {
+    uint64_t full_call_id;
+    int32_t  output_size;  // -1 if the call failed
+    uint32_t padding;
+};
+
+// Returns the read end (non-blocking) of the response FIFO, or -1 on failure
+int CreateResponseFifo(uint16_t client_id);
+void RemoveResponseFifo(uint16_t client_id, int response_fifo_fd);
+
+// Read one output record from the response FIFO. func_call is set to
+// kInvalidFuncCall if no record is available at the moment. pipe_buf is
+// supposed to have a size of at least PIPE_BUF.
+bool FifoReadFuncCallOutput(int response_fifo_fd, char* pipe_buf,
+                            protocol::FuncCall* func_call, bool* success,
+                            std::span<const char>* output,
+                            std::unique_ptr<ipc::ShmRegion>* shm_region,
+                            bool* pipe_buf_used);
+
+// Shared memory message queues between engine and func worker, used when
+// engine sets kFuncWorkerUseShmQueueFlag. Func worker creates its input queue
+// before handshake, while the output queue is created by engine. FIFOs between
+// engine and func worker then only carry wakeup signals for sleeping consumers.
+typedef ipc::SPSCQueue<protocol::Message> MessageQueue;
+
+std::unique_ptr<MessageQueue> CreateInputMessageQueue(uint16_t client_id);
+std::unique_ptr<MessageQueue> OpenOutputMessageQueue(uint16_t client_id, int output_pipe_fd);
+
+// If the queue is full, spin for a bounded number of times, then sleep with
+// backoff until the engine frees up space
+void SendMessageViaQueue(MessageQueue* queue, const protocol::Message& message);
+
+// Return false if the queue is empty, in which case the consumer has entered
+// sleep, and should wait for input_pipe_fd to become readable
+bool PopMessageOrEnterSleep(MessageQueue* queue, protocol::Message* message);
+// Return false if input_pipe_fd is closed
+bool ConsumeDoorbell(int input_pipe_fd);
+// Block until a message is received, assuming input_pipe_fd is blocking
+bool RecvMessageViaQueue(MessageQueue* queue, int input_pipe_fd, protocol::Message* message);
 
 }  // namespace worker_lib
 }  // namespace faas
@@ -24,6 +24,10 @@ func GetFuncWorkerOutputFifoName(clientId uint16) string {
 	return fmt.Sprintf("worker_%d_output", clientId)
 }
 
+func GetFuncWorkerResponseFifoName(clientId uint16) string {
+	return fmt.Sprintf("worker_%d_response", clientId)
+}
+
 func GetFuncCallInputShmName(fullCallId uint64) string {
 	return fmt.Sprintf("%d.i", fullCallId)
 }
@@ -31,7 +35,3 @@ func GetFuncCallInputShmName(fullCallId uint64) string {
 func GetFuncCallOutputShmName(fullCallId uint64) string {
 	return fmt.Sprintf("%d.o", fullCallId)
 }
-
-func GetFuncCallOutputFifoName(fullCallId uint64) string {
-	return fmt.Sprintf("%d.o", fullCallId)
-}
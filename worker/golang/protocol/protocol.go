@@ -9,6 +9,8 @@ type FuncCall struct {
 	MethodId uint16
 	ClientId uint16
 	CallId   uint32
+	// Generation of ClientId, which is set by engine in the handshake response
+	ClientIdGeneration uint8
 }
 
 const FuncCallByteSize = 8
@@ -16,12 +18,15 @@ const FuncCallByteSize = 8
 const FuncIdBits = 8
 const MethodIdBits = 6
 const ClientIdBits = 14
+const CallIdBits = 32
+const ClientIdGenerationBits = 4
 
 func (funcCall *FuncCall) FullCallId() uint64 {
 	return uint64(funcCall.FuncId) +
 		(uint64(funcCall.MethodId) << FuncIdBits) +
 		(uint64(funcCall.ClientId) << (FuncIdBits + MethodIdBits)) +
-		(uint64(funcCall.CallId) << (FuncIdBits + MethodIdBits + ClientIdBits))
+		(uint64(funcCall.CallId) << (FuncIdBits + MethodIdBits + ClientIdBits)) +
+		(uint64(funcCall.ClientIdGeneration) << (FuncIdBits + MethodIdBits + ClientIdBits + CallIdBits))
 }
 
 func FuncCallFromFullCallId(fullCallId uint64) FuncCall {
@@ -30,6 +35,9 @@ func FuncCallFromFullCallId(fullCallId uint64) FuncCall {
 		MethodId: uint16((fullCallId >> FuncIdBits) & ((1 << MethodIdBits) - 1)),
 		ClientId: uint16((fullCallId >> (FuncIdBits + MethodIdBits)) & ((1 << ClientIdBits) - 1)),
 		CallId:   uint32(fullCallId >> (FuncIdBits + MethodIdBits + ClientIdBits)),
+		ClientIdGeneration: uint8(
+			(fullCallId >> (FuncIdBits + MethodIdBits + ClientIdBits + CallIdBits)) &
+				((1 << ClientIdGenerationBits) - 1)),
 	}
 }
 
@@ -65,7 +73,15 @@ func GetFlagsFromMessage(buffer []byte) uint32 {
 
 func GetFuncCallFromMessage(buffer []byte) FuncCall {
 	tmp := binary.LittleEndian.Uint64(buffer[0:8])
-	return FuncCallFromFullCallId(tmp >> MessageTypeBits)
+	funcCall := FuncCallFromFullCallId(tmp >> MessageTypeBits)
+	funcCall.ClientIdGeneration = buffer[38]
+	return funcCall
+}
+
+func setFuncCallInMessage(buffer []byte, funcCall FuncCall, messageType uint16) {
+	tmp := (funcCall.FullCallId() << MessageTypeBits) + uint64(messageType)
+	binary.LittleEndian.PutUint64(buffer[0:8], tmp)
+	buffer[38] = funcCall.ClientIdGeneration
 }
 
 func getMessageType(buffer []byte) uint16 {
@@ -108,24 +124,21 @@ func NewFuncWorkerHandshakeMessage(funcId uint16, clientId uint16) []byte {
 
 func NewInvokeFuncCallMessage(funcCall FuncCall, parentCallId uint64) []byte {
 	buffer := NewEmptyMessage()
-	tmp := (funcCall.FullCallId() << MessageTypeBits) + uint64(MessageType_INVOKE_FUNC)
-	binary.LittleEndian.PutUint64(buffer[0:8], tmp)
+	setFuncCallInMessage(buffer, funcCall, MessageType_INVOKE_FUNC)
 	binary.LittleEndian.PutUint64(buffer[8:16], parentCallId)
 	return buffer
 }
 
 func NewFuncCallCompleteMessage(funcCall FuncCall, processingTime int32) []byte {
 	buffer := NewEmptyMessage()
-	tmp := (funcCall.FullCallId() << MessageTypeBits) + uint64(MessageType_FUNC_CALL_COMPLETE)
-	binary.LittleEndian.PutUint64(buffer[0:8], tmp)
+	setFuncCallInMessage(buffer, funcCall, MessageType_FUNC_CALL_COMPLETE)
 	binary.LittleEndian.PutUint32(buffer[12:16], uint32(processingTime))
 	return buffer
 }
 
 func NewFuncCallFailedMessage(funcCall FuncCall) []byte {
 	buffer := NewEmptyMessage()
-	tmp := (funcCall.FullCallId() << MessageTypeBits) + uint64(MessageType_FUNC_CALL_FAILED)
-	binary.LittleEndian.PutUint64(buffer[0:8], tmp)
+	setFuncCallInMessage(buffer, funcCall, MessageType_FUNC_CALL_FAILED)
 	return buffer
 }
 
@@ -3,13 +3,16 @@ package worker
 import (
 	"context"
 	"encoding/binary"
+	"errors"
 	"fmt"
+	"io"
 	"log"
 	"net"
 	"os"
 	"strings"
 	"sync"
 	"sync/atomic"
+	"syscall"
 
 	common "cs.utexas.edu/zjia/faas/common"
 	config "cs.utexas.edu/zjia/faas/config"
@@ -20,6 +23,11 @@ import (
 
 const PIPE_BUF = 4096
 
+// Each output record in response FIFOs starts with a header of
+// full_call_id (uint64) and output size (int32, -1 on failure),
+// padded to 16 bytes
+const nestedCallOutputHeaderSize = 16
+
 type FuncWorker struct {
 	funcId               uint16
 	clientId             uint16
@@ -32,8 +40,12 @@ type FuncWorker struct {
 	inputPipe            *os.File
 	outputPipe           *os.File                 // protected by mux
 	outgoingFuncCalls    map[uint64](chan []byte) // protected by mux
+	responseFifo         *os.File
+	callerResponseFifos  map[uint16]*os.File // protected by responseFifoMux
+	responseFifoMux      sync.Mutex
 	handler              types.FuncHandler
 	grpcHandler          types.GrpcFuncHandler
+	clientIdGeneration   uint8
 	nextCallId           uint32
 	currentCall          uint64
 	mux                  sync.Mutex
@@ -48,6 +60,7 @@ func NewFuncWorker(funcId uint16, clientId uint16, factory types.FuncHandlerFact
 		useFifoForNestedCall: false,
 		newFuncCallChan:      make(chan []byte),
 		outgoingFuncCalls:    make(map[uint64](chan []byte)),
+		callerResponseFifos:  make(map[uint16]*os.File),
 		nextCallId:           0,
 		currentCall:          0,
 	}
@@ -63,6 +76,9 @@ func (w *FuncWorker) Run() {
 	log.Printf("[INFO] Handshake with engine done")
 
 	go w.servingLoop()
+	if w.useFifoForNestedCall {
+		go w.responseFifoLoop()
+	}
 	for {
 		message := protocol.NewEmptyMessage()
 		n, err := w.inputPipe.Read(message)
@@ -114,10 +130,22 @@ func (w *FuncWorker) doHandshake() error {
 		return fmt.Errorf("Unexpcted type of response")
 	}
 
+	w.clientIdGeneration = uint8(protocol.GetFuncCallFromMessage(response).CallId)
 	flags := protocol.GetFlagsFromMessage(response)
 	if (flags & protocol.FLAG_UseFifoForNestedCall) != 0 {
-		log.Printf("[INFO] Use FIFO for nested calls")
+		log.Printf("[INFO] Use response FIFO for nested calls")
 		w.useFifoForNestedCall = true
+		responseFifoName := ipc.GetFuncWorkerResponseFifoName(w.clientId)
+		// Left by a previous FuncWorker with the same clientId
+		ipc.FifoRemove(responseFifoName)
+		err = ipc.FifoCreate(responseFifoName)
+		if err != nil {
+			return fmt.Errorf("FifoCreate failed: %v", err)
+		}
+		w.responseFifo, err = ipc.FifoOpenForReadWrite(responseFifoName, true)
+		if err != nil {
+			return fmt.Errorf("FifoOpenForReadWrite failed: %v", err)
+		}
 	}
 
 	w.configEntry = config.FindByFuncId(w.funcId)
@@ -149,6 +177,34 @@ func (w *FuncWorker) doHandshake() error {
 	return nil
 }
 
+func (w *FuncWorker) responseFifoLoop() {
+	for {
+		header := make([]byte, nestedCallOutputHeaderSize)
+		_, err := io.ReadFull(w.responseFifo, header)
+		if err != nil {
+			log.Fatalf("[FATAL] Failed to read from response fifo: %v", err)
+		}
+		fullCallId := binary.LittleEndian.Uint64(header[0:8])
+		outputSize := int32(binary.LittleEndian.Uint32(header[8:12]))
+		record := header
+		if outputSize >= 0 && int(outputSize)+nestedCallOutputHeaderSize <= PIPE_BUF {
+			record = make([]byte, nestedCallOutputHeaderSize+int(outputSize))
+			copy(record, header)
+			_, err = io.ReadFull(w.responseFifo, record[nestedCallOutputHeaderSize:])
+			if err != nil {
+				log.Fatalf("[FATAL] Failed to read from response fifo: %v", err)
+			}
+		}
+		w.mux.Lock()
+		ch, exists := w.outgoingFuncCalls[fullCallId]
+		if exists {
+			ch <- record
+			delete(w.outgoingFuncCalls, fullCallId)
+		}
+		w.mux.Unlock()
+	}
+}
+
 func (w *FuncWorker) servingLoop() {
 	for {
 		message := <-w.newFuncCallChan
@@ -294,32 +350,58 @@ func (w *FuncWorker) writeOutputToShm(funcCall protocol.FuncCall, output []byte)
 	return nil
 }
 
-func (w *FuncWorker) writeOutputToFifo(funcCall protocol.FuncCall, success bool, output []byte) error {
-	fifo, err := ipc.FifoOpenForWrite(ipc.GetFuncCallOutputFifoName(funcCall.FullCallId()), true)
+func (w *FuncWorker) getCallerResponseFifo(clientId uint16, reopen bool) (*os.File, error) {
+	w.responseFifoMux.Lock()
+	defer w.responseFifoMux.Unlock()
+	fifo, exists := w.callerResponseFifos[clientId]
+	if exists {
+		if !reopen {
+			return fifo, nil
+		}
+		fifo.Close()
+		delete(w.callerResponseFifos, clientId)
+	}
+	fifo, err := ipc.FifoOpenForWrite(ipc.GetFuncWorkerResponseFifoName(clientId), true)
 	if err != nil {
-		return err
+		return nil, err
 	}
-	defer fifo.Close()
+	w.callerResponseFifos[clientId] = fifo
+	return fifo, nil
+}
+
+func (w *FuncWorker) writeOutputToFifo(funcCall protocol.FuncCall, success bool, output []byte) error {
 	var buffer []byte
 	if success {
-		if len(output)+4 > PIPE_BUF {
+		if len(output)+nestedCallOutputHeaderSize > PIPE_BUF {
 			err := w.writeOutputToShm(funcCall, output)
 			if err != nil {
 				return err
 			}
-			buffer = make([]byte, 4)
-			binary.LittleEndian.PutUint32(buffer, uint32(len(output)))
+			buffer = make([]byte, nestedCallOutputHeaderSize)
 		} else {
-			buffer = make([]byte, len(output)+4)
-			binary.LittleEndian.PutUint32(buffer[0:4], uint32(len(output)))
-			copy(buffer[4:], output)
+			buffer = make([]byte, len(output)+nestedCallOutputHeaderSize)
+			copy(buffer[nestedCallOutputHeaderSize:], output)
 		}
+		binary.LittleEndian.PutUint32(buffer[8:12], uint32(len(output)))
 	} else {
-		buffer = make([]byte, 4)
+		buffer = make([]byte, nestedCallOutputHeaderSize)
 		header := int32(-1)
-		binary.LittleEndian.PutUint32(buffer, uint32(header))
+		binary.LittleEndian.PutUint32(buffer[8:12], uint32(header))
+	}
+	binary.LittleEndian.PutUint64(buffer[0:8], funcCall.FullCallId())
+	var err error
+	for attempt := 0; attempt < 2; attempt++ {
+		// Cached fifo may belong to a previous FuncWorker with the same clientId
+		var fifo *os.File
+		fifo, err = w.getCallerResponseFifo(funcCall.ClientId, attempt > 0)
+		if err != nil {
+			return err
+		}
+		_, err = fifo.Write(buffer)
+		if err == nil || !errors.Is(err, syscall.EPIPE) {
+			return err
+		}
 	}
-	_, err = fifo.Write(buffer)
 	return err
 }
 
@@ -327,7 +409,6 @@ func (w *FuncWorker) newFuncCallCommon(funcCall protocol.FuncCall, input []byte)
 	message := protocol.NewInvokeFuncCallMessage(funcCall, atomic.LoadUint64(&w.currentCall))
 
 	var inputRegion *ipc.ShmRegion
-	var outputFifo *os.File
 	var outputChan chan []byte
 	var output []byte
 	var err error
@@ -347,45 +428,22 @@ func (w *FuncWorker) newFuncCallCommon(funcCall protocol.FuncCall, input []byte)
 		protocol.FillInlineDataInMessage(message, input)
 	}
 
-	if w.useFifoForNestedCall {
-		outputFifoName := ipc.GetFuncCallOutputFifoName(funcCall.FullCallId())
-		err = ipc.FifoCreate(outputFifoName)
-		if err != nil {
-			return nil, fmt.Errorf("FifoCreate failed: %v", err)
-		}
-		defer ipc.FifoRemove(outputFifoName)
-		outputFifo, err = ipc.FifoOpenForReadWrite(outputFifoName, true)
-		if err != nil {
-			return nil, fmt.Errorf("FifoOpenForReadWrite failed: %v", err)
-		}
-		defer outputFifo.Close()
-	}
-
 	w.mux.Lock()
-	if !w.useFifoForNestedCall {
-		outputChan = make(chan []byte)
-		w.outgoingFuncCalls[funcCall.FullCallId()] = outputChan
-	}
+	outputChan = make(chan []byte)
+	w.outgoingFuncCalls[funcCall.FullCallId()] = outputChan
 	_, err = w.outputPipe.Write(message)
 	w.mux.Unlock()
 
 	if w.useFifoForNestedCall {
-		headerBuf := make([]byte, 4)
-		nread, err := outputFifo.Read(headerBuf)
-		if err != nil {
-			return nil, fmt.Errorf("Failed to read from fifo: %v", err)
-		} else if nread < len(headerBuf) {
-			return nil, fmt.Errorf("Failed to read header from output fifo")
-		}
-
-		header := int32(binary.LittleEndian.Uint32(headerBuf))
+		record := <-outputChan
+		header := int32(binary.LittleEndian.Uint32(record[8:12]))
 		if header < 0 {
 			return nil, fmt.Errorf("FuncCall failed")
 		}
 
 		outputSize := int(header)
 		output = make([]byte, outputSize)
-		if outputSize+4 > PIPE_BUF {
+		if outputSize+nestedCallOutputHeaderSize > PIPE_BUF {
 			outputRegion, err := ipc.ShmOpen(ipc.GetFuncCallOutputShmName(funcCall.FullCallId()), true)
 			if err != nil {
 				return nil, fmt.Errorf("ShmOpen failed: %v", err)
@@ -395,16 +453,11 @@ func (w *FuncWorker) newFuncCallCommon(funcCall protocol.FuncCall, input []byte)
 				outputRegion.Remove()
 			}()
 			if outputRegion.Size != outputSize {
-				return nil, fmt.Errorf("Shm size mismatch with header read from output fifo")
+				return nil, fmt.Errorf("Shm size mismatch with header read from response fifo")
 			}
 			copy(output, outputRegion.Data)
 		} else {
-			nread, err = outputFifo.Read(output)
-			if err != nil {
-				return nil, fmt.Errorf("Failed to read from fifo: %v", err)
-			} else if nread < outputSize {
-				return nil, fmt.Errorf("Failed to read output from fifo")
-			}
+			copy(output, record[nestedCallOutputHeaderSize:])
 		}
 	} else {
 		message := <-outputChan
@@ -442,10 +495,11 @@ func (w *FuncWorker) InvokeFunc(ctx context.Context, funcName string, input []by
 		return nil, fmt.Errorf("Invalid function name: %s", funcName)
 	}
 	funcCall := protocol.FuncCall{
-		FuncId:   entry.FuncId,
-		MethodId: 0,
-		ClientId: w.clientId,
-		CallId:   atomic.AddUint32(&w.nextCallId, 1) - 1,
+		FuncId:             entry.FuncId,
+		MethodId:           0,
+		ClientId:           w.clientId,
+		CallId:             atomic.AddUint32(&w.nextCallId, 1) - 1,
+		ClientIdGeneration: w.clientIdGeneration,
 	}
 	return w.newFuncCallCommon(funcCall, input)
 }
@@ -461,10 +515,11 @@ func (w *FuncWorker) GrpcCall(ctx context.Context, service string, method string
 		return nil, fmt.Errorf("Invalid gRPC method: %s", method)
 	}
 	funcCall := protocol.FuncCall{
-		FuncId:   entry.FuncId,
-		MethodId: uint16(methodId),
-		ClientId: w.clientId,
-		CallId:   atomic.AddUint32(&w.nextCallId, 1) - 1,
+		FuncId:             entry.FuncId,
+		MethodId:           uint16(methodId),
+		ClientId:           w.clientId,
+		CallId:             atomic.AddUint32(&w.nextCallId, 1) - 1,
+		ClientIdGeneration: w.clientIdGeneration,
 	}
 	return w.newFuncCallCommon(funcCall, request)
 }
@@ -10,6 +10,7 @@
         "src/ipc/base.cpp",
         "src/ipc/fifo.cpp",
         "src/ipc/shm_region.cpp",
+        "src/ipc/shm_arena.cpp",
         "src/utils/fs.cpp",
         "src/utils/socket.cpp",
         "src/worker/worker_lib.cpp",